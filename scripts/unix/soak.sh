@@ -0,0 +1,129 @@
+#!/bin/sh
+# Benchmark suite for the chat server, run by `make test` (quick) and
+# `make soak` (full scale).
+#
+# Starts a fresh server for every scenario and drives it with chat_bench:
+# a connection ramp, steady fan-out at several room sizes, slow consumers
+# and reconnect storms. Each run appends one JSON line to RESULTS with its
+# latency percentiles, memory per connection and CPU per message (sampled
+# from the server's metrics port). Given BASELINE, a results file of an
+# earlier build, every run is compared with the run of the same label in
+# it, and the suite fails if a figure got worse by more than
+# BENCH_TOLERANCE percent.
+#
+# Usage: soak.sh SERVER CHAT_BENCH RESULTS [BASELINE]
+#
+# Scale and shape come from the environment (defaults for BENCH_SCALE=full,
+# quick in brackets):
+#   BENCH_CONNECTIONS       connections in the ramp             100000 [2000]
+#   BENCH_CONNECT_RATE      ramp connections per second          10000 [2000]
+#   BENCH_FANOUT_CONNECTIONS connections in fan-out runs         10000 [1000]
+#   BENCH_ROOM_SIZES        members per room in fan-out runs  "10 100 1000" ["10 100"]
+#   BENCH_DELIVERIES        copies per second each fan-out run aims for 200000 [20000]
+#   BENCH_STORM_CONNECTIONS connections in the reconnect storm   20000 [1000]
+#   BENCH_DURATION          seconds measured per run                30 [3]
+#   BENCH_WORKERS           server worker threads                    4 [2]
+#   BENCH_THREADS           chat_bench threads                       4 [2]
+#   BENCH_PORT              client port; the metrics port is one above 9400
+#   BENCH_TOLERANCE         percent a figure may worsen              10
+
+set -u
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 SERVER CHAT_BENCH RESULTS [BASELINE]" >&2
+    exit 1
+fi
+server=$1
+bench=$2
+results=$3
+baseline=${4:-}
+
+if [ "${BENCH_SCALE:-full}" = quick ]; then
+    connections=${BENCH_CONNECTIONS:-2000}
+    connect_rate=${BENCH_CONNECT_RATE:-2000}
+    fanout_connections=${BENCH_FANOUT_CONNECTIONS:-1000}
+    room_sizes=${BENCH_ROOM_SIZES:-"10 100"}
+    deliveries=${BENCH_DELIVERIES:-20000}
+    storm_connections=${BENCH_STORM_CONNECTIONS:-1000}
+    duration=${BENCH_DURATION:-3}
+    workers=${BENCH_WORKERS:-2}
+    threads=${BENCH_THREADS:-2}
+else
+    connections=${BENCH_CONNECTIONS:-100000}
+    connect_rate=${BENCH_CONNECT_RATE:-10000}
+    fanout_connections=${BENCH_FANOUT_CONNECTIONS:-10000}
+    room_sizes=${BENCH_ROOM_SIZES:-"10 100 1000"}
+    deliveries=${BENCH_DELIVERIES:-200000}
+    storm_connections=${BENCH_STORM_CONNECTIONS:-20000}
+    duration=${BENCH_DURATION:-30}
+    workers=${BENCH_WORKERS:-4}
+    threads=${BENCH_THREADS:-4}
+fi
+port=${BENCH_PORT:-9400}
+metrics_port=$((port + 1))
+tolerance=${BENCH_TOLERANCE:-10}
+
+# Both processes hold one descriptor per connection
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+# One loopback address has about 28000 ephemeral ports towards one server
+# port; Linux routes all of 127.0.0.0/8 to loopback, so spread over several
+binds=""
+if [ "$(uname -s)" = Linux ]; then
+    count=$((connections / 25000 + 1))
+    i=1
+    while [ "$i" -le "$count" ]; do
+        binds="$binds --bind 127.0.0.$i"
+        i=$((i + 1))
+    done
+fi
+
+rm -f "$results"
+status=0
+
+# run LABEL "SERVER OPTIONS" CHAT_BENCH OPTIONS...
+run() {
+    label=$1
+    server_options=$2
+    shift 2
+    echo ""
+    echo "=== $label"
+    # shellcheck disable=SC2086 # Options are meant to split
+    "$server" "$port" --workers "$workers" --metrics-port "$metrics_port" --log-level error $server_options &
+    pid=$!
+    sleep 1
+    # shellcheck disable=SC2086
+    "$bench" 127.0.0.1 "$port" --threads "$threads" --metrics-port "$metrics_port" --label "$label" \
+        --json "$results" ${baseline:+--baseline "$baseline"} --tolerance "$tolerance" $binds "$@"
+    code=$?
+    if [ "$code" -gt "$status" ]; then
+        status=$code
+    fi
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+}
+
+run ramp "" --scenario ramp --connections "$connections" --connect-rate "$connect_rate" --duration "$duration"
+
+# The same copies per second at every room size: bigger rooms send fewer messages
+for size in $room_sizes; do
+    run "fanout-$size" "" --scenario fanout --connections "$fanout_connections" \
+        --rooms $((fanout_connections / size)) --rate $((deliveries / (size - 1) + 1)) --duration "$duration"
+done
+
+# A tenth of every room stops reading; small queues and socket buffers make
+# the server shed them within seconds, and the readers must not stall meanwhile
+run slow "--queue-limit 32 --send-buffer 16384" --scenario slow --connections "$fanout_connections" \
+    --rooms $((fanout_connections / 100)) --rate $((deliveries / 99 + 1)) --size 4096 --slow-fraction 0.1 \
+    --duration "$duration"
+
+run storm "" --scenario storm --connections "$storm_connections" --rounds 3
+
+echo ""
+echo "Results: $results"
+if [ "$status" -eq 2 ]; then
+    echo "Performance regressed against $baseline."
+elif [ "$status" -ne 0 ]; then
+    echo "The suite failed."
+fi
+exit "$status"
@@ -1,6 +1,6 @@
 @echo off
 REM Build script for Multi-Client TCP Chat Server (Batch version)
-REM Compiles both server and client executables
+REM Compiles the server, client and chat_bench executables
 
 setlocal enabledelayedexpansion
 
@@ -9,6 +9,9 @@ set COMPILER=g++
 set BUILD_TYPE=Release
 set CLEAN=0
 set VERBOSE=0
+set COROUTINES=0
+set TLS=0
+set TRACE=0
 
 :parse_args
 if "%~1"=="" goto :main
@@ -20,6 +23,9 @@ if /i "%~1"=="--verbose" set VERBOSE=1
 if /i "%~1"=="-v" set VERBOSE=1
 if /i "%~1"=="--debug" set BUILD_TYPE=Debug
 if /i "%~1"=="--release" set BUILD_TYPE=Release
+if /i "%~1"=="--coroutines" set COROUTINES=1
+if /i "%~1"=="--tls" set TLS=1
+if /i "%~1"=="--trace" set TRACE=1
 if /i "%~1"=="--compiler" (
     set COMPILER=%~2
     shift
@@ -40,6 +46,9 @@ echo   --verbose, -v        Show verbose output
 echo   --debug              Build in debug mode
 echo   --release            Build in release mode (default)
 echo   --compiler ^<name^>    Specify compiler (default: g++)
+echo   --coroutines         Serve framed clients with C++20 coroutines
+echo   --tls                TLS for clients (needs OpenSSL)
+echo   --trace              Trace sampled messages (GET /trace)
 echo.
 echo Examples:
 echo   build.bat
@@ -64,7 +73,17 @@ if errorlevel 1 (
 
 REM Set compiler flags based on build type
 set COMMON_FLAGS=-std=c++11 -Wall -Wextra
-set LINK_FLAGS=-lws2_32
+if %COROUTINES%==1 (
+    set COMMON_FLAGS=-std=c++20 -Wall -Wextra -DCHAT_COROUTINES
+)
+set LINK_FLAGS=-lws2_32 -lpsapi
+if %TLS%==1 (
+    set COMMON_FLAGS=%COMMON_FLAGS% -DCHAT_TLS
+    set LINK_FLAGS=-lssl -lcrypto -lws2_32 -lpsapi
+)
+if %TRACE%==1 (
+    set COMMON_FLAGS=%COMMON_FLAGS% -DCHAT_TRACE
+)
 
 if "%BUILD_TYPE%"=="Debug" (
     set COMMON_FLAGS=%COMMON_FLAGS% -g -O0 -DDEBUG
@@ -110,6 +129,18 @@ if errorlevel 1 (
 )
 echo ✓ Client compiled successfully
 
+REM Build load generator
+echo Compiling chat_bench...
+if %VERBOSE%==1 (
+    echo Command: %COMPILER% %COMMON_FLAGS% -o ../build/chat_bench.exe chat_bench.cpp %LINK_FLAGS%
+)
+%COMPILER% %COMMON_FLAGS% -o ../build/chat_bench.exe chat_bench.cpp %LINK_FLAGS%
+if errorlevel 1 (
+    echo chat_bench compilation failed!
+    exit /b 1
+)
+echo ✓ chat_bench compiled successfully
+
 REM Show build results
 echo.
 echo Build completed successfully!
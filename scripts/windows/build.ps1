@@ -1,12 +1,15 @@
 #!/usr/bin/env pwsh
 # Build script for Multi-Client TCP Chat Server
-# Compiles both server and client executables
+# Compiles the server, client and chat_bench executables
 
 param(
     [string]$Compiler = "g++",
     [string]$BuildType = "Release",
     [switch]$Clean,
-    [switch]$Verbose
+    [switch]$Verbose,
+    [switch]$Coroutines,
+    [switch]$Tls,
+    [switch]$Trace
 )
 
 # Colors for output
@@ -63,7 +66,7 @@ function Build-Project {
     
     # Set compiler flags based on build type
     $commonFlags = "-std=c++11 -Wall -Wextra"
-    $linkFlags = "-lws2_32"
+    $linkFlags = "-lws2_32 -lpsapi"
     
     if ($BuildType -eq "Debug") {
         $commonFlags += " -g -O0 -DDEBUG"
@@ -71,6 +74,22 @@ function Build-Project {
         $commonFlags += " -O2 -DNDEBUG"
     }
     
+    if ($Coroutines) {
+        # Coroutine connection handlers (see src/coroutine.h) need C++20
+        $commonFlags = $commonFlags.Replace("-std=c++11", "-std=c++20") + " -DCHAT_COROUTINES"
+    }
+
+    if ($Tls) {
+        # TLS for clients (see src/tls.h); OpenSSL must be on the include and library paths
+        $commonFlags += " -DCHAT_TLS"
+        $linkFlags = "-lssl -lcrypto " + $linkFlags
+    }
+
+    if ($Trace) {
+        # Message tracing (see src/trace.h), exported at GET /trace
+        $commonFlags += " -DCHAT_TRACE"
+    }
+
     if ($Verbose) {
         $commonFlags += " -v"
     }
@@ -115,6 +134,24 @@ function Build-Project {
             exit 1
         }
         
+        # Build load generator
+        Write-ColorOutput "Compiling chat_bench..." $Blue
+        $benchCmd = "$Compiler $commonFlags -o ../build/chat_bench.exe chat_bench.cpp $linkFlags"
+        
+        if ($Verbose) {
+            Write-ColorOutput "Command: $benchCmd" $Yellow
+        }
+        
+        $benchResult = Invoke-Expression $benchCmd 2>&1
+        
+        if ($LASTEXITCODE -eq 0) {
+            Write-ColorOutput "✓ chat_bench compiled successfully" $Green
+        } else {
+            Write-ColorOutput "✗ chat_bench compilation failed:" $Red
+            Write-ColorOutput $benchResult $Red
+            exit 1
+        }
+        
         # Show build results
         Write-ColorOutput "`nBuild completed successfully!" $Green
         Write-ColorOutput "Generated files:" $Blue
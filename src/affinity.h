@@ -0,0 +1,120 @@
+// -----------------------------------------------------------------------------
+// CPU and NUMA Affinity
+//
+// Each reactor thread is pinned to one core, so its clients' state stays in
+// that core's caches. --cpus LIST chooses the cores (reactor i takes the
+// i-th listed, wrapping around); by default reactor i takes core i modulo
+// the core count.
+//
+// On machines with several NUMA nodes, memory on another node costs a trip
+// across the interconnect on every access. With --numa local, each reactor
+// also asks the kernel to place the pages it touches first on its core's
+// node. Connection state, read buffers and messages are first touched by
+// the reactor that uses them, above all when the pools are reserved at
+// startup (see object_pool.h and buffer_pool.h), so they end up local.
+//
+// Pinning works on Linux and Windows and does nothing elsewhere; NUMA
+// placement is Linux-only. It is a preference: a full node spills over to
+// the others instead of failing allocations.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_AFFINITY_H
+#define CHAT_AFFINITY_H
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#elif defined(__linux__)
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const int MAX_CPU = 1023;
+
+/**
+ * @brief Parses a CPU list such as "0-3,8,10-11" into @p cpus, in order.
+ * @return False if the list is malformed or names a CPU above MAX_CPU.
+ */
+inline bool parse_cpu_list(const std::string &text, std::vector<int> &cpus) {
+    std::vector<int> parsed;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string item = text.substr(start, end - start);
+        size_t dash = item.find('-');
+        if (item.empty() || item.size() > 9 || item.find_first_not_of("0123456789-") != std::string::npos ||
+            dash == 0 || dash + 1 == item.size() ||
+            (dash != std::string::npos && item.find('-', dash + 1) != std::string::npos)) {
+            return false;
+        }
+        int first = std::atoi(item.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+        if (last < first || last > MAX_CPU) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            parsed.push_back(cpu);
+        }
+        start = end + 1;
+    }
+    cpus.swap(parsed);
+    return true;
+}
+
+/**
+ * @brief Restricts the calling thread to one CPU.
+ * @return False if the CPU does not exist, or the platform cannot pin.
+ */
+inline bool pin_thread_to_cpu(int cpu) {
+#ifdef _WIN32
+    if (cpu >= (int)(sizeof(DWORD_PTR) * 8)) {
+        return false;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+/**
+ * @brief Makes the memory the calling thread touches first come from the
+ *        NUMA node of the CPU it runs on; pin the thread beforehand.
+ * @return The node, or -1 if the placement could not be set.
+ */
+inline int prefer_local_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu) && defined(SYS_set_mempolicy)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    const unsigned long NODE_BITS = 8 * sizeof(unsigned long);
+    unsigned long nodes[1024 / (8 * sizeof(unsigned long))] = {}; // Room for 1024 nodes
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= sizeof(nodes) * 8) {
+        return -1;
+    }
+    nodes[node / NODE_BITS] = 1UL << (node % NODE_BITS);
+    // The kernel reads one bit less than it is given
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, sizeof(nodes) * 8 + 1) != 0) {
+        return -1;
+    }
+    return (int)node;
+#else
+    return -1;
+#endif
+}
+
+#endif // CHAT_AFFINITY_H
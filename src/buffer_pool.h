@@ -0,0 +1,105 @@
+// -----------------------------------------------------------------------------
+// Read Buffer Pool
+//
+// Connections only hold a read buffer while they are in the middle of
+// receiving; idle connections hold none. Buffers are borrowed from a
+// per-reactor pool, grow on demand when a large frame is arriving, and are
+// returned (keeping their grown capacity) once fully consumed. reserve()
+// allocates and touches buffers up front, so the first burst of traffic
+// does not wait for the heap or for page faults.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_BUFFER_POOL_H
+#define CHAT_BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief A growable receive buffer; bytes [0, length) are unprocessed input.
+ */
+struct ReadBuffer {
+    std::vector<char> data;
+    size_t length;
+};
+
+/**
+ * @brief Free list of ReadBuffers. Not thread-safe: one pool per reactor.
+ */
+class BufferPool {
+public:
+    BufferPool(size_t initial_size, size_t max_size, size_t max_idle)
+        : initial_size_(initial_size), max_size_(max_size), max_idle_(max_idle) {}
+
+    ~BufferPool() {
+        for (ReadBuffer *buffer : idle_) {
+            delete buffer;
+        }
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    /**
+     * @brief Hands out an empty buffer, reusing an idle one when possible.
+     */
+    ReadBuffer *acquire() {
+        ReadBuffer *buffer;
+        if (!idle_.empty()) {
+            buffer = idle_.back();
+            idle_.pop_back();
+        } else {
+            buffer = new ReadBuffer();
+            buffer->data.resize(initial_size_);
+        }
+        buffer->length = 0;
+        return buffer;
+    }
+
+    /**
+     * @brief Returns a buffer to the pool, or frees it if enough are idle.
+     */
+    void release(ReadBuffer *buffer) {
+        if (idle_.size() < max_idle_) {
+            idle_.push_back(buffer);
+        } else {
+            delete buffer;
+        }
+    }
+
+    /**
+     * @brief Adds @p count buffers to the idle ones, keeping at least that
+     *        many idle from now on.
+     */
+    void reserve(size_t count) {
+        if (max_idle_ < idle_.size() + count) {
+            max_idle_ = idle_.size() + count;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            ReadBuffer *buffer = new ReadBuffer();
+            buffer->data.resize(initial_size_); // Zero-filled, so every page is touched
+            idle_.push_back(buffer);
+        }
+    }
+
+    /**
+     * @brief Doubles a full buffer's capacity, up to the pool's maximum size.
+     * @return False if the buffer is already as large as allowed.
+     */
+    bool grow(ReadBuffer *buffer) const {
+        size_t size = buffer->data.size();
+        if (size >= max_size_) {
+            return false;
+        }
+        buffer->data.resize(size * 2 < max_size_ ? size * 2 : max_size_);
+        return true;
+    }
+
+private:
+    size_t initial_size_;
+    size_t max_size_;
+    size_t max_idle_;
+    std::vector<ReadBuffer *> idle_;
+};
+
+#endif // CHAT_BUFFER_POOL_H
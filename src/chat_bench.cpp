@@ -0,0 +1,1275 @@
+// -----------------------------------------------------------------------------
+// Chat Server Load Generator
+//
+// Opens many framed connections from a few threads and runs one scenario
+// against a server:
+//
+//   fanout  Every connection sends chat messages at its share of a fixed
+//           aggregate rate, and every copy the server relays to another
+//           bench connection yields one latency sample (send -> receive,
+//           same process clock; payloads carry a marker and the send time).
+//   slow    Like fanout, but a share of the connections never read, so the
+//           server's outbound queues for them fill up. Latency is measured
+//           on the connections that keep reading.
+//   ramp    Connects the connections at a fixed rate and holds them idle.
+//   storm   Connects, then repeatedly drops every connection at once and
+//           reconnects them all (a reconnect storm).
+//
+// A connection counts as connected once the server answers the ping it
+// sends right after the preface, which times admission as well as the TCP
+// handshake. Given the server's metrics port, the bench also samples its
+// resident memory, CPU time and counters while the scenario runs, to report
+// memory per connection and CPU per message. Results can be appended as a
+// JSON line and compared against an earlier run (see scripts/unix/soak.sh).
+//
+// Each thread multiplexes its share of the connections through a Poller
+// (see poller.h), exactly like a server reactor.
+//
+// How to compile (using MinGW g++ on Windows, g++ / clang++ elsewhere):
+// g++ -O2 -o chat_bench.exe chat_bench.cpp -pthread -lws2_32
+// g++ -O2 -o chat_bench chat_bench.cpp -pthread
+//
+// How to run:
+// ./chat_bench.exe <server_ip> <port> [--scenario fanout|slow|ramp|storm]
+//                  [--connections N] [--threads N] [--rate MSGS_PER_SEC]
+//                  [--size BYTES] [--duration SECONDS] [--warmup SECONDS]
+//                  [--rooms N] [--connect-rate CONNS_PER_SEC]
+//                  [--slow-fraction F] [--rounds N] [--bind ADDRESS]...
+//                  [--metrics-port N] [--json PATH] [--label NAME]
+//                  [--baseline PATH] [--tolerance PERCENT]
+// e.g., ./chat_bench.exe 127.0.0.1 8080 --connections 2000 --threads 4 --rate 500
+// -----------------------------------------------------------------------------
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // The IOCP poller needs Vista+
+#endif
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include "socket_compat.h"
+#include "poller.h"
+#include "frame.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Every bench payload starts with this marker and 16 hex digits of send time
+const char BENCH_MARKER[] = "#bench ";
+const size_t BENCH_MARKER_SIZE = sizeof(BENCH_MARKER) - 1;
+const size_t BENCH_HEADER_SIZE = BENCH_MARKER_SIZE + 16;
+
+// Receive buffer per thread: a maximal frame plus a large read
+const size_t BENCH_READ_BUFFER = 2 * (MAX_FRAME_PAYLOAD + MAX_FRAME_HEADER);
+
+// Time allowed after sending stops for relayed copies to arrive
+const int DRAIN_SECONDS = 2;
+
+// Connections the server has not answered by then count as failed
+const int CONNECT_TIMEOUT_SECONDS = 60;
+
+// Receive buffer of connections that never read, so the server's queue fills soon
+const int SLOW_RECEIVE_BUFFER = 4096;
+
+// Exit status when a figure regressed against the baseline
+const int EXIT_REGRESSION = 2;
+
+enum class Scenario {
+    Fanout,
+    Slow,
+    Ramp,
+    Storm
+};
+
+/**
+ * @brief Settings taken from the command line.
+ */
+struct BenchOptions {
+    std::string host;
+    int port;
+    int connections;
+    int threads;
+    double rate;     // Messages per second, across all connections
+    size_t size;     // Payload bytes per message
+    int duration;    // Seconds of measured sending, or of holding (ramp)
+    int warmup;      // Seconds of sending before measuring
+    int rooms;       // Connections are spread over this many rooms
+    Scenario scenario;
+    double connect_rate;  // Connections opened per second, across all threads; 0: all at once
+    double slow_fraction; // Share of connections that never read (slow)
+    int rounds;           // Reconnect rounds (storm)
+    int metrics_port;     // Server metrics to sample; 0: none
+    std::vector<std::string> bind_addresses; // Local addresses to spread connections over
+    std::string json_path; // Append results here as one JSON line
+    std::string label;     // Names the run in results and baselines
+    std::string baseline_path;
+    double tolerance; // Percent a figure may worsen against the baseline
+};
+
+/**
+ * @brief Latency histogram with logarithmic buckets (about 3% precision),
+ *        in the spirit of HdrHistogram.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts_(BUCKETS, 0), total_(0), max_(0) {}
+
+    void record(uint64_t micros) {
+        ++counts_[bucket(micros)];
+        ++total_;
+        max_ = std::max(max_, micros);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    /**
+     * @brief Smallest recorded value (bucket midpoint) at or above a fraction
+     *        of all samples, e.g. 0.99 for p99.
+     */
+    uint64_t percentile(double fraction) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(fraction * total_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total_));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                uint64_t low = lower_bound(i);
+                uint64_t high = lower_bound(i + 1);
+                return std::min(max_, low + (high - low) / 2);
+            }
+        }
+        return max_;
+    }
+
+private:
+    static const int SUB_BUCKETS = 32;
+    static const int BUCKETS = SUB_BUCKETS * 40;
+
+    static int bit_length(uint64_t value) {
+        int bits = 0;
+        while (value != 0) {
+            ++bits;
+            value >>= 1;
+        }
+        return bits;
+    }
+
+    static int bucket(uint64_t value) {
+        if (value < 2 * SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+        int shift = bit_length(value) - bit_length(2 * SUB_BUCKETS - 1);
+        int index = SUB_BUCKETS + shift * SUB_BUCKETS + static_cast<int>((value >> shift) - SUB_BUCKETS);
+        return std::min(index, BUCKETS - 1);
+    }
+
+    static uint64_t lower_bound(int index) {
+        if (index < 2 * SUB_BUCKETS) {
+            return index;
+        }
+        int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+        return sub << shift;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t max_;
+};
+
+/**
+ * @brief One bench connection, owned by one worker thread.
+ */
+struct BenchConnection {
+    SOCKET socket;
+    int index; // Across all threads
+    int room;
+    bool reader;     // False for the connections of the slow scenario that never read
+    bool connecting; // Non-blocking connect under way
+    bool joined;     // The server answered the first ping
+    int64_t opened_ns;
+    std::string input;  // Start of a frame that arrived incomplete
+    std::string output; // Bytes the kernel has not accepted yet
+    bool write_interest;
+};
+
+/**
+ * @brief Counters for one worker thread, merged when the run ends.
+ */
+struct WorkerStats {
+    WorkerStats()
+        : connected(0), sent(0), measured_sent(0), received(0), bytes_received(0), errors(0), disconnects(0) {}
+
+    int connected;                   // Connections the server answered, last round
+    uint64_t sent;
+    uint64_t measured_sent;          // Sent after warm-up
+    std::vector<uint64_t> room_sent; // Measured messages sent per room
+    uint64_t received;               // Relayed bench messages received after warm-up
+    uint64_t bytes_received;
+    uint64_t errors;
+    uint64_t disconnects;            // Connected connections the server closed
+    LatencyHistogram latency;        // Microseconds
+    LatencyHistogram connect_latency;   // First round: connect to first pong
+    LatencyHistogram reconnect_latency; // Later rounds (storm)
+};
+
+/**
+ * @brief Server figures read from its metrics endpoint at one moment.
+ */
+struct ServerSample {
+    ServerSample()
+        : valid(false), resident_bytes(0), cpu_seconds(0), messages_received(0), messages_sent(0), queue_drops(0),
+          connections_closed(0) {}
+
+    bool valid;
+    double resident_bytes;
+    double cpu_seconds;
+    double messages_received;
+    double messages_sent;
+    double queue_drops;
+    double connections_closed;
+};
+
+/**
+ * @brief Scenario-level timings measured by main().
+ */
+struct RunTimes {
+    RunTimes() : connect_seconds(0), measured_seconds(0), slowest_round_seconds(0), timed_out(false) {}
+
+    double connect_seconds;       // Until every connection was answered or failed
+    double measured_seconds;      // Measured sending, or holding
+    double slowest_round_seconds; // Storm
+    bool timed_out;
+    ServerSample before;    // Before connecting
+    ServerSample connected; // Once connected
+    ServerSample start;     // Measurement starts
+    ServerSample end;       // Measurement ends
+};
+
+/**
+ * @brief Figure checked against the baseline, and by how much it may worsen
+ *        besides the tolerance.
+ */
+struct Threshold {
+    const char *key;
+    bool higher_is_better;
+    double slack; // Absolute change that never counts as a regression
+};
+
+const Threshold THRESHOLDS[] = {
+    {"delivery_ratio", true, 0.001},
+    {"delivered_per_s", true, 0},
+    {"connects_per_s", true, 0},
+    {"latency_p99_us", false, 500},
+    {"connect_p99_us", false, 5000},
+    {"reconnect_p99_us", false, 10000},
+    {"memory_per_connection_bytes", false, 256},
+    {"cpu_us_per_message", false, 1},
+    {"cpu_us_per_delivery", false, 0.1},
+};
+
+// --- Function Prototypes ---
+bool parse_options(int argc, char *argv[], BenchOptions &parsed);
+const char *scenario_name(Scenario scenario);
+bool is_slow(const BenchOptions &options, int index);
+void run_worker(const BenchOptions &options, int index, WorkerStats &stats);
+bool open_connection(const BenchOptions &options, Poller &poller, BenchConnection &conn);
+bool finish_connect(const BenchOptions &options, Poller &poller, BenchConnection &conn);
+void close_connection(Poller &poller, BenchConnection &conn);
+bool send_frame(Poller &poller, BenchConnection &conn, uint8_t type, uint8_t flags, const char *payload, size_t length);
+bool flush_connection(Poller &poller, BenchConnection &conn);
+bool read_connection(BenchConnection &conn, std::vector<char> &scratch, WorkerStats &stats);
+bool wait_for_workers(int threads, RunTimes &times);
+bool sample_server(const BenchOptions &options, ServerSample &sample);
+std::string report(const BenchOptions &options, const std::vector<WorkerStats> &stats, const RunTimes &times);
+bool append_line(const std::string &path, const std::string &line);
+int compare_with_baseline(const BenchOptions &options, const std::string &results);
+bool json_number(const std::string &line, const char *key, double &value);
+bool set_non_blocking(SOCKET socket);
+void raise_descriptor_limit();
+
+// Shared clock and phase, set by main()
+std::chrono::steady_clock::time_point bench_start;
+std::atomic<int64_t> measure_from_ns(0); // Messages sent before this are warm-up
+std::atomic<int> workers_ready(0);       // Workers whose connections all connected or failed this round
+std::atomic<int> connect_round(0);       // Raised to make every worker drop and reconnect its connections
+std::atomic<bool> sending(false);
+std::atomic<bool> running(true);
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - bench_start).count();
+}
+
+/**
+ * @brief Initializes the Winsock library.
+ */
+bool InitializeWinsock() {
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Main function to start the benchmark.
+ */
+int main(int argc, char *argv[]) {
+    BenchOptions options = {"", 0, 100, 2, 100.0, 64, 10, 2, 1, Scenario::Fanout, 0, 0.1, 3, 0, {}, "", "", "", 10};
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " <server_ip> <port> [--scenario fanout|slow|ramp|storm]"
+                  << " [--connections N] [--threads N] [--rate MSGS_PER_SEC] [--size BYTES]"
+                  << " [--duration SECONDS] [--warmup SECONDS] [--rooms N] [--connect-rate CONNS_PER_SEC]"
+                  << " [--slow-fraction F] [--rounds N] [--bind ADDRESS]... [--metrics-port N] [--json PATH]"
+                  << " [--label NAME] [--baseline PATH] [--tolerance PERCENT]" << std::endl;
+        return 1;
+    }
+
+    if (!InitializeWinsock()) {
+        return 1;
+    }
+    raise_descriptor_limit();
+
+    bench_start = std::chrono::steady_clock::now();
+    measure_from_ns.store(std::numeric_limits<int64_t>::max());
+
+    RunTimes times;
+    sample_server(options, times.before);
+    std::vector<WorkerStats> stats(options.threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < options.threads; ++i) {
+        workers.push_back(std::thread(run_worker, std::cref(options), i, std::ref(stats[i])));
+    }
+
+    int64_t connect_start = now_ns();
+    wait_for_workers(options.threads, times);
+    times.connect_seconds = (now_ns() - connect_start) / 1e9;
+    sample_server(options, times.connected);
+
+    if (options.scenario == Scenario::Ramp) {
+        // --- Hold the connections idle: what they cost when nothing happens ---
+        times.start = times.connected;
+        std::cout << "Holding " << options.connections << " connection(s) for " << options.duration << " second(s)..."
+                  << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+        times.measured_seconds = options.duration;
+        sample_server(options, times.end);
+    } else if (options.scenario == Scenario::Storm) {
+        // --- Drop and reconnect everything at once, round after round ---
+        times.start = times.connected;
+        int64_t storm_start = now_ns();
+        for (int round = 1; round <= options.rounds; ++round) {
+            workers_ready.store(0);
+            int64_t round_start = now_ns();
+            connect_round.store(round);
+            wait_for_workers(options.threads, times);
+            times.slowest_round_seconds = std::max(times.slowest_round_seconds, (now_ns() - round_start) / 1e9);
+        }
+        times.measured_seconds = (now_ns() - storm_start) / 1e9;
+        sample_server(options, times.end);
+    } else {
+        // --- Warm up, measure, then let in-flight copies drain ---
+        sending.store(true);
+        std::this_thread::sleep_for(std::chrono::seconds(options.warmup));
+        sample_server(options, times.start);
+        int64_t measure_start = now_ns();
+        measure_from_ns.store(measure_start);
+        std::cout << "Measuring for " << options.duration << " second(s)..." << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+        sending.store(false);
+        times.measured_seconds = (now_ns() - measure_start) / 1e9;
+        sample_server(options, times.end);
+        std::this_thread::sleep_for(std::chrono::seconds(DRAIN_SECONDS));
+    }
+    running.store(false);
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    std::string results = report(options, stats, times);
+
+    int status = 0;
+    if (!options.json_path.empty() && !append_line(options.json_path, results)) {
+        std::cerr << "Could not append results to " << options.json_path << "." << std::endl;
+        status = 1;
+    }
+    if (status == 0 && !options.baseline_path.empty()) {
+        status = compare_with_baseline(options, results);
+    }
+
+    WSACleanup();
+    return status;
+}
+
+/**
+ * @brief Parses the command line into @p parsed.
+ * @return False if the arguments are malformed.
+ */
+bool parse_options(int argc, char *argv[], BenchOptions &parsed) {
+    if (argc < 3) {
+        return false;
+    }
+
+    parsed.host = argv[1];
+    parsed.port = std::stoi(argv[2]);
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--connections") {
+            parsed.connections = std::stoi(value);
+        } else if (arg == "--threads") {
+            parsed.threads = std::stoi(value);
+        } else if (arg == "--rate") {
+            parsed.rate = std::stod(value);
+        } else if (arg == "--size") {
+            parsed.size = std::stoul(value);
+        } else if (arg == "--duration") {
+            parsed.duration = std::stoi(value);
+        } else if (arg == "--warmup") {
+            parsed.warmup = std::stoi(value);
+        } else if (arg == "--rooms") {
+            parsed.rooms = std::stoi(value);
+        } else if (arg == "--scenario") {
+            if (value == "fanout") {
+                parsed.scenario = Scenario::Fanout;
+            } else if (value == "slow") {
+                parsed.scenario = Scenario::Slow;
+            } else if (value == "ramp") {
+                parsed.scenario = Scenario::Ramp;
+            } else if (value == "storm") {
+                parsed.scenario = Scenario::Storm;
+            } else {
+                return false;
+            }
+        } else if (arg == "--connect-rate") {
+            parsed.connect_rate = std::stod(value);
+        } else if (arg == "--slow-fraction") {
+            parsed.slow_fraction = std::stod(value);
+        } else if (arg == "--rounds") {
+            parsed.rounds = std::stoi(value);
+        } else if (arg == "--bind") {
+            parsed.bind_addresses.push_back(value);
+        } else if (arg == "--metrics-port") {
+            parsed.metrics_port = std::stoi(value);
+        } else if (arg == "--json") {
+            parsed.json_path = value;
+        } else if (arg == "--label") {
+            parsed.label = value;
+        } else if (arg == "--baseline") {
+            parsed.baseline_path = value;
+        } else if (arg == "--tolerance") {
+            parsed.tolerance = std::stod(value);
+        } else {
+            return false;
+        }
+    }
+
+    if (parsed.connections < 2 || parsed.threads < 1 || parsed.rooms < 1 || parsed.rate <= 0 ||
+        parsed.duration < 1 || parsed.warmup < 0) {
+        std::cerr << "Need at least 2 connections, 1 thread, 1 room, a positive rate and duration." << std::endl;
+        return false;
+    }
+    if (parsed.size < BENCH_HEADER_SIZE || parsed.size > MAX_CHAT_TEXT) {
+        std::cerr << "Message size must be between " << BENCH_HEADER_SIZE << " and " << MAX_CHAT_TEXT << " bytes."
+                  << std::endl;
+        return false;
+    }
+    if (parsed.connect_rate < 0 || parsed.slow_fraction < 0 || parsed.slow_fraction >= 1 || parsed.rounds < 1 ||
+        parsed.tolerance < 0) {
+        std::cerr << "Need a connect rate of 0 or more, a slow fraction below 1, 1 round or more and a tolerance of"
+                  << " 0 or more." << std::endl;
+        return false;
+    }
+    parsed.threads = std::min(parsed.threads, parsed.connections);
+    if (parsed.label.empty()) {
+        parsed.label = std::string(scenario_name(parsed.scenario)) + "-" + std::to_string(parsed.connections) + "x" +
+                       std::to_string(parsed.rooms);
+    }
+    return true;
+}
+
+const char *scenario_name(Scenario scenario) {
+    switch (scenario) {
+    case Scenario::Slow:
+        return "slow";
+    case Scenario::Ramp:
+        return "ramp";
+    case Scenario::Storm:
+        return "storm";
+    default:
+        return "fanout";
+    }
+}
+
+/**
+ * @brief Whether connection @p index is one of the slow scenario's
+ *        non-readers, spread evenly over the connections and rooms.
+ */
+bool is_slow(const BenchOptions &options, int index) {
+    if (options.scenario != Scenario::Slow) {
+        return false;
+    }
+    int member = index / options.rooms; // Its place among the members of room index % rooms
+    return static_cast<int>((member + 1) * options.slow_fraction) > static_cast<int>(member * options.slow_fraction);
+}
+
+/**
+ * @brief Connects one thread's share of the connections at its share of the
+ *        connect rate, reconnects them all whenever main() starts a new
+ *        round, and sends at its share of the message rate while main()
+ *        lets it, recording latencies until told to stop.
+ */
+void run_worker(const BenchOptions &options, int index, WorkerStats &stats) {
+    Poller poller;
+    std::vector<char> scratch(BENCH_READ_BUFFER);
+    stats.room_sent.assign(options.rooms, 0);
+
+    // Connection i overall goes to room i % rooms; the poller keeps pointers, so never resized
+    std::vector<BenchConnection> connections;
+    for (int i = index; i < options.connections; i += options.threads) {
+        BenchConnection conn;
+        conn.socket = INVALID_SOCKET;
+        conn.index = i;
+        conn.room = i % options.rooms;
+        conn.reader = !is_slow(options, i);
+        conn.connecting = false;
+        conn.joined = false;
+        connections.push_back(conn);
+    }
+    // Only readers send: a sender must hear its room, or the expected copies go wrong
+    std::vector<BenchConnection *> senders;
+    for (BenchConnection &conn : connections) {
+        if (conn.reader) {
+            senders.push_back(&conn);
+        }
+    }
+
+    double thread_connect_rate = options.connect_rate / options.threads;
+    int round = -1;
+    size_t opened = 0;  // Connects started this round
+    size_t settled = 0; // Connections answered or failed this round
+    int64_t round_start = 0;
+    bool reported = false;
+
+    double thread_rate = options.rate / options.threads;
+    std::string payload(options.size, 'x');
+    std::memcpy(&payload[0], BENCH_MARKER, BENCH_MARKER_SIZE);
+    int64_t send_start = -1;
+    size_t next = 0;
+    std::vector<PollEvent> events;
+    events.reserve(POLLER_BATCH_SIZE);
+
+    while (running.load()) {
+        // --- A new round drops every connection at once, then reconnects ---
+        if (connect_round.load() != round) {
+            for (BenchConnection &conn : connections) {
+                close_connection(poller, conn);
+            }
+            round = connect_round.load();
+            opened = settled = 0;
+            stats.connected = 0;
+            round_start = now_ns();
+            reported = false;
+        }
+        size_t due = connections.size();
+        if (thread_connect_rate > 0) {
+            due = std::min(due, static_cast<size_t>((now_ns() - round_start) / 1e9 * thread_connect_rate) + 1);
+        }
+        while (opened < due) {
+            BenchConnection &conn = connections[opened++];
+            conn.joined = false;
+            if (!open_connection(options, poller, conn)) {
+                ++stats.errors;
+                ++settled;
+            }
+        }
+        if (!reported && settled == connections.size()) {
+            reported = true;
+            workers_ready.fetch_add(1);
+        }
+
+        // --- Send at a steady rate, round-robin over this thread's connections ---
+        if (sending.load() && reported && !senders.empty()) {
+            int64_t now = now_ns();
+            if (send_start < 0) {
+                send_start = now;
+            }
+            uint64_t due_messages = static_cast<uint64_t>((now - send_start) / 1e9 * thread_rate);
+            // Never burst more than one connection round at once after a stall
+            if (due_messages > stats.sent + senders.size()) {
+                stats.sent = due_messages - senders.size();
+            }
+            while (stats.sent < due_messages) {
+                BenchConnection &conn = *senders[next++ % senders.size()];
+                ++stats.sent;
+                if (conn.socket == INVALID_SOCKET || !conn.joined) {
+                    continue;
+                }
+                char stamp[17];
+                std::snprintf(stamp, sizeof(stamp), "%016llx", static_cast<unsigned long long>(now_ns()));
+                std::memcpy(&payload[BENCH_MARKER_SIZE], stamp, 16);
+                if (!send_frame(poller, conn, FRAME_CHAT, 0, payload.data(), payload.size())) {
+                    ++stats.errors;
+                    continue;
+                }
+                if (now >= measure_from_ns.load()) {
+                    ++stats.measured_sent;
+                    ++stats.room_sent[conn.room];
+                }
+            }
+        }
+
+        if (poller.wait(events, 1) < 0) {
+            continue;
+        }
+        for (const PollEvent &event : events) {
+            BenchConnection &conn = *static_cast<BenchConnection *>(event.user_data);
+            if (conn.socket == INVALID_SOCKET) {
+                continue;
+            }
+            bool was_joined = conn.joined;
+            bool ok = true;
+            if (conn.connecting) {
+                ok = finish_connect(options, poller, conn);
+                if (ok && !conn.reader) {
+                    // Never read again: the server's queue for it fills up
+                    conn.joined = true;
+                    ++stats.connected;
+                    ++settled;
+                    poller.remove(conn.socket);
+                }
+            } else {
+                if (event.events & (POLL_READ | POLL_ERROR)) {
+                    ok = read_connection(conn, scratch, stats) &&
+                         (conn.output.empty() || flush_connection(poller, conn));
+                }
+                if (ok && (event.events & POLL_WRITE)) {
+                    ok = flush_connection(poller, conn);
+                }
+            }
+            if (conn.joined && !was_joined && conn.reader) {
+                uint64_t micros = static_cast<uint64_t>(std::max<int64_t>(0, now_ns() - conn.opened_ns) / 1000);
+                (round == 0 ? stats.connect_latency : stats.reconnect_latency).record(micros);
+                ++stats.connected;
+                ++settled;
+            }
+            if (!ok) {
+                if (conn.joined) {
+                    ++stats.disconnects;
+                    --stats.connected;
+                } else {
+                    ++stats.errors;
+                    ++settled;
+                }
+                close_connection(poller, conn);
+            }
+        }
+    }
+
+    for (BenchConnection &conn : connections) {
+        close_connection(poller, conn);
+    }
+}
+
+/**
+ * @brief Starts a non-blocking connect; finish_connect() runs once the
+ *        socket turns writable.
+ * @return False if no connect could be started.
+ */
+bool open_connection(const BenchOptions &options, Poller &poller, BenchConnection &conn) {
+    struct sockaddr_in serv_addr;
+    std::memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &serv_addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address/ Address not supported" << std::endl;
+        return false;
+    }
+
+    conn.socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (conn.socket == INVALID_SOCKET) {
+        std::cerr << "Socket creation failed with error: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    if (!options.bind_addresses.empty()) {
+        // One address only has so many ephemeral ports towards one server port
+        struct sockaddr_in local;
+        std::memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        const std::string &address = options.bind_addresses[conn.index % options.bind_addresses.size()];
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        int defer = 1; // Pick the port at connect(), per destination
+        setsockopt(conn.socket, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, (const char *)&defer, sizeof(defer));
+#endif
+        if (inet_pton(AF_INET, address.c_str(), &local.sin_addr) <= 0 ||
+            bind(conn.socket, (struct sockaddr *)&local, sizeof(local)) == SOCKET_ERROR) {
+            std::cerr << "Could not bind to " << address << ", error: " << WSAGetLastError() << std::endl;
+            closesocket(conn.socket);
+            conn.socket = INVALID_SOCKET;
+            return false;
+        }
+    }
+    // Messages are small and latency-sensitive: do not let Nagle hold them back
+    int enable = 1;
+    setsockopt(conn.socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&enable, sizeof(enable));
+    if (!conn.reader) {
+        int size = SLOW_RECEIVE_BUFFER;
+        setsockopt(conn.socket, SOL_SOCKET, SO_RCVBUF, (const char *)&size, sizeof(size));
+    }
+    if (!set_non_blocking(conn.socket)) {
+        std::cerr << "Connection setup failed with error: " << WSAGetLastError() << std::endl;
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
+        return false;
+    }
+
+    conn.opened_ns = now_ns();
+    conn.connecting = true;
+    conn.write_interest = true;
+    conn.input.clear();
+    conn.output.clear();
+    if (connect(conn.socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
+        int error = WSAGetLastError();
+        if (error != WSAEWOULDBLOCK && error != WSAEINPROGRESS) {
+            std::cerr << "Connection Failed with error: " << error << std::endl;
+            closesocket(conn.socket);
+            conn.socket = INVALID_SOCKET;
+            return false;
+        }
+    }
+    // Writability reports the outcome of the connect
+    if (!poller.add(conn.socket, POLL_WRITE, &conn)) {
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Completes a connect: announces the framed protocol, joins the
+ *        connection's room and pings, so the pong marks it connected.
+ * @return False if the connect failed.
+ */
+bool finish_connect(const BenchOptions &options, Poller &poller, BenchConnection &conn) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(conn.socket, SOL_SOCKET, SO_ERROR, (char *)&error, &length) == SOCKET_ERROR || error != 0) {
+        return false;
+    }
+    conn.connecting = false;
+    if (conn.reader) {
+        conn.write_interest = false;
+        poller.modify(conn.socket, POLL_READ, &conn);
+    }
+    conn.output.append(FRAME_PREFACE, FRAME_PREFACE_SIZE);
+    if (options.rooms > 1) {
+        std::string room = "bench-" + std::to_string(conn.room);
+        char header[MAX_FRAME_HEADER];
+        conn.output.append(header, encode_frame_header(FRAME_JOIN, 0, (uint32_t)room.size(), header));
+        conn.output += room;
+    }
+    return send_frame(poller, conn, FRAME_PING, 0, "", 0);
+}
+
+/**
+ * @brief Closes a connection, if open, without lingering in TIME_WAIT.
+ */
+void close_connection(Poller &poller, BenchConnection &conn) {
+    if (conn.socket == INVALID_SOCKET) {
+        return;
+    }
+    if (conn.reader || conn.connecting) {
+        poller.remove(conn.socket);
+    }
+    // A reset rather than an orderly close: reconnect storms would exhaust ephemeral ports otherwise
+    struct linger abort_close;
+    abort_close.l_onoff = 1;
+    abort_close.l_linger = 0;
+    setsockopt(conn.socket, SOL_SOCKET, SO_LINGER, (const char *)&abort_close, sizeof(abort_close));
+    closesocket(conn.socket);
+    conn.socket = INVALID_SOCKET;
+    conn.connecting = false;
+    conn.joined = false;
+    std::string().swap(conn.input);
+    std::string().swap(conn.output);
+}
+
+/**
+ * @brief Queues one frame and writes as much as the socket takes.
+ * @return False if the connection failed.
+ */
+bool send_frame(Poller &poller, BenchConnection &conn, uint8_t type, uint8_t flags, const char *payload, size_t length) {
+    if (conn.socket == INVALID_SOCKET) {
+        return false;
+    }
+    char header[MAX_FRAME_HEADER];
+    size_t header_length = encode_frame_header(type, flags, (uint32_t)length, header);
+    conn.output.append(header, header_length);
+    conn.output.append(payload, length);
+    return flush_connection(poller, conn);
+}
+
+/**
+ * @brief Writes queued bytes; watches for writability while some remain.
+ * @return False if the connection failed.
+ */
+bool flush_connection(Poller &poller, BenchConnection &conn) {
+    while (!conn.output.empty()) {
+        int bytes_sent = send(conn.socket, conn.output.data(), (int)conn.output.size(), 0);
+        if (bytes_sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        conn.output.erase(0, bytes_sent);
+    }
+
+    // Connections that never read leave the poller once connected
+    bool want_write = !conn.output.empty();
+    if (want_write != conn.write_interest && conn.reader) {
+        conn.write_interest = want_write;
+        poller.modify(conn.socket, want_write ? POLL_READ | POLL_WRITE : POLL_READ, &conn);
+    }
+    return true;
+}
+
+/**
+ * @brief Drains a connection and records a latency sample per relayed bench message.
+ *
+ * Reads go through the thread's @p scratch buffer; only the start of a
+ * frame that is still incomplete stays with the connection, so idle
+ * connections cost no buffer. The first pong marks the connection joined.
+ * Answers to heartbeat pings are queued in the connection's output.
+ * @return False if the connection closed or sent a malformed frame.
+ */
+bool read_connection(BenchConnection &conn, std::vector<char> &scratch, WorkerStats &stats) {
+    while (true) {
+        size_t buffered = conn.input.size();
+        std::memcpy(scratch.data(), conn.input.data(), buffered);
+        int bytes_received = recv(conn.socket, scratch.data() + buffered, (int)(scratch.size() - buffered), 0);
+        if (bytes_received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            return true;
+        }
+        if (bytes_received <= 0) {
+            return false;
+        }
+        buffered += bytes_received;
+
+        int64_t now = now_ns();
+        int64_t measure_from = measure_from_ns.load();
+        if (now >= measure_from) {
+            stats.bytes_received += bytes_received;
+        }
+        size_t offset = 0;
+        Frame frame;
+        size_t consumed;
+        ParseResult result;
+        while ((result = parse_frame(scratch.data() + offset, buffered - offset, frame, consumed)) ==
+               ParseResult::Complete) {
+            offset += consumed;
+            if (frame.type == FRAME_PING) {
+                // Queued here, written by the caller
+                char header[MAX_FRAME_HEADER];
+                conn.output.append(header, encode_frame_header(FRAME_PONG, 0, frame.length, header));
+                conn.output.append(frame.payload, frame.length);
+                continue;
+            }
+            if (frame.type == FRAME_PONG) {
+                conn.joined = true;
+                continue;
+            }
+            if (frame.type != FRAME_CHAT) {
+                continue;
+            }
+            // Relayed text is "<sender prefix>#bench <send time>..."
+            const char *end = frame.payload + frame.length;
+            const char *marker = std::search(frame.payload, end, BENCH_MARKER, BENCH_MARKER + BENCH_MARKER_SIZE);
+            if (end - marker < (ptrdiff_t)BENCH_HEADER_SIZE) {
+                continue;
+            }
+            int64_t sent_at = 0;
+            for (const char *digit = marker + BENCH_MARKER_SIZE; digit < marker + BENCH_HEADER_SIZE; ++digit) {
+                sent_at = sent_at * 16 + (*digit <= '9' ? *digit - '0' : *digit - 'a' + 10);
+            }
+            if (sent_at >= measure_from) {
+                ++stats.received;
+                stats.latency.record(static_cast<uint64_t>(std::max<int64_t>(0, now - sent_at) / 1000));
+            }
+        }
+        if (result == ParseResult::Invalid) {
+            return false;
+        }
+        if (offset == buffered) {
+            conn.input.clear();
+        } else {
+            conn.input.assign(scratch.data() + offset, buffered - offset);
+        }
+    }
+}
+
+/**
+ * @brief Waits until every worker's connections connected or failed, or
+ *        CONNECT_TIMEOUT_SECONDS passed.
+ * @return False on timeout.
+ */
+bool wait_for_workers(int threads, RunTimes &times) {
+    int64_t deadline = now_ns() + (int64_t)CONNECT_TIMEOUT_SECONDS * 1000000000;
+    while (workers_ready.load() < threads) {
+        if (now_ns() > deadline) {
+            std::cerr << "Timed out waiting for connections." << std::endl;
+            times.timed_out = true;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+/**
+ * @brief Scrapes the server's metrics endpoint, if one was given.
+ * @return False if it was not given or could not be read.
+ */
+bool sample_server(const BenchOptions &options, ServerSample &sample) {
+    if (options.metrics_port == 0) {
+        return false;
+    }
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.metrics_port);
+    if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) <= 0) {
+        return false;
+    }
+    SOCKET socket_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket_fd == INVALID_SOCKET) {
+        return false;
+    }
+    std::string response;
+    const char request[] = "GET /metrics HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) != SOCKET_ERROR &&
+        send(socket_fd, request, (int)sizeof(request) - 1, 0) == (int)sizeof(request) - 1) {
+        char buffer[16384];
+        int length;
+        while ((length = recv(socket_fd, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, length);
+        }
+    }
+    closesocket(socket_fd);
+
+    struct Field {
+        const char *name;
+        double *value;
+    };
+    const Field fields[] = {
+        {"process_resident_memory_bytes", &sample.resident_bytes},
+        {"process_cpu_seconds_total", &sample.cpu_seconds},
+        {"chat_messages_received_total", &sample.messages_received},
+        {"chat_messages_sent_total", &sample.messages_sent},
+        {"chat_queue_drops_total", &sample.queue_drops},
+        {"chat_connections_closed_total", &sample.connections_closed},
+    };
+    int found = 0;
+    for (const Field &field : fields) {
+        // One "name value" line per metric, after its # HELP and # TYPE lines
+        std::string prefix = std::string("\n") + field.name + " ";
+        size_t at = response.find(prefix);
+        if (at != std::string::npos) {
+            *field.value = std::strtod(response.c_str() + at + prefix.size(), NULL);
+            ++found;
+        }
+    }
+    sample.valid = found == (int)(sizeof(fields) / sizeof(fields[0]));
+    if (!sample.valid) {
+        std::cerr << "Could not read the server's metrics on port " << options.metrics_port << "." << std::endl;
+    }
+    return sample.valid;
+}
+
+/**
+ * @brief Appends `"key":value` to a JSON object under construction.
+ */
+void append_json(std::string &out, const char *key, double value) {
+    char text[64];
+    if (value == static_cast<double>(static_cast<long long>(value)) && std::fabs(value) < 1e15) {
+        std::snprintf(text, sizeof(text), "%lld", static_cast<long long>(value));
+    } else {
+        std::snprintf(text, sizeof(text), "%.6g", value);
+    }
+    out += out.size() > 1 ? ",\"" : "\"";
+    out += key;
+    out += "\":";
+    out += text;
+}
+
+void append_json(std::string &out, const char *key, const std::string &value) {
+    out += out.size() > 1 ? ",\"" : "\"";
+    out += key;
+    out += "\":\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+void append_percentiles(std::string &out, const char *prefix, const LatencyHistogram &histogram) {
+    const char *suffixes[] = {"_p50_us", "_p99_us", "_p999_us", "_max_us"};
+    double values[] = {(double)histogram.percentile(0.50), (double)histogram.percentile(0.99),
+                       (double)histogram.percentile(0.999), (double)histogram.max()};
+    for (int i = 0; i < 4; ++i) {
+        append_json(out, (std::string(prefix) + suffixes[i]).c_str(), values[i]);
+    }
+}
+
+/**
+ * @brief Prints the run's figures and renders them as one JSON object.
+ */
+std::string report(const BenchOptions &options, const std::vector<WorkerStats> &stats, const RunTimes &times) {
+    WorkerStats total;
+    total.room_sent.assign(options.rooms, 0);
+    std::vector<int> room_readers(options.rooms, 0);
+    int readers = 0;
+    for (int i = 0; i < options.connections; ++i) {
+        if (!is_slow(options, i)) {
+            room_readers[i % options.rooms] += 1;
+            ++readers;
+        }
+    }
+    for (const WorkerStats &worker : stats) {
+        total.connected += worker.connected;
+        total.sent += worker.sent;
+        total.measured_sent += worker.measured_sent;
+        total.received += worker.received;
+        total.bytes_received += worker.bytes_received;
+        total.errors += worker.errors;
+        total.disconnects += worker.disconnects;
+        total.latency.merge(worker.latency);
+        total.connect_latency.merge(worker.connect_latency);
+        total.reconnect_latency.merge(worker.reconnect_latency);
+        for (int room = 0; room < options.rooms; ++room) {
+            total.room_sent[room] += worker.room_sent[room];
+        }
+    }
+
+    std::string json = "{";
+    append_json(json, "label", options.label);
+    append_json(json, "scenario", std::string(scenario_name(options.scenario)));
+    append_json(json, "connections", options.connections);
+    append_json(json, "rooms", options.rooms);
+    append_json(json, "connected", total.connected);
+    append_json(json, "errors", (double)total.errors);
+    append_json(json, "timed_out", times.timed_out ? 1 : 0);
+    if (options.scenario == Scenario::Ramp) {
+        // Elsewhere connecting is a burst of setup, too noisy to compare
+        append_json(json, "connect_seconds", times.connect_seconds);
+        append_json(json, "connects_per_s", total.connect_latency.count() / std::max(times.connect_seconds, 1e-3));
+        append_percentiles(json, "connect", total.connect_latency);
+    }
+
+    std::printf("Connections:  %d of %d connected, %llu error(s), %llu disconnected by the server\n",
+                total.connected, options.connections, static_cast<unsigned long long>(total.errors),
+                static_cast<unsigned long long>(total.disconnects));
+    std::printf("Connect:      %.2f s (%.0f conn/s), latency (us) p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+                times.connect_seconds, total.connect_latency.count() / std::max(times.connect_seconds, 1e-3),
+                static_cast<unsigned long long>(total.connect_latency.percentile(0.50)),
+                static_cast<unsigned long long>(total.connect_latency.percentile(0.99)),
+                static_cast<unsigned long long>(total.connect_latency.percentile(0.999)),
+                static_cast<unsigned long long>(total.connect_latency.max()));
+
+    if (options.scenario == Scenario::Storm) {
+        append_json(json, "rounds", options.rounds);
+        append_json(json, "slowest_round_seconds", times.slowest_round_seconds);
+        append_json(json, "reconnects_per_s", total.reconnect_latency.count() / std::max(times.measured_seconds, 1e-3));
+        append_percentiles(json, "reconnect", total.reconnect_latency);
+        std::printf("Storm:        %d round(s) in %.2f s, slowest %.2f s, reconnect latency (us) p50 %llu  p99 %llu"
+                    "  max %llu\n",
+                    options.rounds, times.measured_seconds, times.slowest_round_seconds,
+                    static_cast<unsigned long long>(total.reconnect_latency.percentile(0.50)),
+                    static_cast<unsigned long long>(total.reconnect_latency.percentile(0.99)),
+                    static_cast<unsigned long long>(total.reconnect_latency.max()));
+    }
+
+    if (options.scenario == Scenario::Fanout || options.scenario == Scenario::Slow) {
+        // Every message should reach every other member of its room that reads
+        uint64_t expected = 0;
+        for (int room = 0; room < options.rooms; ++room) {
+            expected += total.room_sent[room] * std::max(0, room_readers[room] - 1);
+        }
+        double seconds = times.measured_seconds;
+        append_json(json, "room_size", (double)options.connections / options.rooms);
+        append_json(json, "readers", readers);
+        append_json(json, "message_bytes", (double)options.size);
+        append_json(json, "sent", (double)total.measured_sent);
+        append_json(json, "sent_per_s", total.measured_sent / seconds);
+        append_json(json, "delivered", (double)total.received);
+        append_json(json, "expected", (double)expected);
+        append_json(json, "delivery_ratio", expected == 0 ? 1.0 : (double)total.received / expected);
+        append_json(json, "delivered_per_s", total.received / seconds);
+        append_json(json, "received_mb_per_s", total.bytes_received / seconds / 1e6);
+        append_json(json, "disconnects", (double)total.disconnects);
+        append_percentiles(json, "latency", total.latency);
+
+        std::printf("Sent:         %llu messages in %.2f s (%.0f msg/s, %llu bytes each)\n",
+                    static_cast<unsigned long long>(total.measured_sent), seconds, total.measured_sent / seconds,
+                    static_cast<unsigned long long>(options.size));
+        std::printf("Delivered:    %llu of %llu expected copies (%.0f msg/s fan-out, %.1f MB/s received)\n",
+                    static_cast<unsigned long long>(total.received), static_cast<unsigned long long>(expected),
+                    total.received / seconds, total.bytes_received / seconds / 1e6);
+        std::printf("Latency (us): p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+                    static_cast<unsigned long long>(total.latency.percentile(0.50)),
+                    static_cast<unsigned long long>(total.latency.percentile(0.99)),
+                    static_cast<unsigned long long>(total.latency.percentile(0.999)),
+                    static_cast<unsigned long long>(total.latency.max()));
+    }
+
+    if (times.before.valid && times.connected.valid && times.start.valid && times.end.valid) {
+        double per_connection =
+            total.connected > 0 ? (times.connected.resident_bytes - times.before.resident_bytes) / total.connected : 0;
+        double cpu = times.end.cpu_seconds - times.start.cpu_seconds;
+        double messages = times.end.messages_received - times.start.messages_received;
+        double deliveries = times.end.messages_sent - times.start.messages_sent;
+        append_json(json, "server_rss_bytes", times.end.resident_bytes);
+        append_json(json, "memory_per_connection_bytes", per_connection);
+        append_json(json, "server_cpu_seconds", cpu);
+        append_json(json, "server_cpu_percent", 100 * cpu / std::max(times.measured_seconds, 1e-3));
+        append_json(json, "server_queue_drops", times.end.queue_drops - times.start.queue_drops);
+        append_json(json, "server_disconnects", times.end.connections_closed - times.start.connections_closed);
+        std::printf("Server:       %.1f MB resident, %.0f bytes per connection, %.1f%% CPU while measured, %.0f queue"
+                    " drop(s), %.0f disconnect(s)\n",
+                    times.end.resident_bytes / 1e6, per_connection, 100 * cpu / std::max(times.measured_seconds, 1e-3),
+                    times.end.queue_drops - times.start.queue_drops,
+                    times.end.connections_closed - times.start.connections_closed);
+        if (messages > 0) {
+            append_json(json, "cpu_us_per_message", cpu * 1e6 / messages);
+            append_json(json, "cpu_us_per_delivery", deliveries > 0 ? cpu * 1e6 / deliveries : 0);
+            std::printf("Server CPU:   %.2f us per message received, %.3f us per copy sent\n", cpu * 1e6 / messages,
+                        deliveries > 0 ? cpu * 1e6 / deliveries : 0);
+        }
+    }
+    json += "}";
+    return json;
+}
+
+/**
+ * @brief Appends @p line and a newline to the file at @p path.
+ */
+bool append_line(const std::string &path, const std::string &line) {
+    std::ofstream out(path.c_str(), std::ios::app);
+    out << line << "\n";
+    return static_cast<bool>(out);
+}
+
+/**
+ * @brief Compares this run with the last run of the same label in the
+ *        baseline file and prints every figure that got worse by more than
+ *        the tolerance (and the figure's slack).
+ * @return 0, EXIT_REGRESSION if a figure regressed, 1 if the baseline is unreadable.
+ */
+int compare_with_baseline(const BenchOptions &options, const std::string &results) {
+    std::ifstream in(options.baseline_path.c_str());
+    if (!in) {
+        std::cerr << "Could not read baseline " << options.baseline_path << "." << std::endl;
+        return 1;
+    }
+    std::string label = "\"label\":\"" + options.label + "\"";
+    std::string line, baseline;
+    while (std::getline(in, line)) {
+        if (line.find(label) != std::string::npos) {
+            baseline = line;
+        }
+    }
+    if (baseline.empty()) {
+        std::cout << "Baseline: no run labelled " << options.label << ", nothing to compare." << std::endl;
+        return 0;
+    }
+
+    int regressions = 0;
+    for (const Threshold &threshold : THRESHOLDS) {
+        double before, after;
+        if (!json_number(baseline, threshold.key, before) || !json_number(results, threshold.key, after) ||
+            before == 0) {
+            continue;
+        }
+        double worse = threshold.higher_is_better ? before - after : after - before;
+        if (worse > threshold.slack && worse > std::fabs(before) * options.tolerance / 100) {
+            std::printf("Regression:   %s %.6g, baseline %.6g (%+.1f%%)\n", threshold.key, after, before,
+                        100 * (after - before) / before);
+            ++regressions;
+        }
+    }
+    if (regressions == 0) {
+        std::printf("Baseline:     no regressions beyond %.0f%% against %s\n", options.tolerance,
+                    options.baseline_path.c_str());
+        return 0;
+    }
+    return EXIT_REGRESSION;
+}
+
+/**
+ * @brief Reads the number stored under @p key in a flat JSON object.
+ */
+bool json_number(const std::string &line, const char *key, double &value) {
+    std::string name = std::string("\"") + key + "\":";
+    size_t at = line.find(name);
+    if (at == std::string::npos) {
+        return false;
+    }
+    const char *start = line.c_str() + at + name.size();
+    char *end;
+    value = std::strtod(start, &end);
+    return end != start;
+}
+
+/**
+ * @brief Switches a socket to non-blocking mode.
+ * @return True on success, false otherwise.
+ */
+bool set_non_blocking(SOCKET socket) {
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode) == 0;
+}
+
+/**
+ * @brief Lifts the soft limit on open descriptors to the hard limit, as
+ *        ramps of many connections need.
+ */
+void raise_descriptor_limit() {
+#ifndef _WIN32
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
@@ -0,0 +1,813 @@
+// -----------------------------------------------------------------------------
+// Asynchronous Chat Client Library
+//
+// An embeddable, non-blocking client for the framed protocol (see frame.h).
+// One ChatLoop multiplexes any number of ChatSessions on the thread that
+// runs it, through a Poller (see poller.h), so a bot or an integration
+// service can keep thousands of sessions on a handful of threads. Frames a
+// session is asked to send during one pass of the loop are batched and
+// written with a single send at the end of the pass.
+//
+// Backpressure is reported, not hidden:
+//
+//   - Each session's unsent bytes are bounded. Once they pass
+//     SESSION_HIGH_WATER the send calls refuse new frames (they return
+//     false) and congested() is true, until the backlog drains below
+//     SESSION_LOW_WATER and ChatHandler::on_writable() is called.
+//   - When the server drops one of the session's messages for a rate limit
+//     it flags the notice (FRAME_FLAG_THROTTLED). The session then holds
+//     its output back for THROTTLE_BACKOFF_MS, rather than have that
+//     dropped too, and calls ChatHandler::on_throttled().
+//
+// Sessions answer heartbeats, negotiate compression and decompress what
+// arrives on their own, so handlers only see chat, notices and direct
+// messages. After ChatLoop::use_presence(), sessions also keep each room's
+// member set from the server's presence updates (see presence.h) and
+// report joins, leaves and typing through ChatHandler::on_presence().
+// Everything must be called on the thread running the loop, except
+// ChatLoop::post() and ChatLoop::stop(). The program initializes Winsock
+// itself.
+//
+// In a TLS build (CHAT_TLS, see tls.h) ChatLoop::use_tls() makes later
+// connections TLS. The loop keeps each server's last session ticket, so
+// reconnecting to it skips the full handshake.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "socket_compat.h"
+#include "socket_options.h"
+#include "poller.h"
+#include "mpsc_queue.h"
+#include "frame.h"
+#include "compression.h"
+#include "presence.h"
+#include "tls.h"
+
+// Unsent bytes past which a session refuses new frames, and below which it
+// accepts them again
+const size_t SESSION_HIGH_WATER = 1024 * 1024;
+const size_t SESSION_LOW_WATER = SESSION_HIGH_WATER / 4;
+// Output held back after a throttle notice; server limits refill within a second
+const int THROTTLE_BACKOFF_MS = 1000;
+// Receive buffers start small and grow to hold one maximal frame
+const size_t SESSION_READ_BUFFER = 16 * 1024;
+const size_t MAX_SESSION_READ_BUFFER = 2 * (MAX_FRAME_PAYLOAD + MAX_FRAME_HEADER);
+// recv() calls per readiness event, so one busy session cannot starve the rest
+const int SESSION_READS_PER_EVENT = 16;
+// on_closed() error for a server that broke the protocol
+const int CHAT_PROTOCOL_ERROR = -1;
+#ifdef CHAT_TLS
+// on_closed() error for a TLS handshake or record that failed, say an untrusted certificate
+const int CHAT_TLS_ERROR = -2;
+#endif
+
+class ChatSession;
+
+/**
+ * @brief What a program implements to hear from its sessions.
+ *
+ * Callbacks run on the loop's thread and may call any session method,
+ * including close().
+ */
+class ChatHandler {
+public:
+    virtual ~ChatHandler() {}
+
+    // The connection is up; frames sent before this went out first thing
+    virtual void on_connected(ChatSession &) {}
+    // A FRAME_CHAT, FRAME_NOTICE or FRAME_DIRECT, decompressed
+    virtual void on_message(ChatSession &session, uint8_t type, const char *text, size_t length) = 0;
+    // The server dropped a message for a rate limit; output is held back a while
+    virtual void on_throttled(ChatSession &) {}
+    // A presence snapshot or delta was applied; ChatSession::members() has the result
+    virtual void on_presence(ChatSession &, const PresenceUpdate &update) { (void)update; }
+    // A congested session drained; sends are accepted again
+    virtual void on_writable(ChatSession &) {}
+    // The connection is gone: 0 if it was closed in an orderly way, otherwise
+    // a socket error, CHAT_PROTOCOL_ERROR or CHAT_TLS_ERROR. The session is
+    // freed afterwards.
+    virtual void on_closed(ChatSession &, int error) { (void)error; }
+};
+
+/**
+ * @brief One connection to a chat server, owned by a ChatLoop.
+ */
+class ChatSession {
+public:
+    ChatSession(const ChatSession &) = delete;
+    ChatSession &operator=(const ChatSession &) = delete;
+
+    /**
+     * @brief Queues chat text for the current room.
+     * @return False if the text is too long or the session is congested or closed.
+     */
+    bool send_chat(const std::string &text) { return text.size() <= MAX_CHAT_TEXT && send(FRAME_CHAT, 0, text); }
+
+    /**
+     * @brief Queues chat text for one of the session's rooms.
+     */
+    bool send_to_room(const std::string &room, const std::string &text) {
+        if (room.empty() || room.size() > 255 || text.size() > MAX_CHAT_TEXT) {
+            return false;
+        }
+        return send(FRAME_CHAT, FRAME_FLAG_ROOM, std::string(1, static_cast<char>(room.size())) + room + text);
+    }
+
+    /**
+     * @brief Queues a private message for the client with session id @p recipient.
+     */
+    bool send_direct(uint64_t recipient, const std::string &text) {
+        if (text.size() > MAX_CHAT_TEXT) {
+            return false;
+        }
+        std::string payload;
+        for (size_t i = 0; i < DIRECT_RECIPIENT_SIZE; ++i) {
+            payload += static_cast<char>((recipient >> (8 * i)) & 0xFF);
+        }
+        return send(FRAME_DIRECT, 0, payload + text);
+    }
+
+    bool join(const std::string &room) { return send(FRAME_JOIN, 0, room); }
+
+    // Leaves @p room, or the current room if it is empty
+    bool leave(const std::string &room = std::string()) { return send(FRAME_LEAVE, 0, room); }
+
+    // Tells @p room, or the current room if it is empty, that the user is typing
+    bool send_typing(const std::string &room = std::string()) { return send(FRAME_TYPING, 0, room); }
+
+    /**
+     * @brief The members of @p room as of the last presence update, including
+     *        this session; NULL before the room's snapshot has arrived.
+     */
+    const std::unordered_set<uint64_t> *members(const std::string &room) const {
+        std::unordered_map<std::string, Roster>::const_iterator it = rosters_.find(room);
+        return it != rosters_.end() ? &it->second.members : NULL;
+    }
+
+    /**
+     * @brief Closes the connection once everything queued has been sent.
+     */
+    void close() {
+        if (state_ == State::Closed) {
+            return;
+        }
+        closing_ = true;
+        mark_dirty();
+    }
+
+    bool connected() const { return state_ == State::Connected; }
+    // Refusing new frames until the backlog drains
+    bool congested() const { return congested_; }
+    // Holding output back after a throttle notice
+    bool throttled() const { return std::chrono::steady_clock::now() < resume_at_; }
+    // Compressed frames were negotiated
+    bool compression() const { return compression_; }
+    // Presence updates were negotiated
+    bool presence() const { return presence_; }
+    // Bytes queued but not yet taken by the kernel
+    size_t backlog() const { return output_.size(); }
+
+    void *user_data; // For the program; untouched by the library
+
+private:
+    friend class ChatLoop;
+
+    enum class State { Connecting, Handshaking, Connected, Closed };
+
+    // A room's members, as of a snapshot and the deltas after it
+    struct Roster {
+        uint64_t version; // The snapshot's
+        std::unordered_set<uint64_t> members;
+    };
+
+    ChatSession(class ChatLoop *loop, SOCKET socket, ChatHandler *handler)
+        : user_data(NULL), loop_(loop), socket_(socket), handler_(handler), state_(State::Connecting),
+          buffered_(0), compression_(false), presence_(false), congested_(false), closing_(false), dirty_(false),
+          write_interest_(false) {
+#ifdef CHAT_TLS
+        tls_ = NULL;
+        tls_want_write_ = false;
+#endif
+    }
+
+    /**
+     * @brief Appends a frame, compressed if that was negotiated and pays off.
+     * @param forced Control frames (heartbeats) that must go out even while
+     *        the session is congested.
+     */
+    bool send(uint8_t type, uint8_t flags, const std::string &payload, bool forced = false) {
+        if (state_ == State::Closed || closing_ || (congested_ && !forced)) {
+            return false;
+        }
+        const char *data = payload.data();
+        size_t length = payload.size();
+        if (compression_ && length >= DEFAULT_COMPRESS_MIN && compress_payload(data, length, deflated_)) {
+            flags |= FRAME_FLAG_COMPRESSED;
+            data = deflated_.data();
+            length = deflated_.size();
+        }
+        if (length > MAX_FRAME_PAYLOAD) {
+            return false;
+        }
+        char header[MAX_FRAME_HEADER];
+        output_.append(header, encode_frame_header(type, flags, static_cast<uint32_t>(length), header));
+        output_.append(data, length);
+        if (output_.size() >= SESSION_HIGH_WATER) {
+            congested_ = true;
+        }
+        mark_dirty();
+        return true;
+    }
+
+    inline void mark_dirty();
+
+    ChatLoop *loop_;
+    SOCKET socket_;
+    ChatHandler *handler_;
+    State state_;
+    std::string output_;          // Frames not yet taken by the kernel
+    std::vector<char> input_;     // Received bytes [0, buffered_) not yet parsed
+    size_t buffered_;
+    std::vector<char> deflated_;  // Scratch for compressing a payload
+    std::chrono::steady_clock::time_point resume_at_; // Output held back until then
+    bool compression_;
+    bool presence_;
+    std::unordered_map<std::string, Roster> rosters_; // Room -> members; only with presence
+    bool congested_;
+    bool closing_;                // close() was called; finishes once flushed
+    bool dirty_;                  // Listed in the loop's dirty_ list
+    bool write_interest_;         // Poller is watching for writability
+#ifdef CHAT_TLS
+    SSL *tls_;                    // NULL: plain TCP
+    std::string server_;          // "host:port", the key of its remembered session
+    bool tls_want_write_;         // A read waits for writability
+#endif
+};
+
+/**
+ * @brief Event loop running any number of sessions on one thread.
+ */
+class ChatLoop {
+public:
+    // Work posted from another thread, run on the loop's thread
+    typedef std::function<void()> Task;
+
+    ChatLoop() : presence_(false) {
+        wake_pending_.store(false);
+        stopping_.store(false);
+    }
+
+    ~ChatLoop() {
+        for (ChatSession *session : sessions_) {
+            if (session->state_ != ChatSession::State::Closed) {
+#ifdef CHAT_TLS
+                if (session->tls_ != NULL) {
+                    SSL_free(session->tls_);
+                }
+#endif
+                closesocket(session->socket_);
+            }
+            delete session;
+        }
+    }
+
+    ChatLoop(const ChatLoop &) = delete;
+    ChatLoop &operator=(const ChatLoop &) = delete;
+
+    bool valid() const { return poller_.valid(); }
+
+#ifdef CHAT_TLS
+    /**
+     * @brief Makes every later connect() TLS, trusting the CA certificates
+     *        in @p ca_file, or the system's if it is empty.
+     * @return False with @p error set if they cannot be loaded.
+     */
+    bool use_tls(const std::string &ca_file, std::string &error) { return tls_.init_client(ca_file, error); }
+#endif
+
+    /**
+     * @brief Makes every later connect() ask for presence updates: joins and
+     *        leaves then reach ChatHandler::on_presence() instead of arriving
+     *        as notices.
+     */
+    void use_presence() { presence_ = true; }
+
+    /**
+     * @brief Starts connecting to a server; the handler hears how it goes.
+     *
+     * The session announces the framed protocol and offers compression,
+     * and presence if asked to, ahead of anything the program sends.
+     * @return The session, or NULL if the address does not resolve or no
+     *         socket could be created.
+     */
+    ChatSession *connect(const std::string &host, int port, ChatHandler *handler) {
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC; // IPv4 or IPv6, whichever the name resolves to first
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *found = NULL;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0 || found == NULL) {
+            return NULL;
+        }
+        struct sockaddr_storage address;
+        socklen_t address_length = static_cast<socklen_t>(found->ai_addrlen);
+        std::memcpy(&address, found->ai_addr, found->ai_addrlen);
+        freeaddrinfo(found);
+
+        SOCKET socket = ::socket(address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if (socket == INVALID_SOCKET) {
+            return NULL;
+        }
+        u_long mode = 1;
+        set_int_option(socket, IPPROTO_TCP, TCP_NODELAY, 1);
+        if (ioctlsocket(socket, FIONBIO, &mode) != 0) {
+            closesocket(socket);
+            return NULL;
+        }
+#ifdef CHAT_TLS
+        std::string server = host + ":" + std::to_string(port);
+        SSL *tls = NULL;
+        if (tls_.valid() && (tls = tls_.connect(socket, host, server)) == NULL) {
+            closesocket(socket);
+            return NULL;
+        }
+#endif
+        ChatSession *session = new ChatSession(this, socket, handler);
+#ifdef CHAT_TLS
+        session->tls_ = tls;
+        session->server_ = server;
+#endif
+        sessions_.push_back(session);
+        session->input_.resize(SESSION_READ_BUFFER);
+        session->output_.append(FRAME_PREFACE, FRAME_PREFACE_SIZE);
+        char capabilities = static_cast<char>(CAPABILITY_LZ4 | (presence_ ? CAPABILITY_PRESENCE : 0));
+        session->send(FRAME_CAPABILITIES, 0, std::string(1, capabilities), true);
+
+        int error = 0;
+        if (::connect(socket, (struct sockaddr *)&address, address_length) == SOCKET_ERROR) {
+            error = WSAGetLastError();
+            if (error == WSAEWOULDBLOCK || error == WSAEINPROGRESS) {
+                error = 0;
+            }
+        }
+        // Writability reports the outcome of the connect
+        if (error == 0 && !poller_.add(socket, POLL_WRITE, session)) {
+            error = WSAGetLastError();
+        }
+        if (error != 0) {
+            fail(session, error); // Reported from the next run_once()
+        }
+        return session;
+    }
+
+    /**
+     * @brief Waits up to @p timeout_ms (-1: indefinitely) for I/O or posted
+     *        work, handles it and flushes every session that has output.
+     */
+    void run_once(int timeout_ms) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (const ChatSession *session : held_) {
+            int held_ms = (int)std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::milliseconds>(session->resume_at_ - now).count() + 1);
+            timeout_ms = timeout_ms < 0 ? held_ms : std::min(timeout_ms, held_ms);
+        }
+        if (!failed_.empty()) {
+            timeout_ms = 0;
+        }
+        if (poller_.wait(events_, timeout_ms) < 0) {
+            return;
+        }
+
+        // Clear before running tasks so one posted meanwhile wakes us again
+        wake_pending_.store(false);
+        Task task;
+        while (tasks_.pop(task)) {
+            task();
+        }
+
+        for (const PollEvent &event : events_) {
+            ChatSession *session = static_cast<ChatSession *>(event.user_data);
+            if (session->state_ == ChatSession::State::Closed) {
+                continue;
+            }
+            if (session->state_ == ChatSession::State::Connecting) {
+                finish_connect(session);
+                continue;
+            }
+#ifdef CHAT_TLS
+            if (session->state_ == ChatSession::State::Handshaking) {
+                handshake(session);
+                continue;
+            }
+            if (session->tls_want_write_ && (event.events & POLL_WRITE)) {
+                session->tls_want_write_ = false;
+                read(session);
+                if (session->state_ == ChatSession::State::Closed) {
+                    continue;
+                }
+            }
+#endif
+            if (event.events & (POLL_READ | POLL_ERROR)) {
+                read(session);
+            }
+            if (session->state_ != ChatSession::State::Closed && (event.events & POLL_WRITE)) {
+                session->mark_dirty();
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < held_.size();) {
+            if (now >= held_[i]->resume_at_) {
+                held_[i]->mark_dirty();
+                held_[i] = held_.back();
+                held_.pop_back();
+            } else {
+                ++i;
+            }
+        }
+
+        // Flushing may fail sessions, and handlers may send on others
+        for (size_t i = 0; i < dirty_.size(); ++i) {
+            ChatSession *session = dirty_[i];
+            session->dirty_ = false;
+            if (session->state_ == ChatSession::State::Connected) {
+                flush(session);
+            }
+        }
+        dirty_.clear();
+
+        // Report failures, then free the sessions, once nothing points at them
+        for (size_t i = 0; i < failed_.size(); ++i) {
+            std::pair<ChatSession *, int> failure = failed_[i];
+            failure.first->handler_->on_closed(*failure.first, failure.second);
+        }
+        for (const std::pair<ChatSession *, int> &failure : failed_) {
+            sessions_.erase(std::find(sessions_.begin(), sessions_.end(), failure.first));
+            held_.erase(std::remove(held_.begin(), held_.end(), failure.first), held_.end());
+            delete failure.first;
+        }
+        failed_.clear();
+    }
+
+    /**
+     * @brief Runs the loop until stop() is called.
+     */
+    void run() {
+        while (!stopping_.load()) {
+            run_once(-1);
+        }
+    }
+
+    // Makes run() return; safe to call from any thread
+    void stop() {
+        stopping_.store(true);
+        poller_.wake();
+    }
+
+    /**
+     * @brief Runs @p task on the loop's thread; safe to call from any thread.
+     */
+    void post(Task task) {
+        tasks_.push(std::move(task));
+        // Only the first task since the loop last ran them needs a wake-up
+        if (!wake_pending_.exchange(true)) {
+            poller_.wake();
+        }
+    }
+
+    // Sessions not yet freed, including ones being closed
+    size_t size() const { return sessions_.size(); }
+
+private:
+    friend class ChatSession;
+
+    void finish_connect(ChatSession *session) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(session->socket_, SOL_SOCKET, SO_ERROR, (char *)&error, &length) == SOCKET_ERROR) {
+            error = WSAGetLastError();
+        }
+        if (error != 0) {
+            fail(session, error);
+            return;
+        }
+#ifdef CHAT_TLS
+        if (session->tls_ != NULL) {
+            session->state_ = ChatSession::State::Handshaking;
+            handshake(session);
+            return;
+        }
+#endif
+        become_connected(session);
+    }
+
+    void become_connected(ChatSession *session) {
+        session->state_ = ChatSession::State::Connected;
+        session->write_interest_ = false;
+        poller_.modify(session->socket_, POLL_READ, session);
+        session->mark_dirty();
+        session->handler_->on_connected(*session);
+    }
+
+#ifdef CHAT_TLS
+    /**
+     * @brief Takes a session's handshake a step further, waiting for
+     *        whichever readiness it needs next.
+     */
+    void handshake(ChatSession *session) {
+        switch (tls_handshake(session->tls_)) {
+        case TlsResult::Done:
+            become_connected(session);
+            return;
+        case TlsResult::WantRead:
+            poller_.modify(session->socket_, POLL_READ, session);
+            return;
+        case TlsResult::WantWrite:
+            poller_.modify(session->socket_, POLL_WRITE, session);
+            return;
+        default:
+            ERR_clear_error();
+            fail(session, CHAT_TLS_ERROR);
+            return;
+        }
+    }
+#endif
+
+    /**
+     * @brief recv() on the session's socket, through TLS if it has it.
+     */
+    int receive(ChatSession *session, char *buffer, int length) {
+#ifdef CHAT_TLS
+        if (session->tls_ != NULL) {
+            TlsResult result;
+            int received = tls_read(session->tls_, buffer, length, result);
+            if (received > 0 || result == TlsResult::Closed) {
+                return received;
+            }
+            if (result == TlsResult::WantWrite) {
+                session->tls_want_write_ = true; // flush() watches for writability
+                session->mark_dirty();
+            }
+            ERR_clear_error();
+            WSASetLastError(result == TlsResult::Failed ? CHAT_TLS_ERROR : WSAEWOULDBLOCK);
+            return SOCKET_ERROR;
+        }
+#endif
+        return recv(session->socket_, buffer, length, 0);
+    }
+
+    /**
+     * @brief send() on the session's socket, through TLS if it has it; at
+     *        most one record at a time.
+     */
+    int transmit(ChatSession *session, const char *data, size_t length) {
+#ifdef CHAT_TLS
+        if (session->tls_ != NULL) {
+            // A refused record is retried from the same front of output_, no shorter
+            TlsResult result;
+            int sent = tls_write(session->tls_, data, (int)std::min(length, TLS_MAX_RECORD), result);
+            if (sent > 0) {
+                return sent;
+            }
+            ERR_clear_error();
+            bool blocked = result == TlsResult::WantWrite || result == TlsResult::WantRead;
+            WSASetLastError(blocked ? WSAEWOULDBLOCK : CHAT_TLS_ERROR);
+            return SOCKET_ERROR;
+        }
+#endif
+        return ::send(session->socket_, data, (int)std::min<size_t>(length, 1 << 30), 0);
+    }
+
+    // Decrypted input the socket does not report as readable again
+    static bool tls_pending(const ChatSession *session) {
+#ifdef CHAT_TLS
+        return session->tls_ != NULL && SSL_pending(session->tls_) > 0;
+#else
+        (void)session;
+        return false;
+#endif
+    }
+
+    void read(ChatSession *session) {
+        for (int i = 0; i < SESSION_READS_PER_EVENT || tls_pending(session); ++i) {
+            std::vector<char> &input = session->input_;
+            if (session->buffered_ == input.size()) {
+                if (input.size() >= MAX_SESSION_READ_BUFFER) {
+                    fail(session, CHAT_PROTOCOL_ERROR); // Cannot happen with valid frames
+                    return;
+                }
+                input.resize(std::min(input.size() * 2, MAX_SESSION_READ_BUFFER));
+            }
+            int received = receive(session, input.data() + session->buffered_, (int)(input.size() - session->buffered_));
+            if (received == 0) {
+                fail(session, 0);
+                return;
+            }
+            if (received == SOCKET_ERROR) {
+                int error = WSAGetLastError();
+                if (error != WSAEWOULDBLOCK) {
+                    fail(session, error);
+                }
+                return;
+            }
+            session->buffered_ += received;
+
+            size_t offset = 0;
+            Frame frame;
+            size_t consumed;
+            ParseResult result;
+            while (session->state_ != ChatSession::State::Closed &&
+                   (result = parse_frame(input.data() + offset, session->buffered_ - offset, frame, consumed)) ==
+                       ParseResult::Complete) {
+                offset += consumed;
+                handle_frame(session, frame);
+            }
+            if (session->state_ == ChatSession::State::Closed) {
+                return;
+            }
+            if (result == ParseResult::Invalid) {
+                fail(session, CHAT_PROTOCOL_ERROR);
+                return;
+            }
+            std::memmove(input.data(), input.data() + offset, session->buffered_ - offset);
+            session->buffered_ -= offset;
+        }
+    }
+
+    void handle_frame(ChatSession *session, Frame &frame) {
+        switch (frame.type) {
+        case FRAME_CAPABILITIES:
+            session->compression_ = frame.length > 0 && (frame.payload[0] & CAPABILITY_LZ4);
+            session->presence_ = frame.length > 0 && (frame.payload[0] & CAPABILITY_PRESENCE);
+            return;
+        case FRAME_PRESENCE:
+            handle_presence(session, frame);
+            return;
+        case FRAME_PING:
+            // Answer heartbeats, or the server takes the connection for dead
+            session->send(FRAME_PONG, 0, std::string(frame.payload, frame.length), true);
+            return;
+        case FRAME_CHAT:
+        case FRAME_NOTICE:
+        case FRAME_DIRECT:
+            break;
+        default:
+            return;
+        }
+        if (frame.flags & FRAME_FLAG_COMPRESSED) {
+            if (!decompress_payload(frame.payload, frame.length, MAX_FRAME_PAYLOAD, inflated_)) {
+                fail(session, CHAT_PROTOCOL_ERROR);
+                return;
+            }
+            frame.payload = inflated_.data();
+            frame.length = static_cast<uint32_t>(inflated_.size());
+        }
+        if (frame.type == FRAME_NOTICE && (frame.flags & FRAME_FLAG_THROTTLED)) {
+            if (!session->throttled()) {
+                held_.push_back(session);
+            }
+            session->resume_at_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(THROTTLE_BACKOFF_MS);
+            session->handler_->on_throttled(*session);
+            if (session->state_ == ChatSession::State::Closed) {
+                return;
+            }
+        }
+        session->handler_->on_message(*session, frame.type, frame.payload, frame.length);
+    }
+
+    /**
+     * @brief Applies a presence frame to the session's rosters.
+     *
+     * Deltas the room's snapshot already includes, and any that arrive
+     * before it, are dropped.
+     */
+    void handle_presence(ChatSession *session, const Frame &frame) {
+        if (!decode_presence(frame.payload, frame.length, presence_update_)) {
+            fail(session, CHAT_PROTOCOL_ERROR);
+            return;
+        }
+        const PresenceUpdate &update = presence_update_;
+        std::unordered_map<std::string, ChatSession::Roster>::iterator it = session->rosters_.find(update.room);
+        if (update.kind == PRESENCE_SNAPSHOT) {
+            ChatSession::Roster &roster = session->rosters_[update.room];
+            roster.version = update.version;
+            roster.members.clear();
+            roster.members.insert(update.joined.begin(), update.joined.end());
+        } else if (it == session->rosters_.end() ||
+                   (update.kind == PRESENCE_SNAPSHOT_MORE ? update.version != it->second.version
+                                                          : update.version <= it->second.version)) {
+            return;
+        } else {
+            it->second.members.insert(update.joined.begin(), update.joined.end());
+            for (uint64_t member : update.left) {
+                it->second.members.erase(member);
+            }
+        }
+        session->handler_->on_presence(*session, update);
+    }
+
+    /**
+     * @brief Writes what the kernel takes, unless output is held back.
+     */
+    void flush(ChatSession *session) {
+        if (session->throttled()) {
+            return; // Flushed again once held_ releases it
+        }
+        size_t sent = 0;
+        std::string &output = session->output_;
+        while (sent < output.size()) {
+            int result = transmit(session, output.data() + sent, output.size() - sent);
+            if (result == SOCKET_ERROR) {
+                int error = WSAGetLastError();
+                if (error != WSAEWOULDBLOCK) {
+                    fail(session, error);
+                    return;
+                }
+                break;
+            }
+            sent += result;
+        }
+        output.erase(0, sent);
+
+        // Watch for writability only while the kernel is full
+        bool blocked = !output.empty();
+        bool watch = blocked;
+#ifdef CHAT_TLS
+        watch = watch || session->tls_want_write_;
+#endif
+        if (watch != session->write_interest_) {
+            poller_.modify(session->socket_, watch ? (POLL_READ | POLL_WRITE) : POLL_READ, session);
+            session->write_interest_ = watch;
+        }
+        if (!blocked && session->closing_) {
+            fail(session, 0);
+            return;
+        }
+        if (session->congested_ && output.size() < SESSION_LOW_WATER) {
+            session->congested_ = false;
+            session->handler_->on_writable(*session);
+        }
+    }
+
+    /**
+     * @brief Closes a session's socket; the handler hears of it at the end
+     *        of the loop pass.
+     */
+    void fail(ChatSession *session, int error) {
+        if (session->state_ == ChatSession::State::Closed) {
+            return;
+        }
+        poller_.remove(session->socket_); // Harmless if it never got registered
+#ifdef CHAT_TLS
+        if (session->tls_ != NULL) {
+            tls_.remember(session->tls_, session->server_);
+            tls_close(session->tls_);
+            session->tls_ = NULL;
+        }
+#endif
+        closesocket(session->socket_);
+        session->state_ = ChatSession::State::Closed;
+        failed_.push_back(std::make_pair(session, error));
+    }
+
+    void mark_dirty(ChatSession *session) {
+        if (!session->dirty_) {
+            session->dirty_ = true;
+            dirty_.push_back(session);
+        }
+    }
+
+    Poller poller_;
+    std::vector<PollEvent> events_;
+    std::vector<ChatSession *> sessions_;
+    std::vector<ChatSession *> dirty_;   // Have output to flush at the end of the pass
+    std::vector<ChatSession *> held_;    // Throttled; output held back until resume_at_
+    std::vector<std::pair<ChatSession *, int>> failed_; // Closed this pass, with their error
+    std::vector<char> inflated_;         // Scratch for decompressed frames
+    PresenceUpdate presence_update_;     // Scratch for the presence frame being applied
+    bool presence_;                      // Later sessions ask for presence updates
+    MpscQueue<Task> tasks_;
+    std::atomic<bool> wake_pending_;     // Set once a wake-up for tasks is in flight
+    std::atomic<bool> stopping_;
+#ifdef CHAT_TLS
+    TlsContext tls_;                     // Invalid unless use_tls() was called
+#endif
+};
+
+inline void ChatSession::mark_dirty() {
+    loop_->mark_dirty(this);
+}
+
+#endif // CHAT_CLIENT_H
@@ -1,30 +1,135 @@
 // -----------------------------------------------------------------------------
-// TCP Chat Client (Windows C++)
+// TCP Chat Client (C++)
 //
-// This is the Windows-compatible version of the TCP chat client.
-// It uses the Winsock API to connect to the server and std::thread
-// to handle sending and receiving messages concurrently.
+// The interactive TCP chat client, built on the asynchronous client library
+// (see chat_client.h). A ChatLoop thread owns the connection: it prints what
+// arrives, answers heartbeats and sends what is typed. The main thread only
+// reads standard input, which cannot be polled portably, and posts each line
+// to the loop. Messages are exchanged as length-prefixed frames (see
+// frame.h); large ones are LZ4-compressed if the server agrees to it (see
+// compression.h).
 //
-// How to compile (using MinGW g++):
-// g++ -o client.exe client_windows.cpp -pthread -lws2_32
+// Commands: /join <room>, /leave [room], /msg <room> <text>, /dm <client> <text>.
+// Anything else is chat text for the current room.
+//
+// How to compile (using MinGW g++ on Windows, g++ / clang++ elsewhere):
+// g++ -o client.exe client.cpp -pthread -lws2_32
+// g++ -O2 -o client client.cpp -pthread
+// g++ -DCHAT_TLS -O2 -o client client.cpp -pthread -lssl -lcrypto  (TLS, see tls.h)
 //
 // How to run:
-// ./client.exe <server_ip> <port>
+// ./client.exe <server_ip> <port> [--tls [--ca FILE]]
 // e.g., ./client.exe 127.0.0.1 8080
+// --tls connects over TLS, verifying the server against the CA certificates
+// in FILE, or the system's.
 // -----------------------------------------------------------------------------
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // GetQueuedCompletionStatusEx and WSAPoll need Vista+
+#endif
+
 #include <iostream>
 #include <string>
 #include <thread>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "socket_compat.h"
+#include "chat_client.h"
+
+/**
+ * @brief Prints the session's traffic and ends the loop when it closes.
+ */
+class ConsoleHandler : public ChatHandler {
+public:
+    explicit ConsoleHandler(ChatLoop &loop) : session(NULL), failed(false), loop_(loop), connected_(false) {}
+
+    void on_connected(ChatSession &) override {
+        connected_ = true;
+        std::cout << "Connected to the server. You can start chatting!" << std::endl;
+        std::cout << "Type your message and press Enter to send." << std::endl;
+        std::cout << "Commands: /join <room>, /leave [room], /msg <room> <text>, /dm <client number> <text>"
+                  << std::endl;
+        std::cout << "> " << std::flush;
+    }
 
-// Link with the Winsock library
-#pragma comment(lib, "ws2_32.lib")
+    void on_message(ChatSession &, uint8_t, const char *text, size_t length) override {
+        std::cout << "\r" << std::string(text, length) << std::endl << "> " << std::flush;
+    }
+
+    void on_writable(ChatSession &) override {
+        std::cout << "\rCaught up with the server; sending again." << std::endl << "> " << std::flush;
+    }
+
+    void on_closed(ChatSession &, int error) override {
+        bool tls_failed = false;
+#ifdef CHAT_TLS
+        tls_failed = error == CHAT_TLS_ERROR;
+#endif
+        if (error != 0 && !connected_) {
+            if (tls_failed) {
+                std::cerr << "\rTLS handshake failed; is the server's certificate trusted?" << std::endl;
+            } else {
+                std::cerr << "Connection Failed with error: " << error << std::endl;
+            }
+            failed = true;
+        } else if (session == NULL) {
+            // We hung up ourselves
+        } else if (error == CHAT_PROTOCOL_ERROR) {
+            std::cout << "\rReceived a malformed frame from the server." << std::endl;
+        } else if (tls_failed) {
+            std::cout << "\rThe TLS connection failed." << std::endl;
+        } else {
+            std::cout << "\rServer closed the connection." << std::endl;
+        }
+        session = NULL;
+        loop_.stop();
+    }
 
-// --- Function Prototypes ---
-void receive_messages(SOCKET sock);
-void send_messages(SOCKET sock);
+    ChatSession *session; // NULL once closing; only touched on the loop's thread
+    bool failed;          // The connection never came up
+
+private:
+    ChatLoop &loop_;
+    bool connected_;
+};
+
+/**
+ * @brief Sends one line of input as chat, a direct message, a join or a leave.
+ *
+ * Runs on the loop's thread.
+ */
+void send_line(ConsoleHandler &handler, const std::string &line) {
+    ChatSession *session = handler.session;
+    if (session == NULL) {
+        return;
+    }
+    bool sent;
+    if (line.compare(0, 6, "/join ") == 0) {
+        sent = session->join(line.substr(6));
+    } else if (line == "/leave" || line.compare(0, 7, "/leave ") == 0) {
+        sent = session->leave(line.size() > 7 ? line.substr(7) : "");
+    } else if (line.compare(0, 5, "/msg ") == 0) {
+        size_t space = line.find(' ', 5);
+        std::string room = line.substr(5, space == std::string::npos ? std::string::npos : space - 5);
+        if (room.empty() || room.size() > 255 || space == std::string::npos) {
+            std::cerr << "Usage: /msg <room> <text>" << std::endl;
+            return;
+        }
+        sent = session->send_to_room(room, line.substr(space + 1));
+    } else if (line.compare(0, 4, "/dm ") == 0) {
+        size_t space = line.find(' ', 4);
+        std::string number = line.substr(4, space == std::string::npos ? std::string::npos : space - 4);
+        if (number.empty() || number.size() > 19 || number.find_first_not_of("0123456789") != std::string::npos ||
+            space == std::string::npos) {
+            std::cerr << "Usage: /dm <client number> <text>" << std::endl;
+            return;
+        }
+        sent = session->send_direct(std::stoull(number), line.substr(space + 1));
+    } else {
+        sent = session->send_chat(line);
+    }
+    if (!sent && session->congested()) {
+        std::cerr << "The server is not keeping up; message not sent." << std::endl;
+    }
+}
 
 /**
  * @brief Initializes the Winsock library.
@@ -42,93 +147,84 @@ bool InitializeWinsock() {
  * @brief Main function to start the client.
  */
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <server_ip> <port>" << std::endl;
-        return 1;
-    }
-
-    if (!InitializeWinsock()) {
-        return 1;
+    bool tls = false;
+    std::string ca_file;
+    bool usable = argc >= 3;
+    for (int i = 3; usable && i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tls") {
+            tls = true;
+        } else if (arg == "--ca" && i + 1 < argc) {
+            ca_file = argv[++i];
+        } else {
+            usable = false;
+        }
     }
-
-    const char* server_ip = argv[1];
-    int port = std::stoi(argv[2]);
-    SOCKET sock = INVALID_SOCKET;
-    struct sockaddr_in serv_addr;
-
-    // --- Create client socket ---
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock == INVALID_SOCKET) {
-        std::cerr << "Socket creation failed with error: " << WSAGetLastError() << std::endl;
-        WSACleanup();
+    if (!usable) {
+        std::cerr << "Usage: " << argv[0] << " <server_ip> <port> [--tls [--ca FILE]]" << std::endl;
         return 1;
     }
-
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-
-    // --- Convert IP address from text to binary form ---
-    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) <= 0) {
-        std::cerr << "Invalid address/ Address not supported" << std::endl;
-        closesocket(sock);
-        WSACleanup();
+#ifndef CHAT_TLS
+    if (tls) {
+        std::cerr << "This client was built without TLS; rebuild it with TLS=1 (-DCHAT_TLS)." << std::endl;
         return 1;
     }
+#endif
 
-    // --- Connect to the server ---
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
-        std::cerr << "Connection Failed with error: " << WSAGetLastError() << std::endl;
-        closesocket(sock);
-        WSACleanup();
+    if (!InitializeWinsock()) {
         return 1;
     }
 
-    std::cout << "Connected to the server. You can start chatting!" << std::endl;
-    std::cout << "Type your message and press Enter to send." << std::endl;
-
-    // --- Create threads for sending and receiving messages ---
-    std::thread receive_thread(receive_messages, sock);
-    std::thread send_thread(send_messages, sock);
-
-    // --- Wait for threads to finish ---
-    send_thread.join();
-    receive_thread.detach();
+    int port = std::stoi(argv[2]);
+    bool failed;
+    {
+        ChatLoop loop;
+        ConsoleHandler handler(loop);
+        if (!loop.valid()) {
+            std::cerr << "Failed to create the event loop." << std::endl;
+            WSACleanup();
+            return 1;
+        }
+#ifdef CHAT_TLS
+        std::string tls_problem;
+        if (tls && !loop.use_tls(ca_file, tls_problem)) {
+            std::cerr << "Cannot set up TLS: " << tls_problem << std::endl;
+            WSACleanup();
+            return 1;
+        }
+#endif
+        handler.session = loop.connect(argv[1], port, &handler);
+        if (handler.session == NULL) {
+            std::cerr << "Invalid address/ Address not supported" << std::endl;
+            WSACleanup();
+            return 1;
+        }
 
-    // --- Cleanup ---
-    closesocket(sock);
-    WSACleanup();
-    return 0;
-}
+        // --- Run the connection on its own thread; this one reads input ---
+        std::thread loop_thread([&loop] { loop.run(); });
 
-/**
- * @brief Listens for and prints messages from the server.
- */
-void receive_messages(SOCKET sock) {
-    char buffer[4096];
-    while (true) {
-        int bytes_received = recv(sock, buffer, sizeof(buffer), 0);
-        if (bytes_received > 0) {
-            std::cout << "\r" << std::string(buffer, bytes_received) << std::endl << "> " << std::flush;
-        } else {
-            std::cout << "Server closed the connection." << std::endl;
-            break;
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            if (line.size() > MAX_CHAT_TEXT) {
+                std::cerr << "Message too long (max " << MAX_CHAT_TEXT << " bytes)." << std::endl;
+            } else if (!line.empty()) {
+                loop.post([&handler, line] { send_line(handler, line); });
+            }
+            std::cout << "> " << std::flush;
         }
-    }
-}
 
-/**
- * @brief Reads user input and sends it to the server.
- */
-void send_messages(SOCKET sock) {
-    std::string line;
-    std::cout << "> " << std::flush;
-    while (std::getline(std::cin, line)) {
-        if (!line.empty()) {
-            if (send(sock, line.c_str(), line.length(), 0) == SOCKET_ERROR) {
-                std::cerr << "Send failed with error: " << WSAGetLastError() << std::endl;
-                break;
+        // --- End of input: send what is queued, then hang up ---
+        loop.post([&handler] {
+            ChatSession *session = handler.session;
+            if (session != NULL) {
+                handler.session = NULL;
+                session->close();
             }
-        }
-        std::cout << "> " << std::flush;
+        });
+        loop_thread.join();
+        failed = handler.failed;
     }
+
+    WSACleanup();
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,690 @@
+// -----------------------------------------------------------------------------
+// Cluster Links
+//
+// Several server processes can serve one chat. Each node forwards the room
+// messages it originates to the other nodes that have members in the room,
+// and delivers what they forward to its own members. Nodes form a full mesh
+// (every node names every other one with --peer) and never relay, so a
+// message crosses each node-to-node link at most once.
+//
+// Every node dials each of its peers. The dialing side sends room messages
+// over that link; the accepting side answers with presence gossip: the
+// rooms its node has members in, in full when the link comes up and as
+// changes after that. RoomInfo::peers records the answers, so a message
+// only goes to nodes with members in its room, the way RoomInfo::reactors
+// keeps it away from idle reactors.
+//
+// One cluster thread serves all links. Reactors hand it messages and
+// presence changes through a lock-free queue; the thread encodes whatever
+// arrived since its last pass into each link's buffer and writes it with
+// one send, so a busy room costs a syscall per batch, not per message.
+// Links use the chat framing (frame.h) with frame types of their own, and
+// name each room once per link; later frames carry a varint room id.
+// Messages that were compressed for fan-out (see compression.h) cross the
+// link compressed, and the receiving node fans out that same rendition.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_CLUSTER_H
+#define CHAT_CLUSTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "socket_compat.h"
+#include "socket_options.h"
+#include "poller.h"
+#include "mpsc_queue.h"
+#include "message.h"
+#include "frame.h"
+#include "compression.h"
+#include "room_table.h"
+#include "metrics.h"
+#include "logger.h"
+
+// First bytes a node sends on a link it dialed: magic byte, "CN", version
+const char CLUSTER_PREFACE[] = {'\xC4', 'C', 'N', '\x01'};
+// Most peers a node can have; each is one bit of RoomInfo::peers
+const size_t MAX_PEERS = 64;
+// Delay before a lost or refused link is dialed again
+const int PEER_RETRY_MS = 1000;
+// Unsent bytes a link may hold before the peer is considered stuck
+const size_t MAX_PEER_BACKLOG = 64 * 1024 * 1024;
+// Bytes read from a link per recv() call
+const size_t PEER_READ_SIZE = 64 * 1024;
+
+// Frame types used on cluster links
+const uint8_t PEER_ROOM = 16;     // Names a link-local room id: varint id, then the room name
+const uint8_t PEER_MESSAGE = 17;  // Room message: varint room id, message frame type, text (or
+                                  // with FRAME_FLAG_COMPRESSED, a compressed payload)
+const uint8_t PEER_PRESENCE = 18; // Varint room id; flags 1 while the sender has members there
+
+struct PeerAddress {
+    std::string host;
+    int port;
+};
+
+/**
+ * @brief Parses "host:port".
+ */
+inline bool parse_peer_address(const std::string &text, PeerAddress &address) {
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == text.size()) {
+        return false;
+    }
+    address.host = text.substr(0, colon);
+    address.port = std::atoi(text.c_str() + colon + 1);
+    return address.port > 0 && address.port < 65536;
+}
+
+class ClusterNode {
+public:
+    // Hands a message forwarded by a peer to this node's members of the room
+    typedef void (*DeliverFunction)(RoomInfo *room, const MessageRef &message);
+
+    ClusterNode() : listener_(INVALID_SOCKET), directory_(NULL), deliver_(NULL), active_(false) {
+        wake_pending_.store(false);
+        stopping_.store(false);
+    }
+
+    ClusterNode(const ClusterNode &) = delete;
+    ClusterNode &operator=(const ClusterNode &) = delete;
+
+    /**
+     * @brief Resolves the peers and prepares the links; call before the
+     *        reactors start, then run() on a thread of its own.
+     * @param listener Non-blocking, listening socket that peers dial.
+     * @return False if a peer cannot be resolved or the poller failed.
+     */
+    bool start(SOCKET listener, const std::vector<PeerAddress> &peers, RoomDirectory *directory,
+               DeliverFunction deliver) {
+        if (!poller_.valid() || !poller_.add(listener, POLL_READ, NULL)) {
+            return false;
+        }
+        for (size_t i = 0; i < peers.size() && i < MAX_PEERS; ++i) {
+            PeerLink *link = new PeerLink(static_cast<int>(i));
+            link->name = peers[i].host + ":" + std::to_string(peers[i].port);
+            if (!resolve(peers[i], link->address)) {
+                LOG_EVENT(LogLevel::Error, "Peer address unresolvable").field("peer", link->name);
+                delete link;
+                return false;
+            }
+            outbound_.push_back(link);
+        }
+        listener_ = listener;
+        directory_ = directory;
+        deliver_ = deliver;
+        active_ = true;
+        return true;
+    }
+
+    bool active() const { return active_; }
+
+    // The socket peers dial; stays open after run() returns, for a successor
+    SOCKET listener() const { return listener_; }
+
+    const ThreadMetrics &metrics() const { return metrics_; }
+
+    // --- Called by the reactors ---
+
+    /**
+     * @brief Forwards a message that originated here to the peers that
+     *        have members in its room.
+     */
+    void publish(RoomInfo *room, const MessageRef &message) { post(ClusterEvent{room, message}); }
+
+    /**
+     * @brief Notes that a reactor gained its first or lost its last member
+     *        of @p room; peers hear about it if the node as a whole did.
+     */
+    void presence_changed(RoomInfo *room) { post(ClusterEvent{room, MessageRef()}); }
+
+    /**
+     * @brief Makes run() flush what it can, close every link and return.
+     *        Safe to call from any thread.
+     */
+    void stop() {
+        stopping_.store(true);
+        poller_.wake();
+    }
+
+    /**
+     * @brief Serves all links until stop() is called.
+     */
+    void run() {
+        log_thread_index() = LOG_THREAD_CLUSTER;
+        std::vector<PollEvent> events;
+        events.reserve(POLLER_BATCH_SIZE);
+        for (PeerLink *link : outbound_) {
+            dial(link);
+        }
+
+        while (!stopping_.load()) {
+            if (poller_.wait(events, retry_timeout_ms()) < 0) {
+                LOG_EVENT(LogLevel::Error, "Poller wait failed").field("error", WSAGetLastError());
+                continue;
+            }
+
+            // Clear before draining so an event posted meanwhile wakes us again
+            wake_pending_.store(false);
+            drain_events();
+
+            for (const PollEvent &event : events) {
+                if (event.user_data == NULL) {
+                    accept_links();
+                    continue;
+                }
+                PeerLink *link = static_cast<PeerLink *>(event.user_data);
+                if (link->socket == INVALID_SOCKET) {
+                    continue; // Closed earlier in this batch
+                }
+                if (link->connecting) {
+                    finish_connect(link);
+                    continue;
+                }
+                if (event.events & (POLL_READ | POLL_ERROR)) {
+                    read_link(link);
+                }
+                // Writable links are simply flushed below, with all the others
+            }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            for (PeerLink *link : outbound_) {
+                if (link->socket == INVALID_SOCKET && now >= link->retry_at) {
+                    dial(link);
+                }
+            }
+            flush_links();
+
+            // Links that peers dialed are freed once the batch no longer needs them
+            for (size_t i = 0; i < inbound_.size();) {
+                if (inbound_[i]->socket == INVALID_SOCKET) {
+                    delete inbound_[i];
+                    inbound_[i] = inbound_.back();
+                    inbound_.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+        }
+
+        // Peers notice the links drop and redial, reaching a successor
+        // process that took the listener over
+        drain_events();
+        flush_links();
+        for (PeerLink *link : outbound_) {
+            if (link->socket != INVALID_SOCKET) {
+                close_link(link, "node stopping");
+            }
+        }
+        for (PeerLink *link : inbound_) {
+            if (link->socket != INVALID_SOCKET) {
+                close_link(link, "node stopping");
+            }
+        }
+        poller_.remove(listener_);
+    }
+
+private:
+    struct ClusterEvent {
+        RoomInfo *room;
+        MessageRef message; // Empty for a presence change
+    };
+
+    /**
+     * @brief One TCP connection to another node.
+     *
+     * Links this node dialed (peer >= 0) carry its messages out and its
+     * peer's presence in; links a peer dialed (peer < 0) the other way round.
+     */
+    struct PeerLink {
+        explicit PeerLink(int peer_index)
+            : socket(INVALID_SOCKET), peer(peer_index), connecting(false), preface_seen(peer_index >= 0),
+              write_interest(false) {
+            std::memset(&address, 0, sizeof(address));
+        }
+
+        SOCKET socket;                                 // INVALID_SOCKET while down
+        int peer;                                      // Index in the --peer list; -1 if the peer dialed us
+        std::string name;                              // For log records
+        struct sockaddr_in address;                    // Where to dial; outbound links only
+        bool connecting;                               // Non-blocking connect() under way
+        bool preface_seen;                             // Inbound links: the peer proved to be a node
+        bool write_interest;                           // Poller is watching for writability
+        std::chrono::steady_clock::time_point retry_at; // Next dial, while down
+        std::string input;                             // Bytes not yet parsed
+        std::string output;                            // Frames not yet sent
+        std::unordered_map<RoomInfo *, uint32_t> sent_ids; // Rooms named to the peer
+        std::vector<RoomInfo *> received_ids;          // Room ids the peer named; NULL if unusable
+        std::unordered_set<RoomInfo *> present;        // Outbound links: rooms the peer has members in
+    };
+
+    static bool resolve(const PeerAddress &peer, struct sockaddr_in &address) {
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *found = NULL;
+        if (getaddrinfo(peer.host.c_str(), std::to_string(peer.port).c_str(), &hints, &found) != 0 || found == NULL) {
+            return false;
+        }
+        std::memcpy(&address, found->ai_addr, sizeof(address));
+        freeaddrinfo(found);
+        return true;
+    }
+
+    static bool set_non_blocking(SOCKET socket) {
+        u_long mode = 1;
+        return ioctlsocket(socket, FIONBIO, &mode) == 0;
+    }
+
+    void post(const ClusterEvent &event) {
+        events_.push(event);
+        // Only the first event since the thread last drained needs a wake-up
+        if (!wake_pending_.exchange(true)) {
+            poller_.wake();
+        }
+    }
+
+    int retry_timeout_ms() const {
+        int timeout_ms = -1;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (const PeerLink *link : outbound_) {
+            if (link->socket == INVALID_SOCKET) {
+                int wait_ms = (int)std::max<int64_t>(
+                    0, std::chrono::duration_cast<std::chrono::milliseconds>(link->retry_at - now).count() + 1);
+                timeout_ms = timeout_ms < 0 ? wait_ms : std::min(timeout_ms, wait_ms);
+            }
+        }
+        return timeout_ms;
+    }
+
+    // --- Events from the reactors ---
+
+    void drain_events() {
+        ClusterEvent event;
+        while (events_.pop(event)) {
+            if (event.message) {
+                forward(event.room, event.message);
+            } else {
+                update_presence(event.room);
+            }
+        }
+    }
+
+    void forward(RoomInfo *room, const MessageRef &message) {
+        uint64_t peers = room->peers.load(std::memory_order_acquire);
+        for (PeerLink *link : outbound_) {
+            if (link->socket == INVALID_SOCKET || link->connecting || !(peers & ((uint64_t)1 << link->peer))) {
+                continue;
+            }
+            uint32_t id = room_id(link, room);
+            char prefix[MAX_VARINT_SIZE + 1];
+            size_t prefix_length = encode_varint(id, prefix);
+            prefix[prefix_length++] = static_cast<char>(message->frame_type());
+            const MessageBuffer *compressed = message->compressed();
+            if (compressed != NULL) {
+                append_header(link, PEER_MESSAGE, FRAME_FLAG_COMPRESSED, prefix_length + compressed->size());
+                link->output.append(prefix, prefix_length);
+                link->output.append(compressed->data(), compressed->size());
+            } else {
+                size_t text_length = message->text_size();
+                append_header(link, PEER_MESSAGE, 0, prefix_length + text_length);
+                link->output.append(prefix, prefix_length);
+                size_t offset = link->output.size();
+                link->output.resize(offset + text_length);
+                message->copy_text(&link->output[offset]);
+            }
+            metrics_.add(Counter::PeerMessagesSent);
+        }
+    }
+
+    /**
+     * @brief Tells every peer whether this node now has members in @p room.
+     *
+     * Reactors post a change whenever their own share of the room appears or
+     * disappears, in whatever order; the node-wide state is read here and
+     * only sent if it differs from what peers were last told.
+     */
+    void update_presence(RoomInfo *room) {
+        bool present = room->reactors.load(std::memory_order_acquire) != 0;
+        if (present == (announced_.count(room) != 0)) {
+            return;
+        }
+        if (present) {
+            announced_.insert(room);
+        } else {
+            announced_.erase(room);
+        }
+        for (PeerLink *link : inbound_) {
+            if (link->socket != INVALID_SOCKET) {
+                append_presence(link, room, present);
+            }
+        }
+    }
+
+    // --- Encoding ---
+
+    void append_header(PeerLink *link, uint8_t type, uint8_t flags, size_t length) {
+        char header[MAX_FRAME_HEADER];
+        link->output.append(header, encode_frame_header(type, flags, static_cast<uint32_t>(length), header));
+    }
+
+    /**
+     * @brief The link-local id of @p room, naming it to the peer first if needed.
+     */
+    uint32_t room_id(PeerLink *link, RoomInfo *room) {
+        std::unordered_map<RoomInfo *, uint32_t>::iterator it = link->sent_ids.find(room);
+        if (it != link->sent_ids.end()) {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(link->sent_ids.size());
+        link->sent_ids[room] = id;
+        char encoded[MAX_VARINT_SIZE];
+        size_t length = encode_varint(id, encoded);
+        append_header(link, PEER_ROOM, 0, length + room->name.size());
+        link->output.append(encoded, length);
+        link->output += room->name;
+        return id;
+    }
+
+    void append_presence(PeerLink *link, RoomInfo *room, bool present) {
+        uint32_t id = room_id(link, room);
+        char encoded[MAX_VARINT_SIZE];
+        size_t length = encode_varint(id, encoded);
+        append_header(link, PEER_PRESENCE, present ? 1 : 0, length);
+        link->output.append(encoded, length);
+    }
+
+    // --- Links ---
+
+    void accept_links() {
+        while (true) {
+            struct sockaddr_in address;
+            socklen_t address_length = sizeof(address);
+            SOCKET socket = accept(listener_, (struct sockaddr *)&address, &address_length);
+            if (socket == INVALID_SOCKET) {
+                int error = WSAGetLastError();
+                if (error != WSAEWOULDBLOCK) {
+                    LOG_EVENT(LogLevel::Warn, "Peer accept failed").field("error", error);
+                }
+                return;
+            }
+            PeerLink *link = new PeerLink(-1);
+            char host[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+            link->name = std::string(host) + ":" + std::to_string(ntohs(address.sin_port));
+            set_int_option(socket, IPPROTO_TCP, TCP_NODELAY, 1);
+            if (!set_non_blocking(socket) || !poller_.add(socket, POLL_READ, link)) {
+                LOG_EVENT(LogLevel::Warn, "Peer link registration failed").field("error", WSAGetLastError());
+                closesocket(socket);
+                delete link;
+                continue;
+            }
+            link->socket = socket;
+            inbound_.push_back(link);
+            LOG_EVENT(LogLevel::Info, "Peer link accepted").field("peer", link->name);
+
+            // The new peer learns everything at once, then only changes
+            for (RoomInfo *room : announced_) {
+                append_presence(link, room, true);
+            }
+        }
+    }
+
+    void dial(PeerLink *link) {
+        link->retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(PEER_RETRY_MS);
+        SOCKET socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (socket == INVALID_SOCKET) {
+            LOG_EVENT(LogLevel::Warn, "Peer socket creation failed").field("error", WSAGetLastError());
+            return;
+        }
+        set_int_option(socket, IPPROTO_TCP, TCP_NODELAY, 1);
+        if (!set_non_blocking(socket)) {
+            closesocket(socket);
+            return;
+        }
+        if (connect(socket, (struct sockaddr *)&link->address, sizeof(link->address)) == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK && error != WSAEINPROGRESS) {
+                LOG_EVENT(LogLevel::Debug, "Peer dial failed").field("peer", link->name).field("error", error);
+                closesocket(socket);
+                return;
+            }
+        }
+        // Writability reports the outcome of the connect
+        if (!poller_.add(socket, POLL_WRITE, link)) {
+            closesocket(socket);
+            return;
+        }
+        link->socket = socket;
+        link->connecting = true;
+    }
+
+    void finish_connect(PeerLink *link) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(link->socket, SOL_SOCKET, SO_ERROR, (char *)&error, &length) == SOCKET_ERROR) {
+            error = WSAGetLastError();
+        }
+        if (error != 0) {
+            LOG_EVENT(LogLevel::Debug, "Peer dial failed").field("peer", link->name).field("error", error);
+            poller_.remove(link->socket);
+            closesocket(link->socket);
+            link->socket = INVALID_SOCKET;
+            link->connecting = false;
+            return;
+        }
+        link->connecting = false;
+        poller_.modify(link->socket, POLL_READ, link);
+        link->output.assign(CLUSTER_PREFACE, sizeof(CLUSTER_PREFACE));
+        LOG_EVENT(LogLevel::Info, "Peer link up").field("peer", link->name);
+    }
+
+    void close_link(PeerLink *link, const char *reason) {
+        LOG_EVENT(LogLevel::Warn, "Peer link down").field("peer", link->name).field("reason", reason);
+        poller_.remove(link->socket);
+        closesocket(link->socket);
+        link->socket = INVALID_SOCKET;
+        link->connecting = false;
+        link->write_interest = false;
+        link->input.clear();
+        link->output.clear();
+        link->sent_ids.clear();
+        link->received_ids.clear();
+
+        // Nothing is known about a peer that cannot be reached
+        if (link->peer >= 0) {
+            uint64_t bit = (uint64_t)1 << link->peer;
+            for (RoomInfo *room : link->present) {
+                room->peers.fetch_and(~bit, std::memory_order_acq_rel);
+            }
+            link->present.clear();
+            link->retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(PEER_RETRY_MS);
+        }
+    }
+
+    void read_link(PeerLink *link) {
+        char chunk[PEER_READ_SIZE];
+        while (true) {
+            int received = recv(link->socket, chunk, (int)sizeof(chunk), 0);
+            if (received > 0) {
+                link->input.append(chunk, received);
+                continue;
+            }
+            if (received == 0) {
+                close_link(link, "closed by peer");
+                return;
+            }
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK) {
+                close_link(link, "receive failed");
+                return;
+            }
+            break;
+        }
+
+        size_t offset = 0;
+        if (!link->preface_seen) {
+            if (link->input.size() < sizeof(CLUSTER_PREFACE)) {
+                return;
+            }
+            if (std::memcmp(link->input.data(), CLUSTER_PREFACE, sizeof(CLUSTER_PREFACE)) != 0) {
+                close_link(link, "not a cluster node");
+                return;
+            }
+            link->preface_seen = true;
+            offset = sizeof(CLUSTER_PREFACE);
+        }
+
+        Frame frame;
+        size_t consumed = 0;
+        while (true) {
+            ParseResult result = parse_frame(link->input.data() + offset, link->input.size() - offset, frame, consumed);
+            if (result == ParseResult::NeedMore) {
+                break;
+            }
+            if (result == ParseResult::Invalid || !handle_frame(link, frame)) {
+                close_link(link, "malformed frame");
+                return;
+            }
+            offset += consumed;
+        }
+        link->input.erase(0, offset);
+    }
+
+    /**
+     * @return False if the frame breaks the link protocol.
+     */
+    bool handle_frame(PeerLink *link, const Frame &frame) {
+        uint32_t id;
+        size_t id_length = decode_varint(frame.payload, frame.length, id);
+        if (id_length == 0) {
+            return false;
+        }
+        const char *rest = frame.payload + id_length;
+        size_t rest_length = frame.length - id_length;
+
+        if (frame.type == PEER_ROOM) {
+            if (id > link->received_ids.size() || id >= MAX_ROOMS) {
+                return false; // Ids are handed out in order
+            }
+            RoomInfo *room = NULL;
+            if (valid_room_name(rest, rest_length)) {
+                room = directory_->intern(std::string(rest, rest_length)); // NULL past MAX_ROOMS
+            }
+            if (id == link->received_ids.size()) {
+                link->received_ids.push_back(room);
+            } else {
+                link->received_ids[id] = room;
+            }
+            return true;
+        }
+
+        if (id >= link->received_ids.size()) {
+            return false;
+        }
+        RoomInfo *room = link->received_ids[id];
+        if (frame.type == PEER_MESSAGE && link->peer < 0) {
+            if (rest_length < 1) {
+                return false;
+            }
+            uint8_t type = static_cast<uint8_t>(rest[0]);
+            if (room == NULL || (type != FRAME_CHAT && type != FRAME_NOTICE) || rest_length < 2) {
+                return true;
+            }
+            MessageRef message;
+            if (frame.flags & FRAME_FLAG_COMPRESSED) {
+                if (!decompress_payload(rest + 1, rest_length - 1, MAX_FRAME_PAYLOAD, inflated_)) {
+                    return false;
+                }
+                // Keep the peer's compressed rendition for local recipients that negotiated it
+                message = make_message(type, inflated_.data(), inflated_.size());
+                message->set_compressed(
+                    MessageBuffer::create(rest + 1, rest_length - 1, NULL, type, FRAME_FLAG_COMPRESSED));
+            } else {
+                message = make_message(type, rest + 1, rest_length - 1);
+            }
+            deliver_(room, message);
+            metrics_.add(Counter::PeerMessagesReceived);
+        } else if (frame.type == PEER_PRESENCE && link->peer >= 0) {
+            if (room != NULL) {
+                uint64_t bit = (uint64_t)1 << link->peer;
+                if (frame.flags & 1) {
+                    room->peers.fetch_or(bit, std::memory_order_acq_rel);
+                    link->present.insert(room);
+                } else {
+                    room->peers.fetch_and(~bit, std::memory_order_acq_rel);
+                    link->present.erase(room);
+                }
+            }
+        }
+        // Other types are left for later protocol versions
+        return true;
+    }
+
+    void flush_links() {
+        for (PeerLink *link : outbound_) {
+            flush(link);
+        }
+        for (PeerLink *link : inbound_) {
+            flush(link);
+        }
+    }
+
+    /**
+     * @brief Writes as much of a link's buffer as the kernel takes.
+     */
+    void flush(PeerLink *link) {
+        if (link->socket == INVALID_SOCKET || link->connecting || link->output.empty()) {
+            return;
+        }
+        size_t sent = 0;
+        while (sent < link->output.size()) {
+            size_t chunk = std::min<size_t>(link->output.size() - sent, 1 << 30);
+            int result = send(link->socket, link->output.data() + sent, (int)chunk, 0);
+            if (result > 0) {
+                sent += result;
+                continue;
+            }
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                close_link(link, "send failed");
+                return;
+            }
+            break;
+        }
+        link->output.erase(0, sent);
+        if (link->output.size() > MAX_PEER_BACKLOG) {
+            close_link(link, "peer too slow");
+            return;
+        }
+        // Watch for writability only while the kernel is full
+        bool blocked = !link->output.empty();
+        if (blocked != link->write_interest) {
+            poller_.modify(link->socket, blocked ? (POLL_READ | POLL_WRITE) : POLL_READ, link);
+        }
+        link->write_interest = blocked;
+    }
+
+    SOCKET listener_;
+    RoomDirectory *directory_;
+    DeliverFunction deliver_;
+    bool active_;
+    Poller poller_;
+    std::vector<PeerLink *> outbound_;          // Index = peer index
+    std::vector<PeerLink *> inbound_;
+    std::unordered_set<RoomInfo *> announced_;  // Rooms peers were told this node has members in
+    MpscQueue<ClusterEvent> events_;
+    std::atomic<bool> wake_pending_;              // Set once a wake-up for events is in flight
+    std::atomic<bool> stopping_;                  // stop() was called
+    std::vector<char> inflated_;                  // Scratch for compressed messages from peers
+    ThreadMetrics metrics_;
+};
+
+#endif // CHAT_CLUSTER_H
@@ -0,0 +1,221 @@
+// -----------------------------------------------------------------------------
+// Message Compression
+//
+// Large chat messages (pastes, bot output) can be sent LZ4-compressed to
+// framed clients that ask for it. The codec here writes and reads the
+// standard LZ4 block format, so any LZ4 implementation can decode what the
+// server sends; it is self-contained because the chat programs have no
+// third-party dependencies. The compressor is the classic greedy
+// single-pass variant with a small hash table: fast and cheap rather than
+// thorough, which suits text compressed once and fanned out many times.
+//
+// A compressed frame carries FRAME_FLAG_COMPRESSED and the payload
+//
+//   [varint uncompressed length][LZ4 block]
+//
+// Compression is negotiated with FRAME_CAPABILITIES (see frame.h), and only
+// used when it actually makes the payload smaller.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_COMPRESSION_H
+#define CHAT_COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "frame.h"
+
+// Payloads shorter than this are never compressed
+const size_t DEFAULT_COMPRESS_MIN = 512;
+
+/**
+ * @brief Largest LZ4 block @p length bytes can compress to.
+ */
+inline size_t lz4_compress_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Writes an LZ4 length continuation: 255s, then the remainder.
+ */
+inline uint8_t *lz4_write_length(uint8_t *out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = static_cast<uint8_t>(length);
+    return out;
+}
+
+/**
+ * @brief Compresses @p length bytes into an LZ4 block.
+ * @param out Must hold lz4_compress_bound(length) bytes.
+ * @return Size of the block.
+ */
+inline size_t lz4_compress(const char *data, size_t length, char *out) {
+    static const int HASH_BITS = 12;
+    static const size_t MIN_MATCH = 4;
+    static const size_t LAST_LITERALS = 5; // The format ends with at least 5 literals
+    static const size_t MATCH_END = 12;    // and no match starts in the last 12 bytes
+    uint32_t table[1 << HASH_BITS] = {0};  // Position + 1 of the last 4 bytes with each hash
+
+    const uint8_t *input = reinterpret_cast<const uint8_t *>(data);
+    const uint8_t *end = input + length;
+    const uint8_t *anchor = input; // Start of the pending literals
+    const uint8_t *p = input;
+    uint8_t *op = reinterpret_cast<uint8_t *>(out);
+
+    if (length >= MATCH_END) {
+        const uint8_t *match_limit = end - MATCH_END;
+        while (p < match_limit) {
+            uint32_t sequence = lz4_read32(p);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            uint32_t candidate = table[hash];
+            table[hash] = static_cast<uint32_t>(p - input) + 1;
+            if (candidate == 0) {
+                ++p;
+                continue;
+            }
+            const uint8_t *match = input + candidate - 1;
+            if (p - match > 65535 || lz4_read32(match) != sequence) {
+                ++p;
+                continue;
+            }
+
+            size_t match_length = MIN_MATCH;
+            while (p + match_length < end - LAST_LITERALS && p[match_length] == match[match_length]) {
+                ++match_length;
+            }
+
+            size_t literals = static_cast<size_t>(p - anchor);
+            size_t extra = match_length - MIN_MATCH;
+            uint8_t *token = op++;
+            *token = static_cast<uint8_t>(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+            if (literals >= 15) {
+                op = lz4_write_length(op, literals - 15);
+            }
+            std::memcpy(op, anchor, literals);
+            op += literals;
+            uint16_t offset = static_cast<uint16_t>(p - match);
+            *op++ = static_cast<uint8_t>(offset & 0xFF);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            if (extra >= 15) {
+                op = lz4_write_length(op, extra - 15);
+            }
+            p += match_length;
+            anchor = p;
+        }
+    }
+
+    size_t literals = static_cast<size_t>(end - anchor);
+    *op++ = static_cast<uint8_t>((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = lz4_write_length(op, literals - 15);
+    }
+    std::memcpy(op, anchor, literals);
+    op += literals;
+    return static_cast<size_t>(op - reinterpret_cast<uint8_t *>(out));
+}
+
+/**
+ * @brief Decodes an LZ4 block that must expand to exactly @p expected bytes.
+ * @return False if the block is malformed; @p out is then undefined.
+ */
+inline bool lz4_decompress(const char *block, size_t length, char *out, size_t expected) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(block);
+    const uint8_t *end = p + length;
+    uint8_t *op = reinterpret_cast<uint8_t *>(out);
+    uint8_t *out_end = op + expected;
+
+    while (p < end) {
+        uint8_t token = *p++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t byte;
+            do {
+                if (p == end) {
+                    return false;
+                }
+                byte = *p++;
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > static_cast<size_t>(end - p) || literals > static_cast<size_t>(out_end - op)) {
+            return false;
+        }
+        if (literals > 0) {
+            std::memcpy(op, p, literals);
+        }
+        p += literals;
+        op += literals;
+        if (p == end) {
+            break; // The last sequence has no match
+        }
+
+        if (end - p < 2) {
+            return false;
+        }
+        size_t offset = p[0] | (static_cast<size_t>(p[1]) << 8);
+        p += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - reinterpret_cast<uint8_t *>(out))) {
+            return false;
+        }
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            uint8_t byte;
+            do {
+                if (p == end) {
+                    return false;
+                }
+                byte = *p++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += 4;
+        if (match_length > static_cast<size_t>(out_end - op)) {
+            return false;
+        }
+        // Byte by byte: the match may overlap what it is copying
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < match_length; ++i) {
+            op[i] = match[i];
+        }
+        op += match_length;
+    }
+    return op == out_end;
+}
+
+/**
+ * @brief Builds the payload of a compressed frame.
+ * @return False if compressing would not make @p text smaller.
+ */
+inline bool compress_payload(const char *text, size_t length, std::vector<char> &out) {
+    out.resize(MAX_VARINT_SIZE + lz4_compress_bound(length));
+    size_t header = encode_varint(static_cast<uint32_t>(length), out.data());
+    size_t size = header + lz4_compress(text, length, out.data() + header);
+    out.resize(size);
+    return size < length;
+}
+
+/**
+ * @brief Expands the payload of a compressed frame into @p out.
+ * @return False if it is malformed or expands past @p limit bytes.
+ */
+inline bool decompress_payload(const char *payload, size_t length, size_t limit, std::vector<char> &out) {
+    uint32_t expanded;
+    size_t header = decode_varint(payload, length, expanded);
+    if (header == 0 || expanded > limit) {
+        return false;
+    }
+    out.resize(expanded);
+    return lz4_decompress(payload + header, length - header, out.data(), expanded);
+}
+
+#endif // CHAT_COMPRESSION_H
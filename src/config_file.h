@@ -0,0 +1,70 @@
+// -----------------------------------------------------------------------------
+// Config File
+//
+// Every server option can come from a file given with --config PATH as
+// well as from the command line. The file holds one option per line, named
+// like the long option without its dashes; '#' starts a comment:
+//
+//   # 16 cores on two NUMA nodes, tuned for 200k mostly idle clients
+//   port = 8080
+//   bind = ::                  # IPv6 and IPv4
+//   workers = 16
+//   cpus = 0-7,16-23
+//   numa = local
+//   reserve-connections = 12500
+//   peer = 10.0.0.2:9000       # Repeatable options repeat
+//   peer = 10.0.0.3:9000
+//
+// The file's options take the place of --config on the command line, so
+// options given after it override the file's, and repeatable ones add up.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_CONFIG_FILE_H
+#define CHAT_CONFIG_FILE_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Appends the options in the file at @p path to @p args as
+ *        "--name", "value" pairs.
+ * @param problem Set to what is wrong if the file cannot be used.
+ * @return False if the file cannot be read or a line is malformed.
+ */
+inline bool read_config_file(const std::string &path, std::vector<std::string> &args, std::string &problem) {
+    std::ifstream file(path.c_str());
+    if (!file) {
+        problem = "Cannot read config file " + path + ".";
+        return false;
+    }
+    static const char *const SPACE = " \t\r";
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        line = line.substr(0, line.find('#'));
+        size_t first = line.find_first_not_of(SPACE);
+        if (first == std::string::npos) {
+            continue;
+        }
+        size_t equals = line.find('=');
+        if (equals == std::string::npos || equals == first) {
+            problem = path + ":" + std::to_string(number) + ": expected name = value.";
+            return false;
+        }
+        std::string name = line.substr(first, line.find_last_not_of(SPACE, equals - 1) + 1 - first);
+        size_t value_start = line.find_first_not_of(SPACE, equals + 1);
+        std::string value =
+            value_start == std::string::npos
+                ? std::string()
+                : line.substr(value_start, line.find_last_not_of(SPACE) + 1 - value_start);
+        if (name == "config") {
+            problem = path + ":" + std::to_string(number) + ": config files cannot include others.";
+            return false;
+        }
+        args.push_back("--" + name);
+        args.push_back(value);
+    }
+    return true;
+}
+
+#endif // CHAT_CONFIG_FILE_H
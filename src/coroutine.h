@@ -0,0 +1,125 @@
+// -----------------------------------------------------------------------------
+// Connection Coroutines
+//
+// With CHAT_COROUTINES defined (a C++20 build, see the Makefile), the server
+// serves each framed client with a coroutine that reads as straight-line
+// code: loop over co_await conn->recv_frame(frame), handle the frame, and
+// co_await conn->send(message) or conn->caught_up() where the client has to
+// keep up with its own replies. Fan-out to other clients is not awaited: it
+// goes onto their queues, under their overflow policy. The reactor
+// still does all I/O; an awaitable only suspends the handler until the
+// reactor has what it waits for, so a suspended handler costs its frame and
+// nothing else, not a thread stack.
+//
+// ConnectionTask owns a handler's frame. The frame is not allocated
+// separately: the promise places it in a HandlerFrame embedded in the
+// coroutine's first argument, the pooled per-connection state, so creating
+// a handler never allocates once the pool is warm. A frame that outgrows the
+// embedded storage (a compiler with larger frames) falls back to the slab
+// allocator.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_COROUTINE_H
+#define CHAT_COROUTINE_H
+
+#ifdef CHAT_COROUTINES
+
+#if !defined(__cpp_impl_coroutine) && !defined(_MSC_VER)
+#error "CHAT_COROUTINES needs C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include "slab_allocator.h"
+
+/**
+ * @brief Storage for one handler frame, embedded in what the handler serves.
+ */
+struct HandlerFrame {
+    // Enough for the server's handlers under GCC, Clang and MSVC
+    static const size_t INLINE_SIZE = 256;
+
+    void *allocate(size_t size) {
+        return size <= INLINE_SIZE ? static_cast<void *>(storage) : SlabAllocator::instance().allocate(size);
+    }
+
+    // The size decides where a frame went, so freeing needs no owner
+    static void release(void *frame, size_t size) {
+        if (size > INLINE_SIZE) {
+            SlabAllocator::instance().deallocate(frame, size);
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+};
+
+/**
+ * @brief A connection handler coroutine; destroying the task destroys its frame.
+ *
+ * The handler runs as soon as it is called, up to its first suspension.
+ * A finished handler stays suspended at its end until the task goes away.
+ */
+class ConnectionTask {
+public:
+    struct promise_type {
+        // The handler's argument is the connection, which holds the frame storage
+        struct Placement {
+            template <typename Owner>
+            Placement(Owner *owner) : frame(owner->handler_frame) {} // Implicit: converts the argument
+            HandlerFrame &frame;
+        };
+
+        // Not a template, so the sized delete below is its matching deallocation
+        static void *operator new(size_t size, Placement placement) { return placement.frame.allocate(size); }
+        static void operator delete(void *frame, size_t size) { HandlerFrame::release(frame, size); }
+
+        ConnectionTask get_return_object() {
+            return ConnectionTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    ConnectionTask() {}
+    explicit ConnectionTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    ConnectionTask(ConnectionTask &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    ConnectionTask &operator=(ConnectionTask &&other) noexcept {
+        if (this != &other) {
+            reset();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~ConnectionTask() { reset(); }
+
+    ConnectionTask(const ConnectionTask &) = delete;
+    ConnectionTask &operator=(const ConnectionTask &) = delete;
+
+    // Still waiting for something; false once it returned or if there is none
+    bool running() const { return handle_ && !handle_.done(); }
+
+    void resume() {
+        if (running()) {
+            handle_.resume();
+        }
+    }
+
+    // Only while the handler is suspended, never from inside it
+    void reset() {
+        if (handle_) {
+            handle_.destroy();
+            handle_ = nullptr;
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+#endif // CHAT_COROUTINES
+
+#endif // CHAT_COROUTINE_H
@@ -0,0 +1,182 @@
+// -----------------------------------------------------------------------------
+// Chat Wire Protocol
+//
+// Framed clients open the connection with a 4-byte preface and then exchange
+// length-prefixed binary frames:
+//
+//   +-----------------+---------+---------+-----------------+
+//   | payload length  |  type   |  flags  |     payload     |
+//   | varint, 1-5 B   |  1 byte |  1 byte |  length bytes   |
+//   +-----------------+---------+---------+-----------------+
+//
+// The length is an unsigned LEB128 varint. Connections that do not start
+// with the preface are served in legacy line mode: newline-terminated text.
+//
+// A client may offer optional capabilities with a FRAME_CAPABILITIES frame;
+// the server answers with the ones it enabled, and only those are used in
+// either direction (see compression.h for compressed frames).
+//
+// The server pings framed clients that have been silent for a while and
+// disconnects those that stay silent; clients must answer FRAME_PING.
+//
+// Clients that negotiate CAPABILITY_PRESENCE learn who joins, leaves and
+// types through FRAME_PRESENCE updates instead of join and leave notices
+// (see presence.h).
+//
+// parse_frame() is incremental and allocation-free: it decodes one frame in
+// place from whatever bytes have arrived, or reports that more are needed.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_FRAME_H
+#define CHAT_FRAME_H
+
+#include <cstddef>
+#include <cstdint>
+
+// First bytes sent by a framed client: a non-ASCII magic byte, "CH", version
+const char FRAME_PREFACE[] = {'\xC4', 'C', 'H', '\x01'};
+const size_t FRAME_PREFACE_SIZE = sizeof(FRAME_PREFACE);
+
+// Largest possible header: five varint bytes plus type and flags
+const size_t MAX_FRAME_HEADER = 7;
+// Largest payload either side accepts
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024;
+// Largest chat text a client may send, leaving room for the sender prefix
+// the server adds when relaying it
+const uint32_t MAX_CHAT_TEXT = MAX_FRAME_PAYLOAD - 1024;
+
+// Frame types
+const uint8_t FRAME_CHAT = 1;   // Chat text (client -> server, server -> client)
+const uint8_t FRAME_NOTICE = 2; // Server announcement such as a join or leave
+const uint8_t FRAME_JOIN = 3;   // Join the room named by the payload (client -> server)
+const uint8_t FRAME_LEAVE = 4;  // Leave the named room, or the current one if empty
+const uint8_t FRAME_CAPABILITIES = 5; // One byte of CAPABILITY_* bits: offered, or enabled in reply
+const uint8_t FRAME_PING = 6;   // Heartbeat; either side answers with a FRAME_PONG echoing the payload
+const uint8_t FRAME_PONG = 7;
+// Private chat. Client -> server: the recipient's session id (the number in
+// "Client <id>") as DIRECT_RECIPIENT_SIZE little-endian bytes, then the text.
+// Server -> client: "[private] Client <id>: text".
+const uint8_t FRAME_DIRECT = 8;
+const size_t DIRECT_RECIPIENT_SIZE = 8;
+// Who is in a room and who is typing (server -> client, see presence.h)
+const uint8_t FRAME_PRESENCE = 9;
+// The client is typing in the room named by the payload, or in its current
+// room if the payload is empty (client -> server)
+const uint8_t FRAME_TYPING = 10;
+
+// Frame flags
+// FRAME_CHAT from a client: the payload starts with a one-byte room name
+// length and the room name, and the text after it goes to that room
+const uint8_t FRAME_FLAG_ROOM = 0x01;
+// The payload is LZ4-compressed (see compression.h); only once negotiated
+const uint8_t FRAME_FLAG_COMPRESSED = 0x02;
+// FRAME_NOTICE from the server: a chat message of the client's was dropped
+// by a rate limit, so the client should slow down
+const uint8_t FRAME_FLAG_THROTTLED = 0x04;
+
+// Capabilities
+const uint8_t CAPABILITY_LZ4 = 0x01;      // Compressed frames
+const uint8_t CAPABILITY_PRESENCE = 0x02; // FRAME_PRESENCE updates instead of join and leave notices
+
+/**
+ * @brief A decoded frame; the payload points into the caller's buffer.
+ */
+struct Frame {
+    uint8_t type;
+    uint8_t flags;
+    const char *payload;
+    uint32_t length;
+};
+
+enum class ParseResult {
+    Complete, // A frame was decoded
+    NeedMore, // The buffer holds only part of a frame
+    Invalid   // Malformed varint or oversized payload
+};
+
+// Longest encoding of a 32-bit varint
+const size_t MAX_VARINT_SIZE = 5;
+
+/**
+ * @brief Encodes @p value as an unsigned LEB128 varint into @p out.
+ * @return Number of bytes written (at most MAX_VARINT_SIZE).
+ */
+inline size_t encode_varint(uint32_t value, char *out) {
+    size_t size = 0;
+    do {
+        uint8_t byte = static_cast<uint8_t>(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            byte |= 0x80;
+        }
+        out[size++] = static_cast<char>(byte);
+    } while (value != 0);
+    return size;
+}
+
+/**
+ * @brief Decodes a varint from the start of @p data, which must hold all of it.
+ * @return Bytes consumed, or 0 if the varint is truncated or too long.
+ */
+inline size_t decode_varint(const char *data, size_t size, uint32_t &value) {
+    value = 0;
+    for (size_t position = 0; position < size && position < MAX_VARINT_SIZE; ++position) {
+        uint8_t byte = static_cast<uint8_t>(data[position]);
+        value |= static_cast<uint32_t>(byte & 0x7F) << (7 * position);
+        if (!(byte & 0x80)) {
+            return position + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Encodes a frame header into @p out (at least MAX_FRAME_HEADER bytes).
+ * @return Number of header bytes written.
+ */
+inline size_t encode_frame_header(uint8_t type, uint8_t flags, uint32_t length, char *out) {
+    size_t size = encode_varint(length, out);
+    out[size++] = static_cast<char>(type);
+    out[size++] = static_cast<char>(flags);
+    return size;
+}
+
+/**
+ * @brief Decodes the frame at the start of @p data without copying.
+ * @param consumed Set to the frame's total size when Complete is returned.
+ */
+inline ParseResult parse_frame(const char *data, size_t size, Frame &frame, size_t &consumed) {
+    uint32_t length = 0;
+    size_t position = 0;
+    for (int shift = 0;; shift += 7) {
+        if (position == 5) {
+            return ParseResult::Invalid;
+        }
+        if (position == size) {
+            return ParseResult::NeedMore;
+        }
+        uint8_t byte = static_cast<uint8_t>(data[position++]);
+        if (shift == 28 && (byte & 0x70)) {
+            return ParseResult::Invalid; // Does not fit in 32 bits
+        }
+        length |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    if (length > MAX_FRAME_PAYLOAD) {
+        return ParseResult::Invalid;
+    }
+    if (size - position < 2 + static_cast<size_t>(length)) {
+        return ParseResult::NeedMore;
+    }
+
+    frame.type = static_cast<uint8_t>(data[position]);
+    frame.flags = static_cast<uint8_t>(data[position + 1]);
+    frame.payload = data + position + 2;
+    frame.length = length;
+    consumed = position + 2 + length;
+    return ParseResult::Complete;
+}
+
+#endif // CHAT_FRAME_H
@@ -0,0 +1,483 @@
+// -----------------------------------------------------------------------------
+// Hot Restart Handoff
+//
+// A server started with --handoff PATH keeps a local control socket at PATH.
+// A newer server started with the same option connects to it and takes over
+// everything the running process owns: its listening sockets and every
+// client connection, without a single client noticing. Sockets travel as
+// descriptors over a local (AF_UNIX) stream:
+//
+//   - POSIX:   SCM_RIGHTS ancillary data.
+//   - Windows: WSADuplicateSocket protocol blobs, sent in-band once the
+//              successor has told its process id (AF_UNIX needs Windows 10).
+//
+// The stream is a sequence of records
+//
+//   [u32 payload length][u8 kind][u8 carries a socket][payload]
+//
+// all integers little-endian. The successor opens with HANDOFF_HELLO and
+// closes with HANDOFF_DONE once it has taken everything over; in between the
+// running process sends HANDOFF_LISTENER and HANDOFF_CLIENT records, a TLS
+// server its HANDOFF_TICKET_KEYS, and then HANDOFF_END. Both sides use
+// blocking sockets on their main thread.
+//
+// TLS clients are not handed over: their session state lives in OpenSSL.
+// They are asked to reconnect instead, and resume their TLS sessions with
+// the successor, which takes over the ticket keys.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_HANDOFF_H
+#define CHAT_HANDOFF_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "socket_compat.h"
+
+#ifdef _WIN32
+#include <afunix.h>
+#else
+#include <sys/un.h>
+#endif
+
+// Record kinds
+const uint8_t HANDOFF_HELLO = 1;    // Successor -> running: u32 process id
+const uint8_t HANDOFF_LISTENER = 2; // u8 ListenerRole, with the socket
+const uint8_t HANDOFF_CLIENT = 3;   // An encoded HandoffClient, with the socket
+const uint8_t HANDOFF_END = 4;      // Nothing follows
+const uint8_t HANDOFF_DONE = 5;     // Successor -> running: all taken over
+const uint8_t HANDOFF_TICKET_KEYS = 6; // TLS session ticket keys (see tls.h)
+
+const size_t HANDOFF_RECORD_HEADER = 6;
+// Clients' unsent output is bounded by their queues; anything larger is corrupt
+const uint32_t MAX_HANDOFF_RECORD = 256u * 1024 * 1024;
+
+/**
+ * @brief What a listening socket in a handoff is for.
+ */
+enum class ListenerRole : uint8_t {
+    Clients, // One per reactor with SO_REUSEPORT, otherwise one
+    Cluster,
+    Metrics
+};
+
+/**
+ * @brief Everything a successor needs to carry on serving one client.
+ */
+struct HandoffClient {
+    HandoffClient() : socket(INVALID_SOCKET), session(0), format(0), compression(false), presence(false) {}
+
+    SOCKET socket;
+    uint64_t session;   // 0: accepted but never admitted
+    uint8_t format;     // 0: not known yet, then 1 + WireFormat
+    bool compression;
+    bool presence;      // Negotiated presence updates
+    std::string current_room; // Empty: in no room
+    std::vector<std::string> rooms;
+    std::string input;  // Received bytes not handled yet: the start of a frame
+    std::string output; // Bytes not sent yet, already in the client's wire format
+};
+
+inline void handoff_put_u32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void handoff_put_u64(std::string &out, uint64_t value) {
+    handoff_put_u32(out, static_cast<uint32_t>(value));
+    handoff_put_u32(out, static_cast<uint32_t>(value >> 32));
+}
+
+inline void handoff_put_string(std::string &out, const std::string &value) {
+    handoff_put_u32(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+/**
+ * @brief Bounds-checked reader over a record's payload.
+ */
+class HandoffReader {
+public:
+    explicit HandoffReader(const std::string &data) : data_(data), offset_(0), failed_(false) {}
+
+    uint8_t u8() {
+        if (!available(1)) {
+            return 0;
+        }
+        return static_cast<uint8_t>(data_[offset_++]);
+    }
+
+    uint32_t u32() {
+        if (!available(4)) {
+            return 0;
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= static_cast<uint32_t>(static_cast<uint8_t>(data_[offset_++])) << (8 * i);
+        }
+        return value;
+    }
+
+    uint64_t u64() {
+        uint64_t low = u32();
+        return low | (static_cast<uint64_t>(u32()) << 32);
+    }
+
+    std::string string() {
+        uint32_t length = u32();
+        if (!available(length)) {
+            return std::string();
+        }
+        std::string value = data_.substr(offset_, length);
+        offset_ += length;
+        return value;
+    }
+
+    // False once anything read past the end
+    bool ok() const { return !failed_; }
+
+private:
+    bool available(size_t bytes) {
+        if (failed_ || data_.size() - offset_ < bytes) {
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    const std::string &data_;
+    size_t offset_;
+    bool failed_;
+};
+
+inline std::string encode_handoff_client(const HandoffClient &client) {
+    std::string out;
+    handoff_put_u64(out, client.session);
+    out.push_back(static_cast<char>(client.format));
+    // Negotiated capabilities, one bit each; older servers wrote 0 or 1 for compression
+    out.push_back(static_cast<char>((client.compression ? 1 : 0) | (client.presence ? 2 : 0)));
+    handoff_put_string(out, client.current_room);
+    handoff_put_u32(out, static_cast<uint32_t>(client.rooms.size()));
+    for (const std::string &room : client.rooms) {
+        handoff_put_string(out, room);
+    }
+    handoff_put_string(out, client.input);
+    handoff_put_string(out, client.output);
+    return out;
+}
+
+/**
+ * @return False if @p payload is not a complete client record.
+ */
+inline bool decode_handoff_client(const std::string &payload, HandoffClient &client) {
+    HandoffReader reader(payload);
+    client.session = reader.u64();
+    client.format = reader.u8();
+    uint8_t capabilities = reader.u8();
+    client.compression = (capabilities & 1) != 0;
+    client.presence = (capabilities & 2) != 0;
+    client.current_room = reader.string();
+    uint32_t rooms = reader.u32();
+    client.rooms.clear();
+    for (uint32_t i = 0; i < rooms && reader.ok(); ++i) {
+        client.rooms.push_back(reader.string());
+    }
+    client.input = reader.string();
+    client.output = reader.string();
+    return reader.ok();
+}
+
+/**
+ * @brief One end of the control connection between two server processes.
+ */
+class HandoffChannel {
+public:
+    HandoffChannel() : socket_(INVALID_SOCKET), peer_process_(0) {}
+
+    ~HandoffChannel() { close(); }
+
+    HandoffChannel(const HandoffChannel &) = delete;
+    HandoffChannel &operator=(const HandoffChannel &) = delete;
+
+    /**
+     * @brief Creates the control socket a successor connects to, replacing
+     *        any stale one at @p path.
+     * @return The listening socket, or INVALID_SOCKET.
+     */
+    static SOCKET listen_at(const std::string &path) {
+        struct sockaddr_un address;
+        if (!make_address(path, address)) {
+            return INVALID_SOCKET;
+        }
+        SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        remove_path(path);
+        if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR ||
+            listen(listener, 1) == SOCKET_ERROR) {
+            closesocket(listener);
+            return INVALID_SOCKET;
+        }
+        return listener;
+    }
+
+    static void remove_path(const std::string &path) {
+#ifdef _WIN32
+        DeleteFileA(path.c_str());
+#else
+        unlink(path.c_str());
+#endif
+    }
+
+    /**
+     * @brief Successor side: connects to a running server and says hello.
+     * @return False if no server is listening at @p path.
+     */
+    bool connect_to(const std::string &path) {
+        struct sockaddr_un address;
+        if (!make_address(path, address)) {
+            return false;
+        }
+        socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socket_ == INVALID_SOCKET) {
+            return false;
+        }
+        if (connect(socket_, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR) {
+            close();
+            return false;
+        }
+        std::string hello;
+#ifdef _WIN32
+        handoff_put_u32(hello, static_cast<uint32_t>(GetCurrentProcessId()));
+#else
+        handoff_put_u32(hello, static_cast<uint32_t>(getpid()));
+#endif
+        return send_record(HANDOFF_HELLO, hello);
+    }
+
+    /**
+     * @brief Running side: accepts a successor and reads its hello.
+     */
+    bool accept_from(SOCKET listener) {
+        socket_ = accept(listener, NULL, NULL);
+        if (socket_ == INVALID_SOCKET) {
+            return false;
+        }
+        // The listener may be non-blocking; the channel itself must not be
+        u_long mode = 0;
+        ioctlsocket(socket_, FIONBIO, &mode);
+
+        uint8_t kind;
+        std::string payload;
+        SOCKET unused;
+        if (!receive_record(kind, payload, unused) || kind != HANDOFF_HELLO) {
+            close();
+            return false;
+        }
+        HandoffReader reader(payload);
+        peer_process_ = reader.u32();
+        return reader.ok();
+    }
+
+    /**
+     * @brief Sends one record, passing @p passed along with it if valid.
+     *
+     * The sender keeps its own descriptor for @p passed; it may close it
+     * once the record is sent.
+     */
+    bool send_record(uint8_t kind, const std::string &payload, SOCKET passed = INVALID_SOCKET) {
+        std::string body;
+#ifdef _WIN32
+        if (passed != INVALID_SOCKET) {
+            WSAPROTOCOL_INFOW info;
+            if (WSADuplicateSocketW(passed, peer_process_, &info) != 0) {
+                return false;
+            }
+            body.assign(reinterpret_cast<const char *>(&info), sizeof(info));
+        }
+#endif
+        body += payload;
+
+        std::string record;
+        handoff_put_u32(record, static_cast<uint32_t>(body.size()));
+        record.push_back(static_cast<char>(kind));
+        record.push_back(passed != INVALID_SOCKET ? 1 : 0);
+        record += body;
+
+#ifdef _WIN32
+        return send_bytes(record.data(), record.size());
+#else
+        if (passed == INVALID_SOCKET) {
+            return send_bytes(record.data(), record.size());
+        }
+        // The descriptor rides on the first byte of the record
+        struct iovec vector;
+        vector.iov_base = &record[0];
+        vector.iov_len = 1;
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int))];
+        } control;
+        std::memset(&control, 0, sizeof(control));
+        struct msghdr message = msghdr();
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &passed, sizeof(int));
+        if (sendmsg(socket_, &message, 0) != 1) {
+            return false;
+        }
+        return send_bytes(record.data() + 1, record.size() - 1);
+#endif
+    }
+
+    /**
+     * @brief Reads one record.
+     * @param passed The socket that came with it, or INVALID_SOCKET.
+     */
+    bool receive_record(uint8_t &kind, std::string &payload, SOCKET &passed) {
+        passed = INVALID_SOCKET;
+        char header[HANDOFF_RECORD_HEADER];
+#ifdef _WIN32
+        if (!receive_bytes(header, sizeof(header))) {
+            return false;
+        }
+#else
+        // The first byte may carry a descriptor
+        struct iovec vector;
+        vector.iov_base = header;
+        vector.iov_len = 1;
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr message = msghdr();
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+        ssize_t received;
+        do {
+            received = recvmsg(socket_, &message, 0);
+        } while (received < 0 && errno == EINTR);
+        if (received != 1) {
+            return false;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int descriptor;
+                std::memcpy(&descriptor, CMSG_DATA(cmsg), sizeof(int));
+                passed = descriptor;
+            }
+        }
+        if (!receive_bytes(header + 1, sizeof(header) - 1)) {
+            close_passed(passed);
+            return false;
+        }
+#endif
+        uint32_t length = 0;
+        for (int i = 0; i < 4; ++i) {
+            length |= static_cast<uint32_t>(static_cast<uint8_t>(header[i])) << (8 * i);
+        }
+        kind = static_cast<uint8_t>(header[4]);
+        bool carries_socket = header[5] != 0;
+        if (length > MAX_HANDOFF_RECORD) {
+            close_passed(passed);
+            return false;
+        }
+        payload.resize(length);
+        if (length > 0 && !receive_bytes(&payload[0], length)) {
+            close_passed(passed);
+            return false;
+        }
+
+#ifdef _WIN32
+        if (carries_socket) {
+            WSAPROTOCOL_INFOW info;
+            if (payload.size() < sizeof(info)) {
+                return false;
+            }
+            std::memcpy(&info, payload.data(), sizeof(info));
+            payload.erase(0, sizeof(info));
+            passed = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0,
+                                WSA_FLAG_OVERLAPPED);
+        }
+#else
+        if (carries_socket != (passed != INVALID_SOCKET)) {
+            close_passed(passed);
+            return false;
+        }
+#endif
+        return !carries_socket || passed != INVALID_SOCKET;
+    }
+
+    void close() {
+        if (socket_ != INVALID_SOCKET) {
+            closesocket(socket_);
+            socket_ = INVALID_SOCKET;
+        }
+    }
+
+private:
+    static bool make_address(const std::string &path, struct sockaddr_un &address) {
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    static void close_passed(SOCKET &passed) {
+        if (passed != INVALID_SOCKET) {
+            closesocket(passed);
+            passed = INVALID_SOCKET;
+        }
+    }
+
+    bool send_bytes(const char *data, size_t length) {
+        while (length > 0) {
+            int sent = send(socket_, data, (int)std::min<size_t>(length, 1 << 30), 0);
+            if (sent == SOCKET_ERROR) {
+                if (WSAGetLastError() == WSAEINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    bool receive_bytes(char *data, size_t length) {
+        while (length > 0) {
+            int received = recv(socket_, data, (int)std::min<size_t>(length, 1 << 30), 0);
+            if (received == SOCKET_ERROR && WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            length -= received;
+        }
+        return true;
+    }
+
+    SOCKET socket_;
+    uint32_t peer_process_; // Windows: where duplicated sockets are for
+};
+
+#endif // CHAT_HANDOFF_H
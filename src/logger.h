@@ -0,0 +1,394 @@
+// -----------------------------------------------------------------------------
+// Asynchronous Structured Logger
+//
+// Log calls format a record into a stack buffer and push it onto a bounded,
+// lock-free multi-producer ring; a background thread drains the ring and
+// writes records to the log file (or stdout) in batches. Logging therefore
+// never takes the console lock or waits for I/O on a reactor thread. When the
+// ring is full, records are dropped and counted rather than blocking.
+//
+// Records are logfmt lines: time, level and thread, a message, then any
+// key=value fields:
+//
+//   time=2026-10-14T08:00:00.123456Z level=info thread=worker-0 msg="Client joined room" client="Client 7" room=dev
+//
+// LOG_EVENT checks the level before anything is formatted. LOG_SAMPLED also
+// keeps only one in every `sample_rate` records per thread, for per-message
+// events that would otherwise flood the log.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_LOGGER_H
+#define CHAT_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+// Formatted bytes per record (message and fields); longer records are cut
+const size_t LOG_RECORD_TEXT = 480;
+// Records the ring holds; a power of two
+const size_t LOG_RING_SIZE = 4096;
+// How long the writer sleeps when the ring is empty
+const int LOG_IDLE_WAIT_MS = 20;
+
+enum class LogLevel { Debug, Info, Warn, Error };
+
+/**
+ * @brief Parses "debug", "info", "warn" or "error".
+ */
+inline bool parse_log_level(const std::string &name, LogLevel &level) {
+    if (name == "debug") {
+        level = LogLevel::Debug;
+    } else if (name == "info") {
+        level = LogLevel::Info;
+    } else if (name == "warn") {
+        level = LogLevel::Warn;
+    } else if (name == "error") {
+        level = LogLevel::Error;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// log_thread_index() of the thread serving cluster links
+const int LOG_THREAD_CLUSTER = -2;
+
+/**
+ * @brief Names the calling thread in its log records; -1 (the default) is
+ *        the main thread, LOG_THREAD_CLUSTER the cluster thread, anything
+ *        else a worker index.
+ */
+inline int &log_thread_index() {
+    static thread_local int index = -1;
+    return index;
+}
+
+class Logger {
+public:
+    Logger()
+        : min_level_(static_cast<int>(LogLevel::Info)), sample_rate_(1), slots_(new Slot[LOG_RING_SIZE]),
+          enqueue_position_(0), dequeue_position_(0), dropped_(0), output_(NULL), running_(false) {
+        for (size_t i = 0; i < LOG_RING_SIZE; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Logger() { stop(); }
+
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    /**
+     * @brief Starts the writer thread.
+     * @param path File to append to; empty for stdout.
+     * @return False if the file could not be opened.
+     */
+    bool start(LogLevel min_level, unsigned sample_rate, const std::string &path) {
+        min_level_.store(static_cast<int>(min_level), std::memory_order_relaxed);
+        sample_rate_.store(sample_rate < 1 ? 1 : sample_rate, std::memory_order_relaxed);
+        output_ = path.empty() ? stdout : std::fopen(path.c_str(), "a");
+        if (output_ == NULL) {
+            return false;
+        }
+        running_.store(true);
+        writer_ = std::thread(&Logger::run_writer, this);
+        return true;
+    }
+
+    /**
+     * @brief Writes everything still queued and stops the writer thread.
+     */
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        wake_.notify_one();
+        writer_.join();
+        if (output_ != stdout) {
+            std::fclose(output_);
+        }
+        output_ = NULL;
+    }
+
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) >= min_level_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Whether a sampled record should be kept: one in sample_rate()
+     *        per thread.
+     */
+    bool sample(LogLevel level) {
+        if (!enabled(level)) {
+            return false;
+        }
+        static thread_local unsigned counter = 0;
+        return counter++ % sample_rate() == 0;
+    }
+
+    unsigned sample_rate() const { return sample_rate_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Queues one formatted record without blocking.
+     */
+    void submit(LogLevel level, const char *text, size_t length) {
+        size_t position = enqueue_position_.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;) {
+            slot = &slots_[position & (LOG_RING_SIZE - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (lag == 0) {
+                if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (lag < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return; // Full: the writer is behind
+            } else {
+                position = enqueue_position_.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::system_clock::now().time_since_epoch())
+                            .count();
+        slot->level = level;
+        slot->thread = log_thread_index();
+        slot->length = length < LOG_RECORD_TEXT ? length : LOG_RECORD_TEXT;
+        std::memcpy(slot->text, text, slot->length);
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence; // Ring protocol: who may use the slot next
+        int64_t time_us;
+        LogLevel level;
+        int thread;
+        size_t length;
+        char text[LOG_RECORD_TEXT];
+    };
+
+    // Bytes buffered before the writer issues a write
+    static const size_t WRITE_BATCH_BYTES = 64 * 1024;
+
+    /**
+     * @brief Writer thread: drains the ring in batches until stopped.
+     */
+    void run_writer() {
+        std::string batch;
+        batch.reserve(WRITE_BATCH_BYTES + LOG_RECORD_TEXT + 128);
+        while (true) {
+            bool running = running_.load();
+            size_t records = 0;
+            while (pop_into(batch)) {
+                ++records;
+                if (batch.size() >= WRITE_BATCH_BYTES) {
+                    flush(batch);
+                }
+            }
+            uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                append_header(batch, std::chrono::duration_cast<std::chrono::microseconds>(
+                                         std::chrono::system_clock::now().time_since_epoch())
+                                         .count(),
+                              LogLevel::Warn, -1);
+                batch += "msg=\"Log records dropped\" count=" + std::to_string(dropped) + "\n";
+            }
+            flush(batch);
+            if (!running) {
+                return;
+            }
+            if (records == 0) {
+                std::unique_lock<std::mutex> lock(wake_mutex_);
+                wake_.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_WAIT_MS));
+            }
+        }
+    }
+
+    /**
+     * @brief Moves the oldest record, formatted, onto @p batch.
+     * @return False if the ring is empty.
+     */
+    bool pop_into(std::string &batch) {
+        Slot &slot = slots_[dequeue_position_ & (LOG_RING_SIZE - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeue_position_ + 1) {
+            return false;
+        }
+        append_header(batch, slot.time_us, slot.level, slot.thread);
+        batch.append(slot.text, slot.length);
+        batch += '\n';
+        slot.sequence.store(dequeue_position_ + LOG_RING_SIZE, std::memory_order_release);
+        ++dequeue_position_;
+        return true;
+    }
+
+    static void append_header(std::string &batch, int64_t time_us, LogLevel level, int thread) {
+        static const char *const names[] = {"debug", "info", "warn", "error"};
+        std::time_t seconds = static_cast<std::time_t>(time_us / 1000000);
+        struct tm utc = *std::gmtime(&seconds); // Only the writer thread calls gmtime
+        char header[96];
+        size_t length = std::strftime(header, sizeof(header), "time=%Y-%m-%dT%H:%M:%S", &utc);
+        length += std::snprintf(header + length, sizeof(header) - length, ".%06dZ level=%s thread=",
+                                static_cast<int>(time_us % 1000000), names[static_cast<int>(level)]);
+        if (thread == LOG_THREAD_CLUSTER) {
+            std::snprintf(header + length, sizeof(header) - length, "cluster ");
+        } else if (thread < 0) {
+            std::snprintf(header + length, sizeof(header) - length, "main ");
+        } else {
+            std::snprintf(header + length, sizeof(header) - length, "worker-%d ", thread);
+        }
+        batch += header;
+    }
+
+    void flush(std::string &batch) {
+        if (!batch.empty()) {
+            std::fwrite(batch.data(), 1, batch.size(), output_);
+            std::fflush(output_);
+            batch.clear();
+        }
+    }
+
+    std::atomic<int> min_level_;
+    std::atomic<unsigned> sample_rate_;
+
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<size_t> enqueue_position_; // Producers
+    size_t dequeue_position_;              // Writer thread only
+    std::atomic<uint64_t> dropped_;
+
+    FILE *output_;
+    std::atomic<bool> running_;
+    std::thread writer_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+};
+
+/**
+ * @brief The process-wide logger.
+ */
+inline Logger &logger() {
+    static Logger instance;
+    return instance;
+}
+
+/**
+ * @brief Builds one record on the stack and submits it when destroyed.
+ */
+class LogLine {
+public:
+    LogLine(Logger &target, LogLevel level, const char *message) : target_(target), level_(level), length_(0) {
+        append("msg=");
+        append_value(message, std::strlen(message));
+    }
+
+    ~LogLine() { target_.submit(level_, text_, length_); }
+
+    LogLine(const LogLine &) = delete;
+    LogLine &operator=(const LogLine &) = delete;
+
+    LogLine &field(const char *key, const char *value) { return field(key, value, std::strlen(value)); }
+    LogLine &field(const char *key, const std::string &value) { return field(key, value.data(), value.size()); }
+
+    LogLine &field(const char *key, const char *value, size_t length) {
+        append_key(key);
+        append_value(value, length);
+        return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, LogLine &>::type field(const char *key, T value) {
+        append_key(key);
+        char digits[24];
+        int length = std::is_signed<T>::value
+                         ? std::snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value))
+                         : std::snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(value));
+        append(digits, length);
+        return *this;
+    }
+
+    LogLine &field(const char *key, double value) {
+        append_key(key);
+        char digits[32];
+        append(digits, std::snprintf(digits, sizeof(digits), "%.3f", value));
+        return *this;
+    }
+
+private:
+    void append(const char *data, size_t length) {
+        if (length > LOG_RECORD_TEXT - length_) {
+            length = LOG_RECORD_TEXT - length_;
+        }
+        std::memcpy(text_ + length_, data, length);
+        length_ += length;
+    }
+
+    void append(const char *text) { append(text, std::strlen(text)); }
+
+    void append_key(const char *key) {
+        append(" ");
+        append(key);
+        append("=");
+    }
+
+    /**
+     * @brief Appends a value, quoted and escaped if it contains spaces,
+     *        quotes, '=' or control characters.
+     */
+    void append_value(const char *value, size_t length) {
+        bool quote = length == 0;
+        for (size_t i = 0; i < length && !quote; ++i) {
+            unsigned char c = static_cast<unsigned char>(value[i]);
+            quote = c <= ' ' || c == '"' || c == '=' || c == '\\';
+        }
+        if (!quote) {
+            append(value, length);
+            return;
+        }
+        append("\"");
+        for (size_t i = 0; i < length && length_ < LOG_RECORD_TEXT; ++i) {
+            char c = value[i];
+            if (c == '"' || c == '\\') {
+                char escaped[2] = {'\\', c};
+                append(escaped, 2);
+            } else if (static_cast<unsigned char>(c) < ' ') {
+                char escaped[8];
+                append(escaped, std::snprintf(escaped, sizeof(escaped), "\\x%02x", static_cast<unsigned char>(c)));
+            } else {
+                append(&c, 1);
+            }
+        }
+        append("\"");
+    }
+
+    Logger &target_;
+    LogLevel level_;
+    size_t length_;
+    char text_[LOG_RECORD_TEXT];
+};
+
+// Usage: LOG_EVENT(LogLevel::Info, "Client joined room").field("room", name);
+// Nothing is formatted unless the level is enabled.
+#define LOG_EVENT(level, message) \
+    if (!logger().enabled(level)) { \
+    } else \
+        LogLine(logger(), level, message)
+
+// Like LOG_EVENT, but keeps only one in logger().sample_rate() records
+#define LOG_SAMPLED(level, message) \
+    if (!logger().sample(level)) { \
+    } else \
+        LogLine(logger(), level, message).field("sample_rate", logger().sample_rate())
+
+#endif // CHAT_LOGGER_H
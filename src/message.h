@@ -0,0 +1,357 @@
+// -----------------------------------------------------------------------------
+// Shared Message Buffers
+//
+// A MessageBuffer is an immutable, reference-counted byte buffer whose
+// header (reference count, length, prefix) and payload live in a single
+// allocation. A message built once per inbound chat line is handed to every
+// recipient by pointer through MessageRef handles.
+//
+// A message may point at a shared prefix buffer (e.g. "Client 12: ") that is
+// written in front of its payload with a scatter/gather send, so the prefix
+// and payload are never concatenated.
+//
+// Every message can be written in both wire formats (see frame.h): the frame
+// header is encoded once into the buffer's header, and line-mode recipients
+// get a shared trailing newline instead.
+//
+// A presence update (see presence.h) is a text notice that carries its
+// FRAME_PRESENCE rendition along, the same way a large message carries its
+// compressed one.
+//
+// A batch buffer holds several messages already encoded in both wire
+// formats, back to back, so a recipient gets a whole batch of a room's
+// messages as one queued message and one span.
+//
+// Buffers come from the slab allocator (see slab_allocator.h), so building
+// and freeing a message does not touch the heap once the server is warm.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_MESSAGE_H
+#define CHAT_MESSAGE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include "frame.h"
+#include "slab_allocator.h"
+
+/**
+ * @brief A contiguous run of bytes to be written as part of a gather send.
+ */
+struct ByteSpan {
+    const char *data;
+    size_t length;
+};
+
+/**
+ * @brief How a recipient expects messages to be encoded.
+ */
+enum class WireFormat {
+    Line,  // Legacy clients: text followed by a newline
+    Framed // Length-prefixed frames
+};
+
+// Most spans a single message is written as
+const int MAX_MESSAGE_SPANS = 3;
+
+class MessageBuffer {
+public:
+    /**
+     * @brief Allocates a buffer holding a copy of @p payload.
+     * @param prefix Optional buffer written before the payload. It must not
+     *        have a prefix of its own. The new buffer keeps it alive.
+     * @param frame_type Frame type used for framed recipients.
+     * @param frame_flags Frame flags used for framed recipients.
+     * @return A buffer with one reference owned by the caller.
+     */
+    static MessageBuffer *create(const char *payload, size_t length, MessageBuffer *prefix, uint8_t frame_type,
+                                 uint8_t frame_flags = 0) {
+        void *memory = SlabAllocator::instance().allocate(sizeof(MessageBuffer) + length);
+        MessageBuffer *buffer =
+            new (memory) MessageBuffer(static_cast<uint32_t>(length), prefix, frame_type, frame_flags);
+        if (length > 0) {
+            std::memcpy(buffer->payload(), payload, length);
+        }
+        return buffer;
+    }
+
+    /**
+     * @brief Allocates a batch of @p count messages, each encoded as it would
+     *        be written on its own.
+     * @param compressed Use the messages' compressed renditions where they
+     *        have one; such a batch is for framed recipients only.
+     * @return A buffer with one reference owned by the caller.
+     */
+    static MessageBuffer *create_batch(const MessageBuffer *const *messages, size_t count, bool compressed = false) {
+        size_t framed = 0;
+        size_t line = 0;
+        for (size_t i = 0; i < count; ++i) {
+            framed += rendition(messages[i], compressed)->wire_size(WireFormat::Framed);
+            line += compressed ? 0 : messages[i]->wire_size(WireFormat::Line);
+        }
+        void *memory = SlabAllocator::instance().allocate(sizeof(MessageBuffer) + framed + line);
+        MessageBuffer *buffer = new (memory) MessageBuffer(static_cast<uint32_t>(framed + line), NULL, FRAME_CHAT, 0);
+        buffer->framed_length_ = static_cast<uint32_t>(framed);
+        char *out = buffer->payload();
+        for (int pass = 0; pass < (compressed ? 1 : 2); ++pass) {
+            WireFormat format = pass == 0 ? WireFormat::Framed : WireFormat::Line;
+            for (size_t i = 0; i < count; ++i) {
+                ByteSpan spans[MAX_MESSAGE_SPANS];
+                int span_count = rendition(messages[i], compressed)->spans(format, 0, spans);
+                for (int j = 0; j < span_count; ++j) {
+                    std::memcpy(out, spans[j].data, spans[j].length);
+                    out += spans[j].length;
+                }
+            }
+        }
+        return buffer;
+    }
+
+    void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+    void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            MessageBuffer *prefix = prefix_;
+            MessageBuffer *compressed = compressed_;
+            MessageBuffer *presence = presence_;
+            size_t allocated = sizeof(MessageBuffer) + length_;
+            this->~MessageBuffer();
+            SlabAllocator::instance().deallocate(this, allocated);
+            if (prefix != nullptr) {
+                prefix->release();
+            }
+            if (compressed != nullptr) {
+                compressed->release();
+            }
+            if (presence != nullptr) {
+                presence->release();
+            }
+        }
+    }
+
+    const char *data() const { return payload(); }
+    // Batches are encoded already; they have no text of their own
+    bool batch() const { return framed_length_ != 0; }
+    size_t size() const { return length_; }
+
+    /**
+     * @brief Text length without framing: prefix plus payload.
+     */
+    size_t text_size() const { return (prefix_ != nullptr ? prefix_->length_ : 0) + length_; }
+
+    /**
+     * @brief Copies the text (prefix plus payload) to @p out, which must hold
+     *        text_size() bytes.
+     */
+    void copy_text(char *out) const {
+        if (prefix_ != nullptr) {
+            std::memcpy(out, prefix_->payload(), prefix_->length_);
+            out += prefix_->length_;
+        }
+        std::memcpy(out, payload(), length_);
+    }
+
+    // The header ends with the type byte and the flags byte
+    uint8_t frame_type() const { return static_cast<uint8_t>(frame_header_[frame_header_length_ - 2]); }
+
+    /**
+     * @brief A compressed rendition for clients that negotiated it; NULL if
+     *        there is none. Set once, before the message is shared.
+     */
+    MessageBuffer *compressed() const { return compressed_; }
+
+    /**
+     * @param compressed Takes over the caller's reference.
+     */
+    void set_compressed(MessageBuffer *compressed) { compressed_ = compressed; }
+
+    /**
+     * @brief The FRAME_PRESENCE rendition of a presence update for clients
+     *        that negotiated it; NULL for everything else. Set once, before
+     *        the message is shared.
+     */
+    MessageBuffer *presence() const { return presence_; }
+
+    /**
+     * @param presence Takes over the caller's reference.
+     */
+    void set_presence(MessageBuffer *presence) { presence_ = presence; }
+
+#ifdef CHAT_TRACE
+    /**
+     * @brief Nonzero if the message is sampled for tracing (see trace.h). Set
+     *        once, before the message is shared; it covers the compressed
+     *        rendition, which must be set already.
+     */
+    uint64_t trace_id() const { return trace_id_; }
+
+    void set_trace_id(uint64_t id) {
+        trace_id_ = id;
+        if (compressed_ != nullptr) {
+            compressed_->trace_id_ = id;
+        }
+    }
+#else
+    uint64_t trace_id() const { return 0; }
+    void set_trace_id(uint64_t) {}
+#endif
+
+    /**
+     * @brief Total bytes on the wire in the given format.
+     */
+    size_t wire_size(WireFormat format) const {
+        if (batch()) {
+            return format == WireFormat::Framed ? framed_length_ : length_ - framed_length_;
+        }
+        return text_size() + (format == WireFormat::Framed ? frame_header_length_ : 1);
+    }
+
+    /**
+     * @brief Describes the wire bytes from @p offset onwards as spans.
+     * @return Number of spans (at most MAX_MESSAGE_SPANS) stored in @p spans.
+     */
+    int spans(WireFormat format, size_t offset, ByteSpan *spans) const {
+        static const char newline = '\n';
+        ByteSpan parts[MAX_MESSAGE_SPANS];
+        int part_count = 0;
+        if (batch()) {
+            parts[part_count++] = format == WireFormat::Framed
+                                      ? ByteSpan{payload(), framed_length_}
+                                      : ByteSpan{payload() + framed_length_, length_ - framed_length_};
+        } else {
+            if (format == WireFormat::Framed) {
+                parts[part_count++] = ByteSpan{frame_header_, frame_header_length_};
+            }
+            if (prefix_ != nullptr) {
+                parts[part_count++] = ByteSpan{prefix_->payload(), prefix_->length_};
+            }
+            parts[part_count++] = ByteSpan{payload(), length_};
+            if (format == WireFormat::Line) {
+                parts[part_count++] = ByteSpan{&newline, 1};
+            }
+        }
+
+        int count = 0;
+        for (int i = 0; i < part_count; ++i) {
+            if (offset >= parts[i].length) {
+                offset -= parts[i].length;
+                continue;
+            }
+            spans[count].data = parts[i].data + offset;
+            spans[count].length = parts[i].length - offset;
+            ++count;
+            offset = 0;
+        }
+        return count;
+    }
+
+private:
+    MessageBuffer(uint32_t length, MessageBuffer *prefix, uint8_t frame_type, uint8_t frame_flags)
+        : refs_(1), length_(length), framed_length_(0), prefix_(prefix), compressed_(nullptr), presence_(nullptr) {
+#ifdef CHAT_TRACE
+        trace_id_ = 0;
+#endif
+        if (prefix_ != nullptr) {
+            prefix_->retain();
+        }
+        frame_header_length_ = static_cast<uint8_t>(
+            encode_frame_header(frame_type, frame_flags, static_cast<uint32_t>(text_size()), frame_header_));
+    }
+
+    ~MessageBuffer() {}
+
+    static const MessageBuffer *rendition(const MessageBuffer *message, bool compressed) {
+        return compressed && message->compressed_ != nullptr ? message->compressed_ : message;
+    }
+
+    MessageBuffer(const MessageBuffer &) = delete;
+    MessageBuffer &operator=(const MessageBuffer &) = delete;
+
+    // The payload bytes follow the header in the same allocation
+    char *payload() { return reinterpret_cast<char *>(this + 1); }
+    const char *payload() const { return reinterpret_cast<const char *>(this + 1); }
+
+    std::atomic<uint32_t> refs_;
+    uint32_t length_;
+    uint32_t framed_length_; // Batches: the framed encoding, followed by the line encoding; 0 otherwise
+    MessageBuffer *prefix_;
+    MessageBuffer *compressed_;
+    MessageBuffer *presence_;
+#ifdef CHAT_TRACE
+    uint64_t trace_id_;
+#endif
+    uint8_t frame_header_length_;
+    char frame_header_[MAX_FRAME_HEADER];
+};
+
+/**
+ * @brief Owning handle to a MessageBuffer; copies share the same buffer.
+ */
+class MessageRef {
+public:
+    MessageRef() : buffer_(nullptr) {}
+
+    // Takes over the reference returned by MessageBuffer::create()
+    explicit MessageRef(MessageBuffer *adopted) : buffer_(adopted) {}
+
+    MessageRef(const MessageRef &other) : buffer_(other.buffer_) {
+        if (buffer_ != nullptr) {
+            buffer_->retain();
+        }
+    }
+
+    MessageRef(MessageRef &&other) : buffer_(other.buffer_) { other.buffer_ = nullptr; }
+
+    ~MessageRef() { reset(); }
+
+    MessageRef &operator=(MessageRef other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap(MessageRef &other) {
+        MessageBuffer *buffer = buffer_;
+        buffer_ = other.buffer_;
+        other.buffer_ = buffer;
+    }
+
+    void reset() {
+        if (buffer_ != nullptr) {
+            buffer_->release();
+            buffer_ = nullptr;
+        }
+    }
+
+    /**
+     * @brief A new handle to a buffer someone else holds a reference to.
+     */
+    static MessageRef share(MessageBuffer *buffer) {
+        buffer->retain();
+        return MessageRef(buffer);
+    }
+
+    MessageBuffer *get() const { return buffer_; }
+    MessageBuffer *operator->() const { return buffer_; }
+    const MessageBuffer &operator*() const { return *buffer_; }
+    explicit operator bool() const { return buffer_ != nullptr; }
+
+private:
+    MessageBuffer *buffer_;
+};
+
+/**
+ * @brief Builds a shared message, optionally sent behind a shared prefix.
+ */
+inline MessageRef make_message(uint8_t frame_type, const char *payload, size_t length,
+                               const MessageRef &prefix = MessageRef()) {
+    return MessageRef(MessageBuffer::create(payload, length, prefix.get(), frame_type));
+}
+
+inline MessageRef make_message(uint8_t frame_type, const std::string &text) {
+    return make_message(frame_type, text.data(), text.size());
+}
+
+#endif // CHAT_MESSAGE_H
@@ -0,0 +1,395 @@
+// -----------------------------------------------------------------------------
+// Server Metrics
+//
+// Every thread that does server work owns a ThreadMetrics block: a set of
+// counters and latency histograms that only that thread writes, with
+// relaxed stores and no read-modify-write. The block is padded by a cache
+// line on both sides so neighbouring per-thread state is never falsely
+// shared. Readers (the metrics endpoint) sum all blocks into a
+// MetricsSnapshot on demand, so the hot path never takes a lock or even an
+// atomic increment, and a scrape only costs relaxed loads.
+//
+// Histograms are HDR-style: values are binned by power of two and each
+// power of two is split into 16 linear sub-buckets, which keeps every
+// recorded value within about 6% of its true value from nanoseconds up to
+// minutes in a fixed, small array.
+//
+// A scrape also reports the process's resident memory and CPU time, read
+// from the operating system at that moment, so load tests can work out
+// memory per connection and CPU per message from two scrapes.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_METRICS_H
+#define CHAT_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#endif
+
+const size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * @brief Monotonic clock reading used for all latency measurements.
+ */
+inline uint64_t monotonic_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+/**
+ * @brief Monotonically increasing event counts.
+ */
+enum class Counter {
+    ConnectionsAccepted,
+    ConnectionsClosed,
+    AcceptErrors,
+    AcceptPauses,     // Times accepting stopped for the rate limit or lack of descriptors
+    MessagesReceived, // Chat messages relayed from clients
+    MessagesSent,     // Messages completely written to a client
+    BytesReceived,
+    BytesSent,
+    SendErrors,
+    QueueDrops,       // Messages discarded by the overflow policy
+    PeerMessagesSent, // Room messages forwarded to cluster peers, once per link
+    PeerMessagesReceived,
+    MessagesCompressed, // Large messages compressed once for all capable recipients
+    IdleTimeouts,       // Clients disconnected for staying silent
+    MessagesThrottled,  // Chat messages dropped by a client or room rate limit
+    BytesThrottled,
+    TlsHandshakes,        // Completed, full or resumed
+    TlsResumptions,       // Handshakes that resumed a session from a ticket
+    TlsHandshakeFailures, // Failed, or abandoned past the handshake timeout
+    KtlsOffloads,         // Connections whose records the kernel encrypts
+    BatchesFannedOut,     // Batches of a batched room's chat, counted once per origin
+    MessagesBatched,      // Chat messages that went out in them
+    PresenceUpdates,      // Coalesced presence changes sent for one room from one reactor
+    PresenceEvents,       // Joins, leaves and typing coalesced into them
+    PresenceSnapshots,    // Member sets sent to joiners that asked for presence
+    Count
+};
+
+struct CounterInfo {
+    const char *name;
+    const char *help;
+};
+
+inline const CounterInfo &counter_info(Counter counter) {
+    static const CounterInfo table[] = {
+        {"chat_connections_accepted_total", "Client connections accepted."},
+        {"chat_connections_closed_total", "Client connections closed."},
+        {"chat_accept_errors_total", "Failed accept calls."},
+        {"chat_accept_pauses_total", "Times accepting paused for the rate limit or lack of descriptors."},
+        {"chat_messages_received_total", "Chat messages received from clients."},
+        {"chat_messages_sent_total", "Messages completely written to clients."},
+        {"chat_bytes_received_total", "Bytes read from client sockets."},
+        {"chat_bytes_sent_total", "Bytes written to client sockets."},
+        {"chat_send_errors_total", "Sends that failed and closed the client."},
+        {"chat_queue_drops_total", "Messages discarded because an outbound queue was full."},
+        {"chat_peer_messages_sent_total", "Room messages forwarded to cluster peers, counted per link."},
+        {"chat_peer_messages_received_total", "Room messages received from cluster peers."},
+        {"chat_messages_compressed_total", "Large messages compressed once for all recipients that negotiated it."},
+        {"chat_idle_timeouts_total", "Clients disconnected because they stayed silent past the idle timeout."},
+        {"chat_messages_throttled_total", "Chat messages dropped because their sender or room exceeded its rate limit."},
+        {"chat_bytes_throttled_total", "Bytes of chat text in messages dropped by rate limits."},
+        {"chat_tls_handshakes_total", "TLS handshakes completed, full or resumed."},
+        {"chat_tls_resumptions_total", "TLS handshakes that resumed a session from a ticket instead of a full key exchange."},
+        {"chat_tls_handshake_failures_total", "TLS handshakes that failed or did not finish in time."},
+        {"chat_ktls_offloads_total", "TLS connections whose records the kernel encrypts (kernel TLS)."},
+        {"chat_batches_fanned_out_total", "Batches of a batched room's chat fanned out as one message per member."},
+        {"chat_messages_batched_total", "Chat messages fanned out as part of a batch."},
+        {"chat_presence_updates_total", "Coalesced presence updates fanned out, one per room and worker and interval."},
+        {"chat_presence_events_total", "Joins, leaves and typing events coalesced into presence updates."},
+        {"chat_presence_snapshots_total", "Room member snapshots sent to clients that negotiated presence."},
+    };
+    return table[static_cast<int>(counter)];
+}
+
+// Only the owning thread writes a counter, so no RMW is needed
+inline void add_relaxed(std::atomic<uint64_t> &counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Log-linear histogram of nanosecond values, written by one thread.
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // Largest power of two tracked (2^40 ns is about 18 minutes)
+    static const int MAX_MAGNITUDE = 40;
+    static const int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    LatencyHistogram() : sum_(0) {
+        for (int i = 0; i < BUCKET_COUNT; ++i) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    void record(uint64_t value) {
+        add_relaxed(buckets_[bucket_index(value)]);
+        add_relaxed(sum_, value);
+    }
+
+    /**
+     * @brief Bucket holding @p value; values past the last bucket land in it.
+     */
+    static int bucket_index(uint64_t value) {
+        if (value < (uint64_t)SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+        int magnitude = 63;
+        while (!(value >> magnitude)) {
+            --magnitude;
+        }
+        int index = (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+                    static_cast<int>((value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+        return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
+    }
+
+    /**
+     * @brief Smallest value that falls into bucket @p index.
+     */
+    static uint64_t bucket_floor(int index) {
+        if (index < SUB_BUCKETS) {
+            return static_cast<uint64_t>(index);
+        }
+        int exponent = index / SUB_BUCKETS;
+        uint64_t sub_bucket = static_cast<uint64_t>(index % SUB_BUCKETS);
+        return (SUB_BUCKETS + sub_bucket) << (exponent - 1);
+    }
+
+    // Safe to read from any thread
+    uint64_t bucket(int index) const { return buckets_[index].load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKET_COUNT];
+    std::atomic<uint64_t> sum_;
+};
+
+/**
+ * @brief One thread's counters and histograms.
+ */
+struct ThreadMetrics {
+    ThreadMetrics() {
+        for (int i = 0; i < static_cast<int>(Counter::Count); ++i) {
+            counters[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    ThreadMetrics(const ThreadMetrics &) = delete;
+    ThreadMetrics &operator=(const ThreadMetrics &) = delete;
+
+    void add(Counter counter, uint64_t amount = 1) { add_relaxed(counters[static_cast<int>(counter)], amount); }
+
+    char leading_pad[CACHE_LINE_SIZE];
+    std::atomic<uint64_t> counters[static_cast<int>(Counter::Count)];
+    LatencyHistogram fanout_latency;     // Receipt of a message until it is queued for its recipients
+    LatencyHistogram broadcast_duration; // Time spent in one broadcast on the sending thread
+    LatencyHistogram tls_handshake_cost; // Time spent in one connection's handshake calls
+    char trailing_pad[CACHE_LINE_SIZE];
+};
+
+/**
+ * @brief Histogram totals over several threads.
+ */
+struct HistogramSnapshot {
+    HistogramSnapshot() : count(0), sum(0) {
+        for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+            buckets[i] = 0;
+        }
+    }
+
+    // Counts come from the buckets themselves so they stay consistent with
+    // them while the owning thread keeps recording
+    void merge(const LatencyHistogram &histogram) {
+        for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+            uint64_t hits = histogram.bucket(i);
+            buckets[i] += hits;
+            count += hits;
+        }
+        sum += histogram.sum();
+    }
+
+    /**
+     * @brief Number of recorded values below 2^magnitude.
+     */
+    uint64_t count_below_power(int magnitude) const {
+        uint64_t total = 0;
+        for (int i = 0; i < LatencyHistogram::BUCKET_COUNT && (LatencyHistogram::bucket_floor(i) >> magnitude) == 0; ++i) {
+            total += buckets[i];
+        }
+        return total;
+    }
+
+    uint64_t buckets[LatencyHistogram::BUCKET_COUNT];
+    uint64_t count;
+    uint64_t sum;
+};
+
+/**
+ * @brief Resident memory and CPU time (user plus system) of this process.
+ */
+struct ProcessUsage {
+    ProcessUsage() : resident_bytes(0), cpu_seconds(0) {}
+
+    uint64_t resident_bytes;
+    double cpu_seconds;
+};
+
+/**
+ * @brief Reads the process's current usage; fields the platform cannot
+ *        report stay 0.
+ */
+inline ProcessUsage read_process_usage() {
+    ProcessUsage usage;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS memory;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+        usage.resident_bytes = memory.WorkingSetSize;
+    }
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        // 100 ns units
+        uint64_t ticks = ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+                         ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+        usage.cpu_seconds = ticks / 1e7;
+    }
+#else
+    struct rusage times;
+    if (getrusage(RUSAGE_SELF, &times) == 0) {
+        usage.cpu_seconds = times.ru_utime.tv_sec + times.ru_stime.tv_sec +
+                            (times.ru_utime.tv_usec + times.ru_stime.tv_usec) / 1e6;
+    }
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) == KERN_SUCCESS) {
+        usage.resident_bytes = info.resident_size;
+    }
+#else
+    // Linux: the second field of statm is the resident set, in pages
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        unsigned long long size = 0, resident = 0;
+        if (std::fscanf(statm, "%llu %llu", &size, &resident) == 2) {
+            usage.resident_bytes = resident * (uint64_t)sysconf(_SC_PAGESIZE);
+        }
+        std::fclose(statm);
+    }
+#endif
+#endif
+    return usage;
+}
+
+/**
+ * @brief Everything the endpoint reports, summed over all threads.
+ */
+struct MetricsSnapshot {
+    MetricsSnapshot() {
+        for (int i = 0; i < static_cast<int>(Counter::Count); ++i) {
+            counters[i] = 0;
+        }
+    }
+
+    void merge(const ThreadMetrics &metrics) {
+        for (int i = 0; i < static_cast<int>(Counter::Count); ++i) {
+            counters[i] += metrics.counters[i].load(std::memory_order_relaxed);
+        }
+        fanout_latency.merge(metrics.fanout_latency);
+        broadcast_duration.merge(metrics.broadcast_duration);
+        tls_handshake_cost.merge(metrics.tls_handshake_cost);
+    }
+
+    uint64_t get(Counter counter) const { return counters[static_cast<int>(counter)]; }
+
+    uint64_t counters[static_cast<int>(Counter::Count)];
+    ProcessUsage process; // Filled in by whoever takes the snapshot
+    HistogramSnapshot fanout_latency;
+    HistogramSnapshot broadcast_duration;
+    HistogramSnapshot tls_handshake_cost;
+};
+
+// Bucket bounds reported to Prometheus: powers of two from ~1 us to ~8.6 s
+const int PROMETHEUS_MIN_MAGNITUDE = 10;
+const int PROMETHEUS_MAX_MAGNITUDE = 33;
+
+/**
+ * @brief Appends one histogram, in seconds, in the Prometheus text format.
+ */
+inline void append_prometheus_histogram(std::string &out, const char *name, const char *help,
+                                        const HistogramSnapshot &histogram) {
+    char line[160];
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " histogram\n";
+    for (int magnitude = PROMETHEUS_MIN_MAGNITUDE; magnitude <= PROMETHEUS_MAX_MAGNITUDE; ++magnitude) {
+        std::snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)((uint64_t)1 << magnitude) / 1e9,
+                      (unsigned long long)histogram.count_below_power(magnitude));
+        out += line;
+    }
+    std::snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+                  (unsigned long long)histogram.count, name, (double)histogram.sum / 1e9, name,
+                  (unsigned long long)histogram.count);
+    out += line;
+}
+
+/**
+ * @brief Renders a snapshot in the Prometheus text exposition format.
+ */
+inline std::string format_prometheus(const MetricsSnapshot &snapshot) {
+    std::string out;
+    for (int i = 0; i < static_cast<int>(Counter::Count); ++i) {
+        const CounterInfo &info = counter_info(static_cast<Counter>(i));
+        std::string name = info.name;
+        out += "# HELP " + name + " " + info.help + "\n# TYPE " + name + " counter\n" + name + " " +
+               std::to_string(snapshot.counters[i]) + "\n";
+    }
+
+    uint64_t accepted = snapshot.get(Counter::ConnectionsAccepted);
+    uint64_t closed = snapshot.get(Counter::ConnectionsClosed);
+    out += "# HELP chat_connections_active Client connections currently open.\n"
+           "# TYPE chat_connections_active gauge\nchat_connections_active " +
+           std::to_string(accepted > closed ? accepted - closed : 0) + "\n";
+
+    char cpu_seconds[32];
+    std::snprintf(cpu_seconds, sizeof(cpu_seconds), "%.6f", snapshot.process.cpu_seconds);
+    out += "# HELP process_resident_memory_bytes Resident memory size in bytes.\n"
+           "# TYPE process_resident_memory_bytes gauge\nprocess_resident_memory_bytes " +
+           std::to_string(snapshot.process.resident_bytes) +
+           "\n# HELP process_cpu_seconds_total Total user and system CPU time spent in seconds.\n"
+           "# TYPE process_cpu_seconds_total counter\nprocess_cpu_seconds_total " + cpu_seconds + "\n";
+
+    append_prometheus_histogram(out, "chat_fanout_latency_seconds",
+                                "Time from reading a chat message to queueing it for its recipients, per reactor.",
+                                snapshot.fanout_latency);
+    append_prometheus_histogram(out, "chat_broadcast_duration_seconds",
+                                "Time the sending reactor spends fanning out one broadcast.",
+                                snapshot.broadcast_duration);
+    append_prometheus_histogram(out, "chat_tls_handshake_cost_seconds",
+                                "Reactor time spent in one connection's TLS handshake, not counting network waits.",
+                                snapshot.tls_handshake_cost);
+    return out;
+}
+
+#endif // CHAT_METRICS_H
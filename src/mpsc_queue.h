@@ -0,0 +1,74 @@
+// -----------------------------------------------------------------------------
+// Lock-Free Multi-Producer / Single-Consumer Queue
+//
+// An unbounded intrusive linked queue (Vyukov style). Any number of threads
+// may push() concurrently without locks; exactly one thread may pop().
+// Used for the reactors' inbound message queues. Nodes come from the slab
+// allocator, so pushing does not touch the heap in steady state.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_MPSC_QUEUE_H
+#define CHAT_MPSC_QUEUE_H
+
+#include <atomic>
+#include <utility>
+#include "slab_allocator.h"
+
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head_(new Node()), tail_(head_.load(std::memory_order_relaxed)) {}
+
+    ~MpscQueue() {
+        T discarded;
+        while (pop(discarded)) {
+        }
+        delete tail_;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    /**
+     * @brief Appends a value. Safe to call from any thread.
+     */
+    void push(T value) {
+        Node *node = new Node();
+        node->value = std::move(value);
+        Node *previous = head_.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * @brief Removes the oldest value. Only the consumer thread may call this.
+     * @return True if a value was stored in @p out, false if the queue was empty.
+     */
+    bool pop(T &out) {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        // The popped node becomes the new sentinel
+        out = std::move(next->value);
+        tail_ = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node {
+        Node() : next(nullptr) {}
+
+        static void *operator new(size_t size) { return SlabAllocator::instance().allocate(size); }
+        static void operator delete(void *node, size_t size) { SlabAllocator::instance().deallocate(node, size); }
+
+        std::atomic<Node *> next;
+        T value;
+    };
+
+    std::atomic<Node *> head_; // Most recently pushed node (producers)
+    Node *tail_;               // Sentinel before the oldest value (consumer)
+};
+
+#endif // CHAT_MPSC_QUEUE_H
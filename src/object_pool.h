@@ -0,0 +1,106 @@
+// -----------------------------------------------------------------------------
+// Object Pool
+//
+// Fixed-size slots for objects of one type, carved from chunks that are
+// never returned to the heap. Freed slots are reused first, so once a
+// reactor has seen its peak number of clients, accepting and closing
+// connections no longer allocates their state. reserve() gets there at
+// startup instead, with the memory already faulted in. Not thread-safe: each reactor
+// owns its pool, and only the hit/miss counters may be read elsewhere.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_OBJECT_POOL_H
+#define CHAT_OBJECT_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class ObjectPool {
+public:
+    explicit ObjectPool(size_t chunk_slots = 64)
+        : chunk_slots_(chunk_slots < 1 ? 1 : chunk_slots), free_(nullptr), hits_(0), misses_(0) {}
+
+    // Objects still alive are not destroyed; their owner must destroy() them
+    ~ObjectPool() {
+        for (Slot *chunk : chunks_) {
+            ::operator delete(chunk);
+        }
+    }
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    /**
+     * @brief Constructs an object in a free slot, adding a chunk if none is free.
+     */
+    template <typename... Args>
+    T *create(Args &&... args) {
+        if (free_ == nullptr) {
+            add_chunk();
+            bump(misses_);
+        } else {
+            bump(hits_);
+        }
+        Slot *slot = free_;
+        free_ = slot->next;
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief Adds free slots for at least @p objects more objects, touching
+     *        every page so that no later create() takes a page fault.
+     */
+    void reserve(size_t objects) {
+        for (size_t added = 0; added < objects; added += chunk_slots_) {
+            add_chunk(true);
+        }
+    }
+
+    void destroy(T *object) {
+        object->~T();
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        slot->next = free_;
+        free_ = slot;
+    }
+
+    // Safe to read from any thread
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    union Slot {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void add_chunk(bool prefault = false) {
+        Slot *chunk = static_cast<Slot *>(::operator new(sizeof(Slot) * chunk_slots_));
+        if (prefault) {
+            std::memset(static_cast<void *>(chunk), 0, sizeof(Slot) * chunk_slots_);
+        }
+        chunks_.push_back(chunk);
+        for (size_t i = chunk_slots_; i-- > 0;) {
+            chunk[i].next = free_;
+            free_ = &chunk[i];
+        }
+    }
+
+    // Only the owning thread writes the counters
+    static void bump(std::atomic<uint64_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    size_t chunk_slots_;
+    std::vector<Slot *> chunks_;
+    Slot *free_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+#endif // CHAT_OBJECT_POOL_H
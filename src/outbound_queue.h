@@ -0,0 +1,202 @@
+// -----------------------------------------------------------------------------
+// Outbound Queue
+//
+// A bounded ring of shared, immutable messages (see message.h) waiting to be
+// written to one client. Broadcasts enqueue the same buffer for every
+// recipient, so queueing costs a reference count rather than a copy. The message currently
+// being written is held outside the ring, which lets the oldest *unsent*
+// message be dropped without corrupting the byte stream. The ring starts
+// small and grows up to its limit only for clients that fall behind.
+//
+// gather() describes many queued messages at once, so everything queued
+// for a client can be written with a single gather send.
+//
+// In trace builds the queue also notes when each traced message (see
+// trace.h) was queued, and hands the writes it completes to the tracer.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_OUTBOUND_QUEUE_H
+#define CHAT_OUTBOUND_QUEUE_H
+
+#include <cstddef>
+#include <vector>
+#include "message.h"
+#include "trace.h"
+#ifdef CHAT_TRACE
+#include "metrics.h"
+#endif
+
+/**
+ * @brief What to do when a client's outbound queue is full.
+ */
+enum class OverflowPolicy {
+    DropOldest, // Discard the oldest message that has not started sending
+    DropNew,    // Discard the message being enqueued
+    Disconnect  // Close the slow client
+};
+
+class OutboundQueue {
+public:
+    explicit OutboundQueue(size_t capacity)
+        : limit_(capacity < 1 ? 1 : capacity), format_(WireFormat::Line), head_(0), count_(0),
+          in_flight_offset_(0) {
+#ifdef CHAT_TRACE
+        in_flight_queued_ns_ = 0;
+#endif
+    }
+
+    /**
+     * @brief Sets how messages are encoded; fixed before anything is written.
+     */
+    void set_format(WireFormat format) { format_ = format; }
+    WireFormat format() const { return format_; }
+
+    /**
+     * @brief Number of messages waiting, including one partially written.
+     */
+    size_t depth() const { return count_ + (in_flight_ ? 1 : 0); }
+    size_t capacity() const { return limit_; }
+    bool empty() const { return depth() == 0; }
+    bool full() const { return count_ == limit_; }
+
+    /**
+     * @brief Appends a message; the queue must not be full.
+     * @param already_written Bytes of @p message the caller already sent.
+     *        Only allowed while the queue is empty.
+     */
+    void push(const MessageRef &message, size_t already_written = 0) {
+        if (already_written > 0) {
+            in_flight_ = message;
+            in_flight_offset_ = already_written;
+#ifdef CHAT_TRACE
+            in_flight_queued_ns_ = message->trace_id() != 0 ? monotonic_ns() : 0;
+#endif
+            return;
+        }
+        if (count_ == ring_.size()) {
+            grow();
+        }
+        ring_[(head_ + count_) % ring_.size()] = message;
+#ifdef CHAT_TRACE
+        queued_ns_[(head_ + count_) % ring_.size()] = message->trace_id() != 0 ? monotonic_ns() : 0;
+#endif
+        ++count_;
+    }
+
+    /**
+     * @brief Discards the oldest message that has not started sending.
+     * @return True if a message was discarded.
+     */
+    bool drop_oldest() {
+        if (count_ == 0) {
+            return false;
+        }
+        ring_[head_].reset();
+        head_ = (head_ + 1) % ring_.size();
+        --count_;
+        return true;
+    }
+
+    /**
+     * @brief Describes queued bytes, oldest first, as up to @p max_spans spans.
+     * @return Number of spans stored in @p spans, 0 if nothing is queued.
+     */
+    int gather(ByteSpan *spans, int max_spans) const {
+        int count = 0;
+        if (in_flight_) {
+            count = in_flight_->spans(format_, in_flight_offset_, spans);
+        }
+        for (size_t i = 0; i < count_ && count + MAX_MESSAGE_SPANS <= max_spans; ++i) {
+            count += ring_[(head_ + i) % ring_.size()]->spans(format_, 0, spans + count);
+        }
+        return count;
+    }
+
+    /**
+     * @brief Marks bytes described by gather() as written.
+     * @return Number of messages that are now completely written.
+     */
+    size_t consume(size_t bytes) {
+        size_t completed = 0;
+        while (bytes > 0) {
+            if (!in_flight_) {
+                in_flight_.swap(ring_[head_]);
+                in_flight_offset_ = 0;
+#ifdef CHAT_TRACE
+                in_flight_queued_ns_ = queued_ns_[head_];
+#endif
+                head_ = (head_ + 1) % ring_.size();
+                --count_;
+            }
+            size_t remaining = in_flight_->wire_size(format_) - in_flight_offset_;
+            if (bytes < remaining) {
+                in_flight_offset_ += bytes;
+                return completed;
+            }
+            bytes -= remaining;
+#ifdef CHAT_TRACE
+            if (in_flight_->trace_id() != 0) {
+                traced_writes_.push_back(TracedWrite{in_flight_->trace_id(), in_flight_queued_ns_});
+            }
+#endif
+            in_flight_.reset();
+            in_flight_offset_ = 0;
+            ++completed;
+        }
+        return completed;
+    }
+
+    /**
+     * @brief Takes the next traced message consume() completed, if any;
+     *        never finds one outside trace builds.
+     */
+    bool take_traced_write(TracedWrite &write) {
+#ifdef CHAT_TRACE
+        if (!traced_writes_.empty()) {
+            write = traced_writes_.back();
+            traced_writes_.pop_back();
+            return true;
+        }
+#else
+        (void)write;
+#endif
+        return false;
+    }
+
+private:
+    static const size_t INITIAL_SLOTS = 4;
+
+    void grow() {
+        size_t slots = ring_.empty() ? INITIAL_SLOTS : ring_.size() * 2;
+        std::vector<MessageRef> grown(slots < limit_ ? slots : limit_);
+#ifdef CHAT_TRACE
+        std::vector<uint64_t> queued_ns(grown.size());
+#endif
+        for (size_t i = 0; i < count_; ++i) {
+            grown[i].swap(ring_[(head_ + i) % ring_.size()]);
+#ifdef CHAT_TRACE
+            queued_ns[i] = queued_ns_[(head_ + i) % ring_.size()];
+#endif
+        }
+        ring_.swap(grown);
+#ifdef CHAT_TRACE
+        queued_ns_.swap(queued_ns);
+#endif
+        head_ = 0;
+    }
+
+    size_t limit_;
+    WireFormat format_;
+    std::vector<MessageRef> ring_;
+    size_t head_;
+    size_t count_;
+    MessageRef in_flight_;
+    size_t in_flight_offset_;
+#ifdef CHAT_TRACE
+    std::vector<uint64_t> queued_ns_;       // When ring_'s traced messages were queued; 0 for the rest
+    uint64_t in_flight_queued_ns_;
+    std::vector<TracedWrite> traced_writes_; // Completed by consume(), not yet taken
+#endif
+};
+
+#endif // CHAT_OUTBOUND_QUEUE_H
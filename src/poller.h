@@ -0,0 +1,456 @@
+// -----------------------------------------------------------------------------
+// Portable Socket Poller
+//
+// A small readiness-style event notification layer used by the server's
+// event loop. One Poller multiplexes any number of sockets on a single
+// thread:
+//
+//   - Windows: I/O completion ports. Read readiness is signalled by a
+//     zero-byte overlapped WSARecv that completes when data arrives; write
+//     readiness (only needed while a socket's send buffer is full) is probed
+//     with WSAPoll.
+//   - Linux:   epoll (level-triggered), woken through an eventfd.
+//   - macOS / BSD: kqueue, woken through an EVFILT_USER event.
+//
+// All methods except wake() must be called from the thread that runs wait().
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_POLLER_H
+#define CHAT_POLLER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include <unordered_map>
+typedef SOCKET poll_handle_t;
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+typedef int poll_handle_t;
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <unistd.h>
+typedef int poll_handle_t;
+#else
+#error "No poller backend for this platform"
+#endif
+
+// Interest / readiness flags
+const uint32_t POLL_READ = 1u << 0;
+const uint32_t POLL_WRITE = 1u << 1;
+const uint32_t POLL_ERROR = 1u << 2;
+
+/**
+ * @brief A single readiness notification returned by Poller::wait().
+ */
+struct PollEvent {
+    void *user_data;  // Pointer registered with add()/modify()
+    uint32_t events;  // Combination of POLL_READ, POLL_WRITE and POLL_ERROR
+};
+
+// Maximum number of notifications collected by one wait() call
+const int POLLER_BATCH_SIZE = 256;
+
+#ifdef _WIN32
+
+/**
+ * @brief IOCP-backed poller (Windows).
+ */
+class Poller {
+public:
+    Poller() : port_(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1)) {}
+
+    ~Poller() {
+        for (auto &entry : registrations_) {
+            delete entry.second;
+        }
+        if (port_ != NULL) {
+            CloseHandle(port_);
+        }
+    }
+
+    Poller(const Poller &) = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    bool valid() const { return port_ != NULL; }
+
+    /**
+     * @brief Starts watching a socket for the given interest set.
+     * @return True on success, false otherwise.
+     */
+    bool add(poll_handle_t socket, uint32_t interest, void *user_data) {
+        if (CreateIoCompletionPort(reinterpret_cast<HANDLE>(socket), port_, 0, 0) == NULL) {
+            return false;
+        }
+        Registration *reg = new Registration();
+        reg->socket = socket;
+        reg->user_data = user_data;
+        reg->interest = 0;
+        reg->read_pending = false;
+        reg->removed = false;
+        registrations_[socket] = reg;
+        return modify(socket, interest, user_data);
+    }
+
+    /**
+     * @brief Replaces the interest set and user data of a watched socket.
+     * @return True on success, false otherwise.
+     */
+    bool modify(poll_handle_t socket, uint32_t interest, void *user_data) {
+        auto it = registrations_.find(socket);
+        if (it == registrations_.end()) {
+            return false;
+        }
+        Registration *reg = it->second;
+        reg->user_data = user_data;
+
+        bool was_writer = (reg->interest & POLL_WRITE) != 0;
+        reg->interest = interest;
+        if ((interest & POLL_WRITE) && !was_writer) {
+            writers_.push_back(reg);
+        } else if (!(interest & POLL_WRITE) && was_writer) {
+            writers_.erase(std::remove(writers_.begin(), writers_.end(), reg), writers_.end());
+        }
+        return arm_read(reg);
+    }
+
+    /**
+     * @brief Stops watching a socket. Call before closing it.
+     */
+    void remove(poll_handle_t socket) {
+        auto it = registrations_.find(socket);
+        if (it == registrations_.end()) {
+            return;
+        }
+        Registration *reg = it->second;
+        registrations_.erase(it);
+        writers_.erase(std::remove(writers_.begin(), writers_.end(), reg), writers_.end());
+        reg->removed = true;
+
+        // A pending zero-byte receive still references the registration, so
+        // it is freed when the cancelled operation completes.
+        if (reg->read_pending) {
+            CancelIoEx(reinterpret_cast<HANDLE>(socket), &reg->read_overlapped);
+        } else {
+            retired_.push_back(reg);
+        }
+    }
+
+    /**
+     * @brief Waits for readiness notifications.
+     * @param timeout_ms Maximum time to block, or -1 to wait indefinitely.
+     * @return Number of events stored in @p events, or -1 on error.
+     */
+    int wait(std::vector<PollEvent> &events, int timeout_ms) {
+        events.clear();
+
+        // Re-arm sockets whose readiness was reported by the previous call,
+        // now that the caller has drained them.
+        for (Registration *reg : rearm_) {
+            if (!reg->removed && !arm_read(reg)) {
+                events.push_back(PollEvent{reg->user_data, POLL_ERROR});
+            }
+        }
+        rearm_.clear();
+        for (Registration *reg : retired_) {
+            delete reg;
+        }
+        retired_.clear();
+
+        probe_writers(events);
+
+        DWORD timeout = timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms);
+        if (!events.empty()) {
+            timeout = 0;
+        } else if (!writers_.empty() && (timeout_ms < 0 || static_cast<DWORD>(timeout_ms) > WRITE_PROBE_INTERVAL_MS)) {
+            timeout = WRITE_PROBE_INTERVAL_MS;
+        }
+
+        OVERLAPPED_ENTRY entries[POLLER_BATCH_SIZE];
+        ULONG count = 0;
+        if (!GetQueuedCompletionStatusEx(port_, entries, POLLER_BATCH_SIZE, &count, timeout, FALSE)) {
+            if (GetLastError() != WAIT_TIMEOUT) {
+                return events.empty() ? -1 : static_cast<int>(events.size());
+            }
+            count = 0;
+        }
+
+        for (ULONG i = 0; i < count; ++i) {
+            if (entries[i].lpOverlapped == NULL) {
+                continue; // wake()
+            }
+            Registration *reg = CONTAINING_RECORD(entries[i].lpOverlapped, Registration, read_overlapped);
+            reg->read_pending = false;
+            if (reg->removed) {
+                delete reg;
+                continue;
+            }
+            uint32_t ready = POLL_READ;
+            if (entries[i].lpOverlapped->Internal != 0) {
+                ready |= POLL_ERROR;
+            }
+            events.push_back(PollEvent{reg->user_data, ready});
+            rearm_.push_back(reg);
+        }
+        return static_cast<int>(events.size());
+    }
+
+    /**
+     * @brief Interrupts a blocked wait() from any thread.
+     */
+    void wake() {
+        PostQueuedCompletionStatus(port_, 0, 0, NULL);
+    }
+
+private:
+    struct Registration {
+        OVERLAPPED read_overlapped;
+        SOCKET socket;
+        void *user_data;
+        uint32_t interest;
+        bool read_pending;
+        bool removed;
+    };
+
+    // How often sockets waiting for send buffer space are re-probed
+    static const DWORD WRITE_PROBE_INTERVAL_MS = 5;
+
+    bool arm_read(Registration *reg) {
+        if (reg->read_pending || !(reg->interest & POLL_READ)) {
+            return true;
+        }
+        WSABUF buf;
+        buf.buf = NULL;
+        buf.len = 0;
+        DWORD flags = 0;
+        ZeroMemory(&reg->read_overlapped, sizeof(reg->read_overlapped));
+        if (WSARecv(reg->socket, &buf, 1, NULL, &flags, &reg->read_overlapped, NULL) == SOCKET_ERROR &&
+            WSAGetLastError() != WSA_IO_PENDING) {
+            return false;
+        }
+        reg->read_pending = true;
+        return true;
+    }
+
+    void probe_writers(std::vector<PollEvent> &events) {
+        if (writers_.empty()) {
+            return;
+        }
+        probe_fds_.resize(writers_.size());
+        for (size_t i = 0; i < writers_.size(); ++i) {
+            probe_fds_[i].fd = writers_[i]->socket;
+            probe_fds_[i].events = POLLWRNORM;
+            probe_fds_[i].revents = 0;
+        }
+        if (WSAPoll(probe_fds_.data(), static_cast<ULONG>(probe_fds_.size()), 0) <= 0) {
+            return;
+        }
+        for (size_t i = 0; i < probe_fds_.size(); ++i) {
+            short revents = probe_fds_[i].revents;
+            if (revents == 0) {
+                continue;
+            }
+            uint32_t ready = POLL_WRITE;
+            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                ready |= POLL_ERROR;
+            }
+            events.push_back(PollEvent{writers_[i]->user_data, ready});
+        }
+    }
+
+    HANDLE port_;
+    std::unordered_map<SOCKET, Registration *> registrations_;
+    std::vector<Registration *> writers_;
+    std::vector<Registration *> rearm_;
+    std::vector<Registration *> retired_;
+    std::vector<WSAPOLLFD> probe_fds_;
+};
+
+#elif defined(__linux__)
+
+/**
+ * @brief epoll-backed poller (Linux).
+ */
+class Poller {
+public:
+    Poller() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (epoll_fd_ >= 0 && wake_fd_ >= 0) {
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &wake_fd_;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+        }
+    }
+
+    ~Poller() {
+        if (wake_fd_ >= 0) {
+            close(wake_fd_);
+        }
+        if (epoll_fd_ >= 0) {
+            close(epoll_fd_);
+        }
+    }
+
+    Poller(const Poller &) = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    bool valid() const { return epoll_fd_ >= 0 && wake_fd_ >= 0; }
+
+    bool add(poll_handle_t socket, uint32_t interest, void *user_data) {
+        return control(EPOLL_CTL_ADD, socket, interest, user_data);
+    }
+
+    bool modify(poll_handle_t socket, uint32_t interest, void *user_data) {
+        return control(EPOLL_CTL_MOD, socket, interest, user_data);
+    }
+
+    void remove(poll_handle_t socket) {
+        epoll_event ev = epoll_event();
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket, &ev);
+    }
+
+    int wait(std::vector<PollEvent> &events, int timeout_ms) {
+        events.clear();
+        epoll_event ready[POLLER_BATCH_SIZE];
+        int count = epoll_wait(epoll_fd_, ready, POLLER_BATCH_SIZE, timeout_ms);
+        if (count < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (ready[i].data.ptr == &wake_fd_) {
+                uint64_t value;
+                ssize_t ignored = read(wake_fd_, &value, sizeof(value));
+                (void)ignored;
+                continue;
+            }
+            uint32_t flags = 0;
+            if (ready[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                flags |= POLL_READ;
+            }
+            if (ready[i].events & EPOLLOUT) {
+                flags |= POLL_WRITE;
+            }
+            if (ready[i].events & (EPOLLERR | EPOLLHUP)) {
+                flags |= POLL_ERROR;
+            }
+            events.push_back(PollEvent{ready[i].data.ptr, flags});
+        }
+        return static_cast<int>(events.size());
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd_, &one, sizeof(one));
+        (void)ignored;
+    }
+
+private:
+    bool control(int op, poll_handle_t socket, uint32_t interest, void *user_data) {
+        epoll_event ev;
+        ev.events = 0;
+        if (interest & POLL_READ) {
+            ev.events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (interest & POLL_WRITE) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.ptr = user_data;
+        return epoll_ctl(epoll_fd_, op, socket, &ev) == 0;
+    }
+
+    int epoll_fd_;
+    int wake_fd_;
+};
+
+#else
+
+/**
+ * @brief kqueue-backed poller (macOS / BSD).
+ */
+class Poller {
+public:
+    Poller() : kqueue_fd_(kqueue()) {
+        if (kqueue_fd_ >= 0) {
+            struct kevent change;
+            EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+            kevent(kqueue_fd_, &change, 1, NULL, 0, NULL);
+        }
+    }
+
+    ~Poller() {
+        if (kqueue_fd_ >= 0) {
+            close(kqueue_fd_);
+        }
+    }
+
+    Poller(const Poller &) = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    bool valid() const { return kqueue_fd_ >= 0; }
+
+    bool add(poll_handle_t socket, uint32_t interest, void *user_data) {
+        return modify(socket, interest, user_data);
+    }
+
+    bool modify(poll_handle_t socket, uint32_t interest, void *user_data) {
+        // EV_ADD on an existing filter updates it in place, so both filters
+        // are always registered and merely enabled or disabled.
+        struct kevent changes[2];
+        EV_SET(&changes[0], socket, EVFILT_READ, EV_ADD | ((interest & POLL_READ) ? EV_ENABLE : EV_DISABLE),
+               0, 0, user_data);
+        EV_SET(&changes[1], socket, EVFILT_WRITE, EV_ADD | ((interest & POLL_WRITE) ? EV_ENABLE : EV_DISABLE),
+               0, 0, user_data);
+        return kevent(kqueue_fd_, changes, 2, NULL, 0, NULL) == 0;
+    }
+
+    void remove(poll_handle_t socket) {
+        struct kevent changes[2];
+        EV_SET(&changes[0], socket, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&changes[1], socket, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(kqueue_fd_, changes, 2, NULL, 0, NULL);
+    }
+
+    int wait(std::vector<PollEvent> &events, int timeout_ms) {
+        events.clear();
+        struct kevent ready[POLLER_BATCH_SIZE];
+        struct timespec timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        int count = kevent(kqueue_fd_, NULL, 0, ready, POLLER_BATCH_SIZE, timeout_ms < 0 ? NULL : &timeout);
+        if (count < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (ready[i].filter == EVFILT_USER) {
+                continue; // wake()
+            }
+            uint32_t flags = ready[i].filter == EVFILT_READ ? POLL_READ : POLL_WRITE;
+            if ((ready[i].flags & EV_ERROR) || (ready[i].filter == EVFILT_WRITE && (ready[i].flags & EV_EOF))) {
+                flags |= POLL_ERROR;
+            }
+            events.push_back(PollEvent{ready[i].udata, flags});
+        }
+        return static_cast<int>(events.size());
+    }
+
+    void wake() {
+        struct kevent change;
+        EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+        kevent(kqueue_fd_, &change, 1, NULL, 0, NULL);
+    }
+
+private:
+    int kqueue_fd_;
+};
+
+#endif
+
+#endif // CHAT_POLLER_H
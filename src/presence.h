@@ -0,0 +1,377 @@
+// -----------------------------------------------------------------------------
+// Room Presence
+//
+// Who is in a room, and who is typing there, travels as compact, coalesced
+// updates rather than one notice per event per member. Each reactor
+// collects the joins, leaves and typing of its own clients in a
+// PresenceDelta per room: a join and a leave of the same client within one
+// interval cancel out, and typing is reported once per interval however
+// often it is sent. Once per presence interval the reactor folds its deltas
+// into the rooms' versioned member sets (RoomPresence) and fans each out as
+// one update.
+//
+// Clients that negotiate CAPABILITY_PRESENCE get updates as FRAME_PRESENCE
+// frames, and a snapshot of the member set whenever they join a room:
+//
+//   +------+-----------+------+---------+-------------------------------+
+//   | kind | name size | room | version | lists: count, then session ids |
+//   | 1 B  |    1 B    |      | varint  | as ascending deltas (varints) |
+//   +------+-----------+------+---------+-------------------------------+
+//
+// A snapshot carries one list (the members); a delta carries three
+// (joined, left, typing). Every varint is LEB128 of up to 64 bits. Lists too
+// long for one frame continue in further frames of the same version; a
+// snapshot's continuations have kind PRESENCE_SNAPSHOT_MORE.
+//
+// Deltas from different reactors may arrive in any order, but they concern
+// different clients, so they commute: a client applies every delta whose
+// version is above its snapshot's and ignores the rest, which the snapshot
+// already includes. Versions start from the wall clock when a room is
+// created, so they keep growing across a hot restart.
+//
+// Everyone else keeps getting text notices, coalesced the same way.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_PRESENCE_H
+#define CHAT_PRESENCE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "frame.h"
+#include "message.h"
+
+// FRAME_PRESENCE kinds
+const uint8_t PRESENCE_SNAPSHOT = 0;      // The room's members; replaces what the client knew
+const uint8_t PRESENCE_SNAPSHOT_MORE = 1; // More members of the snapshot before it
+const uint8_t PRESENCE_DELTA = 2;         // Who joined, left and is typing since the last one
+
+// Session ids per FRAME_PRESENCE frame; at most ten bytes each, well within
+// MAX_FRAME_PAYLOAD
+const size_t PRESENCE_IDS_PER_FRAME = 4096;
+// Names a coalesced text notice lists before it only counts the rest
+const size_t MAX_NOTICE_NAMES = 20;
+
+/**
+ * @brief What happened to a client in a room.
+ */
+enum class PresenceChange {
+    Joined,
+    Left, // Left the room
+    Quit, // Disconnected
+    Typing
+};
+
+inline void presence_put_varint(std::string &out, uint64_t value) {
+    do {
+        uint8_t byte = static_cast<uint8_t>(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            byte |= 0x80;
+        }
+        out.push_back(static_cast<char>(byte));
+    } while (value != 0);
+}
+
+/**
+ * @return Bytes consumed, or 0 if the varint is truncated or too long.
+ */
+inline size_t presence_get_varint(const char *data, size_t size, uint64_t &value) {
+    value = 0;
+    for (size_t position = 0; position < size && position < 10; ++position) {
+        uint8_t byte = static_cast<uint8_t>(data[position]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << (7 * position);
+        if (!(byte & 0x80)) {
+            return position + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Encodes ascending session id lists as FRAME_PRESENCE frames,
+ *        splitting them across as many frames as they need.
+ * @param lists One list for a snapshot, joined / left / typing for a delta.
+ */
+inline void encode_presence(uint8_t kind, const std::string &room, uint64_t version,
+                            const std::vector<uint64_t> *lists, size_t list_count, std::vector<MessageRef> &frames) {
+    std::vector<size_t> next(list_count, 0);
+    bool more = true;
+    for (bool first = true; more; first = false) {
+        std::string payload;
+        payload.push_back(static_cast<char>(kind == PRESENCE_SNAPSHOT && !first ? PRESENCE_SNAPSHOT_MORE : kind));
+        payload.push_back(static_cast<char>(room.size()));
+        payload += room;
+        presence_put_varint(payload, version);
+        size_t budget = PRESENCE_IDS_PER_FRAME;
+        more = false;
+        for (size_t i = 0; i < list_count; ++i) {
+            const std::vector<uint64_t> &list = lists[i];
+            size_t count = std::min(budget, list.size() - next[i]);
+            presence_put_varint(payload, count);
+            uint64_t previous = 0;
+            for (size_t j = next[i]; j < next[i] + count; ++j) {
+                presence_put_varint(payload, list[j] - previous);
+                previous = list[j];
+            }
+            next[i] += count;
+            budget -= count;
+            more = more || next[i] < list.size();
+        }
+        frames.push_back(make_message(FRAME_PRESENCE, payload));
+    }
+}
+
+/**
+ * @brief A decoded FRAME_PRESENCE frame.
+ */
+struct PresenceUpdate {
+    uint8_t kind;
+    std::string room;
+    uint64_t version;
+    std::vector<uint64_t> joined; // Snapshots: the members
+    std::vector<uint64_t> left;
+    std::vector<uint64_t> typing;
+};
+
+/**
+ * @return False if @p payload is not a well-formed FRAME_PRESENCE payload.
+ */
+inline bool decode_presence(const char *payload, size_t length, PresenceUpdate &update) {
+    if (length < 2) {
+        return false;
+    }
+    size_t offset = 2 + static_cast<size_t>(static_cast<uint8_t>(payload[1]));
+    update.kind = static_cast<uint8_t>(payload[0]);
+    if (length < offset || update.kind > PRESENCE_DELTA) {
+        return false;
+    }
+    update.room.assign(payload + 2, offset - 2);
+    size_t used = presence_get_varint(payload + offset, length - offset, update.version);
+    if (used == 0) {
+        return false;
+    }
+    offset += used;
+    std::vector<uint64_t> *lists[] = {&update.joined, &update.left, &update.typing};
+    size_t list_count = update.kind == PRESENCE_DELTA ? 3 : 1;
+    for (size_t i = 0; i < 3; ++i) {
+        lists[i]->clear();
+    }
+    for (size_t i = 0; i < list_count; ++i) {
+        uint64_t count;
+        used = presence_get_varint(payload + offset, length - offset, count);
+        // Every id takes at least a byte, which bounds what a count may claim
+        if (used == 0 || count > length - offset - used) {
+            return false;
+        }
+        offset += used;
+        uint64_t session = 0;
+        for (uint64_t j = 0; j < count; ++j) {
+            uint64_t step;
+            used = presence_get_varint(payload + offset, length - offset, step);
+            if (used == 0) {
+                return false;
+            }
+            offset += used;
+            session += step;
+            lists[i]->push_back(session);
+        }
+    }
+    return offset == length;
+}
+
+/**
+ * @brief One reactor's coalesced presence events for one room, collected
+ *        over a presence interval.
+ */
+class PresenceDelta {
+public:
+    PresenceDelta() : events_(0) {}
+
+    bool empty() const { return entries_.empty(); }
+
+    // Events recorded since the last clear(), including those that cancelled out
+    size_t events() const { return events_; }
+
+    /**
+     * @param notice Whether text notices mention the change; typing never is.
+     */
+    void record(uint64_t session, PresenceChange change, bool notice) {
+        ++events_;
+        Entry &entry = entries_[session];
+        switch (change) {
+        case PresenceChange::Joined:
+            // Back before anyone heard it left
+            entry.membership = entry.membership < 0 ? 0 : 1;
+            entry.notice = notice && entry.membership != 0;
+            break;
+        case PresenceChange::Left:
+        case PresenceChange::Quit:
+            if (entry.membership > 0) {
+                entries_.erase(session); // Gone before anyone heard it joined
+                return;
+            }
+            entry.membership = -1;
+            entry.quit = change == PresenceChange::Quit;
+            entry.notice = notice;
+            entry.typing = false;
+            break;
+        case PresenceChange::Typing:
+            entry.typing = entry.membership >= 0;
+            break;
+        }
+        if (entry.membership == 0 && !entry.typing) {
+            entries_.erase(session);
+        }
+    }
+
+    /**
+     * @brief The changes as ascending lists of sessions.
+     */
+    void collect(std::vector<uint64_t> &joined, std::vector<uint64_t> &left, std::vector<uint64_t> &typing) const {
+        for (const std::pair<const uint64_t, Entry> &entry : entries_) {
+            if (entry.second.membership > 0) {
+                joined.push_back(entry.first);
+            } else if (entry.second.membership < 0) {
+                left.push_back(entry.first);
+            }
+            if (entry.second.typing) {
+                typing.push_back(entry.first);
+            }
+        }
+        std::sort(joined.begin(), joined.end());
+        std::sort(left.begin(), left.end());
+        std::sort(typing.begin(), typing.end());
+    }
+
+    /**
+     * @brief The notice text clients without CAPABILITY_PRESENCE get, e.g.
+     *        "[dev] Client 3 and Client 5 joined the room." Empty if no
+     *        change is to be mentioned.
+     * @param lobby Disconnects from the lobby read "Client 3 has left the chat."
+     */
+    std::string notice(const std::string &room, bool lobby) const {
+        std::vector<uint64_t> joined, left, quit;
+        for (const std::pair<const uint64_t, Entry> &entry : entries_) {
+            if (!entry.second.notice) {
+                continue;
+            }
+            if (entry.second.membership > 0) {
+                joined.push_back(entry.first);
+            } else if (entry.second.membership < 0) {
+                (entry.second.quit ? quit : left).push_back(entry.first);
+            }
+        }
+        std::string text;
+        append_sentence(text, "[" + room + "] ", joined, "joined the room.", "joined the room.");
+        append_sentence(text, "[" + room + "] ", left, "left the room.", "left the room.");
+        append_sentence(text, lobby ? std::string() : "[" + room + "] ", quit, "has left the chat.",
+                        "have left the chat.");
+        return text;
+    }
+
+    void clear() {
+        entries_.clear();
+        events_ = 0;
+    }
+
+private:
+    struct Entry {
+        Entry() : membership(0), quit(false), notice(false), typing(false) {}
+
+        int membership; // 1: joined, -1: left, 0: unchanged
+        bool quit;      // Left by disconnecting
+        bool notice;
+        bool typing;
+    };
+
+    static void append_sentence(std::string &text, const std::string &label, std::vector<uint64_t> &sessions,
+                                const char *one, const char *many) {
+        if (sessions.empty()) {
+            return;
+        }
+        std::sort(sessions.begin(), sessions.end());
+        size_t named = sessions.size() > MAX_NOTICE_NAMES ? MAX_NOTICE_NAMES : sessions.size();
+        if (!text.empty()) {
+            text += ' ';
+        }
+        text += label;
+        for (size_t i = 0; i < named; ++i) {
+            if (i > 0) {
+                text += i + 1 == sessions.size() ? " and " : ", ";
+            }
+            text += "Client " + std::to_string(sessions[i]);
+        }
+        if (named < sessions.size()) {
+            text += " and " + std::to_string(sessions.size() - named) + " others";
+        }
+        text += ' ';
+        text += sessions.size() == 1 ? one : many;
+    }
+
+    std::unordered_map<uint64_t, Entry> entries_;
+    size_t events_;
+};
+
+/**
+ * @brief A room's members on this node as a versioned set, shared by all
+ *        reactors.
+ *
+ * Reactors take the lock once per presence interval to apply their deltas,
+ * and joiners that asked for presence once to read a snapshot, which is
+ * encoded once per version and shared by everyone who joins meanwhile.
+ */
+class RoomPresence {
+public:
+    RoomPresence()
+        : version_(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                             std::chrono::system_clock::now().time_since_epoch())
+                                             .count())),
+          snapshot_version_(0) {}
+
+    RoomPresence(const RoomPresence &) = delete;
+    RoomPresence &operator=(const RoomPresence &) = delete;
+
+    /**
+     * @brief Adds @p joined and removes @p left.
+     * @return The version of the set now.
+     */
+    uint64_t apply(const std::vector<uint64_t> &joined, const std::vector<uint64_t> &left) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        members_.insert(joined.begin(), joined.end());
+        for (uint64_t session : left) {
+            members_.erase(session);
+        }
+        return ++version_;
+    }
+
+    /**
+     * @brief Appends the FRAME_PRESENCE snapshot of room @p room to @p frames.
+     */
+    void snapshot(const std::string &room, std::vector<MessageRef> &frames) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (snapshot_version_ != version_ || snapshot_.empty()) {
+            std::vector<uint64_t> members(members_.begin(), members_.end());
+            std::sort(members.begin(), members.end());
+            snapshot_.clear();
+            encode_presence(PRESENCE_SNAPSHOT, room, version_, &members, 1, snapshot_);
+            snapshot_version_ = version_;
+        }
+        frames.insert(frames.end(), snapshot_.begin(), snapshot_.end());
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_set<uint64_t> members_;
+    uint64_t version_;
+    std::vector<MessageRef> snapshot_; // Encoded at snapshot_version_
+    uint64_t snapshot_version_;
+};
+
+#endif // CHAT_PRESENCE_H
@@ -0,0 +1,316 @@
+// -----------------------------------------------------------------------------
+// Room History
+//
+// Every room can remember its last N chat messages so that clients joining
+// later see what was said before. The history is a ring of shared message
+// references (see message.h): recording a message costs a reference count,
+// not a copy, and a replay queues the very same buffers.
+//
+// Optionally, each room's history is also appended to a memory-mapped
+// segment file, so it survives restarts without a database. A segment is a
+// small header followed by records:
+//
+//   [u32 length][u8 frame type][length bytes of text]
+//
+// The length is written last, so a record torn by a crash reads as the end
+// of the segment. When a segment is full it is compacted: the ring's
+// messages are written to a fresh segment, which then replaces the old one.
+//
+// The ring is shared by all reactors and guarded by a per-room mutex that
+// is held only to store or copy a few pointers and to append a record to
+// the mapping; a room's members on different reactors contend for it only
+// when they talk at the same moment. Compaction writes a whole file, so it
+// runs outside the mutex on a snapshot of the ring, and whatever is said
+// meanwhile is appended to the fresh segment once it is in place.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_ROOM_HISTORY_H
+#define CHAT_ROOM_HISTORY_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "message.h"
+#include "logger.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Most messages a room may keep
+const size_t MAX_HISTORY = 1000;
+// Size of one room's segment file
+const size_t HISTORY_SEGMENT_BYTES = 1024 * 1024;
+
+/**
+ * @brief An append-only, memory-mapped segment file of message records.
+ */
+class HistoryFile {
+public:
+    HistoryFile() : base_(NULL), end_(0) {}
+    ~HistoryFile() { unmap(); }
+
+    HistoryFile(const HistoryFile &) = delete;
+    HistoryFile &operator=(const HistoryFile &) = delete;
+
+    /**
+     * @brief Maps @p path, creating it if needed, and reads its records.
+     * @param on_record Called as on_record(type, text, length) for each
+     *        record, oldest first.
+     * @return False if the file cannot be created or mapped.
+     */
+    template <typename Callback>
+    bool open(const std::string &path, Callback on_record) {
+        path_ = path;
+        if (!map(path_)) {
+            return false;
+        }
+        if (std::memcmp(base_, magic(), MAGIC_SIZE) != 0) {
+            if (base_[0] != 0) { // Not a new file, and not one of ours: start over
+                std::memset(base_, 0, HISTORY_SEGMENT_BYTES);
+            }
+            std::memcpy(base_, magic(), MAGIC_SIZE);
+        }
+        end_ = MAGIC_SIZE;
+        while (end_ + RECORD_HEADER <= HISTORY_SEGMENT_BYTES) {
+            uint32_t length;
+            std::memcpy(&length, base_ + end_, sizeof(length));
+            if (length == 0 || length > HISTORY_SEGMENT_BYTES - end_ - RECORD_HEADER) {
+                break;
+            }
+            on_record(static_cast<uint8_t>(base_[end_ + 4]), base_ + end_ + RECORD_HEADER, (size_t)length);
+            end_ += RECORD_HEADER + length;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Appends one message's text.
+     * @return False if the segment is full; compact() it and try again.
+     */
+    bool append(const MessageBuffer &message, uint8_t type) {
+        size_t length = message.text_size();
+        if (base_ == NULL || length == 0 || end_ + RECORD_HEADER + length > HISTORY_SEGMENT_BYTES) {
+            return false;
+        }
+
+        message.copy_text(base_ + end_ + RECORD_HEADER);
+        base_[end_ + 4] = static_cast<char>(type);
+        uint32_t stored = static_cast<uint32_t>(length);
+        std::memcpy(base_ + end_, &stored, sizeof(stored)); // Commits the record
+        end_ += RECORD_HEADER + length;
+        return true;
+    }
+
+    /**
+     * @brief Replaces the segment with a fresh one holding the newest of
+     *        @p messages (oldest first) that fit.
+     *
+     * The new segment is written beside the old one and renamed over it, so
+     * a crash leaves one complete segment or the other.
+     * @return False if that failed; the file is then unmapped for good.
+     */
+    bool compact(const std::vector<const MessageBuffer *> &messages, uint8_t type) {
+        size_t first = messages.size();
+        size_t bytes = MAGIC_SIZE;
+        while (first > 0 && bytes + RECORD_HEADER + messages[first - 1]->text_size() <= HISTORY_SEGMENT_BYTES) {
+            bytes += RECORD_HEADER + messages[--first]->text_size();
+        }
+
+        std::string fresh = path_ + ".tmp";
+        std::remove(fresh.c_str());
+        unmap();
+        if (!map(fresh)) {
+            return false;
+        }
+        std::memcpy(base_, magic(), MAGIC_SIZE);
+        end_ = MAGIC_SIZE;
+        for (size_t i = first; i < messages.size(); ++i) {
+            append(*messages[i], type);
+        }
+#ifdef _WIN32
+        bool renamed = MoveFileExA(fresh.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        bool renamed = std::rename(fresh.c_str(), path_.c_str()) == 0;
+#endif
+        if (!renamed) {
+            unmap();
+        }
+        return renamed;
+    }
+
+private:
+    static const size_t RECORD_HEADER = 5;
+    static const size_t MAGIC_SIZE = 8;
+
+    static const char *magic() { return "CHATHIS1"; }
+
+    /**
+     * @brief Maps a segment-sized file; new files read as zeros.
+     *
+     * The descriptor is closed right away; the mapping keeps the file open.
+     */
+    bool map(const std::string &path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                  NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)HISTORY_SEGMENT_BYTES, NULL);
+        CloseHandle(file);
+        if (mapping == NULL) {
+            return false;
+        }
+        base_ = static_cast<char *>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, HISTORY_SEGMENT_BYTES));
+        CloseHandle(mapping);
+        return base_ != NULL;
+#else
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 ||
+            ((size_t)info.st_size != HISTORY_SEGMENT_BYTES && ftruncate(fd, HISTORY_SEGMENT_BYTES) != 0)) {
+            ::close(fd);
+            return false;
+        }
+        void *memory = mmap(NULL, HISTORY_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        base_ = memory == MAP_FAILED ? NULL : static_cast<char *>(memory);
+        return base_ != NULL;
+#endif
+    }
+
+    void unmap() {
+        if (base_ == NULL) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(base_);
+#else
+        munmap(base_, HISTORY_SEGMENT_BYTES);
+#endif
+        base_ = NULL;
+    }
+
+    std::string path_;
+    char *base_;
+    size_t end_; // Offset of the next record
+};
+
+/**
+ * @brief The last messages said in one room, shared by all reactors.
+ */
+class RoomHistory {
+public:
+    explicit RoomHistory(size_t capacity)
+        : ring_(capacity), head_(0), count_(0), recorded_(0), persistent_(false), compacting_(false) {}
+
+    RoomHistory(const RoomHistory &) = delete;
+    RoomHistory &operator=(const RoomHistory &) = delete;
+
+    /**
+     * @brief Backs the history with a segment file and loads what it holds.
+     * @return False if the file is unusable; the history stays in memory only.
+     */
+    bool persist(const std::string &path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        persistent_ = file_.open(path, [this](uint8_t type, const char *text, size_t length) {
+            push(make_message(type, text, length));
+        });
+        return persistent_;
+    }
+
+    /**
+     * @brief Remembers a chat message, forgetting the oldest if full.
+     */
+    void record(const MessageRef &message) {
+        std::vector<MessageRef> snapshot;
+        uint64_t snapshot_end;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            push(message);
+            ++recorded_;
+            // While another thread compacts, the file is its alone
+            if (!persistent_ || compacting_ || file_.append(*message, FRAME_CHAT)) {
+                return;
+            }
+            compacting_ = true;
+            recent_locked(count_, snapshot);
+            snapshot_end = recorded_;
+        }
+
+        std::vector<const MessageBuffer *> messages;
+        for (const MessageRef &kept : snapshot) {
+            messages.push_back(kept.get());
+        }
+        bool compacted = file_.compact(messages, FRAME_CHAT);
+        int error = errno;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        compacting_ = false;
+        if (!compacted) {
+            LOG_EVENT(LogLevel::Warn, "History compaction failed; keeping it in memory only").field("error", error);
+            persistent_ = false;
+            return;
+        }
+        // Catch up on what was recorded meanwhile; anything that no longer
+        // fits goes into the next compaction
+        size_t missed = (size_t)std::min<uint64_t>(recorded_ - snapshot_end, count_);
+        for (size_t i = count_ - missed; i < count_; ++i) {
+            if (!file_.append(*ring_[(head_ + i) % ring_.size()], FRAME_CHAT)) {
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief Copies out up to @p limit of the most recent messages, oldest first.
+     */
+    void recent(size_t limit, std::vector<MessageRef> &out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        recent_locked(limit, out);
+    }
+
+private:
+    void recent_locked(size_t limit, std::vector<MessageRef> &out) const {
+        size_t skip = count_ > limit ? count_ - limit : 0;
+        for (size_t i = skip; i < count_; ++i) {
+            out.push_back(ring_[(head_ + i) % ring_.size()]);
+        }
+    }
+
+    void push(const MessageRef &message) {
+        if (count_ == ring_.size()) {
+            ring_[head_] = message;
+            head_ = (head_ + 1) % ring_.size();
+        } else {
+            ring_[(head_ + count_) % ring_.size()] = message;
+            ++count_;
+        }
+    }
+
+    std::mutex mutex_;
+    std::vector<MessageRef> ring_;
+    size_t head_;
+    size_t count_;
+    uint64_t recorded_; // Messages recorded so far
+    HistoryFile file_;
+    bool persistent_;
+    bool compacting_;   // A thread is compacting file_; nobody else touches it
+};
+
+#endif // CHAT_ROOM_HISTORY_H
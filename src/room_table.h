@@ -0,0 +1,215 @@
+// -----------------------------------------------------------------------------
+// Chat Rooms
+//
+// Room names are interned once, in a process-wide RoomDirectory, into a
+// RoomInfo that lives for the rest of the process. Messages refer to rooms by
+// pointer, so routing a message never looks a name up or takes a lock.
+//
+// Each reactor keeps its own table from room id to a compact array of the
+// members it serves (RoomMembers); RoomInfo::reactors records which reactors
+// currently have members, so a room message only visits those reactors and
+// only the room's members there. Members remember their slot in the array,
+// which makes removal an O(1) swap with the last element.
+//
+// With history enabled, every room also gets a RoomHistory (see
+// room_history.h) when it is created. In a cluster, RoomInfo::peers does for
+// other nodes what RoomInfo::reactors does for local reactors (see
+// cluster.h).
+//
+// Rooms can be rate limited. Their budgets are SharedTokenBuckets (see
+// token_bucket.h) that members on every reactor spend from without a lock.
+//
+// RoomInfo::presence tracks the members on this node for presence updates
+// (see presence.h).
+//
+// Busy rooms can be batched: their chat is collected for a short window and
+// fanned out once per window, so each member gets one write per window
+// instead of one per message.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_ROOM_TABLE_H
+#define CHAT_ROOM_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "presence.h"
+#include "room_history.h"
+#include "token_bucket.h"
+
+// Room every client is placed in when it connects
+const char LOBBY_ROOM[] = "lobby";
+// Longest room name accepted
+const size_t MAX_ROOM_NAME = 32;
+// Most rooms one client may be in at once
+const size_t MAX_ROOMS_PER_CLIENT = 16;
+// Most distinct rooms the server will ever create
+const size_t MAX_ROOMS = 65536;
+// Longest batch window a room may have
+const unsigned MAX_BATCH_WINDOW_MS = 100;
+
+/**
+ * @brief A room, shared by all reactors. Never freed once created.
+ */
+struct RoomInfo {
+    uint32_t id;
+    std::string name;
+    std::atomic<uint64_t> reactors; // Bit i set while reactor i has members
+    std::atomic<uint64_t> peers;    // Bit i set while cluster peer i has members
+    RoomHistory *history;           // Recent messages; NULL if history is off
+    SharedTokenBucket message_budget; // Chat messages its members may send; unlimited by default
+    SharedTokenBucket byte_budget;    // Bytes of chat text they may send
+    unsigned batch_window_ms;         // Chat is fanned out in batches this often; 0: per message
+    RoomPresence presence;            // Its members on this node, versioned
+};
+
+/**
+ * @brief Bit for a reactor in RoomInfo::reactors; reactors past the 64th
+ *        have none and are always visited.
+ */
+inline uint64_t reactor_bit(int index) {
+    return index < 64 ? (uint64_t)1 << index : 0;
+}
+
+/**
+ * @brief Room names may use letters, digits, '-' and '_'.
+ */
+inline bool valid_room_name(const char *name, size_t length) {
+    if (length == 0 || length > MAX_ROOM_NAME) {
+        return false;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' ||
+              c == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Process-wide name -> room registry. Only joins consult it.
+ */
+class RoomDirectory {
+public:
+    RoomDirectory() : history_size_(0), message_rate_(0), byte_rate_(0) {}
+
+    RoomDirectory(const RoomDirectory &) = delete;
+    RoomDirectory &operator=(const RoomDirectory &) = delete;
+
+    /**
+     * @brief Gives every room created from now on a history of @p size
+     *        messages, persisted under @p directory unless it is empty.
+     */
+    void enable_history(size_t size, const std::string &directory) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        history_size_ = size;
+        history_directory_ = directory;
+    }
+
+    /**
+     * @brief Limits every room created from now on to @p messages_per_s chat
+     *        messages and @p bytes_per_s bytes per second (0: unlimited),
+     *        with bursts of up to a second's worth.
+     */
+    void limit_rate(double messages_per_s, double bytes_per_s) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        message_rate_ = messages_per_s;
+        byte_rate_ = bytes_per_s;
+    }
+
+    /**
+     * @brief Batches the chat of room @p name, once it is created from now
+     *        on, with a window of @p window_ms (0: per message).
+     */
+    void batch(const std::string &name, unsigned window_ms) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch_windows_[name] = window_ms;
+    }
+
+    /**
+     * @brief Finds a room by name, creating it if it does not exist yet.
+     * @return The room, or NULL if MAX_ROOMS rooms already exist.
+     */
+    RoomInfo *intern(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::unordered_map<std::string, RoomInfo *>::iterator it = by_name_.find(name);
+        if (it != by_name_.end()) {
+            return it->second;
+        }
+        if (by_name_.size() >= MAX_ROOMS) {
+            return NULL;
+        }
+        RoomInfo *room = new RoomInfo();
+        room->id = static_cast<uint32_t>(by_name_.size());
+        room->name = name;
+        room->reactors.store(0);
+        room->peers.store(0);
+        room->history = NULL;
+        room->message_budget.configure(message_rate_, message_rate_);
+        room->byte_budget.configure(byte_rate_, byte_rate_);
+        std::unordered_map<std::string, unsigned>::const_iterator window = batch_windows_.find(name);
+        room->batch_window_ms = window != batch_windows_.end() ? window->second : 0;
+        if (history_size_ > 0) {
+            room->history = new RoomHistory(history_size_);
+            // Room names are letters, digits, '-' and '_', so they are safe file names
+            if (!history_directory_.empty() && !room->history->persist(history_directory_ + "/" + name + ".history")) {
+                LOG_EVENT(LogLevel::Warn, "Room history file unusable; keeping it in memory only")
+                    .field("room", name)
+                    .field("error", errno);
+            }
+        }
+        by_name_[name] = room;
+        return room;
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, RoomInfo *> by_name_;
+    std::unordered_map<std::string, unsigned> batch_windows_; // Room name -> batch window
+    size_t history_size_;
+    std::string history_directory_;
+    double message_rate_;
+    double byte_rate_;
+};
+
+/**
+ * @brief One reactor's members of one room, packed for fast iteration.
+ */
+template <typename Member>
+class RoomMembers {
+public:
+    size_t size() const { return members_.size(); }
+    bool empty() const { return members_.empty(); }
+    Member operator[](size_t slot) const { return members_[slot]; }
+
+    /**
+     * @return The slot the member was stored in.
+     */
+    size_t add(Member member) {
+        members_.push_back(member);
+        return members_.size() - 1;
+    }
+
+    /**
+     * @brief Swap-removes the member in @p slot.
+     * @return The member moved into @p slot, whose stored slot must be
+     *         updated, or a null Member if the last slot was removed.
+     */
+    Member remove(size_t slot) {
+        Member moved = members_.back();
+        members_[slot] = moved;
+        members_.pop_back();
+        return slot < members_.size() ? moved : Member();
+    }
+
+private:
+    std::vector<Member> members_;
+};
+
+#endif // CHAT_ROOM_TABLE_H
@@ -1,38 +1,569 @@
 // -----------------------------------------------------------------------------
-// TCP Chat Server (Windows C++)
+// TCP Chat Server (C++)
 //
-// This is the Windows-compatible version of the multi-client TCP chat server.
-// It uses the Winsock API for network communication and std::thread for
-// handling multiple clients.
+// The multi-client TCP chat server. It is written against the Winsock API,
+// which socket_compat.h maps onto BSD sockets on Linux, macOS and the BSDs,
+// so the same source builds natively everywhere. Clients are sharded
+// across one or more reactor threads, each multiplexing its own sockets
+// through a Poller (IOCP / epoll / kqueue, see poller.h). Clients talk in
+// rooms (see room_table.h); everyone starts in the lobby, and anyone can
+// message any other client directly by its session number. Several servers
+// can share their rooms as a cluster (see cluster.h).
 //
-// How to compile (using MinGW g++):
-// g++ -o server.exe server_windows.cpp -pthread -lws2_32
+// How to compile (using MinGW g++ on Windows, g++ / clang++ elsewhere):
+// g++ -o server.exe server.cpp -pthread -lws2_32 -lpsapi
+// g++ -O2 -o server server.cpp -pthread
+// g++ -std=c++20 -DCHAT_COROUTINES -O2 -o server server.cpp -pthread  (coroutine handlers, see coroutine.h)
+// g++ -DCHAT_TLS -O2 -o server server.cpp -pthread -lssl -lcrypto  (TLS, see tls.h)
+// g++ -DCHAT_TRACE -O2 -o server server.cpp -pthread  (message tracing, see trace.h)
 //
 // How to run:
-// ./server.exe <port>
-// e.g., ./server.exe 8080
+// ./server.exe <port> [--config PATH] [--port N] [--bind ADDRESS] [--metrics-bind ADDRESS]
+//              [--workers N] [--cpus LIST] [--numa local|off] [--read-buffer BYTES]
+//              [--reserve-connections N] [--reserve-buffers N] [--reserve-messages N] [--queue-limit N]
+//              [--overflow drop-oldest|drop-new|disconnect]
+//              [--log-level debug|info|warn|error] [--log-file PATH] [--log-sample N]
+//              [--metrics-port N] [--nagle on|off|adaptive] [--backlog N]
+//              [--send-buffer BYTES] [--recv-buffer BYTES]
+//              [--keepalive-idle SECONDS] [--keepalive-interval SECONDS]
+//              [--accept-rate N] [--history N] [--history-dir PATH]
+//              [--cluster-port N] [--peer HOST:PORT]... [--compress-min BYTES]
+//              [--heartbeat SECONDS] [--idle-timeout SECONDS] [--line-idle-timeout SECONDS]
+//              [--client-rate N] [--client-byte-rate BYTES] [--room-rate N] [--room-byte-rate BYTES]
+//              [--drain-timeout SECONDS] [--handoff PATH]
+//              [--tls-cert PATH --tls-key PATH] [--ktls on|off] [--batch ROOM:MS]...
+//              [--presence-interval MS] [--trace-sample N] [--trace-buffer SPANS] [--trace-file PATH]
+// e.g., ./server.exe 8080 --workers 4
+//       ./server.exe --config chat.conf --workers 8
+//
+// Any option can also come from a config file, one "name = value" per line
+// (see config_file.h). With --cpus and --numa local each reactor is pinned
+// to a chosen core and its memory to that core's NUMA node, and the
+// --reserve-* pools are allocated and faulted in before clients arrive
+// (see affinity.h).
+//
+// SIGTERM or SIGINT (Ctrl+C) stops the server gracefully: it stops taking
+// connections, tells its clients and gives them up to the drain timeout to
+// receive what is queued for them. With --handoff, starting a second server
+// with the same PATH instead restarts it without dropping anyone: the new
+// process takes over the listeners and every client (see handoff.h).
+//
+// With --tls-cert and --tls-key (in a TLS build) every client connection is
+// TLS; the wire format is negotiated inside it as usual.
+//
+// --batch ROOM:MS fans the room's chat out in batches: what its members on
+// one reactor say within MS milliseconds reaches each recipient as one
+// write, at the price of up to MS milliseconds of latency.
+//
+// Joins, leaves and typing are coalesced and sent once per presence
+// interval (see presence.h).
+//
+// A trace build records where sampled messages spend their time, for
+// GET /trace on the metrics port and --trace-file (see trace.h).
 // -----------------------------------------------------------------------------
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // GetQueuedCompletionStatusEx and WSAPoll need Vista+
+#endif
+
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <thread>
 #include <mutex>
+#include <unordered_map>
+#include <atomic>
 #include <algorithm>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <chrono>
+#include <cstring>
+#include "socket_compat.h"
+#include "socket_options.h"
+#include "poller.h"
+#include "mpsc_queue.h"
+#include "outbound_queue.h"
+#include "buffer_pool.h"
+#include "object_pool.h"
+#include "slab_allocator.h"
+#include "room_table.h"
+#include "cluster.h"
+#include "token_bucket.h"
+#include "timer_wheel.h"
+#include "logger.h"
+#include "metrics.h"
+#include "frame.h"
+#include "compression.h"
+#include "handoff.h"
+#include "coroutine.h"
+#include "tls.h"
+#include "trace.h"
+#include "affinity.h"
+#include "config_file.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+// Maximum number of recv() calls per readiness event, so one busy client
+// cannot starve the others sharing the event loop
+const int MAX_READS_PER_EVENT = 16;
+
+// Maximum number of buffers passed to one gather send; several queued
+// messages, such as a room's history replayed on join, go out together
+// (kept well below IOV_MAX)
+const int MAX_SEND_SPANS = 256;
+// Queues deeper than one gather send holds are bursts; with adaptive Nagle
+// they are written corked
+const size_t CORK_THRESHOLD = MAX_SEND_SPANS / MAX_MESSAGE_SPANS;
+
+// Per-connection receive buffers start large enough for many frames per
+// recv (--read-buffer) and grow to hold one maximal frame plus a large read
+// after it
+const size_t DEFAULT_READ_BUFFER_SIZE = 64 * 1024;
+const size_t MIN_READ_BUFFER_SIZE = 1024;
+const size_t MAX_READ_BUFFER_SIZE = 2 * (MAX_FRAME_PAYLOAD + MAX_FRAME_HEADER);
+// Idle read buffers each reactor keeps for reuse, unless it reserves more
+const size_t READ_BUFFER_POOL_SIZE = 32;
+// --reserve-messages carves slab blocks of every class up to this size,
+// which covers chat messages of a few hundred bytes and their prefixes
+const size_t RESERVED_MESSAGE_BLOCK = 512;
+
+// Most connections taken per listener wake-up, and admitted per loop
+// iteration, so a connection storm is absorbed in slices between regular I/O
+const int MAX_ACCEPTS_PER_BATCH = 64;
+const size_t MAX_ADMISSIONS_PER_PASS = 64;
+// How long to stop accepting after running out of descriptors or buffers
+const int ACCEPT_BACKOFF_MS = 100;
+
+// Clients that have not sent the frame preface by then are legacy clients
+const int PREFACE_TIMEOUT_MS = 250;
+// TLS clients get this long for the handshake; the preface timeout starts after it
+const int TLS_HANDSHAKE_TIMEOUT_MS = 10000;
+
+// Resolution of the reactors' timer wheels (heartbeats, idle timeouts)
+const int TIMER_TICK_MS = 100;
+// Framed clients silent this long are pinged, and disconnected if they stay
+// silent until the idle timeout
+const int DEFAULT_HEARTBEAT_S = 30;
+const int DEFAULT_IDLE_TIMEOUT_S = 90;
+
+// How often the first reactor logs allocator statistics (while busy)
+const int MEMORY_STATS_INTERVAL_S = 60;
+
+// A metrics scraper that sends no request within this time is dropped
+const int METRICS_REQUEST_TIMEOUT_MS = 2000;
+// Scrapers waited on at once; past this the longest-waiting one is dropped
+const size_t MAX_METRICS_PENDING = 64;
+// How long answering one scrape may wait on a scraper that does not read
+const int METRICS_SEND_TIMEOUT_MS = 200;
+
+// How often a reactor sends out its rooms' coalesced presence changes
+const int DEFAULT_PRESENCE_INTERVAL_MS = 100;
+const int MAX_PRESENCE_INTERVAL_MS = 1000;
+
+// A batch is fanned out early once it holds this many messages or bytes
+const size_t MAX_BATCH_MESSAGES = 64;
+const size_t MAX_BATCH_BYTES = 64 * 1024;
+
+// How long a stopping server keeps flushing its clients' queues
+const int DEFAULT_DRAIN_TIMEOUT_S = 10;
+// How often threads blocked outside the reactors look for a stop request
+const int STOP_POLL_MS = 200;
+
+/**
+ * @brief Settings taken from the command line.
+ */
+struct ServerOptions {
+    int port;
+    std::string bind_address;       // Client listener address; empty: every IPv4 interface
+    std::string metrics_bind;       // The same for the metrics endpoint
+    int workers;
+    std::vector<int> cpus;          // Cores for the reactors, in order; empty: one per core in turn
+    bool numa_local;                // Reactors prefer memory from their core's NUMA node
+    size_t read_buffer_size;        // Initial size of a connection's receive buffer
+    size_t reserve_connections;     // Connection slots each reactor allocates and touches at startup
+    size_t reserve_buffers;         // The same for read buffers
+    size_t reserve_messages;        // The same for message blocks of each small size class
+    size_t queue_limit;             // Max messages queued per client
+    OverflowPolicy overflow_policy; // What to do once that limit is hit
+    LogLevel log_level;
+    std::string log_file;           // Empty: log to stdout
+    unsigned log_sample;            // Log one in this many chat messages
+    int metrics_port;               // 0: no metrics endpoint
+    SocketTuning tuning;            // Listener and connection socket options
+    unsigned accept_rate;           // New connections per second; 0: unlimited
+    size_t history;                 // Messages each room remembers; 0: no history
+    std::string history_dir;        // Where room histories are kept; empty: memory only
+    int cluster_port;               // 0: not part of a cluster
+    std::vector<PeerAddress> peers; // Every other node of the cluster
+    size_t compress_min;            // Smallest chat message sent compressed; 0: never compress
+    int heartbeat_s;                // Silence before a framed client is pinged; 0: never ping
+    int idle_timeout_s;             // Silence before a framed client is dropped; 0: never
+    int line_idle_timeout_s;        // The same for legacy line clients, which cannot be pinged
+    unsigned client_rate;           // Chat messages per second one client may send; 0: unlimited
+    unsigned client_byte_rate;      // Bytes of chat text per second one client may send; 0: unlimited
+    unsigned room_rate;             // The same limits for everyone in one room together
+    unsigned room_byte_rate;
+    int drain_timeout_s;            // Time clients get to receive their queues on shutdown
+    std::string handoff_path;       // Control socket for hot restarts; empty: none
+    std::string tls_cert;           // PEM certificate chain; empty: plain TCP
+    std::string tls_key;            // PEM private key for it
+    bool kernel_tls;                // Let the kernel encrypt records where it can
+    std::vector<std::pair<std::string, unsigned>> batched_rooms; // Room -> batch window in ms
+    int presence_interval_ms;       // Presence changes are coalesced this long; 0: per loop iteration
+    unsigned trace_sample;          // Trace one in this many chat messages; 0: none (trace builds)
+    size_t trace_buffer;            // Spans each reactor keeps for the trace
+    std::string trace_file;         // Where the trace is written on shutdown; empty: nowhere
+};
+
+ServerOptions options = {0, "", "", 1, {}, false, DEFAULT_READ_BUFFER_SIZE, 0, 0, 0, 1024,
+                         OverflowPolicy::Disconnect, LogLevel::Info, "", 100, 0,
+                         {NagleMode::Adaptive, 0, 0, 0, 10, SOMAXCONN}, 0, 0, "", 0, {}, DEFAULT_COMPRESS_MIN,
+                         DEFAULT_HEARTBEAT_S, DEFAULT_IDLE_TIMEOUT_S, 0, 0, 0, 0, 0, DEFAULT_DRAIN_TIMEOUT_S, "",
+                         "", "", true, {}, DEFAULT_PRESENCE_INTERVAL_MS,
+                         DEFAULT_TRACE_SAMPLE, DEFAULT_TRACE_BUFFER, ""};
+
+/**
+ * @brief Whether, and how, the server is going away.
+ */
+enum class StopMode {
+    Running,
+    Drain,  // Flush the clients' queues, then disconnect them
+    Handoff // Package the clients for a successor process, leaving them connected
+};
+
+struct Reactor;
+struct Connection;
+
+/**
+ * @brief A client's place in one room.
+ */
+struct Membership {
+    RoomInfo *room;
+    MessageRef prefix; // "[room] <client_id>: "; the plain prefix in the lobby
+    size_t slot;       // Index in the reactor's RoomMembers for this room
+};
+
+#ifdef CHAT_COROUTINES
+/**
+ * @brief co_await conn->recv_frame(frame): waits for the next complete frame.
+ *
+ * Yields false if the client sent a malformed one instead.
+ */
+struct FrameAwaiter {
+    Connection *conn;
+    Frame &frame;
+    ParseResult result;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<>) {}
+    bool await_resume();
+};
+
+/**
+ * @brief co_await conn->send(message): queues a message and, if the client
+ *        is falling behind, waits until it has caught up again.
+ *
+ * The client is not read from meanwhile, so a client that does not read
+ * what it is sent stops being heard as well. co_await conn->caught_up()
+ * waits the same way without queueing anything.
+ */
+struct SendAwaiter {
+    Connection *conn;
+    MessageRef message;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<>);
+    void await_resume() {}
+};
+#endif
+
+/**
+ * @brief Per-client state, owned by the reactor thread serving it.
+ */
+struct Connection {
+    explicit Connection(size_t queue_limit) : output(queue_limit), input(NULL) {}
+
+    SOCKET socket;
+    Reactor *reactor;
+    uint64_t session;         // Never reused, unlike socket numbers; see new_session()
+    std::string client_id;    // "Client <session>"
+    MessageRef prefix;        // "<client_id>: ", shared by everything this client says
+    MessageRef direct_prefix; // "[private] <client_id>: "; made on the first direct message
+    OutboundQueue output;     // Messages the kernel could not accept yet
+    ReadBuffer *input;        // Unprocessed bytes; pooled, NULL while drained
+    std::vector<Membership> rooms;
+    RoomInfo *current_room;   // Where plain chat goes; NULL if in no room
+    std::chrono::steady_clock::time_point connected_at;
+    TimerNode idle_timer;     // Next heartbeat or idle timeout check
+    uint64_t heard_tick;      // Timer tick at which the client last sent anything
+    TokenBucket message_budget; // Flood limits (options.client_rate, client_byte_rate)
+    TokenBucket byte_budget;
+    size_t dropped_messages;  // Discarded by the overflow policy
+    bool format_known;        // First bytes revealed framed or line mode
+    bool compression;         // Negotiated compressed frames (framed clients only)
+    bool presence;            // Negotiated presence updates instead of join and leave notices
+    bool write_interest;      // Poller is watching for writability
+    bool flush_pending;       // Listed in the reactor's pending_flush
+    bool falling_behind;      // Queue passed half its limit; warned once
+    bool ping_sent;           // Pinged since it last sent anything
+    bool throttled;           // Its last chat message was dropped by a rate limit
+    bool fan_out_mark;        // Singled out by the fan-out in progress: a batch's sender, a joiner
+    bool closing;
+#ifdef CHAT_TLS
+    SSL *tls;                 // NULL: plain TCP
+    std::string tls_unsent;   // A record the socket refused; must go again as it was
+    uint64_t tls_handshake_ns; // Time spent in handshake calls so far
+    bool tls_ready;           // Handshake complete
+    bool tls_want_write;      // A handshake step or read waits for writability
+    bool ktls_send;           // The kernel encrypts what is sent on the socket
+#endif
+#ifdef CHAT_COROUTINES
+    FrameAwaiter recv_frame(Frame &frame) { return FrameAwaiter{this, frame, ParseResult::NeedMore}; }
+    SendAwaiter send(const MessageRef &message) { return SendAwaiter{this, message}; }
+    SendAwaiter caught_up() { return SendAwaiter{this, MessageRef()}; }
+
+    ConnectionTask handler;     // Serves a framed client; see serve_frames()
+    HandlerFrame handler_frame; // Where the handler's coroutine frame lives
+    const char *window;         // Input the handler may parse: [window_offset, window_size)
+    size_t window_size;
+    size_t window_offset;
+    bool awaiting_output;       // Handler suspended in send(); input is not read
+    bool resume_pending;        // Listed in the reactor's resumable
+#endif
+};
+
+/**
+ * @brief A broadcast or direct message handed from one thread to a reactor.
+ */
+struct ShardMessage {
+    MessageRef text;
+    RoomInfo *room;       // NULL for direct messages
+    uint64_t sender;      // Session left out of a broadcast, or told if a direct message finds no one; 0: none
+    uint64_t recipient;   // Direct messages: the only session to deliver to
+    uint64_t received_ns; // When the origin read it (monotonic_ns); 0 for notices
+};
 
-// Link with the Winsock library
-#pragma comment(lib, "ws2_32.lib")
+/**
+ * @brief A batched room's chat that one reactor's clients sent within the
+ *        current window.
+ */
+struct RoomBatch {
+    RoomInfo *room;
+    std::vector<MessageRef> messages;
+    std::vector<uint64_t> senders; // Session of each message's sender
+    size_t bytes;                  // Framed size of the messages
+    uint64_t received_ns;          // When the first message was read
+    uint64_t due_ns;               // When the batch is fanned out (monotonic_ns)
+    bool open;                     // Holds messages
+    bool listed;                   // In the reactor's open_batches, which drops it once fanned out
+
+    RoomBatch() : room(NULL), bytes(0), received_ns(0), due_ns(0), open(false), listed(false) {}
+};
+
+/**
+ * @brief One event loop thread and the shard of connections it owns.
+ *
+ * Only the reactor's own thread touches its state; other threads talk to
+ * the reactor through its inbox.
+ */
+struct Reactor {
+    explicit Reactor(size_t read_buffer_size)
+        : read_buffers(read_buffer_size, MAX_READ_BUFFER_SIZE, READ_BUFFER_POOL_SIZE) {}
+
+    int index;
+    Poller poller;
+    SOCKET listen_socket;                   // Own SO_REUSEPORT listener, if any
+    TokenBucket accept_tokens;              // Rate limit for the own listener
+    bool accept_paused;                     // Listener unwatched until accept_resume_at
+    std::chrono::steady_clock::time_point accept_resume_at;
+    std::deque<SOCKET> handshakes;          // Accepted, not yet admitted; no state allocated
+    std::unordered_map<uint32_t, RoomMembers<Connection *>> rooms; // Room id -> local members
+    std::unordered_map<uint64_t, Connection *> sessions; // This reactor's clients by session id
+    uint64_t issued_sessions;               // Session ids handed out so far
+    std::vector<Connection *> closed;       // Freed at the end of each loop iteration
+    std::vector<Connection *> undecided;    // Waiting for their wire format to be known
+    std::vector<Connection *> pending_flush; // Got output this iteration; flushed at its end
+    std::unordered_map<uint32_t, RoomBatch> batches; // Room id -> batch, for batched rooms
+    std::vector<RoomBatch *> open_batches;  // Batches holding messages, in no particular order
+    std::unordered_map<uint32_t, PresenceDelta> presence; // Room id -> changes of its members here
+    std::vector<RoomInfo *> presence_rooms; // Rooms whose delta has changes
+    uint64_t presence_due_ns;               // When they go out (monotonic_ns); 0: none pending
+#ifdef CHAT_COROUTINES
+    std::vector<Connection *> resumable;    // Caught up; their handlers resume after flushing
+#endif
+    TimerWheel timers;                      // Per-connection heartbeat and idle timers
+    std::chrono::steady_clock::time_point timer_origin; // When tick 0 began
+    uint64_t tick;                          // Timer tick of the current loop iteration
+    BufferPool read_buffers;                // Lent to connections while they have input
+    ObjectPool<Connection> connections;     // Storage for this reactor's clients
+    uint64_t recv_time_ns;                  // When the input being handled was read
+    std::vector<char> inflated;             // Scratch: a client's decompressed frame
+    std::vector<char> text_scratch;         // Scratch: a message's text, about to be compressed
+    std::vector<char> deflated;             // Scratch: compressed payloads
+#ifdef CHAT_TLS
+    std::vector<char> tls_record;           // Scratch: queued messages coalesced into one record
+#endif
+    bool draining;                          // Stopping; exits once every queue is flushed
+    std::chrono::steady_clock::time_point drain_deadline;
+    std::vector<HandoffClient> handed_off;  // Its clients, packaged for a successor
+    ThreadMetrics metrics;                  // Written only by this reactor's thread
+    TraceRing trace;                        // Spans of sampled messages; read by the metrics thread
+    unsigned trace_countdown;               // Chat messages until the next one is traced
+    uint64_t traced_messages;
+    std::thread thread;
 
-// Mutex for protecting shared resources (the list of client sockets)
-std::mutex clients_mutex;
-// Vector to store the sockets of all connected clients
-std::vector<SOCKET> client_sockets;
+    // --- Inbound queues, written by other threads ---
+    std::mutex inbox_mutex;
+    std::vector<SOCKET> accepted_sockets;   // Handed off by the acceptor in main()
+    MpscQueue<ShardMessage> messages;       // Broadcasts from other reactors (lock-free)
+    std::atomic<bool> wake_pending;         // Set once a wake-up for messages is in flight
+};
+
+// All reactors; fixed once the server has started, so any thread may read it
+std::vector<Reactor *> reactors;
+
+RoomDirectory room_directory;
+RoomInfo *lobby_room;
+
+// Links to the other nodes; inactive unless --cluster-port is given
+ClusterNode cluster;
+
+#ifdef CHAT_TLS
+// Server side of every client connection; invalid unless --tls-cert is given
+TlsContext tls_context;
+#endif
+
+// Written only by the accept loop in main()
+ThreadMetrics acceptor_metrics;
+
+// Set by the SIGTERM / SIGINT handler; main() turns it into a stop_mode
+std::atomic<bool> stop_requested(false);
+// Set by main() only; every other thread polls it
+std::atomic<StopMode> stop_mode(StopMode::Running);
+// Reactors that reached the handoff; none packages its clients before all have
+std::atomic<size_t> handoff_arrivals(0);
+
+/**
+ * @brief What a predecessor process handed over on a hot restart.
+ */
+struct Inheritance {
+    std::vector<SOCKET> client_listeners;
+    std::vector<SOCKET> cluster_listeners;
+    std::vector<SOCKET> metrics_listeners;
+    std::vector<HandoffClient> clients;
+    std::string tls_ticket_keys; // Empty if the predecessor had no TLS
+};
 
 // --- Function Prototypes ---
-void broadcast_message(const std::string &message, SOCKET sender_socket);
-void handle_client(SOCKET client_socket);
+bool parse_options(int argc, char *argv[], ServerOptions &parsed);
+SOCKET bind_listener(int port, bool reuse_port, const std::string &bind_address);
+SOCKET create_listener(int port, bool reuse_port, const std::string &bind_address);
+void run_reactor(Reactor *reactor);
+void drain_inbox(Reactor *reactor);
+void accept_clients(Reactor *reactor);
+void resume_accepting(Reactor *reactor);
+int accept_batch(SOCKET listener, TokenBucket &tokens, ThreadMetrics &metrics, std::deque<SOCKET> &accepted);
+SOCKET accept_nonblocking(SOCKET listener);
+void hand_off(std::deque<SOCKET> &accepted, size_t &next_reactor);
+void admit_clients(Reactor *reactor);
+void adopt_client(Reactor *reactor, SOCKET client_socket);
+Connection *register_client(Reactor *reactor, SOCKET client_socket, uint64_t session);
+void install_stop_handlers();
+void begin_drain(Reactor *reactor);
+bool drained(Reactor *reactor);
+void close_all(Reactor *reactor);
+void package_clients(Reactor *reactor);
+bool take_over(const std::string &path, Inheritance &inherited);
+SOCKET inherited_listener(std::vector<SOCKET> &listeners, int port);
+int listener_port(const struct sockaddr_storage &address);
+void resume_client(Reactor *reactor, const HandoffClient &client);
+void hand_over(HandoffChannel &successor, const std::vector<std::pair<SOCKET, ListenerRole>> &listeners);
+uint64_t new_session(Reactor *reactor);
+Reactor *session_owner(uint64_t session);
+void broadcast_message(Reactor *origin, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                       uint64_t received_ns);
+void share_with_reactors(Reactor *origin, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                         uint64_t received_ns);
+void batch_message(Reactor *origin, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                   uint64_t received_ns);
+void fan_out_batch(Reactor *origin, RoomBatch &batch);
+void fan_out_batches(Reactor *reactor, bool all);
+int batch_timeout_ms(const Reactor *reactor);
+void flush_room_batch(Reactor *origin, RoomInfo *room);
+void note_presence(Connection *conn, RoomInfo *room, PresenceChange change, bool notice);
+void fan_out_presence(Reactor *reactor, bool all);
+void fan_out_room_presence(Reactor *origin, RoomInfo *room, const PresenceDelta &delta);
+int presence_timeout_ms(const Reactor *reactor);
+void send_presence_snapshot(Connection *conn, RoomInfo *room);
+void deliver_local(Reactor *reactor, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                   uint64_t received_ns);
+void deliver_from_peer(RoomInfo *room, const MessageRef &message);
+void send_direct(Reactor *origin, uint64_t recipient, uint64_t sender, const MessageRef &message,
+                 uint64_t received_ns);
+void deliver_direct(Reactor *reactor, uint64_t recipient, uint64_t sender, const MessageRef &message,
+                    uint64_t received_ns);
+bool join_room(Connection *conn, const std::string &name, bool announce, bool replay = true);
+void leave_room(Connection *conn, size_t index, bool announce);
+int find_membership(Connection *conn, const RoomInfo *room);
+int find_membership(Connection *conn, const char *name, size_t length);
+void handle_client_readable(Connection *conn);
+int receive_bytes(Connection *conn, char *buffer, int length);
+bool tls_pending(const Connection *conn);
+#ifdef CHAT_TLS
+bool start_tls(Connection *conn);
+TlsResult continue_handshake(Connection *conn);
+int send_records(Connection *conn, const ByteSpan *spans, int count);
+bool send_unsent_record(Connection *conn);
+void hang_up_tls(Connection *conn);
+#endif
+size_t process_input(Connection *conn, const char *data, size_t size);
+bool inflate_frame(Connection *conn, Frame &frame);
+#ifdef CHAT_COROUTINES
+ConnectionTask serve_frames(Connection *conn);
+size_t feed_handler(Connection *conn, const char *data, size_t size);
+void resume_handlers(Reactor *reactor);
+#endif
+void handle_frame(Connection *conn, const Frame &frame);
+void handle_line(Connection *conn, const char *line, size_t length);
+bool handle_command(Connection *conn, const char *line, size_t length);
+void request_join(Connection *conn, const char *name, size_t length);
+void request_leave(Connection *conn, const char *name, size_t length);
+void request_room_chat(Connection *conn, const char *name, size_t name_length, const char *text, size_t length);
+void request_direct(Connection *conn, uint64_t recipient, const char *text, size_t length);
+void handle_chat(Connection *conn, const Membership *membership, const char *text, size_t length);
+bool within_rate_limits(Connection *conn, RoomInfo *room, size_t length);
+void compress_for_fanout(Reactor *reactor, const MessageRef &message);
+void trace_message(Connection *conn, const MessageRef &message);
+void trace_fanout(Reactor *reactor, const MessageRef &message, uint64_t started_ns, size_t recipients);
+void send_notice(Connection *conn, const std::string &text);
+void set_wire_format(Connection *conn, WireFormat format);
+void expire_undecided(Reactor *reactor);
+int timer_timeout_ms(Reactor *reactor);
+void run_timers(Reactor *reactor);
+void check_idle(Connection *conn);
+void arm_idle_timer(Connection *conn);
+void idle_limits(const Connection *conn, uint64_t &heartbeat, uint64_t &timeout);
+void handle_client_writable(Connection *conn);
+void queue_output(Connection *conn, const MessageRef &message);
+void flush_pending(Reactor *reactor);
+uint32_t poll_interest(const Connection *conn);
+bool flush_client(Connection *conn);
+bool flush_output(Connection *conn);
+bool output_pending(const Connection *conn);
+int send_queued(Connection *conn, const ByteSpan *spans, int count);
+int send_spans(SOCKET socket, const ByteSpan *spans, int count);
+void close_client(Connection *conn);
+bool set_non_blocking(SOCKET socket);
+void pin_current_thread(int index);
+void reserve_pools(Reactor *reactor);
+void report_memory_stats();
+void run_metrics_server(SOCKET listen_socket);
+void serve_metrics_request(SOCKET client_socket);
+std::string collect_metrics();
+std::string collect_trace();
+void write_trace_file();
+bool send_all(SOCKET socket, const std::string &data);
 
 /**
  * @brief Initializes the Winsock library.
@@ -44,7 +575,7 @@ void handle_client(SOCKET client_socket);
 bool InitializeWinsock() {
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "WSAStartup failed." << std::endl;
+        LOG_EVENT(LogLevel::Error, "WSAStartup failed");
         return false;
     }
     return true;
@@ -54,117 +585,3445 @@ bool InitializeWinsock() {
  * @brief Main function to start the server.
  */
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " <port> [--config PATH] [--port N] [--bind ADDRESS]"
+                  << " [--metrics-bind ADDRESS] [--workers N] [--cpus LIST] [--numa local|off]"
+                  << " [--read-buffer BYTES] [--reserve-connections N] [--reserve-buffers N]"
+                  << " [--reserve-messages N] [--queue-limit N]"
+                  << " [--overflow drop-oldest|drop-new|disconnect]"
+                  << " [--log-level debug|info|warn|error] [--log-file PATH] [--log-sample N]"
+                  << " [--metrics-port N] [--nagle on|off|adaptive] [--backlog N]"
+                  << " [--send-buffer BYTES] [--recv-buffer BYTES]"
+                  << " [--keepalive-idle SECONDS] [--keepalive-interval SECONDS]"
+                  << " [--accept-rate N] [--history N] [--history-dir PATH]"
+                  << " [--cluster-port N] [--peer HOST:PORT]... [--compress-min BYTES]"
+                  << " [--heartbeat SECONDS] [--idle-timeout SECONDS] [--line-idle-timeout SECONDS]"
+                  << " [--client-rate N] [--client-byte-rate BYTES] [--room-rate N] [--room-byte-rate BYTES]"
+                  << " [--drain-timeout SECONDS] [--handoff PATH]"
+                  << " [--tls-cert PATH --tls-key PATH] [--ktls on|off] [--batch ROOM:MS]..."
+                  << " [--presence-interval MS] [--trace-sample N] [--trace-buffer SPANS] [--trace-file PATH]"
+                  << std::endl;
         return 1;
     }
 
-    if (!InitializeWinsock()) {
+    if (!logger().start(options.log_level, options.log_sample, options.log_file)) {
+        std::cerr << "Cannot open log file " << options.log_file << "." << std::endl;
         return 1;
     }
 
-    int port = std::stoi(argv[1]);
-    SOCKET server_socket = INVALID_SOCKET;
-    struct sockaddr_in address;
+    int port = options.port;
+    int workers = options.workers;
 
-    // --- Create server socket ---
-    server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (server_socket == INVALID_SOCKET) {
-        std::cerr << "Socket creation failed with error: " << WSAGetLastError() << std::endl;
-        WSACleanup();
+    if (!InitializeWinsock()) {
         return 1;
     }
+    install_stop_handlers();
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY; // Accept connections from any IP
-    address.sin_port = htons(port);
-
-    // --- Bind the socket ---
-    if (bind(server_socket, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR) {
-        std::cerr << "Bind failed with error: " << WSAGetLastError() << std::endl;
-        closesocket(server_socket);
+#ifdef CHAT_TLS
+    std::string tls_problem;
+    if (!options.tls_cert.empty() &&
+        !tls_context.init_server(options.tls_cert, options.tls_key, options.kernel_tls, tls_problem)) {
+        LOG_EVENT(LogLevel::Error, "TLS setup failed").field("error", tls_problem);
         WSACleanup();
         return 1;
     }
+#endif
 
-    // --- Listen for incoming connections ---
-    if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
-        std::cerr << "Listen failed with error: " << WSAGetLastError() << std::endl;
-        closesocket(server_socket);
-        WSACleanup();
-        return 1;
+    // A server already running at the handoff path hands everything over
+    Inheritance inherited;
+    bool took_over = !options.handoff_path.empty() && take_over(options.handoff_path, inherited);
+#ifdef CHAT_TLS
+    // Clients the predecessor asked to reconnect resume their sessions here
+    if (tls_context.valid() && !inherited.tls_ticket_keys.empty() &&
+        !tls_context.set_ticket_keys(inherited.tls_ticket_keys)) {
+        LOG_EVENT(LogLevel::Warn, "Inherited TLS ticket keys unusable");
     }
+#endif
 
-    std::cout << "Server listening on port " << port << "..." << std::endl;
+    // With SO_REUSEPORT the kernel load-balances connections across one
+    // listener per reactor; elsewhere main() accepts and deals them out.
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    const bool reuse_port = true;
+#else
+    const bool reuse_port = false;
+#endif
 
-    while (true) {
-        SOCKET client_socket = accept(server_socket, NULL, NULL);
-        if (client_socket == INVALID_SOCKET) {
-            std::cerr << "Accept failed with error: " << WSAGetLastError() << std::endl;
+    SOCKET server_socket = INVALID_SOCKET;
+    if (!reuse_port) {
+        server_socket = inherited_listener(inherited.client_listeners, port);
+        if (server_socket == INVALID_SOCKET) {
+            server_socket = create_listener(port, false, options.bind_address);
+        }
+        if (server_socket == INVALID_SOCKET || !set_non_blocking(server_socket)) {
+            WSACleanup();
+            return 1;
+        }
+    }
+
+    // Sockets sharing a port with SO_REUSEPORT split its connections, so a
+    // second server started on it would bind silently and take half of the
+    // clients. A plain bind first fails if anything already holds the port.
+    if (reuse_port && inherited.client_listeners.empty()) {
+        SOCKET probe = bind_listener(port, false, options.bind_address);
+        if (probe == INVALID_SOCKET) {
+            WSACleanup();
+            return 1;
+        }
+        closesocket(probe);
+    }
+
+    // The rate limit is split evenly across the listeners
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    double accept_rate = reuse_port ? (double)options.accept_rate / workers : options.accept_rate;
+
+    if (options.history > 0) {
+        room_directory.enable_history(options.history, options.history_dir);
+    }
+    room_directory.limit_rate(options.room_rate, options.room_byte_rate);
+    for (const std::pair<std::string, unsigned> &batched : options.batched_rooms) {
+        room_directory.batch(batched.first, batched.second);
+    }
+    lobby_room = room_directory.intern(LOBBY_ROOM);
+
+    // --- Cluster links on their own port and thread ---
+    std::thread cluster_thread;
+    if (options.cluster_port != 0) {
+        SOCKET cluster_socket = inherited_listener(inherited.cluster_listeners, options.cluster_port);
+        if (cluster_socket == INVALID_SOCKET) {
+            cluster_socket = create_listener(options.cluster_port, false, "");
+        }
+        if (cluster_socket == INVALID_SOCKET || !set_non_blocking(cluster_socket) ||
+            !cluster.start(cluster_socket, options.peers, &room_directory, deliver_from_peer)) {
+            LOG_EVENT(LogLevel::Error, "Cluster setup failed").field("port", options.cluster_port);
+            return 1;
+        }
+        LOG_EVENT(LogLevel::Info, "Cluster port listening")
+            .field("port", options.cluster_port)
+            .field("peers", options.peers.size());
+        cluster_thread = std::thread(&ClusterNode::run, &cluster);
+    }
+
+    // --- Create the reactors ---
+    for (int i = 0; i < workers; ++i) {
+        Reactor *reactor = new Reactor(options.read_buffer_size);
+        reactor->index = i;
+        reactor->listen_socket = INVALID_SOCKET;
+        reactor->accept_paused = false;
+        reactor->recv_time_ns = 0;
+        reactor->issued_sessions = 0;
+        reactor->timer_origin = started;
+        reactor->tick = 0;
+        reactor->draining = false;
+        reactor->presence_due_ns = 0;
+        reactor->trace_countdown = options.trace_sample;
+        reactor->traced_messages = 0;
+        if (options.trace_sample != 0) {
+            reactor->trace.reserve(options.trace_buffer);
+        }
+        reactor->wake_pending.store(false);
+        if (!reactor->poller.valid()) {
+            LOG_EVENT(LogLevel::Error, "Poller creation failed").field("worker", i);
+            return 1;
+        }
+        if (reuse_port) {
+            reactor->listen_socket = inherited_listener(inherited.client_listeners, port);
+            if (reactor->listen_socket == INVALID_SOCKET) {
+                reactor->listen_socket = create_listener(port, true, options.bind_address);
+            }
+            if (reactor->listen_socket == INVALID_SOCKET ||
+                !set_non_blocking(reactor->listen_socket) ||
+                !reactor->poller.add(reactor->listen_socket, POLL_READ, NULL)) {
+                LOG_EVENT(LogLevel::Error, "Listener setup failed").field("worker", i);
+                return 1;
+            }
+            if (accept_rate > 0) {
+                reactor->accept_tokens.configure(accept_rate, accept_rate, started);
+            }
+        }
+        reactors.push_back(reactor);
+    }
+
+    // --- Carry on serving the predecessor's clients, before any new one ---
+    if (took_over) {
+        uint64_t last_session = 0;
+        for (const HandoffClient &client : inherited.clients) {
+            last_session = std::max(last_session, client.session);
+        }
+        // No reactor may issue an id a resumed client still has
+        for (Reactor *reactor : reactors) {
+            reactor->issued_sessions = last_session / reactors.size() + 1;
+        }
+        size_t next_reactor = 0;
+        for (const HandoffClient &client : inherited.clients) {
+            // A session stays with the reactor its id names, so direct messages find it
+            Reactor *reactor = client.session != 0 ? session_owner(client.session)
+                                                   : reactors[next_reactor++ % reactors.size()];
+            resume_client(reactor, client);
+        }
+        // Listeners the predecessor had more of than this server needs
+        for (std::vector<SOCKET> *surplus :
+             {&inherited.client_listeners, &inherited.cluster_listeners, &inherited.metrics_listeners}) {
+            for (SOCKET listener : *surplus) {
+                LOG_EVENT(LogLevel::Warn, "Inherited listener unused").field("socket", listener);
+                closesocket(listener);
+            }
+        }
+    }
+
+    LOG_EVENT(LogLevel::Info, "Server listening").field("port", port).field("workers", workers);
+
+    for (Reactor *reactor : reactors) {
+        reactor->thread = std::thread(run_reactor, reactor);
+    }
+
+    // --- Metrics endpoint on its own port and thread ---
+    std::thread metrics_thread;
+    SOCKET metrics_socket = INVALID_SOCKET;
+    if (options.metrics_port != 0) {
+        metrics_socket = inherited_listener(inherited.metrics_listeners, options.metrics_port);
+        if (metrics_socket == INVALID_SOCKET) {
+            metrics_socket = create_listener(options.metrics_port, false, options.metrics_bind);
+        }
+        if (metrics_socket == INVALID_SOCKET) {
+            LOG_EVENT(LogLevel::Error, "Metrics endpoint unavailable").field("port", options.metrics_port);
+        } else {
+            LOG_EVENT(LogLevel::Info, "Metrics endpoint listening").field("port", options.metrics_port);
+            metrics_thread = std::thread(run_metrics_server, metrics_socket);
+        }
+    }
+
+    // --- Wait for a successor on the handoff path ---
+    SOCKET handoff_socket = INVALID_SOCKET;
+    if (!options.handoff_path.empty()) {
+        handoff_socket = HandoffChannel::listen_at(options.handoff_path);
+        if (handoff_socket == INVALID_SOCKET) {
+            LOG_EVENT(LogLevel::Error, "Handoff path unavailable")
+                .field("path", options.handoff_path)
+                .field("error", WSAGetLastError());
+        }
+    }
+
+    // --- Accept connections in batches and deal them out round-robin ---
+    TokenBucket accept_tokens;
+    if (accept_rate > 0) {
+        accept_tokens.configure(accept_rate, accept_rate, started);
+    }
+    std::deque<SOCKET> accepted;
+    size_t next_reactor = 0;
+    HandoffChannel successor;
+    bool handing_off = false;
+    while (!stop_requested.load() && !handing_off) {
+        WSAPOLLFD watched[2];
+        unsigned long count = 0;
+        if (!reuse_port) {
+            watched[count].fd = server_socket;
+            watched[count].events = POLLIN;
+            watched[count].revents = 0;
+            ++count;
+        }
+        if (handoff_socket != INVALID_SOCKET) {
+            watched[count].fd = handoff_socket;
+            watched[count].events = POLLIN;
+            watched[count].revents = 0;
+            ++count;
+        }
+        if (count == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(STOP_POLL_MS));
+            continue;
+        }
+        if (WSAPoll(watched, count, STOP_POLL_MS) == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEINTR) {
+                LOG_EVENT(LogLevel::Error, "Listener wait failed").field("error", WSAGetLastError());
+            }
             continue;
         }
 
-        std::cout << "New client connected." << std::endl;
+        if (handoff_socket != INVALID_SOCKET && watched[count - 1].revents != 0) {
+            handing_off = successor.accept_from(handoff_socket);
+            if (!handing_off) {
+                LOG_EVENT(LogLevel::Warn, "Handoff connection rejected").field("error", WSAGetLastError());
+            }
+        }
+        if (!reuse_port && !handing_off && watched[0].revents != 0) {
+            int pause_ms = accept_batch(server_socket, accept_tokens, acceptor_metrics, accepted);
+            hand_off(accepted, next_reactor);
+            if (pause_ms > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(pause_ms));
+            }
+        }
+    }
 
-        // --- Add new client socket to the list ---
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            client_sockets.push_back(client_socket);
+    // --- Stop: drain the clients, or hand them and the listeners over ---
+    std::vector<std::pair<SOCKET, ListenerRole>> listeners;
+    if (handing_off) {
+        LOG_EVENT(LogLevel::Info, "Handing off to a successor");
+        // Stopped first, so nothing reaches the reactors once they package
+        if (cluster_thread.joinable()) {
+            cluster.stop();
+            cluster_thread.join();
+            listeners.push_back(std::make_pair(cluster.listener(), ListenerRole::Cluster));
+        }
+    } else {
+        LOG_EVENT(LogLevel::Info, "Server stopping").field("drain_timeout_s", options.drain_timeout_s);
+        if (server_socket != INVALID_SOCKET) {
+            closesocket(server_socket); // Refuse newcomers while the rest drain
+            server_socket = INVALID_SOCKET;
         }
+    }
+
+    stop_mode.store(handing_off ? StopMode::Handoff : StopMode::Drain);
+    for (Reactor *reactor : reactors) {
+        reactor->poller.wake();
+    }
+    for (Reactor *reactor : reactors) {
+        reactor->thread.join();
+        if (reactor->listen_socket != INVALID_SOCKET) {
+            listeners.push_back(std::make_pair(reactor->listen_socket, ListenerRole::Clients));
+        }
+    }
+    if (cluster_thread.joinable()) {
+        cluster.stop();
+        cluster_thread.join();
+        closesocket(cluster.listener());
+    }
+    if (metrics_thread.joinable()) {
+        metrics_thread.join();
+    }
+    write_trace_file();
+    if (server_socket != INVALID_SOCKET) {
+        listeners.push_back(std::make_pair(server_socket, ListenerRole::Clients));
+    }
+    if (metrics_socket != INVALID_SOCKET) {
+        listeners.push_back(std::make_pair(metrics_socket, ListenerRole::Metrics));
+    }
 
-        // --- Create a new thread to handle the client ---
-        std::thread(handle_client, client_socket).detach();
+    if (handing_off) {
+        // The successor has already put its own control socket at the path
+        hand_over(successor, listeners);
+    } else {
+        for (const std::pair<SOCKET, ListenerRole> &listener : listeners) {
+            closesocket(listener.first);
+        }
+        if (handoff_socket != INVALID_SOCKET) {
+            HandoffChannel::remove_path(options.handoff_path);
+        }
+    }
+    if (handoff_socket != INVALID_SOCKET) {
+        closesocket(handoff_socket);
     }
 
-    // --- Cleanup ---
-    closesocket(server_socket);
+    LOG_EVENT(LogLevel::Info, "Server stopped");
+    logger().stop();
     WSACleanup();
 
     return 0;
 }
 
 /**
- * @brief Broadcasts a message to all clients except the sender.
+ * @brief Parses the command line, and the config files it names, into @p parsed.
+ * @return False if the arguments are malformed.
  */
-void broadcast_message(const std::string &message, SOCKET sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (SOCKET socket : client_sockets) {
-        if (socket != sender_socket) {
-            if (send(socket, message.c_str(), message.length(), 0) == SOCKET_ERROR) {
-                std::cerr << "Send failed with error: " << WSAGetLastError() << std::endl;
+bool parse_options(int argc, char *argv[], ServerOptions &parsed) {
+    if (argc < 2) {
+        return false;
+    }
+
+    // The port may come first on its own; config files take the place of --config
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (i == 1 && std::strncmp(argv[i], "--", 2) != 0) {
+            args.push_back("--port");
+            args.push_back(argv[i]);
+        } else if (std::strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            std::string problem;
+            if (!read_config_file(argv[++i], args, problem)) {
+                std::cerr << problem << std::endl;
+                return false;
             }
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    bool tracing = false;
+    std::string arg;
+    std::string value;
+    try {
+        for (size_t i = 0; i < args.size(); ++i) {
+            arg = args[i];
+            if (i + 1 >= args.size()) {
+                return false;
+            }
+            value = args[++i];
+            if (arg == "--port") {
+                parsed.port = std::stoi(value);
+            } else if (arg == "--bind") {
+                parsed.bind_address = value;
+            } else if (arg == "--metrics-bind") {
+                parsed.metrics_bind = value;
+            } else if (arg == "--workers") {
+                parsed.workers = std::stoi(value);
+            } else if (arg == "--cpus") {
+                if (!parse_cpu_list(value, parsed.cpus)) {
+                    std::cerr << "CPU lists look like 0-3,8,10-11, with CPUs up to " << MAX_CPU << "." << std::endl;
+                    return false;
+                }
+            } else if (arg == "--numa") {
+                if (value == "local") {
+                    parsed.numa_local = true;
+                } else if (value == "off") {
+                    parsed.numa_local = false;
+                } else {
+                    return false;
+                }
+            } else if (arg == "--read-buffer") {
+                parsed.read_buffer_size = std::stoul(value);
+            } else if (arg == "--reserve-connections") {
+                parsed.reserve_connections = std::stoul(value);
+            } else if (arg == "--reserve-buffers") {
+                parsed.reserve_buffers = std::stoul(value);
+            } else if (arg == "--reserve-messages") {
+                parsed.reserve_messages = std::stoul(value);
+            } else if (arg == "--queue-limit") {
+                parsed.queue_limit = std::stoul(value);
+            } else if (arg == "--overflow") {
+                if (value == "drop-oldest") {
+                    parsed.overflow_policy = OverflowPolicy::DropOldest;
+                } else if (value == "drop-new") {
+                    parsed.overflow_policy = OverflowPolicy::DropNew;
+                } else if (value == "disconnect") {
+                    parsed.overflow_policy = OverflowPolicy::Disconnect;
+                } else {
+                    return false;
+                }
+            } else if (arg == "--log-level") {
+                if (!parse_log_level(value, parsed.log_level)) {
+                    return false;
+                }
+            } else if (arg == "--log-file") {
+                parsed.log_file = value;
+            } else if (arg == "--log-sample") {
+                parsed.log_sample = std::stoul(value);
+            } else if (arg == "--metrics-port") {
+                parsed.metrics_port = std::stoi(value);
+            } else if (arg == "--nagle") {
+                if (value == "on") {
+                    parsed.tuning.nagle = NagleMode::On;
+                } else if (value == "off") {
+                    parsed.tuning.nagle = NagleMode::Off;
+                } else if (value == "adaptive") {
+                    parsed.tuning.nagle = NagleMode::Adaptive;
+                } else {
+                    return false;
+                }
+            } else if (arg == "--backlog") {
+                parsed.tuning.backlog = std::stoi(value);
+            } else if (arg == "--send-buffer") {
+                parsed.tuning.send_buffer = std::stoi(value);
+            } else if (arg == "--recv-buffer") {
+                parsed.tuning.receive_buffer = std::stoi(value);
+            } else if (arg == "--keepalive-idle") {
+                parsed.tuning.keepalive_idle_s = std::stoi(value);
+            } else if (arg == "--keepalive-interval") {
+                parsed.tuning.keepalive_interval_s = std::stoi(value);
+            } else if (arg == "--accept-rate") {
+                parsed.accept_rate = std::stoul(value);
+            } else if (arg == "--history") {
+                parsed.history = std::stoul(value);
+            } else if (arg == "--history-dir") {
+                parsed.history_dir = value;
+            } else if (arg == "--cluster-port") {
+                parsed.cluster_port = std::stoi(value);
+            } else if (arg == "--peer") {
+                PeerAddress peer;
+                if (!parse_peer_address(value, peer)) {
+                    return false;
+                }
+                parsed.peers.push_back(peer);
+            } else if (arg == "--compress-min") {
+                parsed.compress_min = std::stoul(value);
+            } else if (arg == "--heartbeat") {
+                parsed.heartbeat_s = std::stoi(value);
+            } else if (arg == "--idle-timeout") {
+                parsed.idle_timeout_s = std::stoi(value);
+            } else if (arg == "--line-idle-timeout") {
+                parsed.line_idle_timeout_s = std::stoi(value);
+            } else if (arg == "--client-rate") {
+                parsed.client_rate = std::stoul(value);
+            } else if (arg == "--client-byte-rate") {
+                parsed.client_byte_rate = std::stoul(value);
+            } else if (arg == "--room-rate") {
+                parsed.room_rate = std::stoul(value);
+            } else if (arg == "--room-byte-rate") {
+                parsed.room_byte_rate = std::stoul(value);
+            } else if (arg == "--drain-timeout") {
+                parsed.drain_timeout_s = std::stoi(value);
+            } else if (arg == "--handoff") {
+                parsed.handoff_path = value;
+            } else if (arg == "--tls-cert") {
+                parsed.tls_cert = value;
+            } else if (arg == "--tls-key") {
+                parsed.tls_key = value;
+            } else if (arg == "--ktls") {
+                if (value == "on") {
+                    parsed.kernel_tls = true;
+                } else if (value == "off") {
+                    parsed.kernel_tls = false;
+                } else {
+                    return false;
+                }
+            } else if (arg == "--batch") {
+                size_t colon = value.rfind(':');
+                if (colon == std::string::npos || !valid_room_name(value.data(), colon)) {
+                    return false;
+                }
+                int window_ms = std::atoi(value.c_str() + colon + 1);
+                if (window_ms < 1 || window_ms > (int)MAX_BATCH_WINDOW_MS) {
+                    std::cerr << "Batch windows are 1-" << MAX_BATCH_WINDOW_MS << " ms." << std::endl;
+                    return false;
+                }
+                parsed.batched_rooms.push_back(std::make_pair(value.substr(0, colon), (unsigned)window_ms));
+            } else if (arg == "--presence-interval") {
+                parsed.presence_interval_ms = std::stoi(value);
+            } else if (arg == "--trace-sample") {
+                parsed.trace_sample = std::stoul(value);
+                tracing = true;
+            } else if (arg == "--trace-buffer") {
+                parsed.trace_buffer = std::stoul(value);
+                tracing = true;
+            } else if (arg == "--trace-file") {
+                parsed.trace_file = value;
+                tracing = true;
+            } else {
+                std::cerr << "Unknown option " << arg << "." << std::endl;
+                return false;
+            }
+        }
+    } catch (const std::logic_error &) { // std::stoi and friends
+        std::cerr << arg << " takes a number, not \"" << value << "\"." << std::endl;
+        return false;
+    }
+
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    if (parsed.port < 1 || parsed.port > 65535) {
+        std::cerr << "The port (1-65535) comes first, or from --port or a config file." << std::endl;
+        return false;
+    }
+    if (!make_listen_address(parsed.bind_address, parsed.port, address, address_length) ||
+        !make_listen_address(parsed.metrics_bind, parsed.port, address, address_length)) {
+        std::cerr << "Bind addresses are IPv4 or IPv6 literals, such as 0.0.0.0, :: or ::1." << std::endl;
+        return false;
+    }
+    if (parsed.read_buffer_size < MIN_READ_BUFFER_SIZE || parsed.read_buffer_size > MAX_READ_BUFFER_SIZE) {
+        std::cerr << "Read buffers are " << MIN_READ_BUFFER_SIZE << "-" << MAX_READ_BUFFER_SIZE << " bytes."
+                  << std::endl;
+        return false;
+    }
+
+    if (parsed.tls_cert.empty() != parsed.tls_key.empty()) {
+        std::cerr << "--tls-cert and --tls-key go together." << std::endl;
+        return false;
+    }
+#ifndef CHAT_TLS
+    if (!parsed.tls_cert.empty()) {
+        std::cerr << "This server was built without TLS; rebuild it with TLS=1 (-DCHAT_TLS)." << std::endl;
+        return false;
+    }
+#endif
+    if (tracing && !TRACE_ENABLED) {
+        std::cerr << "This server was built without tracing; rebuild it with TRACE=1 (-DCHAT_TRACE)." << std::endl;
+        return false;
+    }
+    if (parsed.trace_buffer < 1 || parsed.trace_buffer > MAX_TRACE_BUFFER) {
+        std::cerr << "The trace buffer holds 1-" << MAX_TRACE_BUFFER << " spans." << std::endl;
+        return false;
+    }
+    if (parsed.presence_interval_ms < 0 || parsed.presence_interval_ms > MAX_PRESENCE_INTERVAL_MS) {
+        std::cerr << "The presence interval is 0-" << MAX_PRESENCE_INTERVAL_MS << " ms." << std::endl;
+        return false;
+    }
+    if (parsed.drain_timeout_s < 0) {
+        std::cerr << "The drain timeout cannot be negative." << std::endl;
+        return false;
+    }
+    if (parsed.workers < 1 || parsed.queue_limit < 1 || parsed.log_sample < 1) {
+        std::cerr << "Worker count, queue limit and log sample rate must be at least 1." << std::endl;
+        return false;
+    }
+    if (parsed.history > MAX_HISTORY || (!parsed.history_dir.empty() && parsed.history == 0)) {
+        std::cerr << "History must be at most " << MAX_HISTORY << " messages, and above 0 with --history-dir."
+                  << std::endl;
+        return false;
+    }
+    if ((!parsed.peers.empty() && parsed.cluster_port == 0) || parsed.peers.size() > MAX_PEERS) {
+        std::cerr << "--peer needs --cluster-port, and a cluster has at most " << MAX_PEERS + 1 << " nodes."
+                  << std::endl;
+        return false;
+    }
+    if (parsed.heartbeat_s < 0 || parsed.idle_timeout_s < 0 || parsed.line_idle_timeout_s < 0 ||
+        (parsed.heartbeat_s > 0 && parsed.idle_timeout_s > 0 && parsed.heartbeat_s >= parsed.idle_timeout_s)) {
+        std::cerr << "Heartbeat and idle timeouts cannot be negative, and the heartbeat must be shorter than the"
+                  << " idle timeout." << std::endl;
+        return false;
+    }
+    const SocketTuning &tuning = parsed.tuning;
+    if (tuning.backlog < 1 || tuning.send_buffer < 0 || tuning.receive_buffer < 0 || tuning.keepalive_idle_s < 0 ||
+        tuning.keepalive_interval_s < 1) {
+        std::cerr << "Backlog and keepalive interval must be at least 1; buffer sizes and keepalive idle time"
+                  << " cannot be negative." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Creates a socket bound to the given port, not yet listening.
+ * @param bind_address IPv4 or IPv6 address to bind (validated by
+ *        parse_options); empty for every IPv4 interface.
+ * @return The bound socket, or INVALID_SOCKET on failure.
+ */
+SOCKET bind_listener(int port, bool reuse_port, const std::string &bind_address) {
+    struct sockaddr_storage address;
+    socklen_t address_length = 0;
+    make_listen_address(bind_address, port, address, address_length);
+
+    // --- Create server socket ---
+    SOCKET server_socket = socket(address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (server_socket == INVALID_SOCKET) {
+        LOG_EVENT(LogLevel::Error, "Socket creation failed").field("error", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+
+    if (!apply_listener_options(server_socket, options.tuning)) {
+        LOG_EVENT(LogLevel::Warn, "Listener option rejected").field("port", port).field("error", WSAGetLastError());
+    }
+
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        int enable = 1;
+        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, (const char *)&enable, sizeof(enable)) == SOCKET_ERROR) {
+            LOG_EVENT(LogLevel::Error, "SO_REUSEPORT failed").field("error", WSAGetLastError());
+            closesocket(server_socket);
+            return INVALID_SOCKET;
         }
     }
+#else
+    (void)reuse_port;
+#endif
+
+    // "::" takes IPv4 clients too; Windows makes IPv6 sockets IPv6-only by default
+    if (address.ss_family == AF_INET6 && !set_int_option(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, 0)) {
+        LOG_EVENT(LogLevel::Warn, "Listener stays IPv6-only").field("port", port);
+    }
+
+    // --- Bind the socket ---
+    if (bind(server_socket, (struct sockaddr *)&address, address_length) == SOCKET_ERROR) {
+        LOG_EVENT(LogLevel::Error, "Bind failed")
+            .field("address", bind_address.empty() ? std::string("*") : bind_address)
+            .field("port", port)
+            .field("error", WSAGetLastError());
+        closesocket(server_socket);
+        return INVALID_SOCKET;
+    }
+
+    return server_socket;
+}
+
+/**
+ * @brief Creates a socket listening on the given port.
+ * @param bind_address As for bind_listener().
+ * @return The listening socket, or INVALID_SOCKET on failure.
+ */
+SOCKET create_listener(int port, bool reuse_port, const std::string &bind_address) {
+    SOCKET server_socket = bind_listener(port, reuse_port, bind_address);
+    if (server_socket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+    // --- Listen for incoming connections ---
+    if (listen(server_socket, options.tuning.backlog) == SOCKET_ERROR) {
+        LOG_EVENT(LogLevel::Error, "Listen failed").field("error", WSAGetLastError());
+        closesocket(server_socket);
+        return INVALID_SOCKET;
+    }
+
+    return server_socket;
 }
 
 /**
- * @brief Handles communication with a single client.
+ * @brief Runs one reactor, dispatching socket readiness to client callbacks,
+ *        until the server stops.
  */
-void handle_client(SOCKET client_socket) {
-    char buffer[4096];
-    std::string client_id = "Client " + std::to_string(client_socket);
+void run_reactor(Reactor *reactor) {
+    log_thread_index() = reactor->index;
+    pin_current_thread(reactor->index);
+    reserve_pools(reactor);
+
+    std::vector<PollEvent> events;
+    events.reserve(POLLER_BATCH_SIZE);
+
+    const std::chrono::seconds stats_interval(MEMORY_STATS_INTERVAL_S);
+    std::chrono::steady_clock::time_point next_stats = std::chrono::steady_clock::now() + stats_interval;
 
     while (true) {
-        int bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+        // Wake up periodically while some clients' wire format is still unknown
+        int timeout_ms = reactor->undecided.empty() ? -1 : PREFACE_TIMEOUT_MS / 5;
+        if (reactor->accept_paused) {
+            std::chrono::steady_clock::duration left = reactor->accept_resume_at - std::chrono::steady_clock::now();
+            int resume_ms = (int)std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1);
+            timeout_ms = timeout_ms < 0 ? resume_ms : std::min(timeout_ms, resume_ms);
+        }
+        int timer_ms = timer_timeout_ms(reactor);
+        if (timer_ms >= 0) {
+            timeout_ms = timeout_ms < 0 ? timer_ms : std::min(timeout_ms, timer_ms);
+        }
+        int batch_ms = batch_timeout_ms(reactor);
+        if (batch_ms >= 0) {
+            timeout_ms = timeout_ms < 0 ? batch_ms : std::min(timeout_ms, batch_ms);
+        }
+        int presence_ms = presence_timeout_ms(reactor);
+        if (presence_ms >= 0) {
+            timeout_ms = timeout_ms < 0 ? presence_ms : std::min(timeout_ms, presence_ms);
+        }
+        if (reactor->draining) {
+            timeout_ms = timeout_ms < 0 ? TIMER_TICK_MS : std::min(timeout_ms, TIMER_TICK_MS); // Mind the deadline
+        }
+        if (!reactor->handshakes.empty()) {
+            timeout_ms = 0; // Keep admitting the backlog between I/O passes
+        }
+#ifdef CHAT_COROUTINES
+        if (!reactor->resumable.empty()) {
+            timeout_ms = 0; // Handlers are ready to go on
+        }
+#endif
+        if (reactor->poller.wait(events, timeout_ms) < 0) {
+            LOG_EVENT(LogLevel::Error, "Poller wait failed").field("error", WSAGetLastError());
+            continue;
+        }
+        reactor->tick = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                  std::chrono::steady_clock::now() - reactor->timer_origin)
+                                                  .count()) /
+                        TIMER_TICK_MS;
 
-        if (bytes_received > 0) {
-            std::string message(buffer, bytes_received);
-            std::string broadcast_msg = client_id + ": " + message;
-            std::cout << "Broadcasting: " << broadcast_msg << std::endl;
-            broadcast_message(broadcast_msg, client_socket);
-        } else {
-            std::cout << client_id << " disconnected." << std::endl;
-            
-            {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                client_sockets.erase(std::remove(client_sockets.begin(), client_sockets.end(), client_socket), client_sockets.end());
-            }
-            
-            std::string disconnect_msg = client_id + " has left the chat.";
-            broadcast_message(disconnect_msg, -1);
-            
-            closesocket(client_socket);
-            break;
+        // Read before draining, so every socket main() handed off before
+        // asking to stop is in the inbox
+        StopMode mode = stop_mode.load();
+        if (mode == StopMode::Handoff) {
+            package_clients(reactor);
+            return;
+        }
+
+        // Clear before draining so a message pushed meanwhile wakes us again
+        reactor->wake_pending.store(false);
+        drain_inbox(reactor);
+        if (mode == StopMode::Drain && !reactor->draining) {
+            begin_drain(reactor);
+        }
+        resume_accepting(reactor);
+
+        for (const PollEvent &event : events) {
+            if (event.user_data == NULL) {
+                if (reactor->listen_socket != INVALID_SOCKET) {
+                    accept_clients(reactor);
+                }
+                continue;
+            }
+            Connection *conn = static_cast<Connection *>(event.user_data);
+            if (conn->closing) {
+                continue;
+            }
+            if (event.events & (POLL_READ | POLL_ERROR)) {
+                handle_client_readable(conn);
+            }
+            if (!conn->closing && (event.events & POLL_WRITE)) {
+                handle_client_writable(conn);
+            }
+        }
+
+        admit_clients(reactor);
+        expire_undecided(reactor);
+        run_timers(reactor);
+        fan_out_presence(reactor, false);
+        fan_out_batches(reactor, false);
+        flush_pending(reactor);
+#ifdef CHAT_COROUTINES
+        // Flushing let some clients catch up; what their handlers send next
+        // goes out in the same pass
+        resume_handlers(reactor);
+        flush_pending(reactor);
+#endif
+
+        // Events later in the batch may still point at a closed connection,
+        // so connections are only freed once the whole batch is processed.
+        for (Connection *conn : reactor->closed) {
+            while (!conn->rooms.empty()) {
+                leave_room(conn, conn->rooms.size() - 1, false);
+            }
+            reactor->connections.destroy(conn);
+        }
+        reactor->closed.clear();
+
+        if (reactor->draining && drained(reactor)) {
+            close_all(reactor);
+            return;
+        }
+
+        if (reactor->index == 0 && std::chrono::steady_clock::now() >= next_stats) {
+            report_memory_stats();
+            next_stats = std::chrono::steady_clock::now() + stats_interval;
         }
     }
 }
+
+/**
+ * @brief Picks up sockets and broadcasts other threads queued for a reactor.
+ *
+ * Handed-off sockets join the handshake queue and are admitted later.
+ */
+void drain_inbox(Reactor *reactor) {
+    std::vector<SOCKET> sockets;
+    {
+        std::lock_guard<std::mutex> lock(reactor->inbox_mutex);
+        sockets.swap(reactor->accepted_sockets);
+    }
+    reactor->handshakes.insert(reactor->handshakes.end(), sockets.begin(), sockets.end());
+
+    ShardMessage message;
+    while (reactor->messages.pop(message)) {
+        if (message.room == NULL) {
+            deliver_direct(reactor, message.recipient, message.sender, message.text, message.received_ns);
+        } else {
+            deliver_local(reactor, message.room, message.text, message.sender, message.received_ns);
+        }
+    }
+}
+
+/**
+ * @brief Accepts a batch of connections on a reactor's own listener.
+ *
+ * If the rate limit or the descriptor supply runs out, the listener is left
+ * unwatched for a while and new connections wait in the kernel backlog.
+ */
+void accept_clients(Reactor *reactor) {
+    int pause_ms = accept_batch(reactor->listen_socket, reactor->accept_tokens, reactor->metrics, reactor->handshakes);
+    if (pause_ms > 0) {
+        reactor->poller.modify(reactor->listen_socket, 0, NULL);
+        reactor->accept_paused = true;
+        reactor->accept_resume_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(pause_ms);
+    }
+}
+
+/**
+ * @brief Watches a paused listener again once its pause is over.
+ */
+void resume_accepting(Reactor *reactor) {
+    if (reactor->accept_paused && std::chrono::steady_clock::now() >= reactor->accept_resume_at) {
+        reactor->accept_paused = false;
+        reactor->poller.modify(reactor->listen_socket, POLL_READ, NULL);
+    }
+}
+
+/**
+ * @brief Accepts pending connections from a non-blocking listener.
+ *
+ * Stops once the backlog is empty, after MAX_ACCEPTS_PER_BATCH connections,
+ * or when @p tokens runs out; connections not taken stay in the backlog.
+ * @return Milliseconds to stop accepting for, or 0 to keep going.
+ */
+int accept_batch(SOCKET listener, TokenBucket &tokens, ThreadMetrics &metrics, std::deque<SOCKET> &accepted) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (int i = 0; i < MAX_ACCEPTS_PER_BATCH; ++i) {
+        int wait_ms = tokens.wait_ms(now);
+        if (wait_ms > 0) {
+            metrics.add(Counter::AcceptPauses);
+            return wait_ms;
+        }
+
+        SOCKET client_socket = accept_nonblocking(listener);
+        if (client_socket == INVALID_SOCKET) {
+            int error = WSAGetLastError();
+            if (error == WSAEWOULDBLOCK) {
+                return 0;
+            }
+            LOG_EVENT(LogLevel::Error, "Accept failed").field("error", error);
+            metrics.add(Counter::AcceptErrors);
+            if (error == WSAEMFILE || error == WSAENOBUFS) {
+                metrics.add(Counter::AcceptPauses);
+                return ACCEPT_BACKOFF_MS;
+            }
+            continue;
+        }
+
+        tokens.try_take(now);
+        LOG_EVENT(LogLevel::Info, "New client connected").field("socket", client_socket);
+        metrics.add(Counter::ConnectionsAccepted);
+        accepted.push_back(client_socket);
+    }
+    return 0;
+}
+
+/**
+ * @brief Accepts one connection as a non-blocking socket; on Linux with a
+ *        single accept4 call.
+ * @return The socket, or INVALID_SOCKET.
+ */
+SOCKET accept_nonblocking(SOCKET listener) {
+#ifdef __linux__
+    return accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET client_socket = accept(listener, NULL, NULL);
+    if (client_socket != INVALID_SOCKET && !set_non_blocking(client_socket)) {
+        closesocket(client_socket);
+        return INVALID_SOCKET;
+    }
+    return client_socket;
+#endif
+}
+
+/**
+ * @brief Deals accepted sockets out to the reactors round-robin.
+ *
+ * Each reactor's inbox is locked and woken once per batch rather than once
+ * per connection.
+ */
+void hand_off(std::deque<SOCKET> &accepted, size_t &next_reactor) {
+    size_t count = reactors.size();
+    for (size_t offset = 0; offset < count && offset < accepted.size(); ++offset) {
+        Reactor *target = reactors[(next_reactor + offset) % count];
+        {
+            std::lock_guard<std::mutex> lock(target->inbox_mutex);
+            for (size_t i = offset; i < accepted.size(); i += count) {
+                target->accepted_sockets.push_back(accepted[i]);
+            }
+        }
+        target->poller.wake();
+    }
+    next_reactor = (next_reactor + accepted.size()) % count;
+    accepted.clear();
+}
+
+/**
+ * @brief Admits up to MAX_ADMISSIONS_PER_PASS sockets from the handshake queue.
+ *
+ * Until it is admitted a socket is only a handle in the queue: it has no
+ * connection state, poller registration or room membership yet.
+ */
+void admit_clients(Reactor *reactor) {
+    for (size_t i = 0; i < MAX_ADMISSIONS_PER_PASS && !reactor->handshakes.empty(); ++i) {
+        SOCKET client_socket = reactor->handshakes.front();
+        reactor->handshakes.pop_front();
+        adopt_client(reactor, client_socket);
+    }
+}
+
+/**
+ * @brief Registers an accepted, non-blocking socket with a reactor.
+ */
+void adopt_client(Reactor *reactor, SOCKET client_socket) {
+    Connection *conn = register_client(reactor, client_socket, new_session(reactor));
+    if (conn == NULL) {
+        return;
+    }
+#ifdef CHAT_TLS
+    if (tls_context.valid() && !start_tls(conn)) {
+        return;
+    }
+#endif
+    reactor->undecided.push_back(conn);
+    join_room(conn, LOBBY_ROOM, false);
+}
+
+/**
+ * @brief Creates the state of a client in no room yet, with the given
+ *        session, and starts watching its socket.
+ * @return The connection, or NULL if the socket was closed instead.
+ */
+Connection *register_client(Reactor *reactor, SOCKET client_socket, uint64_t session) {
+    if (!apply_connection_options(client_socket, options.tuning)) {
+        LOG_EVENT(LogLevel::Warn, "Client socket option rejected").field("error", WSAGetLastError());
+    }
+
+    Connection *conn = reactor->connections.create(options.queue_limit);
+    conn->socket = client_socket;
+    conn->reactor = reactor;
+    conn->session = session;
+    conn->client_id = "Client " + std::to_string(conn->session);
+    conn->prefix = make_message(FRAME_CHAT, conn->client_id + ": ");
+    conn->connected_at = std::chrono::steady_clock::now();
+    conn->dropped_messages = 0;
+    conn->format_known = false;
+    conn->compression = false;
+    conn->presence = false;
+    conn->write_interest = false;
+    conn->flush_pending = false;
+    conn->falling_behind = false;
+    conn->idle_timer.owner = conn;
+    conn->heard_tick = reactor->tick;
+    conn->ping_sent = false;
+    conn->throttled = false;
+    conn->fan_out_mark = false;
+    // Bursts of up to a second's worth
+    if (options.client_rate > 0) {
+        conn->message_budget.configure(options.client_rate, options.client_rate, conn->connected_at);
+    }
+    if (options.client_byte_rate > 0) {
+        conn->byte_budget.configure(options.client_byte_rate, options.client_byte_rate, conn->connected_at);
+    }
+    conn->current_room = NULL;
+    conn->closing = false;
+#ifdef CHAT_TLS
+    conn->tls = NULL; // Plain unless start_tls() follows
+    conn->tls_handshake_ns = 0;
+    conn->tls_ready = false;
+    conn->tls_want_write = false;
+    conn->ktls_send = false;
+#endif
+#ifdef CHAT_COROUTINES
+    conn->window = NULL;
+    conn->window_size = 0;
+    conn->window_offset = 0;
+    conn->awaiting_output = false;
+    conn->resume_pending = false;
+#endif
+
+    if (!reactor->poller.add(client_socket, POLL_READ, conn)) {
+        LOG_EVENT(LogLevel::Error, "Client registration failed").field("error", WSAGetLastError());
+        closesocket(client_socket);
+        reactor->connections.destroy(conn);
+        reactor->metrics.add(Counter::ConnectionsClosed);
+        return NULL;
+    }
+
+    reactor->sessions[conn->session] = conn;
+    return conn;
+}
+
+/**
+ * @brief Hands out the next session id of a reactor's.
+ *
+ * Ids are interleaved across reactors (reactor i issues i, i + N, i + 2N, ...
+ * above 0, for N reactors), so any thread can tell which reactor owns a
+ * session without a shared index.
+ */
+uint64_t new_session(Reactor *reactor) {
+    return ++reactor->issued_sessions * reactors.size() + reactor->index;
+}
+
+Reactor *session_owner(uint64_t session) {
+    return reactors[session % reactors.size()];
+}
+
+/**
+ * @brief Makes SIGTERM and SIGINT (Ctrl+C, or closing the console on
+ *        Windows) stop the server gracefully instead of killing it.
+ */
+#ifdef _WIN32
+BOOL WINAPI handle_console_event(DWORD event) {
+    if (event == CTRL_C_EVENT || event == CTRL_BREAK_EVENT || event == CTRL_CLOSE_EVENT) {
+        stop_requested.store(true);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void install_stop_handlers() {
+    SetConsoleCtrlHandler(handle_console_event, TRUE);
+}
+#else
+void handle_stop_signal(int) {
+    stop_requested.store(true);
+}
+
+void install_stop_handlers() {
+    std::signal(SIGTERM, handle_stop_signal);
+    std::signal(SIGINT, handle_stop_signal);
+}
+#endif
+
+/**
+ * @brief Stops a reactor taking clients and tells everyone connected to it
+ *        that the server is going away.
+ *
+ * Clients keep being served until their queues are flushed (see drained()).
+ */
+void begin_drain(Reactor *reactor) {
+    reactor->draining = true;
+    reactor->drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.drain_timeout_s);
+
+    if (reactor->listen_socket != INVALID_SOCKET) {
+        reactor->poller.remove(reactor->listen_socket);
+        closesocket(reactor->listen_socket);
+        reactor->listen_socket = INVALID_SOCKET;
+        reactor->accept_paused = false;
+    }
+    for (SOCKET client_socket : reactor->handshakes) {
+        closesocket(client_socket);
+        reactor->metrics.add(Counter::ConnectionsClosed);
+    }
+    reactor->handshakes.clear();
+
+    // Queueing can close a client, which removes it from sessions; closed
+    // connections are only freed at the end of the loop iteration
+    std::vector<Connection *> clients;
+    clients.reserve(reactor->sessions.size());
+    for (const std::pair<const uint64_t, Connection *> &entry : reactor->sessions) {
+        clients.push_back(entry.second);
+    }
+    MessageRef notice = make_message(FRAME_NOTICE, "Server is shutting down.");
+    for (Connection *conn : clients) {
+        queue_output(conn, notice);
+    }
+}
+
+/**
+ * @return True once a draining reactor has flushed every client's queue or
+ *         run out of time.
+ */
+bool drained(Reactor *reactor) {
+    if (std::chrono::steady_clock::now() >= reactor->drain_deadline) {
+        return true;
+    }
+    if (batch_timeout_ms(reactor) >= 0) {
+        return false; // Batched chat still to fan out
+    }
+    for (const std::pair<const uint64_t, Connection *> &entry : reactor->sessions) {
+        if (output_pending(entry.second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Disconnects a drained reactor's clients without notices; the
+ *        process is about to exit.
+ */
+void close_all(Reactor *reactor) {
+    size_t unsent = 0;
+    for (const std::pair<const uint64_t, Connection *> &entry : reactor->sessions) {
+        Connection *conn = entry.second;
+        if (output_pending(conn)) {
+            ++unsent;
+        }
+        closesocket(conn->socket);
+        reactor->metrics.add(Counter::ConnectionsClosed);
+    }
+    LOG_EVENT(LogLevel::Info, "Worker drained")
+        .field("worker", reactor->index)
+        .field("clients", reactor->sessions.size())
+        .field("unflushed", unsent);
+    reactor->sessions.clear();
+}
+
+/**
+ * @brief Packages all of a reactor's clients for a successor process and
+ *        stops watching their sockets, which stay open.
+ *
+ * Each reactor waits for all the others first: from then on no reactor
+ * broadcasts, so the inbox drained here is the last one and everything
+ * queued for a client is in its package. TLS clients, whose sessions
+ * cannot move to another process, are asked to reconnect instead.
+ */
+void package_clients(Reactor *reactor) {
+    fan_out_presence(reactor, true);
+    fan_out_batches(reactor, true);
+    handoff_arrivals.fetch_add(1);
+    while (handoff_arrivals.load() < reactors.size()) {
+        std::this_thread::yield();
+    }
+    drain_inbox(reactor);
+
+    if (reactor->listen_socket != INVALID_SOCKET) {
+        reactor->poller.remove(reactor->listen_socket);
+    }
+    for (SOCKET client_socket : reactor->handshakes) {
+        HandoffClient client;
+        client.socket = client_socket;
+        reactor->handed_off.push_back(client);
+    }
+    reactor->handshakes.clear();
+
+    for (const std::pair<const uint64_t, Connection *> &entry : reactor->sessions) {
+        Connection *conn = entry.second;
+#ifdef CHAT_TLS
+        if (conn->tls != NULL) {
+            hang_up_tls(conn);
+            continue;
+        }
+#endif
+        HandoffClient client;
+        client.socket = conn->socket;
+        client.session = conn->session;
+        client.compression = conn->compression;
+        client.presence = conn->presence;
+        if (conn->current_room != NULL) {
+            client.current_room = conn->current_room->name;
+        }
+        for (const Membership &membership : conn->rooms) {
+            client.rooms.push_back(membership.room->name);
+        }
+        if (conn->input != NULL) {
+            client.input.assign(conn->input->data.data(), conn->input->length);
+        }
+        // Until the format is known nothing has been sent; the successor
+        // replays the lobby instead
+        if (conn->format_known) {
+            client.format = 1 + static_cast<uint8_t>(conn->output.format());
+            ByteSpan spans[MAX_SEND_SPANS];
+            int count;
+            while ((count = conn->output.gather(spans, MAX_SEND_SPANS)) > 0) {
+                size_t bytes = 0;
+                for (int i = 0; i < count; ++i) {
+                    client.output.append(spans[i].data, spans[i].length);
+                    bytes += spans[i].length;
+                }
+                conn->output.consume(bytes);
+            }
+        }
+        reactor->poller.remove(conn->socket);
+        reactor->handed_off.push_back(client);
+    }
+    reactor->sessions.clear();
+}
+
+/**
+ * @brief Connects to a server running at the handoff path and takes over
+ *        its listeners and clients.
+ * @return False if no server is running there.
+ */
+bool take_over(const std::string &path, Inheritance &inherited) {
+    HandoffChannel predecessor;
+    if (!predecessor.connect_to(path)) {
+        return false;
+    }
+    LOG_EVENT(LogLevel::Info, "Taking over from running server").field("path", path);
+
+    uint8_t kind;
+    std::string payload;
+    SOCKET passed;
+    bool complete = false;
+    while (predecessor.receive_record(kind, payload, passed)) {
+        if (kind == HANDOFF_END) {
+            complete = true;
+            break;
+        }
+        if (kind == HANDOFF_LISTENER && passed != INVALID_SOCKET && payload.size() == 1) {
+            switch (static_cast<ListenerRole>(payload[0])) {
+            case ListenerRole::Clients:
+                inherited.client_listeners.push_back(passed);
+                continue;
+            case ListenerRole::Cluster:
+                inherited.cluster_listeners.push_back(passed);
+                continue;
+            case ListenerRole::Metrics:
+                inherited.metrics_listeners.push_back(passed);
+                continue;
+            }
+        }
+        if (kind == HANDOFF_TICKET_KEYS && passed == INVALID_SOCKET) {
+            inherited.tls_ticket_keys = payload;
+            continue;
+        }
+        HandoffClient client;
+        if (kind == HANDOFF_CLIENT && passed != INVALID_SOCKET && decode_handoff_client(payload, client)) {
+            client.socket = passed;
+            inherited.clients.push_back(client);
+            continue;
+        }
+        LOG_EVENT(LogLevel::Warn, "Handoff record unusable").field("kind", kind);
+        if (passed != INVALID_SOCKET) {
+            closesocket(passed);
+        }
+    }
+
+    if (complete) {
+        predecessor.send_record(HANDOFF_DONE, std::string());
+    } else {
+        LOG_EVENT(LogLevel::Error, "Handoff broke off; the rest of the clients are lost")
+            .field("error", WSAGetLastError());
+    }
+    LOG_EVENT(LogLevel::Info, "Took over")
+        .field("clients", inherited.clients.size())
+        .field("listeners", inherited.client_listeners.size() + inherited.cluster_listeners.size() +
+                                inherited.metrics_listeners.size());
+    return true;
+}
+
+/**
+ * @brief The port of an IPv4 or IPv6 socket address.
+ */
+int listener_port(const struct sockaddr_storage &address) {
+    if (address.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const struct sockaddr_in6 *>(&address)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<const struct sockaddr_in *>(&address)->sin_port);
+}
+
+/**
+ * @brief Takes an inherited listener still bound to @p port out of
+ *        @p listeners; ones on other ports are closed.
+ * @return The listener, or INVALID_SOCKET if none was inherited.
+ */
+SOCKET inherited_listener(std::vector<SOCKET> &listeners, int port) {
+    while (!listeners.empty()) {
+        SOCKET listener = listeners.back();
+        listeners.pop_back();
+        struct sockaddr_storage address;
+        socklen_t length = sizeof(address);
+        if (getsockname(listener, (struct sockaddr *)&address, &length) == 0 && listener_port(address) == port) {
+            return listener;
+        }
+        LOG_EVENT(LogLevel::Warn, "Inherited listener on another port").field("port", port);
+        closesocket(listener);
+    }
+    return INVALID_SOCKET;
+}
+
+/**
+ * @brief Carries on serving a client a predecessor process handed over.
+ *
+ * The client keeps its session and rooms, and its unparsed input and
+ * unsent output continue where they left off. Room members are not told,
+ * since to them nothing happened.
+ */
+void resume_client(Reactor *reactor, const HandoffClient &client) {
+    if (client.session == 0) {
+        adopt_client(reactor, client.socket); // Never admitted: simply a new client
+        return;
+    }
+    Connection *conn = register_client(reactor, client.socket, client.session);
+    if (conn == NULL) {
+        return;
+    }
+
+    bool format_known = client.format != 0;
+    for (const std::string &name : client.rooms) {
+        join_room(conn, name, false, !format_known);
+    }
+    int current = find_membership(conn, client.current_room.data(), client.current_room.size());
+    conn->current_room = current >= 0 ? conn->rooms[current].room : NULL;
+
+    if (!client.input.empty()) {
+        BufferPool &pool = reactor->read_buffers;
+        conn->input = pool.acquire();
+        while (conn->input->data.size() < client.input.size()) {
+            if (!pool.grow(conn->input)) {
+                break;
+            }
+        }
+        conn->input->length = std::min(client.input.size(), conn->input->data.size());
+        std::memcpy(conn->input->data.data(), client.input.data(), conn->input->length);
+    }
+
+    if (!format_known) {
+        reactor->undecided.push_back(conn);
+        return;
+    }
+    WireFormat format = static_cast<WireFormat>(client.format - 1);
+    conn->compression = client.compression;
+    conn->presence = client.presence;
+    if (!client.output.empty()) {
+        // The unsent bytes become one message the client has already
+        // received the rest of: a line rendition adds back the final newline,
+        // and a frame's own header counts as written
+        const std::string &rest = client.output;
+        if (format == WireFormat::Line) {
+            conn->output.push(make_message(FRAME_NOTICE, rest.data(), rest.size() - (rest.back() == '\n' ? 1 : 0)));
+        } else {
+            MessageRef message = make_message(FRAME_NOTICE, rest.data(), rest.size());
+            conn->output.push(message, message->wire_size(WireFormat::Framed) - message->text_size());
+        }
+    }
+    set_wire_format(conn, format);
+}
+
+/**
+ * @brief Sends every listener and packaged client to a successor process.
+ *
+ * This process's descriptors are closed only once the successor confirms,
+ * so no socket is ever without an owner.
+ */
+void hand_over(HandoffChannel &successor, const std::vector<std::pair<SOCKET, ListenerRole>> &listeners) {
+    std::vector<SOCKET> sent;
+    bool ok = true;
+    for (const std::pair<SOCKET, ListenerRole> &listener : listeners) {
+        ok = ok && successor.send_record(HANDOFF_LISTENER, std::string(1, static_cast<char>(listener.second)),
+                                         listener.first);
+        sent.push_back(listener.first);
+    }
+    size_t clients = 0;
+    for (Reactor *reactor : reactors) {
+        for (const HandoffClient &client : reactor->handed_off) {
+            if (ok && successor.send_record(HANDOFF_CLIENT, encode_handoff_client(client), client.socket)) {
+                ++clients;
+            } else {
+                ok = false;
+            }
+            sent.push_back(client.socket);
+        }
+    }
+
+#ifdef CHAT_TLS
+    if (tls_context.valid()) {
+        ok = ok && successor.send_record(HANDOFF_TICKET_KEYS, tls_context.ticket_keys());
+    }
+#endif
+
+    uint8_t kind = 0;
+    std::string payload;
+    SOCKET passed;
+    ok = ok && successor.send_record(HANDOFF_END, std::string()) && successor.receive_record(kind, payload, passed) &&
+         kind == HANDOFF_DONE;
+    if (ok) {
+        LOG_EVENT(LogLevel::Info, "Handed off to successor").field("clients", clients).field("listeners", listeners.size());
+    } else {
+        LOG_EVENT(LogLevel::Error, "Handoff failed").field("clients_sent", clients).field("error", WSAGetLastError());
+    }
+    for (SOCKET socket : sent) {
+        closesocket(socket);
+    }
+}
+
+/**
+ * @brief Broadcasts a message to everyone in a room except the sender.
+ *
+ * The origin reactor delivers to its own members directly and pushes one
+ * shared copy onto the lock-free inbox of every other reactor that has
+ * members in the room, so no lock is taken or held anywhere on the fan-out
+ * path and reactors without members never hear of the message.
+ * @param received_ns When the message was read from its sender; 0 for
+ *        server notices, which are left out of the fan-out latency.
+ */
+void broadcast_message(Reactor *origin, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                       uint64_t received_ns) {
+    flush_room_batch(origin, room);
+    uint64_t started_ns = monotonic_ns();
+    share_with_reactors(origin, room, message, sender, received_ns);
+    if (room->peers.load(std::memory_order_relaxed) != 0) {
+        cluster.publish(room, message);
+    }
+    deliver_local(origin, room, message, sender, received_ns);
+    origin->metrics.broadcast_duration.record(monotonic_ns() - started_ns);
+}
+
+/**
+ * @brief Pushes one shared copy of a room message onto the inbox of every
+ *        reactor other than @p origin that has members in the room.
+ */
+void share_with_reactors(Reactor *origin, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                         uint64_t received_ns) {
+    if (reactors.size() < 2) {
+        return;
+    }
+    uint64_t present = room->reactors.load(std::memory_order_acquire);
+    for (Reactor *reactor : reactors) {
+        uint64_t bit = reactor_bit(reactor->index);
+        if (reactor == origin || (bit != 0 && !(present & bit))) {
+            continue;
+        }
+        reactor->messages.push(ShardMessage{message, room, sender, 0, received_ns});
+        // Only the first message since the reactor last drained needs a wake-up
+        if (!reactor->wake_pending.exchange(true)) {
+            reactor->poller.wake();
+        }
+    }
+}
+
+/**
+ * @brief Adds a chat message to the batch its batched room is collecting
+ *        on @p origin, which is fanned out once the room's window is over.
+ *
+ * A batch that grows past MAX_BATCH_MESSAGES or MAX_BATCH_BYTES is fanned
+ * out right away.
+ */
+void batch_message(Reactor *origin, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                   uint64_t received_ns) {
+    RoomBatch &batch = origin->batches[room->id];
+    if (!batch.open) {
+        batch.room = room;
+        batch.bytes = 0;
+        batch.received_ns = received_ns;
+        batch.due_ns = monotonic_ns() + (uint64_t)room->batch_window_ms * 1000000;
+        batch.open = true;
+        if (!batch.listed) {
+            batch.listed = true;
+            origin->open_batches.push_back(&batch);
+        }
+    }
+    batch.messages.push_back(message);
+    batch.senders.push_back(sender);
+    batch.bytes += message->wire_size(WireFormat::Framed);
+    if (batch.messages.size() >= MAX_BATCH_MESSAGES || batch.bytes >= MAX_BATCH_BYTES) {
+        fan_out_batch(origin, batch);
+    }
+}
+
+/**
+ * @brief Sends a batch to the room's members everywhere and empties it.
+ *
+ * The messages are encoded once, into one batch buffer (see message.h)
+ * that every member who said nothing in the batch gets as a single queued
+ * message. Only the batch's senders, all of them on @p origin, get the
+ * others' messages one by one, without their own. Cluster peers get the
+ * messages one by one as well.
+ */
+void fan_out_batch(Reactor *origin, RoomBatch &batch) {
+    uint64_t started_ns = monotonic_ns();
+    RoomInfo *room = batch.room;
+    batch.open = false;
+    if (batch.messages.size() == 1) {
+        share_with_reactors(origin, room, batch.messages[0], batch.senders[0], batch.received_ns);
+        if (room->peers.load(std::memory_order_relaxed) != 0) {
+            cluster.publish(room, batch.messages[0]);
+        }
+        deliver_local(origin, room, batch.messages[0], batch.senders[0], batch.received_ns);
+    } else {
+        std::vector<const MessageBuffer *> parts;
+        parts.reserve(batch.messages.size());
+        bool compressed = false;
+        for (const MessageRef &message : batch.messages) {
+            parts.push_back(message.get());
+            compressed = compressed || message->compressed() != NULL;
+        }
+        MessageRef combined(MessageBuffer::create_batch(parts.data(), parts.size()));
+        if (compressed) {
+            combined->set_compressed(MessageBuffer::create_batch(parts.data(), parts.size(), true));
+        }
+
+        share_with_reactors(origin, room, combined, 0, batch.received_ns);
+        if (room->peers.load(std::memory_order_relaxed) != 0) {
+            for (const MessageRef &message : batch.messages) {
+                cluster.publish(room, message);
+            }
+        }
+
+        for (uint64_t sender : batch.senders) {
+            std::unordered_map<uint64_t, Connection *>::iterator it = origin->sessions.find(sender);
+            if (it != origin->sessions.end()) {
+                it->second->fan_out_mark = true;
+            }
+        }
+        std::unordered_map<uint32_t, RoomMembers<Connection *>>::iterator it = origin->rooms.find(room->id);
+        if (it != origin->rooms.end()) {
+            const RoomMembers<Connection *> &members = it->second;
+            for (size_t i = 0; i < members.size(); ++i) {
+                Connection *conn = members[i];
+                if (!conn->fan_out_mark) {
+                    queue_output(conn, combined);
+                    continue;
+                }
+                for (size_t j = 0; j < batch.messages.size(); ++j) {
+                    if (batch.senders[j] != conn->session) {
+                        queue_output(conn, batch.messages[j]);
+                    }
+                }
+            }
+            origin->metrics.fanout_latency.record(monotonic_ns() - batch.received_ns);
+        }
+        for (uint64_t sender : batch.senders) {
+            std::unordered_map<uint64_t, Connection *>::iterator member = origin->sessions.find(sender);
+            if (member != origin->sessions.end()) {
+                member->second->fan_out_mark = false;
+            }
+        }
+        origin->metrics.add(Counter::BatchesFannedOut);
+        origin->metrics.add(Counter::MessagesBatched, batch.messages.size());
+    }
+    origin->metrics.broadcast_duration.record(monotonic_ns() - started_ns);
+    batch.messages.clear();
+    batch.senders.clear();
+}
+
+/**
+ * @brief Fans out the reactor's batches whose window is over, or all of
+ *        them if @p all is set.
+ */
+void fan_out_batches(Reactor *reactor, bool all) {
+    std::vector<RoomBatch *> &open = reactor->open_batches;
+    if (open.empty()) {
+        return;
+    }
+    uint64_t now_ns = monotonic_ns();
+    size_t kept = 0;
+    for (size_t i = 0; i < open.size(); ++i) {
+        RoomBatch *batch = open[i];
+        if (batch->open && (all || batch->due_ns <= now_ns)) {
+            fan_out_batch(reactor, *batch);
+        }
+        if (batch->open) {
+            open[kept++] = batch;
+        } else {
+            batch->listed = false;
+        }
+    }
+    open.resize(kept);
+}
+
+/**
+ * @brief Fans out the chat batched for @p room on @p origin, if any, so a
+ *        message sent to the room next does not overtake it.
+ */
+void flush_room_batch(Reactor *origin, RoomInfo *room) {
+    if (room->batch_window_ms == 0) {
+        return;
+    }
+    std::unordered_map<uint32_t, RoomBatch>::iterator it = origin->batches.find(room->id);
+    if (it != origin->batches.end() && it->second.open) {
+        fan_out_batch(origin, it->second);
+    }
+}
+
+/**
+ * @brief Milliseconds until the reactor's next batch is due; -1 if none is open.
+ */
+int batch_timeout_ms(const Reactor *reactor) {
+    if (reactor->open_batches.empty()) {
+        return -1;
+    }
+    uint64_t now_ns = monotonic_ns();
+    uint64_t left_ns = UINT64_MAX;
+    for (const RoomBatch *batch : reactor->open_batches) {
+        if (batch->open) {
+            left_ns = std::min(left_ns, batch->due_ns > now_ns ? batch->due_ns - now_ns : 0);
+        }
+    }
+    if (left_ns == UINT64_MAX) {
+        return -1;
+    }
+    return (int)((left_ns + 999999) / 1000000);
+}
+
+/**
+ * @brief Delivers a message another node forwarded to this node's members.
+ *
+ * Runs on the cluster thread, which hands the message to every reactor with
+ * members in the room the same way a reactor hands off its broadcasts.
+ */
+void deliver_from_peer(RoomInfo *room, const MessageRef &message) {
+    if (room->history != NULL && message->frame_type() == FRAME_CHAT) {
+        room->history->record(message);
+    }
+    uint64_t present = room->reactors.load(std::memory_order_acquire);
+    for (Reactor *reactor : reactors) {
+        uint64_t bit = reactor_bit(reactor->index);
+        if (bit != 0 && !(present & bit)) {
+            continue;
+        }
+        reactor->messages.push(ShardMessage{message, room, 0, 0, 0});
+        if (!reactor->wake_pending.exchange(true)) {
+            reactor->poller.wake();
+        }
+    }
+}
+
+/**
+ * @brief Queues a message for a room's members on one reactor, except the sender.
+ *
+ * Nothing is written here: each recipient's queue is flushed once, with a
+ * single gather send, at the end of the loop iteration. Members closed
+ * mid-broadcast stay in the room until the iteration ends and are skipped,
+ * so the array never changes while it is being walked.
+ */
+void deliver_local(Reactor *reactor, RoomInfo *room, const MessageRef &message, uint64_t sender,
+                   uint64_t received_ns) {
+    std::unordered_map<uint32_t, RoomMembers<Connection *>>::iterator it = reactor->rooms.find(room->id);
+    if (it == reactor->rooms.end()) {
+        return;
+    }
+    uint64_t started_ns = message->trace_id() != 0 ? monotonic_ns() : 0;
+    const RoomMembers<Connection *> &members = it->second;
+    size_t recipients = 0;
+    for (size_t i = 0; i < members.size(); ++i) {
+        Connection *conn = members[i];
+        if (conn->session != sender) {
+            queue_output(conn, message);
+            ++recipients;
+        }
+    }
+    if (received_ns != 0) {
+        reactor->metrics.fanout_latency.record(monotonic_ns() - received_ns);
+    }
+    trace_fanout(reactor, message, started_ns, recipients);
+}
+
+/**
+ * @brief Records a traced message's fan-out on one reactor; @p started_ns
+ *        is when it began.
+ */
+void trace_fanout(Reactor *reactor, const MessageRef &message, uint64_t started_ns, size_t recipients) {
+    if (message->trace_id() != 0) {
+        reactor->trace.record(TracePhase::Fanout, started_ns, monotonic_ns(), message->trace_id(), recipients);
+    }
+}
+
+/**
+ * @brief Routes a message to the one client with session @p recipient.
+ *
+ * The recipient's reactor follows from its session id, so this is a single
+ * push onto that reactor's inbox, or no hand-off at all if it is @p origin.
+ * @param sender Session told if the recipient is not connected; 0: nobody.
+ */
+void send_direct(Reactor *origin, uint64_t recipient, uint64_t sender, const MessageRef &message,
+                 uint64_t received_ns) {
+    Reactor *owner = session_owner(recipient);
+    if (owner == origin) {
+        deliver_direct(origin, recipient, sender, message, received_ns);
+        return;
+    }
+    owner->messages.push(ShardMessage{message, NULL, sender, recipient, received_ns});
+    if (!owner->wake_pending.exchange(true)) {
+        owner->poller.wake();
+    }
+}
+
+/**
+ * @brief Queues a direct message for one of this reactor's clients, or tells
+ *        its sender that nobody has that session.
+ */
+void deliver_direct(Reactor *reactor, uint64_t recipient, uint64_t sender, const MessageRef &message,
+                    uint64_t received_ns) {
+    std::unordered_map<uint64_t, Connection *>::iterator it = reactor->sessions.find(recipient);
+    if (it != reactor->sessions.end()) {
+        uint64_t started_ns = message->trace_id() != 0 ? monotonic_ns() : 0;
+        queue_output(it->second, message);
+        if (received_ns != 0) {
+            reactor->metrics.fanout_latency.record(monotonic_ns() - received_ns);
+        }
+        trace_fanout(reactor, message, started_ns, 1);
+    } else if (sender != 0) {
+        send_direct(reactor, sender, 0,
+                    make_message(FRAME_NOTICE, "Client " + std::to_string(recipient) + " is not connected."), 0);
+    }
+}
+
+/**
+ * @brief Adds a client to a room, creating the room if needed, and makes it
+ *        the client's current room.
+ * @param announce Confirm to the client and tell the room's members.
+ * @param replay Queue the room's recent history for the client.
+ * @return False if the client or the server has too many rooms.
+ */
+bool join_room(Connection *conn, const std::string &name, bool announce, bool replay) {
+    int existing = find_membership(conn, name.data(), name.size());
+    if (existing >= 0) {
+        conn->current_room = conn->rooms[existing].room;
+        if (announce) {
+            send_notice(conn, "Now talking in room " + name + ".");
+        }
+        return true;
+    }
+    if (conn->rooms.size() >= MAX_ROOMS_PER_CLIENT) {
+        send_notice(conn, "You are already in " + std::to_string(MAX_ROOMS_PER_CLIENT) + " rooms.");
+        return false;
+    }
+    // Every client joins the lobby, so it skips the directory and its lock
+    RoomInfo *room = name == LOBBY_ROOM ? lobby_room : room_directory.intern(name);
+    if (room == NULL) {
+        send_notice(conn, "The server cannot create any more rooms.");
+        return false;
+    }
+
+    Reactor *reactor = conn->reactor;
+    RoomMembers<Connection *> &members = reactor->rooms[room->id];
+    if (members.empty()) {
+        room->reactors.fetch_or(reactor_bit(reactor->index));
+        if (cluster.active()) {
+            cluster.presence_changed(room);
+        }
+    }
+    Membership membership;
+    membership.room = room;
+    membership.prefix = room == lobby_room ? conn->prefix
+                                           : make_message(FRAME_CHAT, "[" + name + "] " + conn->client_id + ": ");
+    membership.slot = members.add(conn);
+    conn->rooms.push_back(membership);
+    conn->current_room = room;
+
+    if (announce) {
+        LOG_EVENT(LogLevel::Info, "Client joined room").field("client", conn->client_id).field("room", name);
+        send_notice(conn, "Joined room " + name + ".");
+    }
+    note_presence(conn, room, PresenceChange::Joined, announce);
+    if (conn->presence) {
+        send_presence_snapshot(conn, room);
+    }
+
+    // Replay what was said before, as far as the outbound queue has room;
+    // it leaves in as few gather sends as the queue allows
+    if (replay && room->history != NULL && conn->output.depth() < conn->output.capacity()) {
+        std::vector<MessageRef> recent;
+        room->history->recent(conn->output.capacity() - conn->output.depth(), recent);
+        for (const MessageRef &message : recent) {
+            queue_output(conn, message);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Removes a client from the room in conn->rooms[index].
+ * @param announce Confirm to the client and tell the room's members.
+ */
+void leave_room(Connection *conn, size_t index, bool announce) {
+    Reactor *reactor = conn->reactor;
+    RoomInfo *room = conn->rooms[index].room;
+    size_t slot = conn->rooms[index].slot;
+    conn->rooms[index] = conn->rooms.back();
+    conn->rooms.pop_back();
+
+    // Swap-remove, then fix the slot of the member that took our place
+    std::unordered_map<uint32_t, RoomMembers<Connection *>>::iterator it = reactor->rooms.find(room->id);
+    Connection *moved = it->second.remove(slot);
+    if (moved != NULL) {
+        moved->rooms[find_membership(moved, room)].slot = slot;
+    }
+    if (it->second.empty()) {
+        reactor->rooms.erase(it);
+        room->reactors.fetch_and(~reactor_bit(reactor->index));
+        if (cluster.active()) {
+            cluster.presence_changed(room);
+        }
+    }
+
+    if (conn->current_room == room) {
+        int lobby = find_membership(conn, lobby_room);
+        conn->current_room = lobby >= 0 ? lobby_room : conn->rooms.empty() ? NULL : conn->rooms[0].room;
+    }
+
+    if (announce) {
+        LOG_EVENT(LogLevel::Info, "Client left room").field("client", conn->client_id).field("room", room->name);
+        send_notice(conn, "Left room " + room->name + ".");
+    }
+    // Closed clients leave their rooms once the loop iteration ends
+    note_presence(conn, room, conn->closing ? PresenceChange::Quit : PresenceChange::Left,
+                  announce || conn->closing);
+}
+
+/**
+ * @brief Records a presence change in the room's delta on the client's
+ *        reactor; it goes out with the next presence update.
+ */
+void note_presence(Connection *conn, RoomInfo *room, PresenceChange change, bool notice) {
+    Reactor *reactor = conn->reactor;
+    PresenceDelta &delta = reactor->presence[room->id];
+    if (delta.events() == 0) {
+        reactor->presence_rooms.push_back(room);
+    }
+    delta.record(conn->session, change, notice);
+    if (reactor->presence_due_ns == 0) {
+        reactor->presence_due_ns = monotonic_ns() + (uint64_t)options.presence_interval_ms * 1000000;
+    }
+}
+
+/**
+ * @brief Sends out the reactor's presence changes once the interval is
+ *        over, or right away if @p all is set.
+ */
+void fan_out_presence(Reactor *reactor, bool all) {
+    if (reactor->presence_due_ns == 0 || (!all && monotonic_ns() < reactor->presence_due_ns)) {
+        return;
+    }
+    reactor->presence_due_ns = 0;
+    // Taken first, as fanning out may note more changes
+    std::vector<RoomInfo *> rooms;
+    rooms.swap(reactor->presence_rooms);
+    for (RoomInfo *room : rooms) {
+        std::unordered_map<uint32_t, PresenceDelta>::iterator it = reactor->presence.find(room->id);
+        PresenceDelta delta;
+        std::swap(delta, it->second);
+        reactor->presence.erase(it);
+        reactor->metrics.add(Counter::PresenceEvents, delta.events());
+        if (!delta.empty()) {
+            fan_out_room_presence(reactor, room, delta);
+        }
+    }
+}
+
+/**
+ * @brief Applies one reactor's changes to a room's member set and tells the
+ *        room's members everywhere, with a single shared update.
+ *
+ * The update is a text notice with its FRAME_PRESENCE rendition attached
+ * (see queue_output()); a notice without text, for changes nobody is told
+ * about in words (typing, a client connecting), only reaches clients that
+ * asked for presence. The room's joiners in this delta are left out of the
+ * text, as they were told already.
+ */
+void fan_out_room_presence(Reactor *origin, RoomInfo *room, const PresenceDelta &delta) {
+    std::vector<uint64_t> lists[3];
+    delta.collect(lists[0], lists[1], lists[2]);
+    uint64_t version = room->presence.apply(lists[0], lists[1]);
+    std::vector<MessageRef> frames;
+    encode_presence(PRESENCE_DELTA, room->name, version, lists, 3, frames);
+    MessageBuffer *structured = frames[0].get();
+    if (frames.size() == 1) {
+        structured->retain();
+    } else {
+        std::vector<const MessageBuffer *> parts;
+        for (const MessageRef &frame : frames) {
+            parts.push_back(frame.get());
+        }
+        structured = MessageBuffer::create_batch(parts.data(), parts.size());
+    }
+    MessageRef update = make_message(FRAME_NOTICE, delta.notice(room->name, room == lobby_room));
+    update->set_presence(structured);
+
+    flush_room_batch(origin, room);
+    share_with_reactors(origin, room, update, 0, 0);
+    if (room->peers.load(std::memory_order_relaxed) != 0 && update->text_size() > 0) {
+        cluster.publish(room, update);
+    }
+    for (uint64_t session : lists[0]) {
+        std::unordered_map<uint64_t, Connection *>::iterator it = origin->sessions.find(session);
+        if (it != origin->sessions.end()) {
+            it->second->fan_out_mark = true;
+        }
+    }
+    std::unordered_map<uint32_t, RoomMembers<Connection *>>::iterator it = origin->rooms.find(room->id);
+    if (it != origin->rooms.end()) {
+        const RoomMembers<Connection *> &members = it->second;
+        for (size_t i = 0; i < members.size(); ++i) {
+            Connection *conn = members[i];
+            if (conn->presence || !conn->fan_out_mark) {
+                queue_output(conn, update);
+            }
+        }
+    }
+    for (uint64_t session : lists[0]) {
+        std::unordered_map<uint64_t, Connection *>::iterator member = origin->sessions.find(session);
+        if (member != origin->sessions.end()) {
+            member->second->fan_out_mark = false;
+        }
+    }
+    origin->metrics.add(Counter::PresenceUpdates);
+}
+
+/**
+ * @brief Milliseconds until the reactor's next presence update; -1 if none is pending.
+ */
+int presence_timeout_ms(const Reactor *reactor) {
+    if (reactor->presence_due_ns == 0) {
+        return -1;
+    }
+    uint64_t now_ns = monotonic_ns();
+    return reactor->presence_due_ns > now_ns ? (int)((reactor->presence_due_ns - now_ns + 999999) / 1000000) : 0;
+}
+
+/**
+ * @brief Queues the room's member set for a client that asked for presence.
+ */
+void send_presence_snapshot(Connection *conn, RoomInfo *room) {
+    std::vector<MessageRef> frames;
+    room->presence.snapshot(room->name, frames);
+    for (const MessageRef &frame : frames) {
+        queue_output(conn, frame);
+    }
+    conn->reactor->metrics.add(Counter::PresenceSnapshots);
+}
+
+/**
+ * @return Index of the client's membership in @p room, or -1.
+ */
+int find_membership(Connection *conn, const RoomInfo *room) {
+    for (size_t i = 0; i < conn->rooms.size(); ++i) {
+        if (conn->rooms[i].room == room) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+int find_membership(Connection *conn, const char *name, size_t length) {
+    for (size_t i = 0; i < conn->rooms.size(); ++i) {
+        const std::string &room_name = conn->rooms[i].room->name;
+        if (room_name.size() == length && std::memcmp(room_name.data(), name, length) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Drains readable data from a client and handles every message in it.
+ *
+ * Reads go straight into a large per-connection buffer borrowed from the
+ * reactor's pool, so one recv can carry many frames and an incomplete
+ * trailing frame stays in place. The buffer goes back to the pool as soon as
+ * everything in it has been handled.
+ */
+void handle_client_readable(Connection *conn) {
+    BufferPool &pool = conn->reactor->read_buffers;
+    if (conn->input == NULL) {
+        conn->input = pool.acquire();
+    }
+    ReadBuffer *input = conn->input;
+
+    for (int i = 0; i < MAX_READS_PER_EVENT || tls_pending(conn); ++i) {
+        if (input->length == input->data.size() && !pool.grow(input)) {
+            break; // Cannot happen: a partial frame always fits
+        }
+        int bytes_received = receive_bytes(conn, input->data.data() + input->length,
+                                           (int)(input->data.size() - input->length));
+
+        if (bytes_received > 0) {
+            conn->reactor->recv_time_ns = monotonic_ns();
+            conn->heard_tick = conn->reactor->tick; // The idle timer reads this lazily
+            conn->ping_sent = false;
+            conn->reactor->metrics.add(Counter::BytesReceived, bytes_received);
+            input->length += bytes_received;
+            size_t consumed = process_input(conn, input->data.data(), input->length);
+            if (conn->closing) {
+                return;
+            }
+            if (consumed > 0) {
+                std::memmove(input->data.data(), input->data.data() + consumed, input->length - consumed);
+                input->length -= consumed;
+            }
+#ifdef CHAT_COROUTINES
+            if (conn->awaiting_output) {
+                break; // The rest stays unread until the handler resumes
+            }
+#endif
+        } else if (bytes_received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            break;
+        } else {
+            LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id);
+            close_client(conn);
+            return;
+        }
+    }
+
+    if (input->length == 0) {
+        pool.release(input);
+        conn->input = NULL;
+    }
+}
+
+/**
+ * @brief Reads what a client sent, like recv(); over TLS the handshake is
+ *        completed first and records are decrypted.
+ * @return Bytes read, 0 if the client is gone, or SOCKET_ERROR.
+ */
+int receive_bytes(Connection *conn, char *buffer, int length) {
+#ifdef CHAT_TLS
+    if (conn->tls != NULL) {
+        TlsResult result = conn->tls_ready ? TlsResult::Done : continue_handshake(conn);
+        if (result == TlsResult::Done) {
+            int bytes_read = tls_read(conn->tls, buffer, length, result);
+            if (bytes_read > 0) {
+                return bytes_read;
+            }
+        }
+        if (result == TlsResult::WantRead || result == TlsResult::WantWrite) {
+            bool want_write = result == TlsResult::WantWrite;
+            if (want_write && !conn->tls_want_write) {
+                conn->tls_want_write = true; // Retried by handle_client_writable()
+                conn->reactor->poller.modify(conn->socket, poll_interest(conn), conn);
+            }
+            WSASetLastError(WSAEWOULDBLOCK);
+            return SOCKET_ERROR;
+        }
+        if (result == TlsResult::Failed && conn->tls_ready) {
+            LOG_EVENT(LogLevel::Info, "TLS record rejected").field("client", conn->client_id).field("error", tls_error());
+        }
+        return 0;
+    }
+#endif
+    return recv(conn->socket, buffer, length, 0);
+}
+
+/**
+ * @brief Whether a client's TLS layer holds input it decrypted already,
+ *        which the socket does not report as readable again.
+ */
+bool tls_pending(const Connection *conn) {
+#ifdef CHAT_TLS
+    return conn->tls != NULL && SSL_pending(conn->tls) > 0;
+#else
+    (void)conn;
+    return false;
+#endif
+}
+
+#ifdef CHAT_TLS
+/**
+ * @brief Makes a newly accepted client's connection TLS; the handshake runs
+ *        as its first bytes arrive.
+ * @return False if the client was closed instead.
+ */
+bool start_tls(Connection *conn) {
+    conn->tls = tls_context.accept(conn->socket);
+    if (conn->tls == NULL) {
+        LOG_EVENT(LogLevel::Error, "TLS state unavailable").field("client", conn->client_id).field("error", tls_error());
+        close_client(conn);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Takes a client's handshake a step further and, once it completes,
+ *        records its cost and whether the kernel took over the records.
+ */
+TlsResult continue_handshake(Connection *conn) {
+    uint64_t started_ns = monotonic_ns();
+    TlsResult result = tls_handshake(conn->tls);
+    conn->tls_handshake_ns += monotonic_ns() - started_ns;
+
+    ThreadMetrics &metrics = conn->reactor->metrics;
+    if (result == TlsResult::Done) {
+        conn->tls_ready = true;
+        conn->ktls_send = tls_kernel_send(conn->tls);
+        bool resumed = SSL_session_reused(conn->tls) == 1;
+        metrics.add(Counter::TlsHandshakes);
+        metrics.tls_handshake_cost.record(conn->tls_handshake_ns);
+        if (resumed) {
+            metrics.add(Counter::TlsResumptions);
+        }
+        if (conn->ktls_send) {
+            metrics.add(Counter::KtlsOffloads);
+        }
+        // The client only now gets to announce its wire format
+        conn->connected_at = std::chrono::steady_clock::now();
+        LOG_EVENT(LogLevel::Debug, "TLS handshake complete")
+            .field("client", conn->client_id)
+            .field("version", SSL_get_version(conn->tls))
+            .field("resumed", resumed)
+            .field("ktls", conn->ktls_send)
+            .field("cost_us", conn->tls_handshake_ns / 1000);
+    } else if (result == TlsResult::Failed || result == TlsResult::Closed) {
+        metrics.add(Counter::TlsHandshakeFailures);
+        LOG_EVENT(LogLevel::Info, "TLS handshake failed").field("client", conn->client_id).field("error", tls_error());
+    }
+    return result;
+}
+#endif
+
+/**
+ * @brief Handles every complete message in freshly received data.
+ * @return Number of bytes consumed; the rest is an incomplete frame.
+ */
+size_t process_input(Connection *conn, const char *data, size_t size) {
+    size_t offset = 0;
+
+    // --- The first bytes decide the client's wire format ---
+    if (!conn->format_known) {
+        if (data[0] != FRAME_PREFACE[0]) {
+            set_wire_format(conn, WireFormat::Line);
+        } else if (size < FRAME_PREFACE_SIZE) {
+            return 0;
+        } else if (std::memcmp(data, FRAME_PREFACE, FRAME_PREFACE_SIZE) != 0) {
+            LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "unsupported protocol version");
+            close_client(conn);
+            return size;
+        } else {
+            set_wire_format(conn, WireFormat::Framed);
+            offset = FRAME_PREFACE_SIZE;
+        }
+    }
+
+    // --- Legacy line mode ---
+    // Every line is a message. As before framing existed, text left at the
+    // end of a read counts as a message too.
+    if (conn->output.format() == WireFormat::Line) {
+        while (offset < size && !conn->closing) {
+            const char *line = data + offset;
+            const char *newline = static_cast<const char *>(std::memchr(line, '\n', size - offset));
+            size_t length = newline != NULL ? (size_t)(newline - line) : size - offset;
+            offset += length + (newline != NULL ? 1 : 0);
+            if (length > 0 && line[length - 1] == '\r') {
+                --length;
+            }
+            handle_line(conn, line, length);
+        }
+        return size;
+    }
+
+    // --- Framed mode ---
+#ifdef CHAT_COROUTINES
+    return offset + feed_handler(conn, data + offset, size - offset);
+#else
+    Frame frame;
+    size_t consumed;
+    while (offset < size && !conn->closing) {
+        ParseResult result = parse_frame(data + offset, size - offset, frame, consumed);
+        if (result == ParseResult::NeedMore) {
+            break;
+        }
+        if (result == ParseResult::Invalid) {
+            LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "malformed frame");
+            close_client(conn);
+            return size;
+        }
+        offset += consumed;
+        if (!inflate_frame(conn, frame)) {
+            return size;
+        }
+        handle_frame(conn, frame);
+    }
+    return offset;
+#endif
+}
+
+/**
+ * @brief Replaces a compressed frame's payload with the decompressed one.
+ * @return False if the frame was not acceptable and the client was closed.
+ */
+bool inflate_frame(Connection *conn, Frame &frame) {
+    if (!(frame.flags & FRAME_FLAG_COMPRESSED)) {
+        return true;
+    }
+    std::vector<char> &inflated = conn->reactor->inflated;
+    if (!conn->compression || !decompress_payload(frame.payload, frame.length, MAX_FRAME_PAYLOAD, inflated)) {
+        LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "bad compressed frame");
+        close_client(conn);
+        return false;
+    }
+    frame.payload = inflated.data();
+    frame.length = static_cast<uint32_t>(inflated.size());
+    frame.flags &= ~FRAME_FLAG_COMPRESSED;
+    return true;
+}
+
+#ifdef CHAT_COROUTINES
+/**
+ * @brief Serves a framed client, from its first frame to its last.
+ *
+ * Whatever a frame makes the server send the client itself (replies,
+ * notices, history, its own chat echoed back) is waited on before the next
+ * frame is read. What it fans out to others is only queued for them, under
+ * their own overflow policy.
+ */
+ConnectionTask serve_frames(Connection *conn) {
+    Frame frame;
+    while (co_await conn->recv_frame(frame)) {
+        if (!inflate_frame(conn, frame)) {
+            co_return;
+        }
+        if (frame.type == FRAME_PING) {
+            co_await conn->send(make_message(FRAME_PONG, frame.payload, frame.length));
+        } else {
+            handle_frame(conn, frame);
+            co_await conn->caught_up();
+        }
+        if (conn->closing) {
+            co_return;
+        }
+    }
+    LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "malformed frame");
+    close_client(conn);
+}
+
+bool FrameAwaiter::await_ready() {
+    size_t consumed;
+    result = parse_frame(conn->window + conn->window_offset, conn->window_size - conn->window_offset, frame, consumed);
+    if (result == ParseResult::Complete) {
+        conn->window_offset += consumed;
+    }
+    return result != ParseResult::NeedMore;
+}
+
+// Resumed only once there is a frame (or garbage) to take
+bool FrameAwaiter::await_resume() {
+    if (result == ParseResult::NeedMore) {
+        await_ready();
+    }
+    return result == ParseResult::Complete;
+}
+
+bool SendAwaiter::await_ready() {
+    if (message) {
+        queue_output(conn, message);
+    }
+    return conn->closing || conn->output.depth() * 2 < conn->output.capacity();
+}
+
+void SendAwaiter::await_suspend(std::coroutine_handle<>) {
+    conn->awaiting_output = true;
+    conn->reactor->poller.modify(conn->socket, poll_interest(conn), conn);
+}
+
+/**
+ * @brief Lets the handler take every complete frame in freshly received data.
+ * @return Number of bytes consumed.
+ */
+size_t feed_handler(Connection *conn, const char *data, size_t size) {
+    conn->window = data;
+    conn->window_size = size;
+    conn->window_offset = 0;
+    Frame frame;
+    size_t consumed;
+    if (!conn->awaiting_output && parse_frame(data, size, frame, consumed) != ParseResult::NeedMore) {
+        conn->handler.resume();
+    }
+    return conn->window_offset;
+}
+
+/**
+ * @brief Resumes the handlers of clients that caught up with their output,
+ *        on the input they had already sent.
+ */
+void resume_handlers(Reactor *reactor) {
+    std::vector<Connection *> ready;
+    ready.swap(reactor->resumable);
+    for (Connection *conn : ready) {
+        conn->resume_pending = false;
+        if (conn->closing) {
+            continue;
+        }
+        conn->awaiting_output = false;
+        conn->reactor->poller.modify(conn->socket, poll_interest(conn), conn);
+        conn->window = NULL;
+        conn->window_size = 0;
+        conn->window_offset = 0;
+        conn->handler.resume(); // Back from send(); then parses what is buffered
+
+        ReadBuffer *input = conn->input;
+        if (!conn->closing && input != NULL && !conn->awaiting_output) {
+            size_t consumed = feed_handler(conn, input->data.data(), input->length);
+            if (conn->closing) {
+                continue;
+            }
+            std::memmove(input->data.data(), input->data.data() + consumed, input->length - consumed);
+            input->length -= consumed;
+            if (input->length == 0) {
+                reactor->read_buffers.release(input);
+                conn->input = NULL;
+            }
+        }
+        // Input decrypted before the handler stopped is not reported again
+        if (!conn->closing && !conn->awaiting_output && tls_pending(conn)) {
+            handle_client_readable(conn);
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Dispatches one frame received from a framed client.
+ */
+void handle_frame(Connection *conn, const Frame &frame) {
+    switch (frame.type) {
+    case FRAME_CHAT:
+        if (frame.length > MAX_CHAT_TEXT) {
+            LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "message too long");
+            close_client(conn);
+            return;
+        }
+        if (frame.flags & FRAME_FLAG_ROOM) {
+            size_t name_length = frame.length > 0 ? (uint8_t)frame.payload[0] : 0;
+            if (frame.length < 1 + name_length) {
+                LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "malformed frame");
+                close_client(conn);
+                return;
+            }
+            request_room_chat(conn, frame.payload + 1, name_length, frame.payload + 1 + name_length,
+                              frame.length - 1 - name_length);
+        } else {
+            int current = find_membership(conn, conn->current_room);
+            handle_chat(conn, current >= 0 ? &conn->rooms[current] : NULL, frame.payload, frame.length);
+        }
+        break;
+    case FRAME_JOIN:
+        request_join(conn, frame.payload, frame.length);
+        break;
+    case FRAME_LEAVE:
+        request_leave(conn, frame.payload, frame.length);
+        break;
+    case FRAME_CAPABILITIES: {
+        // Enable what both sides support and tell the client which that is
+        char enabled = 0;
+        if (frame.length > 0 && (frame.payload[0] & CAPABILITY_LZ4) && options.compress_min > 0) {
+            enabled |= CAPABILITY_LZ4;
+        }
+        if (frame.length > 0 && (frame.payload[0] & CAPABILITY_PRESENCE)) {
+            enabled |= CAPABILITY_PRESENCE;
+        }
+        conn->compression = (enabled & CAPABILITY_LZ4) != 0;
+        queue_output(conn, make_message(FRAME_CAPABILITIES, &enabled, 1));
+        // Rooms joined before, the lobby at least, start with a snapshot
+        if ((enabled & CAPABILITY_PRESENCE) && !conn->presence) {
+            conn->presence = true;
+            for (const Membership &membership : conn->rooms) {
+                send_presence_snapshot(conn, membership.room);
+            }
+        }
+        break;
+    }
+    case FRAME_TYPING: {
+        int index = frame.length == 0 ? find_membership(conn, conn->current_room)
+                                      : find_membership(conn, frame.payload, frame.length);
+        if (index >= 0) {
+            note_presence(conn, conn->rooms[index].room, PresenceChange::Typing, false);
+        }
+        break;
+    }
+    case FRAME_DIRECT: {
+        if (frame.length < DIRECT_RECIPIENT_SIZE || frame.length - DIRECT_RECIPIENT_SIZE > MAX_CHAT_TEXT) {
+            LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "malformed frame");
+            close_client(conn);
+            return;
+        }
+        uint64_t recipient = 0;
+        for (size_t i = 0; i < DIRECT_RECIPIENT_SIZE; ++i) {
+            recipient |= (uint64_t)(uint8_t)frame.payload[i] << (8 * i);
+        }
+        request_direct(conn, recipient, frame.payload + DIRECT_RECIPIENT_SIZE, frame.length - DIRECT_RECIPIENT_SIZE);
+        break;
+    }
+    case FRAME_PING:
+        queue_output(conn, make_message(FRAME_PONG, frame.payload, frame.length));
+        break;
+    case FRAME_PONG:
+        break; // Receiving it already counted as hearing from the client
+    default:
+        // Unknown frame types are ignored so newer clients keep working
+        break;
+    }
+}
+
+/**
+ * @brief Handles one line from a legacy client: a command or chat text.
+ *
+ * Overlong lines are relayed as several messages.
+ */
+void handle_line(Connection *conn, const char *line, size_t length) {
+    if (length > 0 && line[0] == '/' && handle_command(conn, line, length)) {
+        return;
+    }
+    int current = find_membership(conn, conn->current_room);
+    const Membership *membership = current >= 0 ? &conn->rooms[current] : NULL;
+    for (size_t start = 0; start < length && !conn->closing; start += MAX_CHAT_TEXT) {
+        handle_chat(conn, membership, line + start, std::min<size_t>(length - start, MAX_CHAT_TEXT));
+    }
+}
+
+/**
+ * @brief Runs a legacy client's "/join <room>", "/leave [room]" or
+ *        "/msg <room> <text>" command.
+ * @return False if the line is not a known command and is chat text.
+ */
+bool handle_command(Connection *conn, const char *line, size_t length) {
+    const char *end = line + length;
+    const char *space = std::find(line, end, ' ');
+    const char *args = space < end ? space + 1 : end;
+    std::string command(line, space);
+
+    if (command == "/join") {
+        request_join(conn, args, end - args);
+    } else if (command == "/leave") {
+        request_leave(conn, args, end - args);
+    } else if (command == "/msg") {
+        const char *name_end = std::find(args, end, ' ');
+        const char *text = name_end < end ? name_end + 1 : end;
+        request_room_chat(conn, args, name_end - args, text, end - text);
+    } else if (command == "/dm") {
+        const char *id_end = std::find(args, end, ' ');
+        const char *text = id_end < end ? id_end + 1 : end;
+        uint64_t recipient = 0;
+        bool valid = id_end > args && id_end - args <= 19; // Client numbers fit in 19 digits
+        for (const char *digit = args; valid && digit < id_end; ++digit) {
+            valid = *digit >= '0' && *digit <= '9';
+            recipient = recipient * 10 + (*digit - '0');
+        }
+        if (!valid) {
+            send_notice(conn, "Usage: /dm <client number> <text>");
+        } else {
+            request_direct(conn, recipient, text, end - text);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void request_join(Connection *conn, const char *name, size_t length) {
+    if (!valid_room_name(name, length)) {
+        send_notice(conn, "Room names are 1-" + std::to_string(MAX_ROOM_NAME) + " letters, digits, '-' or '_'.");
+        return;
+    }
+    join_room(conn, std::string(name, length), true);
+}
+
+/**
+ * @brief Leaves the named room, or the current room if no name is given.
+ */
+void request_leave(Connection *conn, const char *name, size_t length) {
+    int index = length == 0 ? find_membership(conn, conn->current_room) : find_membership(conn, name, length);
+    if (index < 0) {
+        send_notice(conn, length == 0 ? std::string("You are not in any room.")
+                                      : "You are not in room " + std::string(name, length) + ".");
+        return;
+    }
+    leave_room(conn, index, true);
+}
+
+/**
+ * @brief Sends chat text to a named room the client is in.
+ */
+void request_room_chat(Connection *conn, const char *name, size_t name_length, const char *text, size_t length) {
+    int index = find_membership(conn, name, name_length);
+    if (index < 0) {
+        send_notice(conn, "You are not in room " + std::string(name, name_length) + ".");
+        return;
+    }
+    handle_chat(conn, &conn->rooms[index], text, length);
+}
+
+/**
+ * @brief Sends chat text from a client to one other client.
+ */
+void request_direct(Connection *conn, uint64_t recipient, const char *text, size_t length) {
+    if (length == 0 || !within_rate_limits(conn, NULL, length)) {
+        return;
+    }
+    if (!conn->direct_prefix) {
+        conn->direct_prefix = make_message(FRAME_DIRECT, "[private] " + conn->client_id + ": ");
+    }
+    conn->reactor->metrics.add(Counter::MessagesReceived);
+    MessageRef message = make_message(FRAME_DIRECT, text, length, conn->direct_prefix);
+    trace_message(conn, message);
+    send_direct(conn->reactor, recipient, conn->session, message, conn->reactor->recv_time_ns);
+}
+
+/**
+ * @brief Relays one chat message from a client to everyone else in a room.
+ */
+void handle_chat(Connection *conn, const Membership *membership, const char *text, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (membership == NULL) {
+        send_notice(conn, "You are not in any room; use /join <room> first.");
+        return;
+    }
+    if (!within_rate_limits(conn, membership->room, length)) {
+        return;
+    }
+
+    // One allocation per message; the sender prefix is shared, not copied
+    MessageRef broadcast_msg = make_message(FRAME_CHAT, text, length, membership->prefix);
+    if (options.compress_min > 0 && broadcast_msg->text_size() >= options.compress_min) {
+        compress_for_fanout(conn->reactor, broadcast_msg);
+    }
+    LOG_SAMPLED(LogLevel::Info, "Chat message")
+        .field("client", conn->client_id)
+        .field("room", membership->room->name)
+        .field("bytes", length)
+        .field("text", text, length);
+    conn->reactor->metrics.add(Counter::MessagesReceived);
+    if (membership->room->history != NULL) {
+        membership->room->history->record(broadcast_msg);
+    }
+    if (membership->room->batch_window_ms != 0) {
+        batch_message(conn->reactor, membership->room, broadcast_msg, conn->session, conn->reactor->recv_time_ns);
+    } else {
+        trace_message(conn, broadcast_msg);
+        broadcast_message(conn->reactor, membership->room, broadcast_msg, conn->session,
+                          conn->reactor->recv_time_ns);
+    }
+}
+
+/**
+ * @brief Samples a message for tracing and records how long reading it took.
+ *
+ * Batched messages are never traced: a batch carries many of them.
+ */
+void trace_message(Connection *conn, const MessageRef &message) {
+    Reactor *reactor = conn->reactor;
+    if (!TRACE_ENABLED || reactor->trace_countdown == 0 || --reactor->trace_countdown != 0) {
+        return;
+    }
+    reactor->trace_countdown = options.trace_sample;
+    // Unique across reactors without sharing a counter
+    message->set_trace_id(++reactor->traced_messages * reactors.size() + reactor->index);
+    reactor->trace.record(TracePhase::Read, reactor->recv_time_ns, monotonic_ns(), message->trace_id(),
+                          conn->session);
+}
+
+/**
+ * @brief Spends a chat message from its sender's and its room's budgets.
+ *
+ * A message costs its length in bytes, but never more than a full byte
+ * budget, so messages longer than a second's worth can still be sent one
+ * at a time. No budget is spent unless all of them cover the message.
+ * @p room is NULL for direct messages.
+ * @return False if the message must be dropped; the sender is told once
+ *         per run of dropped messages.
+ */
+bool within_rate_limits(Connection *conn, RoomInfo *room, size_t length) {
+    TokenBucket::Clock::time_point now(
+        std::chrono::duration_cast<TokenBucket::Clock::duration>(std::chrono::nanoseconds(conn->reactor->recv_time_ns)));
+    double client_bytes = std::min<double>((double)length, conn->byte_budget.burst());
+    bool client_ok = conn->message_budget.wait_ms(now) == 0 && conn->byte_budget.wait_ms(now, client_bytes) == 0;
+    double room_bytes = room != NULL ? std::min<double>((double)length, room->byte_budget.burst()) : 0;
+    bool room_ok = client_ok && (room == NULL || (room->message_budget.wait_ms(now) == 0 &&
+                                                  room->byte_budget.wait_ms(now, room_bytes) == 0));
+    // Other reactors spend from the room too, so its budgets can still run out here
+    if (room_ok && room != NULL) {
+        room_ok = room->message_budget.try_take(now);
+        if (room_ok && !room->byte_budget.try_take(now, room_bytes)) {
+            room->message_budget.give_back();
+            room_ok = false;
+        }
+    }
+    if (room_ok) {
+        conn->message_budget.try_take(now);
+        conn->byte_budget.try_take(now, client_bytes);
+        conn->throttled = false;
+        return true;
+    }
+
+    conn->reactor->metrics.add(Counter::MessagesThrottled);
+    conn->reactor->metrics.add(Counter::BytesThrottled, length);
+    if (!conn->throttled) {
+        conn->throttled = true;
+        LOG_EVENT(LogLevel::Info, "Client throttled")
+            .field("client", conn->client_id)
+            .field("room", room != NULL ? room->name : "")
+            .field("limit", client_ok ? "room" : "client");
+        std::string where = room == NULL || room == lobby_room ? "" : "[" + room->name + "] ";
+        std::string text = client_ok ? where + "The room is too busy; messages are being dropped."
+                                     : "You are sending too fast; messages are being dropped.";
+        // Flagged, so client libraries can back off without parsing the text
+        queue_output(conn, MessageRef(MessageBuffer::create(text.data(), text.size(), NULL, FRAME_NOTICE,
+                                                            FRAME_FLAG_THROTTLED)));
+    }
+    return false;
+}
+
+/**
+ * @brief Compresses a message once, before it is shared, for every
+ *        recipient that negotiated compression.
+ *
+ * Nothing is attached if compression would not make it smaller.
+ */
+void compress_for_fanout(Reactor *reactor, const MessageRef &message) {
+    std::vector<char> &text = reactor->text_scratch;
+    text.resize(message->text_size());
+    message->copy_text(text.data());
+    if (!compress_payload(text.data(), text.size(), reactor->deflated)) {
+        return;
+    }
+    message->set_compressed(MessageBuffer::create(reactor->deflated.data(), reactor->deflated.size(), NULL,
+                                                  message->frame_type(), FRAME_FLAG_COMPRESSED));
+    reactor->metrics.add(Counter::MessagesCompressed);
+}
+
+/**
+ * @brief Queues a server notice for one client.
+ */
+void send_notice(Connection *conn, const std::string &text) {
+    queue_output(conn, make_message(FRAME_NOTICE, text));
+}
+
+/**
+ * @brief Fixes a client's wire format and releases anything queued meanwhile.
+ */
+void set_wire_format(Connection *conn, WireFormat format) {
+    conn->output.set_format(format);
+    conn->format_known = true;
+#ifdef CHAT_COROUTINES
+    if (format == WireFormat::Framed) {
+        conn->handler.reset();
+        conn->handler = serve_frames(conn); // Runs until it waits for the first frame
+    }
+#endif
+
+    std::vector<Connection *> &undecided = conn->reactor->undecided;
+    std::vector<Connection *>::iterator it = std::find(undecided.begin(), undecided.end(), conn);
+    if (it != undecided.end()) {
+        *it = undecided.back();
+        undecided.pop_back();
+    }
+
+    if (!conn->output.empty() && !conn->flush_pending) {
+        conn->flush_pending = true;
+        conn->reactor->pending_flush.push_back(conn);
+    }
+    arm_idle_timer(conn);
+}
+
+/**
+ * @brief Treats clients that stayed silent past the preface timeout as legacy.
+ *
+ * TLS clients are timed from the end of their handshake, and dropped if it
+ * does not end within TLS_HANDSHAKE_TIMEOUT_MS.
+ */
+void expire_undecided(Reactor *reactor) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::vector<Connection *> &undecided = reactor->undecided;
+    for (size_t i = 0; i < undecided.size();) {
+        Connection *conn = undecided[i];
+#ifdef CHAT_TLS
+        if (conn->tls != NULL && !conn->tls_ready) {
+            if (now - conn->connected_at >= std::chrono::milliseconds(TLS_HANDSHAKE_TIMEOUT_MS)) {
+                LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "TLS handshake timeout");
+                reactor->metrics.add(Counter::TlsHandshakeFailures);
+                close_client(conn); // Takes it out of slot i
+            } else {
+                ++i;
+            }
+            continue;
+        }
+#endif
+        if (now - conn->connected_at >= std::chrono::milliseconds(PREFACE_TIMEOUT_MS)) {
+            set_wire_format(conn, WireFormat::Line); // Swaps another client into slot i
+        } else {
+            ++i;
+        }
+    }
+}
+
+/**
+ * @brief Milliseconds until the reactor's next timer tick with work to do.
+ * @return -1 if no timer is scheduled.
+ */
+int timer_timeout_ms(Reactor *reactor) {
+    int64_t ticks = reactor->timers.ticks_until_due();
+    if (ticks < 0) {
+        return -1;
+    }
+    std::chrono::steady_clock::time_point due =
+        reactor->timer_origin +
+        std::chrono::milliseconds(static_cast<int64_t>(reactor->timers.current() + ticks) * TIMER_TICK_MS);
+    int64_t left = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now()).count();
+    return (int)std::max<int64_t>(0, left + 1);
+}
+
+/**
+ * @brief Fires the timers due by the current loop iteration's tick.
+ */
+void run_timers(Reactor *reactor) {
+    reactor->timers.advance(reactor->tick, [](TimerNode *node) {
+        Connection *conn = static_cast<Connection *>(node->owner);
+        if (!conn->closing) {
+            check_idle(conn);
+        }
+    });
+}
+
+/**
+ * @brief Pings or disconnects a client that has been silent too long.
+ *
+ * Reads only note when the client was last heard from; the timer is not
+ * moved on every read but checks, when it fires, whether the client really
+ * has been silent and otherwise re-arms for the remaining time.
+ */
+void check_idle(Connection *conn) {
+    uint64_t heartbeat, timeout;
+    idle_limits(conn, heartbeat, timeout);
+    uint64_t silent = conn->reactor->tick - conn->heard_tick;
+
+    if (timeout > 0 && silent >= timeout) {
+        LOG_EVENT(LogLevel::Info, "Client disconnected").field("client", conn->client_id).field("reason", "idle timeout");
+        conn->reactor->metrics.add(Counter::IdleTimeouts);
+        close_client(conn);
+        return;
+    }
+    if (heartbeat > 0 && !conn->ping_sent && silent >= heartbeat) {
+        queue_output(conn, make_message(FRAME_PING, "", 0));
+        conn->ping_sent = true;
+        if (conn->closing) {
+            return;
+        }
+    }
+    arm_idle_timer(conn);
+}
+
+/**
+ * @brief A client's heartbeat interval and idle timeout in timer ticks; 0: none.
+ *
+ * Legacy line clients cannot answer pings, so they only have a timeout.
+ */
+void idle_limits(const Connection *conn, uint64_t &heartbeat, uint64_t &timeout) {
+    bool framed = conn->output.format() == WireFormat::Framed;
+    heartbeat = framed ? (uint64_t)options.heartbeat_s * 1000 / TIMER_TICK_MS : 0;
+    timeout = (uint64_t)(framed ? options.idle_timeout_s : options.line_idle_timeout_s) * 1000 / TIMER_TICK_MS;
+}
+
+/**
+ * @brief Schedules a client's next heartbeat or idle timeout check, if any.
+ */
+void arm_idle_timer(Connection *conn) {
+    uint64_t heartbeat, timeout;
+    idle_limits(conn, heartbeat, timeout);
+
+    uint64_t next = UINT64_MAX;
+    if (heartbeat > 0) {
+        // Once pinged, look again after another interval in case it answered
+        next = conn->ping_sent ? conn->reactor->tick + heartbeat : conn->heard_tick + heartbeat;
+    }
+    if (timeout > 0) {
+        next = std::min(next, conn->heard_tick + timeout);
+    }
+    if (next != UINT64_MAX) {
+        conn->reactor->timers.schedule(&conn->idle_timer, next);
+    }
+}
+
+/**
+ * @brief Flushes queued output once a client's socket becomes writable.
+ */
+void handle_client_writable(Connection *conn) {
+#ifdef CHAT_TLS
+    if (conn->tls_want_write) {
+        // The handshake or a read was waiting to write
+        conn->tls_want_write = false;
+        conn->reactor->poller.modify(conn->socket, poll_interest(conn), conn);
+        handle_client_readable(conn);
+        if (conn->closing) {
+            return;
+        }
+    }
+#endif
+    if (!flush_output(conn)) {
+        LOG_EVENT(LogLevel::Warn, "Send failed").field("client", conn->client_id).field("error", WSAGetLastError());
+        conn->reactor->metrics.add(Counter::SendErrors);
+        close_client(conn);
+    }
+}
+
+/**
+ * @brief Queues a message for a client without blocking.
+ *
+ * The client is marked for flushing at the end of the loop iteration, so
+ * everything queued for it meanwhile goes out in one gather send. A full
+ * queue is handled according to options.overflow_policy. Until the client's
+ * wire format is known, messages are only queued.
+ */
+void queue_output(Connection *conn, const MessageRef &message) {
+    if (conn->closing) {
+        return;
+    }
+    // Clients that negotiated compression get the shared compressed rendition
+    if (conn->compression && message->compressed() != NULL) {
+        queue_output(conn, MessageRef::share(message->compressed()));
+        return;
+    }
+    // Presence updates: the structured rendition, or the notice if it says anything
+    if (message->presence() != NULL) {
+        if (conn->presence) {
+            queue_output(conn, MessageRef::share(message->presence()));
+            return;
+        }
+        if (message->text_size() == 0) {
+            return;
+        }
+    }
+
+    // A burst (say, from a cluster peer) can fill the queue within one pass;
+    // the kernel gets what it takes before the overflow policy is applied
+    if (conn->output.full() && conn->format_known && !conn->write_interest && !flush_client(conn)) {
+        return;
+    }
+
+    if (conn->output.full()) {
+        switch (options.overflow_policy) {
+        case OverflowPolicy::DropOldest:
+            conn->output.drop_oldest();
+            conn->output.push(message);
+            ++conn->dropped_messages;
+            conn->reactor->metrics.add(Counter::QueueDrops);
+            break;
+        case OverflowPolicy::DropNew:
+            ++conn->dropped_messages;
+            conn->reactor->metrics.add(Counter::QueueDrops);
+            break;
+        case OverflowPolicy::Disconnect:
+            LOG_EVENT(LogLevel::Warn, "Client disconnected")
+                .field("client", conn->client_id)
+                .field("reason", "outbound queue full")
+                .field("depth", conn->output.depth());
+            close_client(conn);
+            return;
+        }
+    } else {
+        conn->output.push(message);
+    }
+
+    if (!conn->falling_behind && conn->output.depth() * 2 >= conn->output.capacity()) {
+        conn->falling_behind = true;
+        LOG_EVENT(LogLevel::Warn, "Client falling behind")
+            .field("client", conn->client_id)
+            .field("depth", conn->output.depth())
+            .field("capacity", conn->output.capacity());
+    }
+
+    // With write interest set the poller already flushes once writable
+    if (conn->format_known && !conn->write_interest && !conn->flush_pending) {
+        conn->flush_pending = true;
+        conn->reactor->pending_flush.push_back(conn);
+    }
+}
+
+/**
+ * @brief Flushes every client that was queued output this loop iteration.
+ *
+ * A client the kernel cannot take everything from is handed to the poller
+ * until its socket becomes writable again.
+ */
+void flush_pending(Reactor *reactor) {
+    std::vector<Connection *> &pending = reactor->pending_flush;
+    // Closing a failed client queues its leave notice, which may append here
+    for (size_t i = 0; i < pending.size(); ++i) {
+        Connection *conn = pending[i];
+        conn->flush_pending = false;
+        if (!conn->closing) {
+            flush_client(conn);
+        }
+    }
+    pending.clear();
+}
+
+/**
+ * @brief Writes what the kernel takes, then watches for writability if
+ *        anything is left.
+ * @return False if the send failed and the client was closed.
+ */
+bool flush_client(Connection *conn) {
+    if (!flush_output(conn)) {
+        LOG_EVENT(LogLevel::Warn, "Send failed").field("client", conn->client_id).field("error", WSAGetLastError());
+        conn->reactor->metrics.add(Counter::SendErrors);
+        close_client(conn);
+        return false;
+    }
+    if (output_pending(conn) && !conn->write_interest) {
+        conn->write_interest = true;
+        conn->reactor->poller.modify(conn->socket, poll_interest(conn), conn);
+    }
+    return true;
+}
+
+/**
+ * @brief Writes queued messages until the queue is empty or the socket is full.
+ *
+ * Each send covers as many queued messages as fit in MAX_SEND_SPANS buffers.
+ * With adaptive Nagle, a queue needing several sends is written corked and
+ * uncorked at the end, which pushes out the final partial segment.
+ * @return False if the connection failed.
+ */
+bool flush_output(Connection *conn) {
+#ifdef CHAT_TLS
+    if (!conn->tls_unsent.empty() && !send_unsent_record(conn)) {
+        return false;
+    }
+#endif
+    bool corked = options.tuning.nagle == NagleMode::Adaptive && conn->output.depth() > CORK_THRESHOLD &&
+                  set_cork(conn->socket, true);
+
+    ByteSpan spans[MAX_SEND_SPANS];
+    int count;
+    while ((count = conn->output.gather(spans, MAX_SEND_SPANS)) > 0) {
+        uint64_t send_started_ns = TRACE_ENABLED ? monotonic_ns() : 0;
+        int bytes_sent = send_queued(conn, spans, count);
+        if (bytes_sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return false; // The socket is closed next, cork and all
+            }
+            break;
+        }
+        ThreadMetrics &metrics = conn->reactor->metrics;
+        metrics.add(Counter::BytesSent, bytes_sent);
+        metrics.add(Counter::MessagesSent, conn->output.consume(bytes_sent));
+        TracedWrite write;
+        while (conn->output.take_traced_write(write)) {
+            conn->reactor->trace.record(TracePhase::Write, write.queued_ns, monotonic_ns(), write.message,
+                                        conn->session, std::max(send_started_ns, write.queued_ns));
+        }
+    }
+
+    if (corked) {
+        set_cork(conn->socket, false);
+    }
+#ifdef CHAT_COROUTINES
+    if (conn->awaiting_output && !conn->resume_pending && conn->output.depth() * 4 < conn->output.capacity()) {
+        conn->resume_pending = true;
+        conn->reactor->resumable.push_back(conn);
+    }
+#endif
+    if (output_pending(conn)) {
+        return true; // Socket is full; the rest goes once it is writable
+    }
+
+    if (conn->falling_behind) {
+        LOG_EVENT(LogLevel::Info, "Client caught up")
+            .field("client", conn->client_id)
+            .field("dropped", conn->dropped_messages);
+        conn->falling_behind = false;
+        conn->dropped_messages = 0;
+    }
+    if (conn->write_interest) {
+        conn->write_interest = false;
+        conn->reactor->poller.modify(conn->socket, poll_interest(conn), conn);
+    }
+    return true;
+}
+
+/**
+ * @brief Events the poller should watch a client's socket for.
+ */
+uint32_t poll_interest(const Connection *conn) {
+    uint32_t interest = conn->write_interest ? POLL_WRITE : 0;
+#ifdef CHAT_TLS
+    if (conn->tls_want_write) {
+        interest = POLL_WRITE;
+    }
+#endif
+#ifdef CHAT_COROUTINES
+    if (conn->awaiting_output) {
+        return interest; // Not read until its handler resumes
+    }
+#endif
+    return interest | POLL_READ;
+}
+
+/**
+ * @brief Whether anything queued for a client has not reached the socket yet.
+ */
+bool output_pending(const Connection *conn) {
+#ifdef CHAT_TLS
+    if (!conn->tls_unsent.empty()) {
+        return true;
+    }
+#endif
+    return !conn->output.empty();
+}
+
+/**
+ * @brief Writes gathered queue buffers to a client: as they are, or as TLS
+ *        records unless the kernel encrypts them.
+ * @return Bytes of the queue written, or SOCKET_ERROR.
+ */
+int send_queued(Connection *conn, const ByteSpan *spans, int count) {
+#ifdef CHAT_TLS
+    if (conn->tls != NULL && !conn->ktls_send) {
+        return send_records(conn, spans, count);
+    }
+#endif
+    return send_spans(conn->socket, spans, count);
+}
+
+#ifdef CHAT_TLS
+/**
+ * @brief Coalesces queued buffers into one TLS record and writes it.
+ *
+ * A record the socket refuses is taken off the queue as a whole and kept in
+ * tls_unsent, since OpenSSL needs exactly those bytes again; nothing else
+ * is written until it has gone.
+ * @return Bytes of the queue taken, or SOCKET_ERROR.
+ */
+int send_records(Connection *conn, const ByteSpan *spans, int count) {
+    if (!conn->tls_unsent.empty()) {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    std::vector<char> &record = conn->reactor->tls_record;
+    record.clear();
+    for (int i = 0; i < count && record.size() < TLS_MAX_RECORD; ++i) {
+        size_t take = std::min(spans[i].length, TLS_MAX_RECORD - record.size());
+        record.insert(record.end(), spans[i].data, spans[i].data + take);
+    }
+
+    TlsResult result;
+    int written = tls_write(conn->tls, record.data(), (int)record.size(), result);
+    if (written > 0) {
+        return written;
+    }
+    if (result == TlsResult::WantWrite || result == TlsResult::WantRead) {
+        conn->tls_unsent.assign(record.data(), record.size());
+        return (int)record.size();
+    }
+    LOG_EVENT(LogLevel::Debug, "TLS write failed").field("client", conn->client_id).field("error", tls_error());
+    WSASetLastError(WSAECONNRESET);
+    return SOCKET_ERROR;
+}
+
+/**
+ * @brief Retries the record the socket refused last time.
+ * @return False if the connection failed; tls_unsent is empty once it went.
+ */
+bool send_unsent_record(Connection *conn) {
+    std::string &unsent = conn->tls_unsent;
+    while (!unsent.empty()) {
+        TlsResult result;
+        int written = tls_write(conn->tls, unsent.data(), (int)unsent.size(), result);
+        if (written > 0) {
+            unsent.erase(0, written);
+        } else if (result == TlsResult::WantWrite || result == TlsResult::WantRead) {
+            return true;
+        } else {
+            WSASetLastError(WSAECONNRESET);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief At a hot restart: tells a TLS client to reconnect and closes it.
+ *
+ * Nobody in its rooms is told it left: the successor never hears of it,
+ * and it comes back as a new client. Runs while the reactor's sessions are
+ * being packaged, so it must not close the client the usual way.
+ */
+void hang_up_tls(Connection *conn) {
+    Reactor *reactor = conn->reactor;
+    if (conn->tls_ready && conn->format_known) {
+        if (!conn->output.full()) {
+            conn->output.push(make_message(FRAME_NOTICE, "Server is restarting; please reconnect."));
+        }
+        flush_output(conn); // Best effort: the socket is not waited on
+    }
+    reactor->poller.remove(conn->socket);
+    tls_close(conn->tls);
+    conn->tls = NULL;
+    closesocket(conn->socket);
+    reactor->metrics.add(Counter::ConnectionsClosed);
+}
+#endif
+
+/**
+ * @brief Writes several buffers with a single system call (WSASend / sendmsg).
+ * @return Number of bytes written, or SOCKET_ERROR.
+ */
+int send_spans(SOCKET socket, const ByteSpan *spans, int count) {
+#ifdef _WIN32
+    WSABUF buffers[MAX_SEND_SPANS];
+    for (int i = 0; i < count; ++i) {
+        buffers[i].buf = const_cast<char *>(spans[i].data);
+        buffers[i].len = static_cast<ULONG>(spans[i].length);
+    }
+    DWORD bytes_sent = 0;
+    if (WSASend(socket, buffers, count, &bytes_sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    return static_cast<int>(bytes_sent);
+#else
+    struct iovec vectors[MAX_SEND_SPANS];
+    for (int i = 0; i < count; ++i) {
+        vectors[i].iov_base = const_cast<char *>(spans[i].data);
+        vectors[i].iov_len = spans[i].length;
+    }
+    struct msghdr header = msghdr();
+    header.msg_iov = vectors;
+    header.msg_iovlen = count;
+#ifdef MSG_NOSIGNAL
+    return static_cast<int>(sendmsg(socket, &header, MSG_NOSIGNAL));
+#else
+    return static_cast<int>(sendmsg(socket, &header, 0));
+#endif
+#endif
+}
+
+/**
+ * @brief Unregisters and closes a client, then tells everyone it left.
+ */
+void close_client(Connection *conn) {
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = true;
+
+    Reactor *reactor = conn->reactor;
+    if (!conn->format_known) {
+        reactor->undecided.erase(std::remove(reactor->undecided.begin(), reactor->undecided.end(), conn),
+                                 reactor->undecided.end());
+    }
+
+    reactor->timers.cancel(&conn->idle_timer);
+    reactor->sessions.erase(conn->session);
+#ifdef CHAT_COROUTINES
+    if (conn->resume_pending) {
+        reactor->resumable.erase(std::remove(reactor->resumable.begin(), reactor->resumable.end(), conn),
+                                 reactor->resumable.end());
+    }
+#endif
+    reactor->poller.remove(conn->socket);
+#ifdef CHAT_TLS
+    if (conn->tls != NULL) {
+        tls_close(conn->tls);
+        conn->tls = NULL;
+        std::string().swap(conn->tls_unsent);
+    }
+#endif
+    closesocket(conn->socket);
+    reactor->closed.push_back(conn);
+    reactor->metrics.add(Counter::ConnectionsClosed);
+    if (conn->input != NULL) {
+        reactor->read_buffers.release(conn->input);
+        conn->input = NULL;
+    }
+    // The client stays in its rooms until the loop iteration ends; leaving
+    // them then tells their members it has left the chat
+}
+
+/**
+ * @brief Switches a socket to non-blocking mode.
+ * @return True on success, false otherwise.
+ */
+bool set_non_blocking(SOCKET socket) {
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode) == 0;
+}
+
+/**
+ * @brief Pins the calling reactor thread to its core, from --cpus or one
+ *        per core in turn, and with --numa local to its core's memory.
+ *
+ * Best effort: on platforms without an affinity API this does nothing.
+ */
+void pin_current_thread(int index) {
+    int cpu;
+    if (!options.cpus.empty()) {
+        cpu = options.cpus[(size_t)index % options.cpus.size()];
+    } else {
+        unsigned int cores = std::thread::hardware_concurrency();
+        if (cores == 0) {
+            return;
+        }
+        cpu = (int)((unsigned int)index % cores);
+    }
+    if (!pin_thread_to_cpu(cpu) && !options.cpus.empty()) {
+        LOG_EVENT(LogLevel::Warn, "CPU pinning failed").field("worker", index).field("cpu", cpu);
+    }
+    if (options.numa_local) {
+        int node = prefer_local_numa_node();
+        if (node < 0) {
+            LOG_EVENT(LogLevel::Warn, "NUMA placement unavailable").field("worker", index);
+        } else {
+            LOG_EVENT(LogLevel::Debug, "Worker memory placed").field("worker", index).field("cpu", cpu).field("node",
+                                                                                                              node);
+        }
+    }
+}
+
+/**
+ * @brief Allocates and touches the pools a reactor was asked to reserve.
+ *
+ * Runs on the reactor's thread once it is pinned, so with --numa local the
+ * pages come from its own node, and the first clients meet no page faults.
+ */
+void reserve_pools(Reactor *reactor) {
+    if (options.reserve_connections == 0 && options.reserve_buffers == 0 && options.reserve_messages == 0) {
+        return;
+    }
+    uint64_t started_ns = monotonic_ns();
+    reactor->connections.reserve(options.reserve_connections);
+    reactor->read_buffers.reserve(options.reserve_buffers);
+    for (size_t size = SlabAllocator::MIN_BLOCK; size <= RESERVED_MESSAGE_BLOCK; size *= 2) {
+        SlabAllocator::instance().reserve(size, options.reserve_messages);
+    }
+    LOG_EVENT(LogLevel::Info, "Pools reserved")
+        .field("worker", reactor->index)
+        .field("connections", options.reserve_connections)
+        .field("read_buffers", options.reserve_buffers)
+        .field("messages", options.reserve_messages)
+        .field("ms", (monotonic_ns() - started_ns) / 1000000);
+}
+
+/**
+ * @brief Logs how often message and connection storage came from the pools.
+ */
+void report_memory_stats() {
+    SlabStats slab = SlabAllocator::instance().stats();
+    uint64_t pool_hits = 0;
+    uint64_t pool_misses = 0;
+    for (Reactor *reactor : reactors) {
+        pool_hits += reactor->connections.hits();
+        pool_misses += reactor->connections.misses();
+    }
+    LOG_EVENT(LogLevel::Info, "Memory stats")
+        .field("slab_hits", slab.hits)
+        .field("slab_misses", slab.misses)
+        .field("slab_oversize", slab.oversize)
+        .field("slab_reserved_kib", slab.reserved_bytes / 1024)
+        .field("connection_pool_hits", pool_hits)
+        .field("connection_pool_misses", pool_misses);
+}
+
+/**
+ * @brief A metrics connection whose request has not arrived yet.
+ */
+struct PendingScrape {
+    SOCKET socket;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/**
+ * @brief Serves the Prometheus text endpoint until the server stops.
+ *
+ * Runs on its own thread. Accepted scrapers are polled together with the
+ * listener and each is answered once its request arrives, so one that
+ * connects and sends nothing only costs a slot until its deadline, not the
+ * other scrapers' time. A scrape only reads the threads' counters, so it
+ * never stalls a reactor.
+ */
+void run_metrics_server(SOCKET listen_socket) {
+    std::vector<PendingScrape> pending;
+    std::vector<WSAPOLLFD> watched;
+    while (stop_mode.load() == StopMode::Running) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int timeout_ms = STOP_POLL_MS;
+        watched.resize(1 + pending.size());
+        watched[0].fd = listen_socket;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            watched[i + 1].fd = pending[i].socket;
+            int remaining_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(pending[i].deadline - now)
+                                   .count();
+            timeout_ms = std::max(0, std::min(timeout_ms, remaining_ms));
+        }
+        for (WSAPOLLFD &entry : watched) {
+            entry.events = POLLIN;
+            entry.revents = 0;
+        }
+        if (WSAPoll(watched.data(), (unsigned long)watched.size(), timeout_ms) == SOCKET_ERROR) {
+            continue; // A signal; look at stop_mode again
+        }
+
+        // Backwards, so the last entry can fill a removed one's place
+        now = std::chrono::steady_clock::now();
+        for (size_t i = pending.size(); i-- > 0;) {
+            if (watched[i + 1].revents != 0) {
+                serve_metrics_request(pending[i].socket);
+            } else if (now < pending[i].deadline) {
+                continue;
+            }
+            closesocket(pending[i].socket);
+            pending[i] = pending.back();
+            pending.pop_back();
+        }
+
+        if (watched[0].revents == 0) {
+            continue;
+        }
+        SOCKET client_socket = accept(listen_socket, NULL, NULL);
+        if (client_socket == INVALID_SOCKET) {
+            LOG_EVENT(LogLevel::Warn, "Metrics accept failed").field("error", WSAGetLastError());
+            continue;
+        }
+        if (pending.size() >= MAX_METRICS_PENDING) {
+            std::vector<PendingScrape>::iterator oldest = std::min_element(
+                pending.begin(), pending.end(),
+                [](const PendingScrape &a, const PendingScrape &b) { return a.deadline < b.deadline; });
+            closesocket(oldest->socket);
+            *oldest = pending.back();
+            pending.pop_back();
+        }
+        PendingScrape scrape;
+        scrape.socket = client_socket;
+        scrape.deadline = now + std::chrono::milliseconds(METRICS_REQUEST_TIMEOUT_MS);
+        pending.push_back(scrape);
+    }
+    for (const PendingScrape &scrape : pending) {
+        closesocket(scrape.socket);
+    }
+}
+
+/**
+ * @brief Answers one HTTP request: GET /metrics, anything else is a 404.
+ *
+ * Called once the socket is readable, so reading does not block.
+ */
+void serve_metrics_request(SOCKET client_socket) {
+#ifdef _WIN32
+    DWORD timeout = METRICS_SEND_TIMEOUT_MS;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = METRICS_SEND_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (METRICS_SEND_TIMEOUT_MS % 1000) * 1000;
+#endif
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+
+    // The request line arrives in the first segment; headers are ignored
+    char request[1024];
+    int length = recv(client_socket, request, sizeof(request) - 1, 0);
+    if (length <= 0) {
+        return;
+    }
+    request[length] = '\0';
+
+    std::string status = "200 OK";
+    std::string content_type = "text/plain; version=0.0.4";
+    std::string body;
+    if (std::strncmp(request, "GET /metrics", 12) == 0) {
+        body = collect_metrics();
+    } else if (TRACE_ENABLED && std::strncmp(request, "GET /trace", 10) == 0) {
+        content_type = "application/json";
+        body = collect_trace();
+    } else {
+        status = "404 Not Found";
+        body = TRACE_ENABLED ? "Scrape /metrics, or fetch /trace.\n" : "Scrape /metrics.\n";
+    }
+    send_all(client_socket, "HTTP/1.1 " + status + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+                                std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+}
+
+/**
+ * @brief Sums every thread's metrics and renders them for Prometheus.
+ */
+std::string collect_metrics() {
+    MetricsSnapshot snapshot;
+    snapshot.merge(acceptor_metrics);
+    snapshot.merge(cluster.metrics());
+    for (Reactor *reactor : reactors) {
+        snapshot.merge(reactor->metrics);
+    }
+    snapshot.process = read_process_usage();
+    return format_prometheus(snapshot);
+}
+
+/**
+ * @brief Renders what every reactor's trace ring holds as a Chrome trace.
+ */
+std::string collect_trace() {
+    std::vector<std::pair<std::string, std::vector<TraceSpan>>> threads;
+    for (Reactor *reactor : reactors) {
+        threads.push_back(std::make_pair("worker " + std::to_string(reactor->index), std::vector<TraceSpan>()));
+        reactor->trace.snapshot(threads.back().second);
+    }
+    return format_chrome_trace(threads);
+}
+
+/**
+ * @brief Writes the trace to --trace-file, if one was given.
+ */
+void write_trace_file() {
+    if (options.trace_file.empty()) {
+        return;
+    }
+    std::string trace = collect_trace();
+    FILE *file = std::fopen(options.trace_file.c_str(), "wb");
+    bool written = file != NULL && std::fwrite(trace.data(), 1, trace.size(), file) == trace.size();
+    if (file != NULL && std::fclose(file) != 0) {
+        written = false;
+    }
+    if (written) {
+        LOG_EVENT(LogLevel::Info, "Trace written").field("path", options.trace_file).field("bytes", trace.size());
+    } else {
+        LOG_EVENT(LogLevel::Error, "Trace file unwritable").field("path", options.trace_file);
+    }
+}
+
+/**
+ * @brief Writes all of @p data to a blocking socket.
+ * @return False if the connection failed.
+ */
+bool send_all(SOCKET socket, const std::string &data) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int bytes_sent = send(socket, data.data() + sent, (int)(data.size() - sent), flags);
+        if (bytes_sent == SOCKET_ERROR) {
+            return false;
+        }
+        sent += bytes_sent;
+    }
+    return true;
+}
@@ -0,0 +1,293 @@
+// -----------------------------------------------------------------------------
+// Slab Allocator
+//
+// A size-class allocator for the server's short-lived, variable-size blocks:
+// message buffers (see message.h) and cross-reactor queue nodes. Requests
+// are rounded up to a power-of-two class between 64 bytes and 128 KiB and
+// served from per-thread free lists, so the steady-state broadcast path
+// never reaches the heap.
+//
+// Blocks may be freed on a different thread than the one that allocated
+// them (the last reference to a message is often dropped by another
+// reactor). Freed blocks go to the freeing thread's cache; caches that grow
+// too large hand a batch back to a shared, mutex-protected depot, which
+// refills caches that run dry. Only when the depot is empty too is a new
+// slab carved from the heap. Slabs are never returned to the heap, and
+// reserve() can carve them at startup, already faulted in.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_SLAB_ALLOCATOR_H
+#define CHAT_SLAB_ALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ * @brief Allocation counters, summed over all threads.
+ */
+struct SlabStats {
+    uint64_t hits;         // Served from a free list
+    uint64_t misses;       // Needed a new slab from the heap
+    uint64_t oversize;     // Larger than the biggest class; went to the heap
+    size_t reserved_bytes; // Total size of all slabs carved so far
+};
+
+class SlabAllocator {
+public:
+    static const size_t MIN_BLOCK = 64;
+    static const int CLASS_COUNT = 12; // 64 B .. 128 KiB
+
+    /**
+     * @brief The process-wide allocator.
+     */
+    static SlabAllocator &instance() {
+        static SlabAllocator allocator;
+        return allocator;
+    }
+
+    void *allocate(size_t size) {
+        ThreadCache &cache = thread_cache();
+        int index = size_class(size);
+        if (index < 0) {
+            cache.bump(cache.oversize);
+            return ::operator new(size);
+        }
+        bool carved = cache.free[index] == nullptr && refill(cache, index);
+        cache.bump(carved ? cache.misses : cache.hits);
+        FreeBlock *block = cache.free[index];
+        cache.free[index] = block->next;
+        --cache.count[index];
+        return block;
+    }
+
+    /**
+     * @brief Frees a block; @p size must be the size it was allocated with.
+     */
+    void deallocate(void *memory, size_t size) {
+        int index = size_class(size);
+        if (index < 0) {
+            ::operator delete(memory);
+            return;
+        }
+        ThreadCache &cache = thread_cache();
+        FreeBlock *block = static_cast<FreeBlock *>(memory);
+        block->next = cache.free[index];
+        cache.free[index] = block;
+        if (++cache.count[index] >= 2 * TRANSFER_BATCH) {
+            give_back(cache, index, TRANSFER_BATCH);
+        }
+    }
+
+    /**
+     * @brief Carves slabs for at least @p blocks blocks of the class that
+     *        holds @p size bytes, touches them and adds them to the depot.
+     */
+    void reserve(size_t size, size_t blocks) {
+        int index = size_class(size);
+        if (index < 0) {
+            return;
+        }
+        Depot &depot = depots_[index];
+        for (size_t added = 0; added < blocks;) {
+            size_t carved = 0;
+            FreeBlock *first = carve_slab(index, carved);
+            std::memset(static_cast<void *>(first), 0, block_size(index) * carved);
+            FreeBlock *last = first;
+            for (size_t i = 1; i < carved; ++i) {
+                last->next = reinterpret_cast<FreeBlock *>(reinterpret_cast<char *>(last) + block_size(index));
+                last = last->next;
+            }
+            std::lock_guard<std::mutex> lock(depot.mutex);
+            last->next = depot.free;
+            depot.free = first;
+            depot.count += carved;
+            added += carved;
+        }
+    }
+
+    SlabStats stats() {
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        SlabStats totals = retired_;
+        for (ThreadCache *cache : caches_) {
+            totals.hits += cache->hits.load(std::memory_order_relaxed);
+            totals.misses += cache->misses.load(std::memory_order_relaxed);
+            totals.oversize += cache->oversize.load(std::memory_order_relaxed);
+        }
+        totals.reserved_bytes = reserved_bytes_.load(std::memory_order_relaxed);
+        return totals;
+    }
+
+private:
+    // Blocks moved between a thread cache and the depot at a time
+    static const size_t TRANSFER_BATCH = 32;
+    // Preferred slab size; classes larger than this get a few blocks per slab
+    static const size_t SLAB_BYTES = 256 * 1024;
+    static const size_t MIN_BLOCKS_PER_SLAB = 2;
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    struct Depot {
+        Depot() : free(nullptr), count(0) {}
+        std::mutex mutex;
+        FreeBlock *free;
+        size_t count;
+    };
+
+    struct ThreadCache {
+        ThreadCache() : hits(0), misses(0), oversize(0) {
+            for (int i = 0; i < CLASS_COUNT; ++i) {
+                free[i] = nullptr;
+                count[i] = 0;
+            }
+            SlabAllocator::instance().attach(this);
+        }
+
+        ~ThreadCache() { SlabAllocator::instance().detach(this); }
+
+        // Counters are only written by the owning thread, so no RMW is needed
+        void bump(std::atomic<uint64_t> &counter) {
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        FreeBlock *free[CLASS_COUNT];
+        size_t count[CLASS_COUNT];
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> oversize;
+    };
+
+    SlabAllocator() : reserved_bytes_(0) { retired_ = SlabStats{0, 0, 0, 0}; }
+
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    static ThreadCache &thread_cache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static size_t block_size(int index) { return MIN_BLOCK << index; }
+
+    /**
+     * @return The class whose blocks fit @p size, or -1 if none does.
+     */
+    static int size_class(size_t size) {
+        int index = 0;
+        while (block_size(index) < size) {
+            if (++index == CLASS_COUNT) {
+                return -1;
+            }
+        }
+        return index;
+    }
+
+    /**
+     * @brief Restocks an empty cache list from the depot, or from a new slab.
+     * @return True if a new slab had to be carved.
+     */
+    bool refill(ThreadCache &cache, int index) {
+        Depot &depot = depots_[index];
+        {
+            std::lock_guard<std::mutex> lock(depot.mutex);
+            while (depot.free != nullptr && cache.count[index] < TRANSFER_BATCH) {
+                FreeBlock *block = depot.free;
+                depot.free = block->next;
+                --depot.count;
+                block->next = cache.free[index];
+                cache.free[index] = block;
+                ++cache.count[index];
+            }
+        }
+        if (cache.free[index] != nullptr) {
+            return false;
+        }
+
+        size_t size = block_size(index);
+        size_t blocks = 0;
+        char *slab = reinterpret_cast<char *>(carve_slab(index, blocks));
+        for (size_t i = blocks; i-- > 0;) {
+            FreeBlock *block = reinterpret_cast<FreeBlock *>(slab + i * size);
+            block->next = cache.free[index];
+            cache.free[index] = block;
+        }
+        cache.count[index] += blocks;
+        return true;
+    }
+
+    /**
+     * @brief Allocates a new slab for one class; @p blocks is set to how
+     *        many blocks it holds. The blocks are not linked yet.
+     */
+    FreeBlock *carve_slab(int index, size_t &blocks) {
+        size_t size = block_size(index);
+        blocks = SLAB_BYTES / size < MIN_BLOCKS_PER_SLAB ? MIN_BLOCKS_PER_SLAB : SLAB_BYTES / size;
+        void *slab = ::operator new(size * blocks);
+        reserved_bytes_.fetch_add(size * blocks, std::memory_order_relaxed);
+        return static_cast<FreeBlock *>(slab);
+    }
+
+    /**
+     * @brief Moves up to @p limit blocks of one class from a cache to the depot.
+     */
+    void give_back(ThreadCache &cache, int index, size_t limit) {
+        FreeBlock *first = cache.free[index];
+        if (first == nullptr || limit == 0) {
+            return;
+        }
+        FreeBlock *last = first;
+        size_t moved = 1;
+        while (moved < limit && last->next != nullptr) {
+            last = last->next;
+            ++moved;
+        }
+        cache.free[index] = last->next;
+        cache.count[index] -= moved;
+
+        Depot &depot = depots_[index];
+        std::lock_guard<std::mutex> lock(depot.mutex);
+        last->next = depot.free;
+        depot.free = first;
+        depot.count += moved;
+    }
+
+    void attach(ThreadCache *cache) {
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        caches_.push_back(cache);
+    }
+
+    /**
+     * @brief Returns an exiting thread's blocks and keeps its counts.
+     */
+    void detach(ThreadCache *cache) {
+        for (int i = 0; i < CLASS_COUNT; ++i) {
+            give_back(*cache, i, cache->count[i]);
+        }
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        retired_.hits += cache->hits.load(std::memory_order_relaxed);
+        retired_.misses += cache->misses.load(std::memory_order_relaxed);
+        retired_.oversize += cache->oversize.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < caches_.size(); ++i) {
+            if (caches_[i] == cache) {
+                caches_[i] = caches_.back();
+                caches_.pop_back();
+                break;
+            }
+        }
+    }
+
+    Depot depots_[CLASS_COUNT];
+    std::atomic<size_t> reserved_bytes_;
+
+    std::mutex registry_mutex_;
+    std::vector<ThreadCache *> caches_; // Live threads' caches, for stats()
+    SlabStats retired_;                 // Counts of threads that have exited
+};
+
+#endif // CHAT_SLAB_ALLOCATOR_H
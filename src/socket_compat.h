@@ -0,0 +1,88 @@
+// -----------------------------------------------------------------------------
+// Socket Portability Layer
+//
+// The chat programs are written against the Winsock API. On Windows this
+// header simply pulls Winsock in. On Linux, macOS and the BSDs it maps the
+// small part of Winsock the programs use onto BSD sockets, so the same
+// sources build natively there and run on epoll / kqueue (see poller.h).
+//
+// Only what the programs actually call is provided; anything else should be
+// added here rather than behind #ifdefs in the programs themselves.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_SOCKET_COMPAT_H
+#define CHAT_SOCKET_COMPAT_H
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+// Link with the Winsock library
+#pragma comment(lib, "ws2_32.lib")
+
+#else
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+typedef unsigned long u_long;
+
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+
+const int WSAEWOULDBLOCK = EWOULDBLOCK;
+const int WSAEINTR = EINTR; // A signal arrived during a blocking call
+const int WSAEINPROGRESS = EINPROGRESS; // A non-blocking connect() is under way
+const int WSAEMFILE = EMFILE;
+const int WSAENOBUFS = ENOBUFS;
+const int WSAECONNRESET = ECONNRESET;
+
+struct WSADATA {};
+typedef struct pollfd WSAPOLLFD;
+
+#define MAKEWORD(low, high) ((unsigned short)(((low) & 0xff) | (((high) & 0xff) << 8)))
+
+/**
+ * @brief Nothing to initialize on POSIX, except that writing to a closed
+ *        peer must fail with EPIPE, as it does on Windows, instead of
+ *        killing the process with SIGPIPE.
+ */
+inline int WSAStartup(unsigned short, WSADATA *) {
+    std::signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+inline int WSACleanup() { return 0; }
+
+inline int WSAGetLastError() { return errno; }
+
+inline void WSASetLastError(int error) { errno = error; }
+
+inline int closesocket(SOCKET socket) { return close(socket); }
+
+inline int WSAPoll(WSAPOLLFD *fds, unsigned long count, int timeout_ms) {
+    return poll(fds, static_cast<nfds_t>(count), timeout_ms);
+}
+
+/**
+ * @brief Only FIONBIO is used, which POSIX ioctl takes as an int.
+ */
+inline int ioctlsocket(SOCKET socket, unsigned long command, u_long *argument) {
+    int value = static_cast<int>(*argument);
+    return ioctl(socket, command, &value);
+}
+
+#endif
+
+#endif // CHAT_SOCKET_COMPAT_H
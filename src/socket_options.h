@@ -0,0 +1,159 @@
+// -----------------------------------------------------------------------------
+// Socket Tuning
+//
+// Listener and per-connection TCP options, set from the command line:
+//
+//   - Listeners get SO_REUSEADDR (SO_EXCLUSIVEADDRUSE on Windows, where
+//     SO_REUSEADDR would let another process steal the port), a configurable
+//     backlog, and the send / receive buffer sizes. Accepted sockets inherit
+//     the buffer sizes, and setting them before listen() lets the receive
+//     window scale accordingly.
+//   - Connections get TCP_NODELAY and TCP keepalive.
+//   - Listeners bind to every IPv4 interface, or to the IPv4 or IPv6
+//     address given with --bind. "::" takes IPv4 clients too, as mapped
+//     addresses, on every platform.
+//
+// Nagle's algorithm trades latency for fewer packets. The adaptive mode
+// keeps it off so a lone chat message leaves at once, but corks a socket
+// (TCP_CORK on Linux, TCP_NOPUSH on macOS / BSD) while a burst larger than
+// one gather send is written, so the burst goes out as full segments
+// instead of one short segment per send call. Windows has no cork; there
+// the adaptive mode behaves like "on", and bursts still leave in as few
+// gather sends as possible.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_SOCKET_OPTIONS_H
+#define CHAT_SOCKET_OPTIONS_H
+
+#include "socket_compat.h"
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <mstcpip.h>
+#endif
+
+/**
+ * @brief How Nagle's algorithm is handled on client connections.
+ */
+enum class NagleMode {
+    On,      // Nagle enabled (TCP_NODELAY off), the OS default
+    Off,     // TCP_NODELAY on every connection
+    Adaptive // TCP_NODELAY, corked while a burst is written
+};
+
+struct SocketTuning {
+    NagleMode nagle;
+    int send_buffer;        // SO_SNDBUF in bytes; 0 keeps the OS default
+    int receive_buffer;     // SO_RCVBUF in bytes; 0 keeps the OS default
+    int keepalive_idle_s;   // Idle time before the first probe; 0 disables keepalive
+    int keepalive_interval_s;
+    int backlog;            // listen() backlog
+};
+
+inline bool set_int_option(SOCKET socket, int level, int name, int value) {
+    return setsockopt(socket, level, name, (const char *)&value, sizeof(value)) != SOCKET_ERROR;
+}
+
+/**
+ * @brief Builds the address a listener binds to.
+ * @param text An IPv4 or IPv6 literal, optionally in brackets; empty for
+ *        every IPv4 interface.
+ * @return False if @p text is not an address literal.
+ */
+inline bool make_listen_address(const std::string &text, int port, struct sockaddr_storage &address,
+                                socklen_t &length) {
+    std::memset(&address, 0, sizeof(address));
+    std::string host = text.size() > 2 && text[0] == '[' && text[text.size() - 1] == ']'
+                           ? text.substr(1, text.size() - 2)
+                           : text;
+    struct sockaddr_in *ipv4 = reinterpret_cast<struct sockaddr_in *>(&address);
+    struct sockaddr_in6 *ipv6 = reinterpret_cast<struct sockaddr_in6 *>(&address);
+    if (host.empty()) {
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, host.c_str(), &ipv4->sin_addr) == 1) {
+        ipv4->sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, host.c_str(), &ipv6->sin6_addr) == 1) {
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = htons(static_cast<unsigned short>(port));
+        length = sizeof(struct sockaddr_in6);
+        return true;
+    } else {
+        return false;
+    }
+    ipv4->sin_port = htons(static_cast<unsigned short>(port));
+    length = sizeof(struct sockaddr_in);
+    return true;
+}
+
+/**
+ * @brief Applies the options that must be set before bind() and listen().
+ * @return False if any option was rejected; the socket is still usable.
+ */
+inline bool apply_listener_options(SOCKET socket, const SocketTuning &tuning) {
+    bool ok = true;
+#ifdef _WIN32
+    ok &= set_int_option(socket, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, 1);
+#else
+    ok &= set_int_option(socket, SOL_SOCKET, SO_REUSEADDR, 1);
+#endif
+    if (tuning.send_buffer > 0) {
+        ok &= set_int_option(socket, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer);
+    }
+    if (tuning.receive_buffer > 0) {
+        ok &= set_int_option(socket, SOL_SOCKET, SO_RCVBUF, tuning.receive_buffer);
+    }
+    return ok;
+}
+
+/**
+ * @brief Applies Nagle and keepalive settings to an accepted socket.
+ * @return False if any option was rejected; the socket is still usable.
+ */
+inline bool apply_connection_options(SOCKET socket, const SocketTuning &tuning) {
+    bool ok = true;
+    if (tuning.nagle != NagleMode::On) {
+        ok &= set_int_option(socket, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (tuning.keepalive_idle_s > 0) {
+#ifdef _WIN32
+        struct tcp_keepalive keepalive;
+        keepalive.onoff = 1;
+        keepalive.keepalivetime = (ULONG)tuning.keepalive_idle_s * 1000;
+        keepalive.keepaliveinterval = (ULONG)tuning.keepalive_interval_s * 1000;
+        DWORD returned = 0;
+        ok &= WSAIoctl(socket, SIO_KEEPALIVE_VALS, &keepalive, sizeof(keepalive), NULL, 0, &returned, NULL, NULL) !=
+              SOCKET_ERROR;
+#else
+        ok &= set_int_option(socket, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+        ok &= set_int_option(socket, IPPROTO_TCP, TCP_KEEPIDLE, tuning.keepalive_idle_s);
+#elif defined(TCP_KEEPALIVE)
+        ok &= set_int_option(socket, IPPROTO_TCP, TCP_KEEPALIVE, tuning.keepalive_idle_s); // macOS
+#endif
+#ifdef TCP_KEEPINTVL
+        ok &= set_int_option(socket, IPPROTO_TCP, TCP_KEEPINTVL, tuning.keepalive_interval_s);
+#endif
+#endif
+    }
+    return ok;
+}
+
+/**
+ * @brief Holds back partial segments while corked; uncorking sends them.
+ * @return False if the platform cannot cork, or the call failed.
+ */
+inline bool set_cork(SOCKET socket, bool corked) {
+#if defined(TCP_CORK)
+    return set_int_option(socket, IPPROTO_TCP, TCP_CORK, corked ? 1 : 0);
+#elif defined(TCP_NOPUSH) && !defined(_WIN32)
+    return set_int_option(socket, IPPROTO_TCP, TCP_NOPUSH, corked ? 1 : 0);
+#else
+    (void)socket;
+    (void)corked;
+    return false;
+#endif
+}
+
+#endif // CHAT_SOCKET_OPTIONS_H
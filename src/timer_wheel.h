@@ -0,0 +1,202 @@
+// -----------------------------------------------------------------------------
+// Hierarchical Timer Wheel
+//
+// Every connection needs a timer (heartbeats, idle timeouts), and there may be
+// hundreds of thousands of them per reactor, almost all of them re-armed or
+// cancelled long before they fire. A hierarchical wheel makes scheduling and
+// cancelling O(1): time advances in ticks, and a timer is linked into one
+// slot of one of four levels of 64 slots, chosen by how far away it is.
+// Level 0 holds the next 64 ticks one tick per slot, level 1 the next 4096
+// ticks 64 per slot, and so on. Whenever a level's index wraps, the next
+// level's current slot is cascaded: its timers are re-linked into finer
+// levels, so each timer moves at most three times before it fires.
+//
+// Timers are intrusive TimerNodes embedded in their owners, so a wheel never
+// allocates. A wheel belongs to one thread and is not synchronized.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_TIMER_WHEEL_H
+#define CHAT_TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A timer, embedded in whatever it times.
+ */
+struct TimerNode {
+    TimerNode() : prev(NULL), next(NULL), expires(0), owner(NULL) {}
+
+    bool pending() const { return prev != NULL; }
+
+    TimerNode *prev; // NULL while not scheduled
+    TimerNode *next;
+    uint64_t expires; // Tick at which it fires
+    void *owner;      // Handed back when it fires
+};
+
+/**
+ * @brief Four-level wheel of timers counted in caller-defined ticks.
+ */
+class TimerWheel {
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;
+    static const int LEVELS = 4;
+    // Timers further out than this many ticks fire early, at this horizon
+    static const uint64_t MAX_DELAY = ((uint64_t)1 << (LEVEL_BITS * LEVELS)) - 1;
+
+    TimerWheel() : current_(0), count_(0) {
+        for (int level = 0; level < LEVELS; ++level) {
+            for (int slot = 0; slot < SLOTS; ++slot) {
+                TimerNode &head = slots_[level][slot];
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /**
+     * @brief (Re)schedules @p node to fire at tick @p expires.
+     *
+     * Ticks already passed fire on the next advance().
+     */
+    void schedule(TimerNode *node, uint64_t expires) {
+        if (node->pending()) {
+            unlink(node);
+        } else {
+            ++count_;
+        }
+        node->expires = expires;
+        place(node);
+    }
+
+    /**
+     * @brief Unschedules @p node; harmless if it is not pending.
+     */
+    void cancel(TimerNode *node) {
+        if (node->pending()) {
+            unlink(node);
+            --count_;
+        }
+    }
+
+    /**
+     * @brief Runs every tick up to and including @p now, calling
+     *        on_expire(node) for each timer that fires.
+     *
+     * The callback may schedule or cancel any timer, including the one firing.
+     */
+    template <typename Callback>
+    void advance(uint64_t now, Callback on_expire) {
+        while (current_ <= now) {
+            // Bring down the slots whose span starts at this tick, coarsest first
+            int top = 0;
+            while (top + 1 < LEVELS && (current_ & (((uint64_t)1 << (LEVEL_BITS * (top + 1))) - 1)) == 0) {
+                ++top;
+            }
+            for (int level = top; level > 0; --level) {
+                cascade(slot(level, current_));
+            }
+
+            TimerNode due;
+            take(slot(0, current_), due);
+            ++current_;
+            while (due.next != &due) {
+                TimerNode *node = due.next;
+                unlink(node);
+                --count_;
+                on_expire(node);
+            }
+        }
+    }
+
+    /**
+     * @brief Ticks from the next unprocessed tick until the earliest one that
+     *        may fire or cascade timers; -1 if none is scheduled.
+     */
+    int64_t ticks_until_due() const {
+        if (count_ == 0) {
+            return -1;
+        }
+        for (uint64_t tick = current_;; ++tick) {
+            if ((tick & (SLOTS - 1)) == 0) {
+                return (int64_t)(tick - current_); // Level 0 wraps: a cascade is due
+            }
+            const TimerNode &head = slots_[0][tick & (SLOTS - 1)];
+            if (head.next != &head) {
+                return (int64_t)(tick - current_);
+            }
+        }
+    }
+
+    // Next tick advance() will process
+    uint64_t current() const { return current_; }
+    size_t size() const { return count_; }
+
+private:
+    TimerNode *slot(int level, uint64_t tick) {
+        return &slots_[level][(tick >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+    }
+
+    void place(TimerNode *node) {
+        if (node->expires < current_) {
+            node->expires = current_;
+        }
+        if (node->expires - current_ > MAX_DELAY) {
+            node->expires = current_ + MAX_DELAY;
+        }
+        uint64_t delay = node->expires - current_;
+        int level = 0;
+        while (level + 1 < LEVELS && delay >= ((uint64_t)1 << (LEVEL_BITS * (level + 1)))) {
+            ++level;
+        }
+        link(slot(level, node->expires), node);
+    }
+
+    // Re-places a slot's timers; those due within this slot's span land on
+    // finer levels, any a full wheel turn later on the next level up
+    void cascade(TimerNode *head) {
+        TimerNode moving;
+        take(head, moving);
+        while (moving.next != &moving) {
+            TimerNode *node = moving.next;
+            unlink(node);
+            place(node);
+        }
+    }
+
+    // Moves a slot's whole list onto the empty list @p into
+    static void take(TimerNode *head, TimerNode &into) {
+        if (head->next == head) {
+            into.prev = into.next = &into;
+            return;
+        }
+        into.next = head->next;
+        into.prev = head->prev;
+        into.next->prev = &into;
+        into.prev->next = &into;
+        head->prev = head->next = head;
+    }
+
+    static void link(TimerNode *head, TimerNode *node) {
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    static void unlink(TimerNode *node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = NULL;
+    }
+
+    TimerNode slots_[LEVELS][SLOTS]; // List heads; each slot is a circular list
+    uint64_t current_;
+    size_t count_;
+};
+
+#endif // CHAT_TIMER_WHEEL_H
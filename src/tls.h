@@ -0,0 +1,325 @@
+// -----------------------------------------------------------------------------
+// TLS
+//
+// With CHAT_TLS defined (a build linked against OpenSSL, see the Makefile),
+// the server terminates TLS on its client port and the client library can
+// connect over it. Sockets stay non-blocking: a handshake step or record
+// that cannot make progress reports which readiness it waits for, and the
+// caller retries once its poller reports it.
+//
+// Reconnects are cheap: the server issues stateless session tickets, so a
+// returning client resumes its session and skips the certificate exchange
+// and key agreement. Tickets are sealed with keys of the server process;
+// a hot restart hands them to the successor (see handoff.h), so tickets
+// issued before the restart still resume afterwards.
+//
+// Where the kernel supports it (Linux kernel TLS), OpenSSL hands the
+// session keys to the kernel after the handshake. Plain sends on the socket
+// are then encrypted by the kernel, so the server keeps writing shared
+// message buffers straight from the outbound queue with one gather send.
+// Otherwise queued messages are coalesced into records of up to
+// TLS_MAX_RECORD bytes, one SSL_write each.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_TLS_H
+#define CHAT_TLS_H
+
+#ifdef CHAT_TLS
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "socket_compat.h"
+
+// Largest plaintext one TLS record carries
+const size_t TLS_MAX_RECORD = 16 * 1024;
+// Ticket name, HMAC secret and AES key, as SSL_CTX_get_tlsext_ticket_keys has them
+const size_t TLS_TICKET_KEYS_SIZE = 80;
+
+/**
+ * @brief Outcome of a TLS call on a non-blocking socket.
+ */
+enum class TlsResult {
+    Done,
+    WantRead,  // Retry once the socket is readable
+    WantWrite, // Retry once the socket is writable
+    Closed,    // The peer closed the connection
+    Failed
+};
+
+/**
+ * @brief The oldest pending OpenSSL error as text, for logs; clears the queue.
+ */
+inline std::string tls_error() {
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) {
+        return "connection reset";
+    }
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return text;
+}
+
+/**
+ * @brief Classifies the result @p ret of a TLS call on @p ssl.
+ */
+inline TlsResult tls_result(SSL *ssl, int ret) {
+    if (ret > 0) {
+        return TlsResult::Done;
+    }
+    switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        return TlsResult::WantRead;
+    case SSL_ERROR_WANT_WRITE:
+        return TlsResult::WantWrite;
+    case SSL_ERROR_ZERO_RETURN:
+        return TlsResult::Closed;
+    case SSL_ERROR_SYSCALL:
+        // EOF without close_notify: clients that just hang up are common
+        return ERR_peek_error() == 0 ? TlsResult::Closed : TlsResult::Failed;
+    default:
+        return TlsResult::Failed;
+    }
+}
+
+/**
+ * @brief Takes the handshake as far as the socket allows.
+ */
+inline TlsResult tls_handshake(SSL *ssl) {
+    ERR_clear_error(); // SSL_get_error reads the thread's error queue
+    return tls_result(ssl, SSL_do_handshake(ssl));
+}
+
+/**
+ * @brief Reads decrypted bytes, like recv().
+ * @return Bytes read, or 0 with the reason in @p result.
+ */
+inline int tls_read(SSL *ssl, char *buffer, int length, TlsResult &result) {
+    ERR_clear_error();
+    int ret = SSL_read(ssl, buffer, length);
+    result = tls_result(ssl, ret);
+    return ret > 0 ? ret : 0;
+}
+
+/**
+ * @brief Writes bytes as records, like send(); up to TLS_MAX_RECORD make one record.
+ *
+ * After WantRead or WantWrite the same bytes must be offered again, though
+ * they may have moved and more may follow them.
+ * @return Bytes written, or 0 with the reason in @p result.
+ */
+inline int tls_write(SSL *ssl, const char *data, int length, TlsResult &result) {
+    ERR_clear_error();
+    int ret = SSL_write(ssl, data, length);
+    result = tls_result(ssl, ret);
+    return ret > 0 ? ret : 0;
+}
+
+/**
+ * @brief Whether the kernel encrypts what is sent on the connection's socket.
+ */
+inline bool tls_kernel_send(SSL *ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+}
+
+/**
+ * @brief Sends close_notify if the handshake got that far, without waiting
+ *        for the peer's, and frees the connection's TLS state.
+ *
+ * The socket itself is left to the caller.
+ */
+inline void tls_close(SSL *ssl) {
+    ERR_clear_error();
+    if (SSL_is_init_finished(ssl)) {
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    ERR_clear_error();
+}
+
+/**
+ * @brief Certificates and settings shared by all connections of one side.
+ *
+ * A server context issues session tickets; a client context verifies the
+ * server and remembers one resumable session per server it connected to.
+ */
+class TlsContext {
+public:
+    TlsContext() : ctx_(NULL) {}
+
+    ~TlsContext() {
+        for (const std::pair<const std::string, SSL_SESSION *> &entry : sessions_) {
+            SSL_SESSION_free(entry.second);
+        }
+        if (ctx_ != NULL) {
+            SSL_CTX_free(ctx_);
+        }
+    }
+
+    TlsContext(const TlsContext &) = delete;
+    TlsContext &operator=(const TlsContext &) = delete;
+
+    bool valid() const { return ctx_ != NULL; }
+
+    /**
+     * @brief Sets up the server side with a PEM certificate chain and key.
+     * @param kernel_tls Let OpenSSL offload record encryption to the kernel.
+     * @return False with @p error set if the files are unusable.
+     */
+    bool init_server(const std::string &certificate, const std::string &key, bool kernel_tls, std::string &error) {
+        if (!create(TLS_server_method())) {
+            error = tls_error();
+            return false;
+        }
+        if (SSL_CTX_use_certificate_chain_file(ctx_, certificate.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx_, key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx_) != 1) {
+            error = tls_error();
+            SSL_CTX_free(ctx_);
+            ctx_ = NULL;
+            return false;
+        }
+        // Stateless tickets only: nothing to look up or expire per session
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_num_tickets(ctx_, 1);
+        SSL_CTX_set_options(ctx_, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+        if (kernel_tls) {
+            SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+        }
+#else
+        (void)kernel_tls;
+#endif
+        return true;
+    }
+
+    /**
+     * @brief Sets up the client side, trusting the CA certificates in
+     *        @p ca_file, or the system's if it is empty.
+     */
+    bool init_client(const std::string &ca_file, std::string &error) {
+        if (!create(TLS_client_method())) {
+            error = tls_error();
+            return false;
+        }
+        int loaded = ca_file.empty() ? SSL_CTX_set_default_verify_paths(ctx_)
+                                     : SSL_CTX_load_verify_locations(ctx_, ca_file.c_str(), NULL);
+        if (loaded != 1) {
+            error = tls_error();
+            SSL_CTX_free(ctx_);
+            ctx_ = NULL;
+            return false;
+        }
+        SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, NULL);
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        return true;
+    }
+
+    /**
+     * @brief TLS state for a client connection accepted on @p socket.
+     * @return NULL if OpenSSL is out of memory.
+     */
+    SSL *accept(SOCKET socket) {
+        SSL *ssl = SSL_new(ctx_);
+        if (ssl != NULL && SSL_set_fd(ssl, static_cast<int>(socket)) != 1) {
+            SSL_free(ssl);
+            return NULL;
+        }
+        if (ssl != NULL) {
+            SSL_set_accept_state(ssl);
+        }
+        return ssl;
+    }
+
+    /**
+     * @brief TLS state for a connection to @p host on @p socket, which
+     *        resumes the last session with @p server if one is remembered.
+     */
+    SSL *connect(SOCKET socket, const std::string &host, const std::string &server) {
+        SSL *ssl = SSL_new(ctx_);
+        if (ssl == NULL) {
+            return NULL;
+        }
+        unsigned char address[16];
+        bool literal = inet_pton(AF_INET, host.c_str(), address) == 1 || inet_pton(AF_INET6, host.c_str(), address) == 1;
+        bool named = literal ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str()) == 1
+                             : SSL_set_tlsext_host_name(ssl, host.c_str()) == 1 && SSL_set1_host(ssl, host.c_str()) == 1;
+        if (!named || SSL_set_fd(ssl, static_cast<int>(socket)) != 1) {
+            SSL_free(ssl);
+            return NULL;
+        }
+        std::unordered_map<std::string, SSL_SESSION *>::iterator it = sessions_.find(server);
+        if (it != sessions_.end()) {
+            SSL_set_session(ssl, it->second);
+        }
+        SSL_set_connect_state(ssl);
+        return ssl;
+    }
+
+    /**
+     * @brief Keeps a client connection's session for the next connect() to
+     *        @p server, if it can be resumed.
+     */
+    void remember(SSL *ssl, const std::string &server) {
+        SSL_SESSION *session = SSL_get1_session(ssl);
+        if (session == NULL) {
+            return;
+        }
+        if (!SSL_SESSION_is_resumable(session)) {
+            SSL_SESSION_free(session);
+            return;
+        }
+        SSL_SESSION *&slot = sessions_[server];
+        if (slot != NULL) {
+            SSL_SESSION_free(slot);
+        }
+        slot = session;
+    }
+
+    /**
+     * @brief The server's current ticket keys, TLS_TICKET_KEYS_SIZE bytes.
+     */
+    std::string ticket_keys() const {
+        char keys[TLS_TICKET_KEYS_SIZE];
+        if (SSL_CTX_get_tlsext_ticket_keys(ctx_, keys, sizeof(keys)) != 1) {
+            return std::string();
+        }
+        return std::string(keys, sizeof(keys));
+    }
+
+    /**
+     * @brief Seals and opens tickets with keys another server issued them with.
+     */
+    bool set_ticket_keys(const std::string &keys) {
+        if (keys.size() != TLS_TICKET_KEYS_SIZE) {
+            return false;
+        }
+        char copy[TLS_TICKET_KEYS_SIZE];
+        std::memcpy(copy, keys.data(), sizeof(copy));
+        return SSL_CTX_set_tlsext_ticket_keys(ctx_, copy, sizeof(copy)) == 1;
+    }
+
+private:
+    bool create(const SSL_METHOD *method) {
+        ctx_ = SSL_CTX_new(method);
+        if (ctx_ == NULL) {
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+        // Records are written from queues that may move between retries
+        SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                   SSL_MODE_RELEASE_BUFFERS);
+        return true;
+    }
+
+    SSL_CTX *ctx_;
+    std::unordered_map<std::string, SSL_SESSION *> sessions_; // Client side: server -> last resumable session
+};
+
+#endif // CHAT_TLS
+
+#endif // CHAT_TLS_H
@@ -0,0 +1,183 @@
+// -----------------------------------------------------------------------------
+// Token Bucket
+//
+// A classic token bucket for rate limiting: tokens accrue at a fixed rate up
+// to a burst size, and each admitted event spends one or more. Refills are
+// computed lazily from the caller's clock reading, so an idle bucket costs
+// nothing. Not thread-safe; every bucket belongs to one thread.
+//
+// SharedTokenBucket is the same limit for state several threads spend from,
+// such as a room whose members are spread over all reactors. It keeps one
+// atomic word, the time at which the bucket will be full again (the "generic
+// cell rate algorithm" form of a token bucket), and spends with a single
+// compare-and-swap: no lock, and no work at all while the bucket is idle.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_TOKEN_BUCKET_H
+#define CHAT_TOKEN_BUCKET_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Unlimited until configured
+    TokenBucket() : rate_(0), burst_(0), tokens_(0) {}
+
+    /**
+     * @param rate Tokens added per second; 0 means unlimited.
+     * @param burst Most tokens the bucket holds; it starts full.
+     */
+    void configure(double rate, double burst, Clock::time_point now) {
+        rate_ = rate;
+        burst_ = burst < 1 ? 1 : burst;
+        tokens_ = burst_;
+        last_refill_ = now;
+    }
+
+    bool unlimited() const { return rate_ <= 0; }
+    double burst() const { return burst_; }
+
+    /**
+     * @brief Spends @p cost tokens if that many are available.
+     */
+    bool try_take(Clock::time_point now, double cost = 1) {
+        if (unlimited()) {
+            return true;
+        }
+        refill(now);
+        if (tokens_ < cost) {
+            return false;
+        }
+        tokens_ -= cost;
+        return true;
+    }
+
+    /**
+     * @return Milliseconds until @p cost tokens are available (0 if they are).
+     */
+    int wait_ms(Clock::time_point now, double cost = 1) {
+        if (unlimited()) {
+            return 0;
+        }
+        refill(now);
+        if (tokens_ >= cost) {
+            return 0;
+        }
+        return static_cast<int>((cost - tokens_) * 1000 / rate_) + 1;
+    }
+
+private:
+    void refill(Clock::time_point now) {
+        double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+        last_refill_ = now;
+        if (elapsed > 0) {
+            tokens_ += elapsed * rate_;
+            if (tokens_ > burst_) {
+                tokens_ = burst_;
+            }
+        }
+    }
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_refill_;
+};
+
+/**
+ * @brief A token bucket any number of threads may spend from, lock-free.
+ */
+class SharedTokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Unlimited until configured
+    SharedTokenBucket() : interval_ns_(0), burst_(0), burst_ns_(0), full_at_ns_(0) {}
+
+    SharedTokenBucket(const SharedTokenBucket &) = delete;
+    SharedTokenBucket &operator=(const SharedTokenBucket &) = delete;
+
+    /**
+     * @brief Sets the limit; call before other threads use the bucket.
+     * @param rate Tokens added per second; 0 means unlimited.
+     * @param burst Most tokens the bucket holds; it starts full.
+     */
+    void configure(double rate, double burst) {
+        interval_ns_ = rate > 0 ? 1e9 / rate : 0;
+        burst_ = burst < 1 ? 1 : burst;
+        burst_ns_ = burst_ * interval_ns_;
+        full_at_ns_.store(0, std::memory_order_relaxed);
+    }
+
+    bool unlimited() const { return interval_ns_ <= 0; }
+    double burst() const { return burst_; }
+
+    /**
+     * @brief Spends @p cost tokens if that many are available.
+     */
+    bool try_take(Clock::time_point now, double cost = 1) {
+        if (unlimited()) {
+            return true;
+        }
+        uint64_t now_ns = to_ns(now);
+        uint64_t spend_ns = static_cast<uint64_t>(cost * interval_ns_);
+        uint64_t full_at = full_at_ns_.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            // Spending pushes the time the bucket is full again further out;
+            // it may not move past one full burst from now
+            next = (full_at > now_ns ? full_at : now_ns) + spend_ns;
+            if ((double)(next - now_ns) > burst_ns_) {
+                return false;
+            }
+        } while (!full_at_ns_.compare_exchange_weak(full_at, next, std::memory_order_relaxed));
+        return true;
+    }
+
+    /**
+     * @return Milliseconds until @p cost tokens are available (0 if they are).
+     *         Other threads may spend them first.
+     */
+    int wait_ms(Clock::time_point now, double cost = 1) const {
+        if (unlimited()) {
+            return 0;
+        }
+        uint64_t now_ns = to_ns(now);
+        uint64_t full_at = full_at_ns_.load(std::memory_order_relaxed);
+        double over_ns = (double)((full_at > now_ns ? full_at : now_ns) - now_ns) + cost * interval_ns_ - burst_ns_;
+        return over_ns > 0 ? static_cast<int>(over_ns / 1e6) + 1 : 0;
+    }
+
+    /**
+     * @brief Returns @p cost tokens taken by try_take() for an event that
+     *        did not happen after all.
+     */
+    void give_back(double cost = 1) {
+        if (unlimited()) {
+            return;
+        }
+        uint64_t spend_ns = static_cast<uint64_t>(cost * interval_ns_);
+        uint64_t full_at = full_at_ns_.load(std::memory_order_relaxed);
+        while (!full_at_ns_.compare_exchange_weak(full_at, full_at > spend_ns ? full_at - spend_ns : 0,
+                                                  std::memory_order_relaxed)) {
+        }
+    }
+
+private:
+    static uint64_t to_ns(Clock::time_point now) {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count());
+    }
+
+    double interval_ns_; // Time one token takes to accrue
+    double burst_;
+    double burst_ns_;    // Time a whole burst takes to accrue
+    std::atomic<uint64_t> full_at_ns_;
+};
+
+#endif // CHAT_TOKEN_BUCKET_H
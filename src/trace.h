@@ -0,0 +1,215 @@
+// -----------------------------------------------------------------------------
+// Message Tracing
+//
+// Built with CHAT_TRACE (TRACE=1 in the Makefile), the server samples one in
+// --trace-sample chat messages and records where each spends its time:
+//
+//   read     From the recv() that returned the message until it is built:
+//            parsing, rate limits and compression, on the sender's reactor
+//   fan-out  On every reactor with recipients: queueing it for all of them.
+//            The gap before it is the hop through that reactor's inbox
+//   queued   For every recipient: from being queued until the send() that
+//            finished writing it started
+//   send     That send() call
+//
+// Each reactor records into its own fixed ring of spans, which only its
+// thread writes: a span is a handful of relaxed stores, without locks, and
+// the oldest spans are overwritten once the ring is full. Readers copy a
+// ring while it is being written and discard what was overwritten meanwhile.
+//
+// The rings are exported in the Chrome trace event format, which Perfetto
+// (ui.perfetto.dev) and chrome://tracing open: GET /trace on the metrics
+// port returns what they hold, and --trace-file PATH receives it when the
+// server stops. Every span names its message's trace id, so one message can
+// be followed across reactors.
+//
+// Without CHAT_TRACE, TraceRing is an empty class and messages report trace
+// id 0, so every tracing branch is dead code the compiler removes.
+// -----------------------------------------------------------------------------
+
+#ifndef CHAT_TRACE_H
+#define CHAT_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+const unsigned DEFAULT_TRACE_SAMPLE = 100;  // Trace one in this many chat messages
+const size_t DEFAULT_TRACE_BUFFER = 65536;  // Spans each reactor keeps
+const size_t MAX_TRACE_BUFFER = 1u << 24;
+
+#ifdef CHAT_TRACE
+const bool TRACE_ENABLED = true;
+#else
+const bool TRACE_ENABLED = false;
+#endif
+
+enum class TracePhase : uint8_t { Read, Fanout, Write };
+
+/**
+ * @brief One recorded span; times are monotonic_ns() readings.
+ */
+struct TraceSpan {
+    TracePhase phase;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t message; // Trace id
+    uint64_t detail;  // Read: the sender's session; Fanout: recipients; Write: the recipient's session
+    uint64_t mark_ns; // Write: when the final send() started; 0 otherwise
+};
+
+/**
+ * @brief A traced message an outbound queue finished writing.
+ */
+struct TracedWrite {
+    uint64_t message;
+    uint64_t queued_ns;
+};
+
+#ifdef CHAT_TRACE
+
+/**
+ * @brief Fixed ring of spans with one writer and any number of readers.
+ */
+class TraceRing {
+public:
+    TraceRing() : mask_(0), written_(0) {}
+
+    /**
+     * @brief Allocates room for at least @p spans spans; before any recording.
+     */
+    void reserve(size_t spans) {
+        size_t slots = 1;
+        while (slots < spans) {
+            slots <<= 1;
+        }
+        slots_ = std::vector<Slot>(slots);
+        mask_ = slots - 1;
+    }
+
+    /**
+     * @brief Records a span; only ever called by the ring's own thread.
+     */
+    void record(TracePhase phase, uint64_t start_ns, uint64_t end_ns, uint64_t message, uint64_t detail,
+                uint64_t mark_ns = 0) {
+        if (slots_.empty()) {
+            return;
+        }
+        uint64_t position = written_.load(std::memory_order_relaxed);
+        std::atomic<uint64_t> *words = slots_[position & mask_].words;
+        // A reader that sees any of the new words also sees that the slot's old span is gone
+        std::atomic_thread_fence(std::memory_order_release);
+        words[0].store(static_cast<uint64_t>(phase), std::memory_order_relaxed);
+        words[1].store(start_ns, std::memory_order_relaxed);
+        words[2].store(end_ns, std::memory_order_relaxed);
+        words[3].store(message, std::memory_order_relaxed);
+        words[4].store(detail, std::memory_order_relaxed);
+        words[5].store(mark_ns, std::memory_order_relaxed);
+        written_.store(position + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Appends the spans the ring holds, oldest first, to @p out.
+     */
+    void snapshot(std::vector<TraceSpan> &out) const {
+        uint64_t end = written_.load(std::memory_order_acquire);
+        uint64_t capacity = slots_.size();
+        uint64_t begin = end > capacity ? end - capacity : 0;
+        size_t first = out.size();
+        for (uint64_t position = begin; position < end; ++position) {
+            const std::atomic<uint64_t> *words = slots_[position & mask_].words;
+            TraceSpan span;
+            span.phase = static_cast<TracePhase>(words[0].load(std::memory_order_relaxed));
+            span.start_ns = words[1].load(std::memory_order_relaxed);
+            span.end_ns = words[2].load(std::memory_order_relaxed);
+            span.message = words[3].load(std::memory_order_relaxed);
+            span.detail = words[4].load(std::memory_order_relaxed);
+            span.mark_ns = words[5].load(std::memory_order_relaxed);
+            out.push_back(span);
+        }
+        // Spans the writer reached again while they were being copied are torn
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = written_.load(std::memory_order_relaxed);
+        uint64_t torn = after + 1 > begin + capacity ? after + 1 - begin - capacity : 0;
+        if (torn > 0) {
+            out.erase(out.begin() + first, out.begin() + first + (size_t)std::min<uint64_t>(torn, end - begin));
+        }
+    }
+
+private:
+    struct Slot {
+        Slot() {
+            for (std::atomic<uint64_t> &word : words) {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+        std::atomic<uint64_t> words[6];
+    };
+
+    std::vector<Slot> slots_;
+    uint64_t mask_;
+    std::atomic<uint64_t> written_; // Spans recorded so far
+};
+
+#else
+
+class TraceRing {
+public:
+    void reserve(size_t) {}
+    void record(TracePhase, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t = 0) {}
+    void snapshot(std::vector<TraceSpan> &) const {}
+};
+
+#endif // CHAT_TRACE
+
+/**
+ * @brief Renders the spans of every thread as a Chrome trace.
+ * @param threads Thread name and spans; the thread's index is its tid.
+ */
+inline std::string format_chrome_trace(const std::vector<std::pair<std::string, std::vector<TraceSpan>>> &threads) {
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                      "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"chat server\"}}";
+    char event[256];
+    for (size_t tid = 0; tid < threads.size(); ++tid) {
+        out += ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" + std::to_string(tid) +
+               ",\"args\":{\"name\":\"" + threads[tid].first + "\"}}";
+        for (const TraceSpan &span : threads[tid].second) {
+            // Writes become two events: queued until the send, then the send
+            const char *names[2] = {NULL, NULL};
+            uint64_t bounds[3] = {span.start_ns, span.end_ns, 0};
+            const char *argument = "client";
+            switch (span.phase) {
+            case TracePhase::Read:
+                names[0] = "read";
+                break;
+            case TracePhase::Fanout:
+                names[0] = "fan-out";
+                argument = "recipients";
+                break;
+            case TracePhase::Write:
+                names[0] = "queued";
+                names[1] = "send";
+                bounds[1] = span.mark_ns;
+                bounds[2] = span.end_ns;
+                break;
+            }
+            for (int i = 0; i < 2 && names[i] != NULL; ++i) {
+                std::snprintf(event, sizeof(event),
+                              ",\n{\"ph\":\"X\",\"cat\":\"message\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"message\":%llu,\"%s\":%llu}}",
+                              names[i], (unsigned)tid, bounds[i] / 1000.0, (bounds[i + 1] - bounds[i]) / 1000.0,
+                              (unsigned long long)span.message, argument, (unsigned long long)span.detail);
+                out += event;
+            }
+        }
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+#endif // CHAT_TRACE_H